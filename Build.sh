@@ -2,7 +2,7 @@
 echo "Building BloodOS..."
 
 # Install dependencies (Ubuntu/Debian)
-# sudo apt-get install nasm gcc-multilib qemu-system-x86
+# sudo apt-get install nasm gcc-multilib qemu-system-x86 dosfstools mtools cpio
 
 # Clean previous builds
 make clean
@@ -13,7 +13,7 @@ make
 # Check if build successful
 if [ -f "bloodos.img" ]; then
     echo "✅ Build successful!"
-    echo "Image: bloodos.img (1.44MB)"
+    echo "Image: bloodos.img (boot sector, kernel, initrd, 16MB FAT and 8MB LFS partitions)"
     echo ""
     echo "To run in QEMU:"
     echo "  make run        # Floppy mode"
@@ -16,14 +16,24 @@ start:
     ; Save drive number
     mov [boot_drive], dl
     
+    ; Enable A20 (fast gate) so RAM above 1MB is usable
+    in al, 0x92
+    or al, 0x02
+    and al, 0xFE
+    out 0x92, al
+    
     ; Clear screen
     mov ax, 0x0003
     int 0x10
     
-    ; Load kernel (sector 2-50)
-    mov bx, KERNEL_OFFSET
-    mov dh, 50        ; Load 50 sectors (25KB)
-    mov dl, [boot_drive]
+    ; Load the kernel (KERNEL_SECTORS sectors from sector 2), then the
+    ; initrd that follows it on disk
+    call disk_geometry
+    mov ax, KERNEL_OFFSET >> 4
+    mov cx, KERNEL_SECTORS
+    call disk_load
+    mov ax, INITRD_ADDR >> 4
+    mov cx, INITRD_SECTORS
     call disk_load
     
     ; Switch to protected mode
@@ -36,23 +46,71 @@ start:
     
     jmp CODE_SEG:init_pm
 
+; === DISK GEOMETRY ===
+; Ask the BIOS for sectors/track and heads; keep 1.44MB floppy
+; defaults if it can't tell us.
+disk_geometry:
+    pusha
+    push es
+    mov ah, 0x08
+    mov dl, [boot_drive]
+    xor di, di
+    mov es, di
+    int 0x13
+    jc .done
+    and cl, 0x3F
+    mov [sectors_per_track], cl
+    inc dh
+    mov [heads], dh
+.done:
+    pop es
+    popa
+    ret
+
 ; === DISK LOAD FUNCTION ===
+; CX sectors from [lba] on to AX:0. One sector per call so no read
+; crosses a track or 64KB boundary.
 disk_load:
     pusha
-    push dx
+    mov es, ax
+.next:
+    push cx
     
-    mov ah, 0x02      ; BIOS read sectors
-    mov al, dh        ; Sectors to read
-    mov ch, 0x00      ; Cylinder 0
-    mov dh, 0x00      ; Head 0
-    mov cl, 0x02      ; Start from sector 2
-    int 0x13
+    ; LBA -> CHS
+    mov ax, [lba]
+    xor dx, dx
+    movzx bx, byte [sectors_per_track]
+    div bx            ; AX = track, DX = sector - 1
+    inc dx
+    mov cl, dl
+    xor dx, dx
+    movzx bx, byte [heads]
+    div bx            ; AX = cylinder, DX = head
+    mov ch, al
+    shl ah, 6
+    or cl, ah         ; Cylinder bits 8-9
+    mov dh, dl
+    mov dl, [boot_drive]
+    xor bx, bx
     
-    jc disk_error     ; Carry flag = error
+    mov di, 3         ; Retries (floppy motor spin-up)
+.retry:
+    mov ax, 0x0201    ; BIOS read 1 sector to ES:BX
+    int 0x13
+    jnc .ok
+    xor ah, ah        ; Reset drive and try again
+    int 0x13
+    dec di
+    jnz .retry
+    jmp disk_error
+.ok:
+    mov ax, es
+    add ax, 0x20      ; Next 512 bytes
+    mov es, ax
+    inc word [lba]
     
-    pop dx
-    cmp al, dh        ; AL = sectors read, DH = sectors expected
-    jne disk_error
+    pop cx
+    loop .next
     
     popa
     ret
@@ -95,6 +153,9 @@ init_pm:
 
 ; === DATA ===
 boot_drive db 0
+sectors_per_track db 18
+heads db 2
+lba dw 1
 error_msg db "Boot Error", 0
 
 ; === GDT ===
@@ -122,8 +183,63 @@ gdt_descriptor:
 
 CODE_SEG equ gdt_code - gdt_start
 DATA_SEG equ gdt_data - gdt_start
-KERNEL_OFFSET equ 0x1000
+KERNEL_OFFSET equ 0x10000
+INITRD_ADDR equ 0x60000     ; Must match INITRD_ADDR in kernel.c
+
+%ifndef KERNEL_SECTORS
+%define KERNEL_SECTORS 320  ; Passed by the Makefile
+%endif
+%ifndef INITRD_SECTORS
+%define INITRD_SECTORS 384  ; Passed by the Makefile
+%endif
+%ifndef FS_SECTORS
+%define FS_SECTORS 32768    ; Passed by the Makefile
+%endif
+%ifndef FAT_BITS
+%define FAT_BITS 16
+%endif
+%ifndef LFS_START
+%define LFS_START 33480     ; Passed by the Makefile
+%endif
+%ifndef LFS_SECTORS
+%define LFS_SECTORS 16384   ; Passed by the Makefile
+%endif
+%ifndef EXT2_START
+%define EXT2_START 49864    ; Passed by the Makefile
+%endif
+%ifndef EXT2_SECTORS
+%define EXT2_SECTORS 16384  ; Passed by the Makefile
+%endif
+
+; === PARTITION TABLE ===
+; A FAT partition after the kernel and initrd, then the log-structured
+; one (type 0x7F, made by mkfs.lfs) and an ext2 one (type 0x83, made by
+; mke2fs), all formatted by the Makefile.
+; LBA only: the CHS fields say "use LBA".
+times 446-($-$$) db 0
+    db 0x00                 ; Not bootable
+    db 0xFE, 0xFF, 0xFF     ; CHS start
+%if FAT_BITS == 32
+    db 0x0C                 ; FAT32, LBA
+%else
+    db 0x0E                 ; FAT16, LBA
+%endif
+    db 0xFE, 0xFF, 0xFF     ; CHS end
+    dd 1 + KERNEL_SECTORS + INITRD_SECTORS ; First sector
+    dd FS_SECTORS
+    db 0x00
+    db 0xFE, 0xFF, 0xFF
+    db 0x7F                 ; BloodOS LFS
+    db 0xFE, 0xFF, 0xFF
+    dd LFS_START
+    dd LFS_SECTORS
+    db 0x00
+    db 0xFE, 0xFF, 0xFF
+    db 0x83                 ; Linux (ext2)
+    db 0xFE, 0xFF, 0xFF
+    dd EXT2_START
+    dd EXT2_SECTORS
+    times 16 db 0           ; Unused entry
 
 ; Boot signature
-times 510-($-$$) db 0
 dw 0xaa55
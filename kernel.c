@@ -1,11 +1,130 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // ==================== CONFIG ====================
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
 #define CMD_BUFFER_SIZE 128
 #define MAX_CMD_HISTORY 10
+#define MAX_CPUS 8
+#define AP_STACK_SIZE 4096
+#define AP_TRAMPOLINE 0x8000      // Must match kernel_entry.asm
+#define IPI_WAKE_VECTOR 0xF0
+#define SPURIOUS_VECTOR 0xFF
+#define WAKE_BENCH_ROUNDS 256
+#define MAX_THREADS 32
+#define THREAD_STACK_SIZE 4096      // One page from the page allocator
+#define THREAD_MAX_FDS 16           // Open files per thread
+#define FUTEX_HASH_BITS 6
+#define FUTEX_BUCKETS (1 << FUTEX_HASH_BITS)
+#define KBD_BUFFER_SIZE 64
+#define PAGE_SIZE 4096
+#define PMM_BITMAP 0x100000         // Frame bitmap lives just above 1MB
+#define PMM_EARLY_LIMIT 0x1000000   // Frames usable before parallel init
+#define PMM_CHUNK_FRAMES 1024       // 4MB per parallel init work item
+#define PMM_PREZERO 1               // Zero free frames at boot, not on alloc
+#define IDENTITY_LIMIT 0xC0000000   // RAM below this is identity-mapped
+#define MM_PRIVATE_BASE 0xC0000000
+#define MM_PRIVATE_SIZE 0x10000000
+#define VMAP_BASE 0xD0000000
+#define VMAP_PAGES 4096             // 16MB ioremap/vmap window
+#define VMALLOC_MAX_PAGES 32
+#define MAX_MMS 8
+#define TLB_VECTOR 0xF1
+#define TLB_BATCH_MAX 64
+#define TLB_INVLPG_MAX 16           // Larger batches reload CR3 instead
+#define TLB_BENCH_PAGES 64
+#define TIMER_HZ 100
+#define TIMER_VECTOR 0xF2
+#define RESCHED_VECTOR 0xF3
+#define RT_PRIORITIES 32
+#define RT_PRIO_INPUT 20            // Keyboard bottom half and echo
+#define SCHED_SLICE_US 10000        // Fair-class time slice
+#define SCHED_LAT_BUCKETS 5
+#define SHELL_LINES 4
+#define HOG_SECONDS 5
+#define MAX_INITCALLS 32            // Dependencies are a bitmask of these
+#define NR_IRQS 24                  // IOAPIC pins (GSIs); ISA IRQs map onto these
+#define IRQ_SHARED_MAX 4            // Handlers per line (PCI INTx is shared)
+#define IRQ_BASE 0x20               // Vector of IRQ/GSI 0
+#define IRQ_BALANCE_MS 1000
+#define IRQ_BALANCE_MIN_RATE 100    // Interrupts/s before a CPU counts as busy
+#define IRQ_BALANCE_HOLD 10         // Intervals a moved IRQ stays put
+#define SECTOR_SIZE 512
+#define MAX_BLOCK_DEVS 8
+#define ELV_READ_EXPIRE_MS 500      // Deadline scheduler: how long a read may wait...
+#define ELV_WRITE_EXPIRE_MS 5000    // ...and a write
+#define ELV_FIFO_BATCH 16           // Requests per sweep before directions are reconsidered
+#define ELV_WRITES_STARVED 2        // Read batches that may pass pending writes
+#define ELV_MAX_SECTORS 1024        // Largest merged request
+#define ELV_BENCH_OPS 64
+#define IORING_MAX_RINGS 4
+#define IORING_MAX_ENTRIES 128      // SQ size; the CQ is twice that
+#define IORING_BENCH_OPS 1024       // 4KB random reads per pass
+#define IORING_BENCH_DEPTH 32
+#define ATA_MULTIPLE_MAX 16         // Sectors per interrupt for READ/WRITE MULTIPLE
+#define DD_MAX_KB 64                // Largest request the dd benchmark issues
+#define DD_TOTAL_KB 4096            // Data moved per dd run (capped to the disk)
+#define PCI_MAX_DEVICES 32
+#define ATA_PRD_ENTRIES 512         // One page of PRDs per channel
+#define AHCI_MAX_DISKS 4
+#define AHCI_SLOTS 32
+#define AHCI_PRDS 248               // Fills a page after the 128-byte table header
+#define AHCI_MAX_SECTORS 8192       // Per command, keeps merged PRDs under 4MB
+#define QD_BENCH_OPS 2048           // 4KB random reads per queue depth
+#define QD_BENCH_MAX_DEPTH 32
+#define MSI_VECTOR_BASE 0x40        // MSI-X vectors, after the IOAPIC's
+#define MSI_VECTORS 32
+#define VIRTIO_BLK_MAX_DEVS 2
+#define VIRTIO_BLK_MAX_QUEUES MAX_CPUS
+#define VIRTIO_QUEUE_SIZE 64        // Ring entries (= requests) per queue
+#define VIRTIO_BLK_SEGS 28          // Data segments per indirect table
+#define VIRTIO_BLK_MAX_SECTORS 8192
+#define FDC_TRACK_CACHE 8           // Floppy cylinders (18KB each) kept in memory
+#define FDC_SPINUP_MS 300
+#define FDC_MOTOR_OFF_MS 3000       // Idle time before the floppy motor stops
+#define FDC_RETRIES 3
+#define BUF_CACHE_BLOCKS 1024       // 4KB blocks: 4MB of cached disk data
+#define BUF_HASH_BITS 10
+#define BUF_RA_MIN 4                // Read-ahead window in blocks, first...
+#define BUF_RA_MAX 32               // ...and largest
+#define BCACHE_BENCH_KB 4096
+#define PAGE_CACHE_PAGES 2048       // 8MB of file data from disk; memory-only files don't count
+#define WB_INTERVAL_MS 500          // Flusher wakeups
+#define WB_EXPIRE_MS 5000           // Dirty data older than this gets written
+#define WB_BATCH 32                 // Buffers per sorted batch
+#define WB_BACKGROUND_PCT 10        // Dirty share of both caches that starts the flusher...
+#define WB_DIRTY_PCT 20             // ...and that throttles writers
+#define WB_PAUSE_MS 10              // Throttled writers recheck this often...
+#define WB_PAUSE_MAX_MS 1000        // ...for at most this long per write
+#define WB_BENCH_KB 256
+#define DCACHE_HASH_BITS 8          // log2 of the buckets, for names and for inodes
+#define DCACHE_MAX 1024             // Unused names kept...
+#define ICACHE_MAX 512              // ...and unused inodes
+#define VFS_MAX_MOUNTS 8
+#define VFS_MAX_FILES 64            // Open files, all threads together
+#define VFS_PATH_MAX 128
+#define FAT_EXTENT_PAGES 16         // Extent map limit: 5461 fragments per file
+#define FAT_DIR_INDEXES 8           // Directories with a name index
+#define FAT_INDEX_PAGES 16          // Index limit: 4096 names per directory
+#define INITRD_ADDR 0x60000         // Must match boot.asm and the ASSERT in Linker.Id
+#define INITRD_MAX 0x30000          // INITRD_SECTORS in the Makefile
+#define TMPFS_HASH_BITS 8
+#define LFS_MAX_SEGS 1024           // 128MB at 32 x 4KB per segment
+#define LFS_MAX_INODES 1024
+#define LFS_ICACHE 32               // Inodes in memory
+#define LFS_CHECKPOINT_MS 5000
+#define LFS_CLEANER_MS 1000
+#define LFS_CLEAN_LOW 4             // Free segments that start the cleaner...
+#define LFS_CLEAN_HIGH 8            // ...and that it stops at
+#define LFS_RESERVE_SEGS 3          // Kept for metadata and the cleaner
+#define LFS_BENCH_FILES 64
+#define LFS_BENCH_KB 1024
+#define EXT2_ICACHE 16              // Inodes in memory, each with...
+#define EXT2_MAP_CACHE 4            // ...this many pointer blocks pinned
+#define EXT2_ITABLE_CACHE 16        // Inode-table blocks pinned in the buffer cache
+#define SCRIPT_MAX_DEPTH 4          // Nested scripts; each holds a page, not stack
 
 // ==================== VGA ====================
 static uint16_t* const VGA_MEMORY = (uint16_t*)0xB8000;
@@ -31,90 +150,11351 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+static inline void outl(uint16_t port, uint32_t value) {
+    asm volatile ("outl %0, %1" :: "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    asm volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void insw(uint16_t port, void* buf, uint32_t count) {
+    asm volatile ("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buf, uint32_t count) {
+    asm volatile ("rep outsw" : "+S"(buf), "+c"(count) : "d"(port));
+}
+
 // ==================== VGA FUNCTIONS ====================
+// The keyboard thread echoes while the shell prints; both go through
+// the console lock (defined with the spinlocks).
+static uint32_t console_lock(void);
+static void console_unlock(uint32_t flags);
+
 static void vga_set_color(uint8_t fg, uint8_t bg) {
     vga_color = (bg << 4) | (fg & 0x0F);
 }
 
-static void vga_putc(char c) {
-    if (c == '\n') {
-        cursor_x = 0;
-        if (++cursor_y >= VGA_HEIGHT) {
-            cursor_y = VGA_HEIGHT - 1;
-            // Scroll screen
-            for (uint32_t i = 0; i < (VGA_HEIGHT - 1) * VGA_WIDTH; i++) {
-                VGA_MEMORY[i] = VGA_MEMORY[i + VGA_WIDTH];
-            }
-            // Clear last line
-            for (uint32_t i = 0; i < VGA_WIDTH; i++) {
-                VGA_MEMORY[(VGA_HEIGHT - 1) * VGA_WIDTH + i] = vga_color << 8 | ' ';
-            }
+static void __vga_putc(char c) {
+    if (c == '\n') {
+        cursor_x = 0;
+        if (++cursor_y >= VGA_HEIGHT) {
+            cursor_y = VGA_HEIGHT - 1;
+            // Scroll screen
+            for (uint32_t i = 0; i < (VGA_HEIGHT - 1) * VGA_WIDTH; i++) {
+                VGA_MEMORY[i] = VGA_MEMORY[i + VGA_WIDTH];
+            }
+            // Clear last line
+            for (uint32_t i = 0; i < VGA_WIDTH; i++) {
+                VGA_MEMORY[(VGA_HEIGHT - 1) * VGA_WIDTH + i] = vga_color << 8 | ' ';
+            }
+        }
+    } else if (c == '\b') {
+        if (cursor_x > 0) {
+            cursor_x--;
+        } else if (cursor_y > 0) {
+            cursor_y--;
+            cursor_x = VGA_WIDTH - 1;
+        }
+        VGA_MEMORY[cursor_y * VGA_WIDTH + cursor_x] = vga_color << 8 | ' ';
+    } else if (c == '\r') {
+        cursor_x = 0;
+    } else if (c == '\t') {
+        cursor_x = (cursor_x + 4) & ~3;
+    } else {
+        VGA_MEMORY[cursor_y * VGA_WIDTH + cursor_x] = vga_color << 8 | c;
+        cursor_x++;
+    }
+    
+    if (cursor_x >= VGA_WIDTH) {
+        cursor_x = 0;
+        cursor_y++;
+    }
+}
+
+static void vga_putc(char c) {
+    uint32_t flags = console_lock();
+    __vga_putc(c);
+    console_unlock(flags);
+}
+
+static void vga_puts(const char* str) {
+    uint32_t flags = console_lock();
+    while (*str) __vga_putc(*str++);
+    console_unlock(flags);
+}
+
+static void vga_put_dec(uint32_t value) {
+    char buf[11];
+    int i = 10;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    vga_puts(&buf[i]);
+}
+
+// Right-aligned in a field of width characters
+static void vga_put_dec_width(uint32_t value, uint32_t width) {
+    uint32_t digits = 1;
+    for (uint32_t v = value; v >= 10; v /= 10) digits++;
+    while (width-- > digits) vga_putc(' ');
+    vga_put_dec(value);
+}
+
+static void vga_put_hex(uint32_t value) {
+    static const char digits[] = "0123456789ABCDEF";
+    vga_puts("0x");
+    for (int shift = 28; shift >= 0; shift -= 4) {
+        vga_putc(digits[(value >> shift) & 0xF]);
+    }
+}
+
+// File contents: anything unprintable shows as '.'
+static void vga_put_text(const uint8_t* text, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        char c = text[i];
+        vga_putc((c >= ' ' && c < 0x7F) || c == '\n' || c == '\t' ? c : '.');
+    }
+}
+
+static void vga_clear(void) {
+    uint32_t flags = console_lock();
+    for (uint32_t i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
+        VGA_MEMORY[i] = vga_color << 8 | ' ';
+    }
+    cursor_x = 0;
+    cursor_y = 0;
+    console_unlock(flags);
+}
+
+// Under the console lock: the index/data port pairs mustn't interleave
+static void vga_set_cursor(void) {
+    uint32_t flags = console_lock();
+    uint16_t pos = cursor_y * VGA_WIDTH + cursor_x;
+    outb(0x3D4, 0x0F);
+    outb(0x3D5, (uint8_t)(pos & 0xFF));
+    outb(0x3D4, 0x0E);
+    outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
+    console_unlock(flags);
+}
+
+// ==================== STRING FUNCTIONS ====================
+static size_t strlen(const char* str) {
+    size_t len = 0;
+    while (str[len]) len++;
+    return len;
+}
+
+static int strcmp(const char* s1, const char* s2) {
+    while (*s1 && (*s1 == *s2)) {
+        s1++;
+        s2++;
+    }
+    return *(unsigned char*)s1 - *(unsigned char*)s2;
+}
+
+static char tolower(char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static int strcasecmp(const char* s1, const char* s2) {
+    while (*s1 && tolower(*s1) == tolower(*s2)) {
+        s1++;
+        s2++;
+    }
+    return (unsigned char)tolower(*s1) - (unsigned char)tolower(*s2);
+}
+
+static void strcpy(char* dest, const char* src) {
+    while ((*dest++ = *src++));
+}
+
+static void memset(void* dest, int value, size_t n) {
+    unsigned char* d = dest;
+    while (n--) *d++ = (unsigned char)value;
+}
+
+static void memcpy(void* dest, const void* src, size_t n) {
+    unsigned char* d = dest;
+    const unsigned char* s = src;
+    while (n--) *d++ = *s++;
+}
+
+static int memcmp(const void* s1, const void* s2, size_t n) {
+    const unsigned char* a = s1;
+    const unsigned char* b = s2;
+    for (; n; n--, a++, b++) {
+        if (*a != *b) return *a - *b;
+    }
+    return 0;
+}
+
+// Parse a decimal or 0x-prefixed hex number and skip trailing spaces.
+// Returns false (and leaves *s alone) if there is no number.
+static bool parse_uint(const char** s, uint32_t* out) {
+    const char* p = *s;
+    uint32_t value = 0;
+    bool hex = p[0] == '0' && (p[1] == 'x' || p[1] == 'X');
+    if (hex) p += 2;
+    const char* digits = p;
+    for (;; p++) {
+        char c = *p;
+        uint32_t d;
+        if (c >= '0' && c <= '9') d = c - '0';
+        else if (hex && c >= 'a' && c <= 'f') d = c - 'a' + 10;
+        else if (hex && c >= 'A' && c <= 'F') d = c - 'A' + 10;
+        else break;
+        value = value * (hex ? 16 : 10) + d;
+    }
+    if (p == digits) return false;
+    while (*p == ' ') p++;
+    *s = p;
+    *out = value;
+    return true;
+}
+
+// ==================== CPU ====================
+static bool cpu_has_apic = false;
+static bool cpu_has_mwait = false;
+static bool cpu_has_sse42 = false;
+static uint32_t tsc_per_us = 1;
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    asm volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void cpu_relax(void) {
+    asm volatile ("pause" ::: "memory");
+}
+
+// 64-by-32 division without libgcc (we link with -nostdlib)
+static inline uint64_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    uint32_t q_hi = hi / d;
+    uint32_t rem = hi % d;
+    uint32_t q_lo;
+    asm ("divl %4" : "=a"(q_lo), "=d"(rem) : "a"(lo), "d"(rem), "rm"(d));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+static uint32_t cycles_to_ns(uint64_t cycles) {
+    return (uint32_t)div64_32(cycles * 1000, tsc_per_us);
+}
+
+static void udelay(uint32_t us) {
+    uint64_t start = rdtsc();
+    uint64_t wait = (uint64_t)us * tsc_per_us;
+    while (rdtsc() - start < wait) cpu_relax();
+}
+
+static void tsc_calibrate(void) {
+    // Let PIT channel 2 count down 10ms (11932 ticks at 1.193182 MHz)
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+    outb(0x43, 0xB0);
+    outb(0x42, 11932 & 0xFF);
+    outb(0x42, 11932 >> 8);
+
+    uint64_t start = rdtsc();
+    while (!(inb(0x61) & 0x20));
+    uint64_t cycles = rdtsc() - start;
+
+    tsc_per_us = (uint32_t)div64_32(cycles, 10000);
+    if (tsc_per_us == 0) tsc_per_us = 1;
+}
+
+// CRC32C (Castagnoli), with SSE4.2's crc32 instruction when the CPU has
+// it and a table otherwise. crc32c_update() works on the raw register
+// so a CRC can span several buffers: start from ~0 and invert the end.
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (uint32_t k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78 & -(c & 1));
+        crc32c_table[i] = c;
+    }
+}
+
+static uint32_t crc32c_update(uint32_t crc, const void* data, uint32_t len) {
+    const uint8_t* p = data;
+    if (cpu_has_sse42) {
+        for (; len >= 4; p += 4, len -= 4) {
+            uint32_t word;
+            memcpy(&word, p, 4);
+            asm ("crc32l %1, %0" : "+r"(crc) : "rm"(word));
+        }
+        for (; len; p++, len--) asm ("crc32b %1, %0" : "+r"(crc) : "qm"(*p));
+        return crc;
+    }
+    for (; len; p++, len--) crc = (crc >> 8) ^ crc32c_table[(crc ^ *p) & 0xFF];
+    return crc;
+}
+
+static inline uint32_t crc32c(const void* data, uint32_t len) {
+    return ~crc32c_update(~0u, data, len);
+}
+
+static void cpu_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    cpu_has_apic = (d >> 9) & 1;
+    cpu_has_mwait = (c >> 3) & 1;
+    cpu_has_sse42 = (c >> 20) & 1;
+    crc32c_init();
+    tsc_calibrate();
+}
+
+// ==================== LOCAL APIC ====================
+#define LAPIC_ID      0x020
+#define LAPIC_EOI     0x0B0
+#define LAPIC_SVR     0x0F0
+#define LAPIC_ICR_LO  0x300
+#define LAPIC_ICR_HI  0x310
+
+#define ICR_INIT      0x00004500
+#define ICR_STARTUP   0x00004600
+#define ICR_FIXED     0x00004000
+#define ICR_PENDING   0x00001000
+
+static volatile uint32_t* lapic = 0;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static uint32_t lapic_id(void) {
+    return lapic ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+static void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+    lapic_write(LAPIC_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) cpu_relax();
+}
+
+static void* ioremap(uint32_t phys, uint32_t size);
+
+// Called on every CPU; the first call maps the register window
+static void lapic_init(void) {
+    if (!cpu_has_apic) return;
+    uint64_t base = rdmsr(0x1B);
+    wrmsr(0x1B, base | 0x800);  // Global enable
+    if (!lapic) lapic = ioremap((uint32_t)base & 0xFFFFF000, PAGE_SIZE);
+    lapic_write(LAPIC_SVR, 0x100 | SPURIOUS_VECTOR);
+}
+
+// ==================== INTERRUPTS ====================
+struct interrupt_frame {
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;  // pusha
+    uint32_t vector, error_code;
+    uint32_t eip, cs, eflags;
+} __attribute__((packed));
+
+struct idt_entry {
+    uint16_t base_lo;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t flags;
+    uint16_t base_hi;
+} __attribute__((packed));
+
+struct idt_ptr {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+extern uint32_t isr_stub_table[256];
+
+static struct idt_entry idt[256];
+static struct idt_ptr idtr;
+static void (*interrupt_handlers[256])(void);
+
+static void idt_set_gate(uint8_t n, uint32_t base) {
+    idt[n].base_lo = base & 0xFFFF;
+    idt[n].selector = 0x08;     // Kernel code segment from boot.asm
+    idt[n].zero = 0;
+    idt[n].flags = 0x8E;        // Present, ring 0, 32-bit interrupt gate
+    idt[n].base_hi = (base >> 16) & 0xFFFF;
+}
+
+static void idt_load(void) {
+    asm volatile ("lidt %0" :: "m"(idtr));
+}
+
+static void register_interrupt(uint8_t vector, void (*handler)(void)) {
+    interrupt_handlers[vector] = handler;
+}
+
+// ==================== SPINLOCKS ====================
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200) asm volatile ("sti" ::: "memory");
+}
+
+// Defined with the per-CPU data; a held spinlock disables preemption
+static inline void preempt_disable(void);
+static inline void preempt_enable(void);
+static inline void preempt_enable_no_resched(void);
+static inline void preempt_check_resched(void);
+
+static inline void spin_lock(spinlock_t* lock) {
+    preempt_disable();
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) cpu_relax();
+    }
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable_no_resched();
+    irq_restore(flags);
+    preempt_check_resched();
+}
+
+static spinlock_t console_spinlock;
+
+static uint32_t console_lock(void) {
+    return spin_lock_irqsave(&console_spinlock);
+}
+
+static void console_unlock(uint32_t flags) {
+    spin_unlock_irqrestore(&console_spinlock, flags);
+}
+
+// ==================== ACPI ====================
+static bool acpi_checksum(const void* table, uint32_t len) {
+    const uint8_t* p = table;
+    uint8_t sum = 0;
+    while (len--) sum += *p++;
+    return sum == 0;
+}
+
+static const uint8_t* acpi_scan_rsdp(uint32_t start, uint32_t end) {
+    for (uint32_t addr = start; addr < end; addr += 16) {
+        const uint8_t* p = (const uint8_t*)addr;
+        if (memcmp(p, "RSD PTR ", 8) == 0 && acpi_checksum(p, 20)) return p;
+    }
+    return 0;
+}
+
+// A word of low memory, read through asm: GCC takes a constant pointer
+// this close to 0 for a null dereference and warns about its bounds
+static inline uint16_t phys_read16(uint32_t addr) {
+    uint16_t value;
+    asm volatile("movw (%1), %0" : "=r"(value) : "r"(addr) : "memory");
+    return value;
+}
+
+static const uint8_t* acpi_find_table(const char* signature) {
+    uint32_t ebda = (uint32_t)phys_read16(0x40E) << 4;  // From the BDA
+    const uint8_t* rsdp = ebda ? acpi_scan_rsdp(ebda, ebda + 1024) : 0;
+    if (!rsdp) rsdp = acpi_scan_rsdp(0xE0000, 0x100000);
+    if (!rsdp) return 0;
+
+    const uint8_t* rsdt = (const uint8_t*)*(const uint32_t*)(rsdp + 16);
+    uint32_t entries = (*(const uint32_t*)(rsdt + 4) - 36) / 4;
+    for (uint32_t i = 0; i < entries; i++) {
+        const uint8_t* table = (const uint8_t*)((const uint32_t*)(rsdt + 36))[i];
+        if (memcmp(table, signature, 4) == 0) return table;
+    }
+    return 0;
+}
+
+// ==================== SMP ====================
+#define IDLE_RUNNING 0
+#define IDLE_MWAIT   1
+#define IDLE_HLT     2
+
+struct cpu {
+    volatile uint32_t wake_flag;        // MONITORed; alone on its cache line
+    uint32_t apic_id __attribute__((aligned(64)));
+    uint32_t index;
+    volatile bool online;
+    volatile uint32_t idle_state;       // IDLE_RUNNING or the method in use
+    uint32_t idle_method;
+    void (*volatile call_fn)(void*);
+    void* volatile call_arg;
+    uint32_t wakeups;
+    struct cpu* self;                   // percpu_read(self) == this CPU
+    struct thread* current;
+    struct thread* idle;
+    struct thread* last;                // Thread switched away from, see schedule()
+    struct mm* active_mm;
+    uint32_t preempt_count;             // Spinlocks held; no preemption while > 0
+    volatile uint32_t need_resched;
+    uint32_t interrupts;
+    uint32_t vector;                    // Being handled (IRQs are off meanwhile)
+    uint32_t context_switches;
+    uint32_t irq_counts[NR_IRQS];       // Device interrupts handled here
+} __attribute__((aligned(64)));
+
+extern uint8_t ap_trampoline[];
+extern uint8_t ap_trampoline_end[];
+
+static struct cpu cpus[MAX_CPUS];
+static uint32_t cpu_count = 1;
+static volatile uint32_t ap_booting;
+static uint8_t ap_stacks[MAX_CPUS][AP_STACK_SIZE] __attribute__((aligned(16)));
+
+static void sched_init_cpu(struct cpu* c);
+static void idle_loop(struct cpu* c);
+static void timer_init_cpu(void);
+
+// ==================== PER-CPU DATA ====================
+// The kernel GDT has one extra data segment per CPU whose base is that
+// CPU's struct cpu. GS holds it, so percpu_read(field) is a single
+// "mov %gs:offset, reg" and never has to look up the APIC ID.
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_PERCPU(i)   (0x18 + (i) * 8)
+
+struct gdt_ptr {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+static uint64_t gdt[3 + MAX_CPUS];
+static struct gdt_ptr gdtr;
+
+#define percpu_check(field) \
+    _Static_assert(sizeof(((struct cpu*)0)->field) == 4, "percpu field must be 32-bit")
+
+#define percpu_read(field) ({                                       \
+    percpu_check(field);                                            \
+    __typeof__(((struct cpu*)0)->field) __val;                      \
+    asm volatile ("movl %%gs:%c1, %0"                               \
+                  : "=r"(__val) : "i"(offsetof(struct cpu, field))); \
+    __val;                                                          \
+})
+
+#define percpu_write(field, value) do {                             \
+    percpu_check(field);                                            \
+    asm volatile ("movl %0, %%gs:%c1"                               \
+                  :: "r"(value), "i"(offsetof(struct cpu, field))   \
+                  : "memory");                                      \
+} while (0)
+
+#define percpu_inc(field) do {                                      \
+    percpu_check(field);                                            \
+    asm volatile ("incl %%gs:%c0"                                   \
+                  :: "i"(offsetof(struct cpu, field)) : "memory");  \
+} while (0)
+
+static uint64_t gdt_entry(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    uint64_t e = limit & 0xFFFF;
+    e |= (uint64_t)(base & 0xFFFFFF) << 16;
+    e |= (uint64_t)access << 40;
+    e |= (uint64_t)((limit >> 16) & 0xF) << 48;
+    e |= (uint64_t)(flags & 0xF) << 52;
+    e |= (uint64_t)(base >> 24) << 56;
+    return e;
+}
+
+static void gdt_load(void) {
+    asm volatile ("lgdt %0" :: "m"(gdtr));
+    asm volatile ("ljmp %0, $1f\n1:" :: "i"(GDT_KERNEL_CODE));
+    asm volatile ("mov %0, %%ds\n"
+                  "mov %0, %%es\n"
+                  "mov %0, %%fs\n"
+                  "mov %0, %%ss"
+                  :: "r"(GDT_KERNEL_DATA));
+}
+
+// Same flat code/data layout as boot.asm, plus a small segment per CPU
+static void gdt_init(void) {
+    gdt[0] = 0;
+    gdt[1] = gdt_entry(0, 0xFFFFF, 0x9A, 0xC);
+    gdt[2] = gdt_entry(0, 0xFFFFF, 0x92, 0xC);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpus[i].self = &cpus[i];
+        cpus[i].index = i;
+        gdt[3 + i] = gdt_entry((uint32_t)&cpus[i], sizeof(struct cpu) - 1, 0x92, 0x4);
+    }
+    gdtr.limit = sizeof(gdt) - 1;
+    gdtr.base = (uint32_t)&gdt;
+    gdt_load();
+}
+
+// Point GS at this CPU's block; called once on every CPU
+static void percpu_init(struct cpu* c) {
+    asm volatile ("mov %0, %%gs" :: "r"(GDT_PERCPU(c->index)));
+}
+
+#define percpu_dec(field) do {                                      \
+    percpu_check(field);                                            \
+    asm volatile ("decl %%gs:%c0"                                   \
+                  :: "i"(offsetof(struct cpu, field)) : "memory");  \
+} while (0)
+
+static inline struct cpu* this_cpu(void) {
+    return percpu_read(self);
+}
+
+static void preempt_schedule(void);
+
+static inline void preempt_disable(void) {
+    percpu_inc(preempt_count);
+    asm volatile ("" ::: "memory");
+}
+
+static inline void preempt_enable_no_resched(void) {
+    asm volatile ("" ::: "memory");
+    percpu_dec(preempt_count);
+}
+
+// Reschedule now if asked to and nothing forbids it (locks held, IRQs off)
+static inline void preempt_check_resched(void) {
+    uint32_t flags;
+    if (!percpu_read(need_resched) || percpu_read(preempt_count)) return;
+    asm volatile ("pushf; pop %0" : "=r"(flags));
+    if (flags & 0x200) preempt_schedule();
+}
+
+static inline void preempt_enable(void) {
+    preempt_enable_no_resched();
+    preempt_check_resched();
+}
+
+// ==================== PHYSICAL MEMORY ====================
+// One bit per 4KB frame, kept at PMM_BITMAP (just above 1MB), followed by
+// a struct page per frame. Everything below 1MB (kernel image, stacks,
+// trampoline, BIOS areas) stays reserved. pmm_init() only releases frames
+// below PMM_EARLY_LIMIT; the rest is initialised (and pre-zeroed) in
+// chunks by every CPU in parallel, see MEMORY INIT.
+#define PG_RESERVED 0x01                // Kernel, BIOS or allocator metadata
+#define PG_ZERO     0x02                // Free and known to be all zeroes
+#define PG_UPTODATE 0x04                // Page cache (see PAGE CACHE): data valid...
+#define PG_DIRTY    0x08                // ...newer than the disk
+#define PG_LOCKED   0x10                // ...being read in
+#define PG_ERROR    0x20                // ...and that read failed
+
+struct address_space;
+
+struct page {
+    volatile uint32_t flags;
+    struct address_space* mapping;      // Page cache only: the file, 0 once truncated
+    uint32_t index;                     // Page offset in it
+    uint32_t refs;
+    struct page* prev;                  // LRU, towards MRU
+    struct page* next;
+};
+
+static uint32_t* pmm_bitmap = (uint32_t*)PMM_BITMAP;
+static struct page* page_frames;
+static uint32_t pmm_frames = 0;
+static uint32_t pmm_free = 0;
+static uint32_t pmm_next = 0;
+static spinlock_t pmm_lock;
+static uint32_t mem_total_kb = 0;
+
+// Frames from pmm_chunk_base up are handed out in PMM_CHUNK_FRAMES chunks
+static uint32_t pmm_chunk_base = 0;
+static uint32_t pmm_chunk_count = 0;
+static volatile uint32_t pmm_chunk_next = 0;
+static volatile uint32_t pmm_chunks_done = 0;
+static volatile bool pmm_init_active = false;
+static uint32_t pmm_chunks_by_cpu[MAX_CPUS];
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(0x70, reg);
+    return inb(0x71);
+}
+
+static void memory_detect(void) {
+    uint32_t ext_kb = cmos_read(0x30) | (cmos_read(0x31) << 8);         // 1MB..
+    uint32_t high_64k = cmos_read(0x34) | (cmos_read(0x35) << 8);       // 16MB..
+    mem_total_kb = high_64k ? 16 * 1024 + high_64k * 64 : 1024 + ext_kb;
+    if (mem_total_kb > IDENTITY_LIMIT / 1024) mem_total_kb = IDENTITY_LIMIT / 1024;
+}
+
+static void pmm_mark(uint32_t frame, bool used) {
+    if (used) pmm_bitmap[frame / 32] |= 1u << (frame % 32);
+    else pmm_bitmap[frame / 32] &= ~(1u << (frame % 32));
+}
+
+static void zero_pages(uint32_t phys, uint32_t count) {
+    uint32_t dwords = count * (PAGE_SIZE / 4);
+    asm volatile ("rep stosl" : "+D"(phys), "+c"(dwords) : "a"(0) : "memory");
+}
+
+static void pmm_init(void) {
+    memory_detect();
+    pmm_frames = mem_total_kb / 4;
+
+    uint32_t bitmap_bytes = (pmm_frames + 31) / 32 * 4;
+    page_frames = (struct page*)((PMM_BITMAP + bitmap_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    uint32_t reserved = ((uint32_t)(page_frames + pmm_frames) + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (reserved > pmm_frames) reserved = pmm_frames;
+
+    // Round up to a bitmap word so chunks never share one with the early range
+    uint32_t early = PMM_EARLY_LIMIT / PAGE_SIZE;
+    if (early < reserved) early = reserved;
+    early = (early + 31) & ~31u;
+    if (early > pmm_frames) early = pmm_frames;
+
+    // Everything starts allocated; only the early range is released here
+    memset(pmm_bitmap, 0xFF, bitmap_bytes);
+    for (uint32_t f = 0; f < early; f++) {
+        page_frames[f] = (struct page){ .flags = f < reserved ? PG_RESERVED : 0 };
+        if (f >= reserved) pmm_mark(f, false);
+    }
+
+    pmm_free = early - reserved;
+    pmm_next = reserved;
+    pmm_chunk_base = early;
+    pmm_chunk_count = (pmm_frames - early + PMM_CHUNK_FRAMES - 1) / PMM_CHUNK_FRAMES;
+}
+
+// Set up one chunk's metadata, optionally zero it, then make it allocatable
+static void pmm_init_chunk(uint32_t chunk) {
+    uint32_t first = pmm_chunk_base + chunk * PMM_CHUNK_FRAMES;
+    uint32_t count = pmm_frames - first < PMM_CHUNK_FRAMES ? pmm_frames - first : PMM_CHUNK_FRAMES;
+
+    for (uint32_t i = 0; i < count; i++) page_frames[first + i] = (struct page){ .flags = PMM_PREZERO ? PG_ZERO : 0 };
+    if (PMM_PREZERO) zero_pages(first * PAGE_SIZE, count);
+
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    for (uint32_t i = 0; i < count; i++) pmm_mark(first + i, false);
+    pmm_free += count;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// Returns a zeroed, identity-mapped page or 0
+static uint32_t pmm_alloc_page(void) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t phys = 0;
+    bool zero = false;
+    for (uint32_t n = 0; n < pmm_frames && pmm_free; n++) {
+        uint32_t f = pmm_next++;
+        if (pmm_next >= pmm_frames) pmm_next = 0;
+        if (!(pmm_bitmap[f / 32] & (1u << (f % 32)))) {
+            pmm_mark(f, true);
+            pmm_free--;
+            zero = page_frames[f].flags & PG_ZERO;
+            page_frames[f].flags &= ~PG_ZERO;
+            phys = f * PAGE_SIZE;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    if (phys && !zero) zero_pages(phys, 1);
+    return phys;
+}
+
+static inline struct page* virt_to_page(const void* addr) {
+    return &page_frames[(uint32_t)addr / PAGE_SIZE];
+}
+
+static inline uint8_t* page_address(const struct page* page) {
+    return (uint8_t*)((page - page_frames) * PAGE_SIZE);
+}
+
+static void pmm_free_page(uint32_t phys) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    pmm_mark(phys / PAGE_SIZE, false);
+    page_frames[phys / PAGE_SIZE].flags &= ~PG_ZERO;
+    pmm_free++;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// ==================== PAGING ====================
+// 0 .. IDENTITY_LIMIT     RAM, identity-mapped with global 4MB pages
+// MM_PRIVATE_BASE ..      4KB mappings private to each address space
+// VMAP_BASE ..            shared window for ioremap()/vmap()
+#define PTE_PRESENT  0x001
+#define PTE_WRITE    0x002
+#define PTE_PWT      0x008
+#define PTE_PCD      0x010
+#define PTE_DIRTY    0x040            // Set by the CPU on a write
+#define PTE_4MB      0x080
+#define PTE_GLOBAL   0x100
+
+struct mm {
+    uint32_t* pgdir;
+    volatile uint32_t cpu_mask;         // CPUs that have pgdir in CR3
+    spinlock_t lock;
+    uint32_t pending[TLB_BATCH_MAX];    // Unmapped, not yet invalidated
+    uint32_t pending_count;
+    bool pending_full;                  // Batch overflowed: flush everything
+};
+
+static uint32_t kernel_pgdir[1024] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t vmap_tables[VMAP_PAGES / 1024][1024] __attribute__((aligned(PAGE_SIZE)));
+static uint8_t vmap_used[VMAP_PAGES / 8];
+static spinlock_t vmap_lock;
+static struct mm kernel_mm;
+
+static void tlb_queue(struct mm* mm, uint32_t va);
+static void tlb_flush_mm(struct mm* mm);
+
+static inline uint32_t read_cr3(void) {
+    uint32_t v;
+    asm volatile ("mov %%cr3, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr3(uint32_t v) {
+    asm volatile ("mov %0, %%cr3" :: "r"(v) : "memory");
+}
+
+static inline void invlpg(uint32_t va) {
+    asm volatile ("invlpg (%0)" :: "r"(va) : "memory");
+}
+
+// Load the kernel page directory and turn paging on (every CPU)
+static void paging_enable(void) {
+    uint32_t cr0, cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 0x10 | 0x80;                 // PSE, PGE
+    asm volatile ("mov %0, %%cr4" :: "r"(cr4));
+    write_cr3((uint32_t)kernel_pgdir);
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= 0x80000000;
+    asm volatile ("mov %0, %%cr0" :: "r"(cr0));
+    this_cpu()->active_mm = &kernel_mm;
+}
+
+static void paging_init(void) {
+    for (uint32_t i = 0; i < IDENTITY_LIMIT >> 22; i++) {
+        kernel_pgdir[i] = (i << 22) | PTE_PRESENT | PTE_WRITE | PTE_4MB | PTE_GLOBAL;
+    }
+    for (uint32_t t = 0; t < VMAP_PAGES / 1024; t++) {
+        kernel_pgdir[(VMAP_BASE >> 22) + t] = (uint32_t)vmap_tables[t] | PTE_PRESENT | PTE_WRITE;
+    }
+    kernel_mm.pgdir = kernel_pgdir;
+    paging_enable();
+}
+
+// Walk the active page tables; 0 if addr isn't mapped
+static uint32_t virt_to_phys(const void* addr) {
+    uint32_t va = (uint32_t)addr;
+    uint32_t pde = this_cpu()->active_mm->pgdir[va >> 22];
+    if (!(pde & PTE_PRESENT)) return 0;
+    if (pde & PTE_4MB) return (pde & 0xFFC00000) | (va & 0x3FFFFF);
+    uint32_t pte = ((const uint32_t*)(pde & ~0xFFF))[(va >> 12) & 0x3FF];
+    return pte & PTE_PRESENT ? (pte & ~0xFFF) | (va & 0xFFF) : 0;
+}
+
+static uint32_t* vmap_pte(uint32_t va) {
+    uint32_t page = (va - VMAP_BASE) / PAGE_SIZE;
+    return &vmap_tables[page / 1024][page % 1024];
+}
+
+// Map physical pages into the shared window. Callers keep the pages.
+static void* vmap(const uint32_t* phys, uint32_t count, uint32_t pte_flags) {
+    uint32_t flags = spin_lock_irqsave(&vmap_lock);
+    uint32_t run = 0, start = 0;
+    for (uint32_t p = 0; p < VMAP_PAGES && run < count; p++) {
+        if (vmap_used[p / 8] & (1 << (p % 8))) {
+            run = 0;
+        } else if (run++ == 0) {
+            start = p;
+        }
+    }
+    if (run < count) {
+        spin_unlock_irqrestore(&vmap_lock, flags);
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t p = start + i;
+        vmap_used[p / 8] |= 1 << (p % 8);
+        *vmap_pte(VMAP_BASE + p * PAGE_SIZE) = phys[i] | PTE_PRESENT | PTE_WRITE | pte_flags;
+    }
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    return (void*)(VMAP_BASE + start * PAGE_SIZE);
+}
+
+// Unmap a vmap() range; the whole range costs a single shootdown
+static inline void vunmap(void* addr, uint32_t count) {
+    uint32_t va = (uint32_t)addr;
+    uint32_t flags = spin_lock_irqsave(&vmap_lock);
+    for (uint32_t i = 0; i < count; i++, va += PAGE_SIZE) {
+        uint32_t p = (va - VMAP_BASE) / PAGE_SIZE;
+        *vmap_pte(va) = 0;
+        vmap_used[p / 8] &= ~(1 << (p % 8));
+        tlb_queue(&kernel_mm, va);
+    }
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    tlb_flush_mm(&kernel_mm);
+}
+
+// Zeroed pages, vmapped unless there is only one
+static void* vmalloc(uint32_t pages) {
+    uint32_t frames[VMALLOC_MAX_PAGES] = {0};
+    if (pages > VMALLOC_MAX_PAGES) return 0;
+    for (uint32_t i = 0; i < pages; i++) {
+        if (!(frames[i] = pmm_alloc_page())) {
+            while (i--) pmm_free_page(frames[i]);
+            return 0;
+        }
+    }
+    void* p = pages == 1 ? (void*)frames[0] : vmap(frames, pages, PTE_PRESENT | PTE_WRITE);
+    if (!p) {
+        for (uint32_t i = 0; i < pages; i++) pmm_free_page(frames[i]);
+    }
+    return p;
+}
+
+static void vfree(void* p, uint32_t pages) {
+    if (pages == 1) {
+        pmm_free_page((uint32_t)p);
+        return;
+    }
+    for (uint32_t i = 0; i < pages; i++) pmm_free_page(virt_to_phys((uint8_t*)p + i * PAGE_SIZE));
+    vunmap(p, pages);
+}
+
+// Uncached mapping of device registers
+static void* ioremap(uint32_t phys, uint32_t size) {
+    uint32_t pages[16];
+    uint32_t offset = phys & (PAGE_SIZE - 1);
+    uint32_t count = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (count > 16) return 0;
+    for (uint32_t i = 0; i < count; i++) pages[i] = (phys & ~(PAGE_SIZE - 1)) + i * PAGE_SIZE;
+    uint8_t* va = vmap(pages, count, PTE_PCD | PTE_PWT);
+    return va ? va + offset : 0;
+}
+
+static struct mm mm_pool[MAX_MMS];
+static spinlock_t mm_pool_lock;
+
+// New address space: shares every kernel PDE, private region empty
+static struct mm* mm_create(void) {
+    uint32_t pgdir = pmm_alloc_page();
+    if (!pgdir) return 0;
+    uint32_t flags = spin_lock_irqsave(&mm_pool_lock);
+    struct mm* mm = 0;
+    for (uint32_t i = 0; i < MAX_MMS; i++) {
+        if (!mm_pool[i].pgdir) {
+            mm = &mm_pool[i];
+            memset(mm, 0, sizeof(*mm));
+            mm->pgdir = (uint32_t*)pgdir;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&mm_pool_lock, flags);
+    if (!mm) {
+        pmm_free_page(pgdir);
+        return 0;
+    }
+    memcpy(mm->pgdir, kernel_pgdir, PAGE_SIZE);
+    return mm;
+}
+
+static bool mm_map(struct mm* mm, uint32_t va, uint32_t phys) {
+    uint32_t* pde = &mm->pgdir[va >> 22];
+    if (!(*pde & PTE_PRESENT)) {
+        uint32_t table = pmm_alloc_page();
+        if (!table) return false;
+        *pde = table | PTE_PRESENT | PTE_WRITE;
+    }
+    uint32_t* table = (uint32_t*)(*pde & ~(PAGE_SIZE - 1));
+    table[(va >> 12) & 0x3FF] = phys | PTE_PRESENT | PTE_WRITE;
+    return true;
+}
+
+// Clears the PTE and queues the invalidation; call tlb_flush_mm() after a batch
+static uint32_t mm_unmap(struct mm* mm, uint32_t va) {
+    uint32_t pde = mm->pgdir[va >> 22];
+    if (!(pde & PTE_PRESENT)) return 0;
+    uint32_t* pte = &((uint32_t*)(pde & ~(PAGE_SIZE - 1)))[(va >> 12) & 0x3FF];
+    uint32_t phys = *pte & ~(PAGE_SIZE - 1);
+    if (*pte & PTE_PRESENT) {
+        *pte = 0;
+        tlb_queue(mm, va);
+    }
+    return phys;
+}
+
+// Caller guarantees no CPU still has mm loaded
+static void mm_destroy(struct mm* mm) {
+    tlb_flush_mm(mm);
+    for (uint32_t i = MM_PRIVATE_BASE >> 22; i < (MM_PRIVATE_BASE + MM_PRIVATE_SIZE) >> 22; i++) {
+        if (mm->pgdir[i] & PTE_PRESENT) pmm_free_page(mm->pgdir[i] & ~(PAGE_SIZE - 1));
+    }
+    pmm_free_page((uint32_t)mm->pgdir);
+    mm->pgdir = 0;
+}
+
+// Join next's CPU mask before loading CR3 so no shootdown can miss us,
+// leave prev's afterwards (the CR3 load already dropped its entries).
+static void switch_mm(struct mm* next) {
+    struct cpu* c = this_cpu();
+    struct mm* prev = c->active_mm;
+    if (prev == next) return;
+    uint32_t bit = 1u << c->index;
+    __atomic_fetch_or(&next->cpu_mask, bit, __ATOMIC_SEQ_CST);
+    write_cr3((uint32_t)next->pgdir);
+    c->active_mm = next;
+    if (prev != &kernel_mm) __atomic_fetch_and(&prev->cpu_mask, ~bit, __ATOMIC_SEQ_CST);
+}
+
+// ==================== TLB SHOOTDOWN ====================
+// Unmaps queue invalidations per address space; tlb_flush_mm() sends one
+// IPI round for the whole batch, only to CPUs in the mm's cpu_mask, and
+// each CPU picks invlpg or a CR3 reload depending on the batch size.
+// Must be called from thread context with interrupts enabled.
+struct tlb_request {
+    struct mm* mm;
+    uint32_t pages[TLB_BATCH_MAX];
+    uint32_t count;
+    bool full;
+    volatile uint32_t pending;          // CPUs that still have to ack
+};
+
+static struct tlb_request tlb_req;
+static spinlock_t tlb_lock;             // Serialises tlb_req; taken with IRQs on
+
+static uint32_t tlb_shootdowns = 0;
+static uint32_t tlb_ipis = 0;
+static uint32_t tlb_pages = 0;
+static uint32_t tlb_full_flushes = 0;
+static uint64_t tlb_window_start = 0;
+static uint32_t tlb_window_count = 0;
+static uint32_t tlb_rate = 0;           // Shootdowns in the last full second
+
+static void tlb_queue(struct mm* mm, uint32_t va) {
+    uint32_t flags = spin_lock_irqsave(&mm->lock);
+    if (mm->pending_count < TLB_BATCH_MAX) mm->pending[mm->pending_count++] = va;
+    else mm->pending_full = true;
+    spin_unlock_irqrestore(&mm->lock, flags);
+}
+
+static void tlb_flush_local(const uint32_t* pages, uint32_t count, bool full) {
+    if (full || count > TLB_INVLPG_MAX) {
+        write_cr3(read_cr3());
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) invlpg(pages[i]);
+}
+
+static void tlb_ipi_handler(void) {
+    struct cpu* c = this_cpu();
+    // kernel_mm mappings live in every page directory
+    if (tlb_req.mm == &kernel_mm || c->active_mm == tlb_req.mm) {
+        tlb_flush_local(tlb_req.pages, tlb_req.count, tlb_req.full);
+    }
+    __atomic_fetch_and(&tlb_req.pending, ~(1u << c->index), __ATOMIC_SEQ_CST);
+    lapic_eoi();
+}
+
+// Caller holds tlb_lock. Ends the current one-second window if it is
+// over; a window with a whole idle second after it reads as 0.
+static void tlb_window_roll(uint64_t now) {
+    uint64_t second = (uint64_t)tsc_per_us * 1000000;
+    if (now - tlb_window_start < second) return;
+    tlb_rate = now - tlb_window_start < 2 * second ? tlb_window_count : 0;
+    tlb_window_count = 0;
+    tlb_window_start = now;
+}
+
+static void tlb_account(uint32_t count, bool full) {
+    tlb_shootdowns++;
+    tlb_pages += count;
+    if (full || count > TLB_INVLPG_MAX) tlb_full_flushes++;
+    tlb_window_roll(rdtsc());
+    tlb_window_count++;
+}
+
+static void tlb_flush_mm(struct mm* mm) {
+    struct cpu* self = this_cpu();
+    uint32_t flags = spin_lock_irqsave(&mm->lock);
+    if (!mm->pending_count && !mm->pending_full) {
+        spin_unlock_irqrestore(&mm->lock, flags);
+        return;
+    }
+    spin_unlock_irqrestore(&mm->lock, flags);
+
+    spin_lock(&tlb_lock);
+    flags = spin_lock_irqsave(&mm->lock);
+    if (!mm->pending_count && !mm->pending_full) {
+        // Another CPU flushed this batch while we waited for tlb_lock
+        spin_unlock_irqrestore(&mm->lock, flags);
+        spin_unlock(&tlb_lock);
+        return;
+    }
+    tlb_req.mm = mm;
+    tlb_req.count = mm->pending_count;
+    tlb_req.full = mm->pending_full;
+    memcpy(tlb_req.pages, mm->pending, mm->pending_count * sizeof(uint32_t));
+    mm->pending_count = 0;
+    mm->pending_full = false;
+    spin_unlock_irqrestore(&mm->lock, flags);
+
+    uint32_t targets = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (!cpus[i].online || &cpus[i] == self) continue;
+        if (mm == &kernel_mm || (mm->cpu_mask & (1u << i))) targets |= 1u << i;
+    }
+
+    if (mm == &kernel_mm || self->active_mm == mm) {
+        tlb_flush_local(tlb_req.pages, tlb_req.count, tlb_req.full);
+    }
+    if (targets) {
+        tlb_req.pending = targets;
+        for (uint32_t i = 0; i < cpu_count; i++) {
+            if (!(targets & (1u << i))) continue;
+            lapic_send_ipi(cpus[i].apic_id, ICR_FIXED | TLB_VECTOR);
+            tlb_ipis++;
+        }
+        while (tlb_req.pending) cpu_relax();
+    }
+    tlb_account(tlb_req.count, tlb_req.full);
+    spin_unlock(&tlb_lock);
+}
+
+static void tlb_init(void) {
+    register_interrupt(TLB_VECTOR, tlb_ipi_handler);
+}
+
+static void show_tlb_stats(void) {
+    // Rolled here too, or the rate would be as of the last shootdown
+    spin_lock(&tlb_lock);
+    tlb_window_roll(rdtsc());
+    spin_unlock(&tlb_lock);
+    vga_puts("\nTLB shootdowns: ");
+    vga_put_dec(tlb_shootdowns);
+    vga_puts(" (");
+    vga_put_dec(tlb_rate);
+    vga_puts("/s)\nIPIs sent:      ");
+    vga_put_dec(tlb_ipis);
+    vga_puts("\nPages flushed:  ");
+    vga_put_dec(tlb_pages);
+    vga_puts("\nFull flushes:   ");
+    vga_put_dec(tlb_full_flushes);
+}
+
+// ==================== SMP STARTUP ====================
+static void madt_parse(void) {
+    const uint8_t* madt = acpi_find_table("APIC");
+    if (!madt) return;
+
+    uint32_t len = *(const uint32_t*)(madt + 4);
+    for (uint32_t off = 44; off + 2 <= len; off += madt[off + 1]) {
+        const uint8_t* entry = madt + off;
+        if (entry[1] == 0) break;
+        // Type 0: processor local APIC, flags bit 0 = enabled
+        if (entry[0] == 0 && (*(const uint32_t*)(entry + 4) & 1)) {
+            if (entry[3] == cpus[0].apic_id || cpu_count >= MAX_CPUS) continue;
+            cpus[cpu_count++].apic_id = entry[3];
+        }
+    }
+}
+
+static void smp_init(void) {
+    if (!lapic) return;
+
+    madt_parse();
+    if (cpu_count == 1) return;
+
+    uint32_t size = ap_trampoline_end - ap_trampoline;
+    memcpy((void*)AP_TRAMPOLINE, ap_trampoline, size);
+    volatile uint32_t* stack_top = (volatile uint32_t*)(AP_TRAMPOLINE + size - 4);
+
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        *stack_top = (uint32_t)&ap_stacks[i][AP_STACK_SIZE];
+        ap_booting = i;
+
+        lapic_send_ipi(cpus[i].apic_id, ICR_INIT);
+        udelay(10000);
+        for (int sipi = 0; sipi < 2 && !cpus[i].online; sipi++) {
+            lapic_send_ipi(cpus[i].apic_id, ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+            for (int t = 0; t < 1000 && !cpus[i].online; t++) udelay(100);
+        }
+    }
+}
+
+void ap_main(void) {
+    struct cpu* c = &cpus[ap_booting];
+
+    gdt_load();
+    percpu_init(c);
+    idt_load();
+    paging_enable();
+    lapic_init();
+    c->idle_method = cpus[0].idle_method;
+    sched_init_cpu(c);
+    timer_init_cpu();
+    c->online = true;
+    asm volatile ("sti");
+
+    idle_loop(c);
+}
+
+// ==================== IRQ ROUTING ====================
+// Device interrupts are numbered by GSI (IOAPIC pin); ISA IRQs are
+// translated through the MADT interrupt source overrides. With an
+// IOAPIC each IRQ is delivered to one CPU (physical destination) chosen
+// from its affinity mask; without one everything goes through the PIC
+// to CPU 0. The irq layer EOIs, so handlers only service the device.
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WIN    0x10
+#define IOAPIC_VER    0x01
+#define IOAPIC_REDIR(pin) (0x10 + (pin) * 2)
+#define REDIR_ACTIVE_LOW 0x2000
+#define REDIR_LEVEL      0x8000
+#define REDIR_MASKED     0x10000
+
+struct irq_desc {
+    void (*handlers[IRQ_SHARED_MAX])(void);
+    uint32_t nr_handlers;
+    const char* name;
+    uint32_t affinity;          // CPUs allowed to take it
+    uint32_t target;            // CPU index it is routed to
+    uint32_t redir_flags;       // Polarity/trigger from the MADT
+    uint32_t last_total;        // Balancer snapshot
+    uint32_t rate;              // Per second over the last interval
+    uint32_t hold;              // Balancer intervals left before it may move
+};
+
+static struct irq_desc irqs[NR_IRQS];
+static uint8_t isa_irq_gsi[16];
+static uint32_t irq_overridden = 0;        // GSIs with a MADT source override
+static volatile uint32_t* ioapic = 0;
+static uint32_t ioapic_gsi_base = 0;
+static uint32_t ioapic_pins = 0;
+static spinlock_t irq_lock;
+
+static uint32_t ioapic_read(uint32_t reg) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    return ioapic[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    ioapic[IOAPIC_WIN / 4] = value;
+}
+
+static uint32_t isa_irq(uint32_t irq) {
+    return isa_irq_gsi[irq];
+}
+
+static uint32_t cpus_online_mask(void) {
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (cpus[i].online) mask |= 1u << i;
+    }
+    return mask;
+}
+
+// Caller holds irq_lock. Point the IOAPIC entry at desc->target.
+static void irq_route(uint32_t irq) {
+    struct irq_desc* desc = &irqs[irq];
+    if (!ioapic) return;
+    uint32_t pin = irq - ioapic_gsi_base;
+    if (pin >= ioapic_pins) return;
+    uint32_t low = (IRQ_BASE + irq) | desc->redir_flags;   // Fixed, physical
+    if (!desc->nr_handlers) low |= REDIR_MASKED;
+    ioapic_write(IOAPIC_REDIR(pin), REDIR_MASKED);
+    ioapic_write(IOAPIC_REDIR(pin) + 1, cpus[desc->target].apic_id << 24);
+    ioapic_write(IOAPIC_REDIR(pin), low);
+}
+
+static void irq_eoi(uint32_t irq) {
+    if (ioapic) {
+        lapic_eoi();
+        return;
+    }
+    if (irq >= 8) outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+}
+
+// Shared lines run every handler; each checks its own device
+static void irq_handle(uint32_t irq) {
+    struct irq_desc* desc = &irqs[irq];
+    this_cpu()->irq_counts[irq]++;
+    for (uint32_t i = 0; i < desc->nr_handlers; i++) desc->handlers[i]();
+    irq_eoi(irq);
+}
+
+static void request_irq(uint32_t irq, const char* name, void (*handler)(void)) {
+    uint32_t flags = spin_lock_irqsave(&irq_lock);
+    struct irq_desc* desc = &irqs[irq];
+    if (desc->nr_handlers == IRQ_SHARED_MAX) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        return;
+    }
+    desc->handlers[desc->nr_handlers++] = handler;
+    if (desc->nr_handlers > 1) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        return;
+    }
+    desc->name = name;
+    desc->affinity = 0xFFFFFFFF;
+    desc->target = 0;
+    if (ioapic) irq_route(irq);
+    else if (irq < 8) outb(0x21, inb(0x21) & ~(1 << irq));
+    else outb(0xA1, inb(0xA1) & ~(1 << (irq - 8)));
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+// Restrict an IRQ to the CPUs in mask; it moves now if its current
+// target isn't one of them. Fails if no CPU in mask is online.
+static bool irq_set_affinity(uint32_t irq, uint32_t mask) {
+    if (irq >= NR_IRQS || !ioapic) return false;
+    uint32_t flags = spin_lock_irqsave(&irq_lock);
+    struct irq_desc* desc = &irqs[irq];
+    uint32_t usable = mask & cpus_online_mask();
+    bool ok = desc->nr_handlers && usable;
+    if (ok) {
+        desc->affinity = mask;
+        if (!(usable & (1u << desc->target))) {
+            desc->target = __builtin_ctz(usable);
+            irq_route(irq);
+        }
+    }
+    spin_unlock_irqrestore(&irq_lock, flags);
+    return ok;
+}
+
+// PCI INTx: the line the firmware wrote to config space, level-triggered
+// and active low unless the MADT overrides that ISA IRQ
+static void request_pci_irq(uint8_t line, const char* name, void (*handler)(void)) {
+    uint32_t irq = line < 16 ? isa_irq(line) : line;
+    if (irq >= NR_IRQS) return;
+    if (!(irq_overridden & (1u << irq))) irqs[irq].redir_flags = REDIR_LEVEL | REDIR_ACTIVE_LOW;
+    request_irq(irq, name, handler);
+}
+
+static void ioapic_init(void) {
+    for (uint32_t i = 0; i < 16; i++) isa_irq_gsi[i] = i;
+    const uint8_t* madt = lapic ? acpi_find_table("APIC") : 0;
+    if (!madt) return;
+
+    uint32_t phys = 0;
+    uint32_t len = *(const uint32_t*)(madt + 4);
+    for (uint32_t off = 44; off + 2 <= len; off += madt[off + 1]) {
+        const uint8_t* entry = madt + off;
+        if (entry[1] == 0) break;
+        if (entry[0] == 1 && !phys) {
+            // Type 1: IOAPIC (only the first one is used)
+            phys = *(const uint32_t*)(entry + 4);
+            ioapic_gsi_base = *(const uint32_t*)(entry + 8);
+        } else if (entry[0] == 2 && entry[3] < 16) {
+            // Type 2: ISA interrupt source override
+            uint32_t gsi = *(const uint32_t*)(entry + 4);
+            uint16_t mps = *(const uint16_t*)(entry + 8);
+            if (gsi >= NR_IRQS) continue;
+            isa_irq_gsi[entry[3]] = gsi;
+            irq_overridden |= 1u << gsi;
+            irqs[gsi].redir_flags = ((mps & 3) == 3 ? REDIR_ACTIVE_LOW : 0) |
+                                    (((mps >> 2) & 3) == 3 ? REDIR_LEVEL : 0);
+        }
+    }
+    if (!phys) return;
+
+    ioapic = ioremap(phys, PAGE_SIZE);
+    ioapic_pins = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+    if (ioapic_pins > NR_IRQS - ioapic_gsi_base) ioapic_pins = NR_IRQS - ioapic_gsi_base;
+    for (uint32_t pin = 0; pin < ioapic_pins; pin++) irq_route(ioapic_gsi_base + pin);
+
+    // The PIC stays fully masked from here on
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
+}
+
+// ==================== IDLE ====================
+static inline void cpu_monitor(const volatile void* addr) {
+    asm volatile ("monitor" :: "a"(addr), "c"(0), "d"(0));
+}
+
+// STI right before MWAIT: its shadow covers the MWAIT, so an interrupt
+// that arrives after the caller's last check wakes it instead of being
+// taken in between
+static inline void cpu_sti_mwait(uint32_t hints, uint32_t extensions) {
+    asm volatile ("sti; mwait" :: "a"(hints), "c"(extensions));
+}
+
+static inline bool sched_has_work(void);
+
+static void ipi_wake_handler(void) {
+    lapic_eoi();
+}
+
+static void spurious_handler(void) {
+    // Spurious interrupts must not be acknowledged
+}
+
+// Sleep until cpu_wake() or any interrupt. With MWAIT a remote wakeup is
+// just the store to wake_flag; with HLT the waker has to send an IPI.
+static void cpu_idle(struct cpu* c) {
+    uint32_t method = c->idle_method;
+
+    // Publish the idle state before checking the flag; cpu_wake() does
+    // the mirror-image xchg, so one side always sees the other.
+    __atomic_store_n(&c->idle_state, method, __ATOMIC_SEQ_CST);
+
+    // The run queues are checked again with interrupts off: an IRQ on
+    // this CPU that queues a thread doesn't cpu_wake() us (sched_place
+    // leaves that to this recheck), and STI's shadow covers the sleep.
+    asm volatile ("cli" ::: "memory");
+    if (method == IDLE_MWAIT) cpu_monitor(&c->wake_flag);
+    if (c->wake_flag || sched_has_work()) asm volatile ("sti");
+    else if (method == IDLE_MWAIT) cpu_sti_mwait(0, 0);
+    else asm volatile ("sti; hlt");
+
+    c->idle_state = IDLE_RUNNING;
+    if (__atomic_exchange_n(&c->wake_flag, 0, __ATOMIC_SEQ_CST)) c->wakeups++;
+}
+
+static void cpu_wake(struct cpu* c) {
+    if (__atomic_exchange_n(&c->wake_flag, 1, __ATOMIC_SEQ_CST)) return;
+    if (__atomic_load_n(&c->idle_state, __ATOMIC_SEQ_CST) == IDLE_HLT) {
+        lapic_send_ipi(c->apic_id, ICR_FIXED | IPI_WAKE_VECTOR);
+    }
+}
+
+static void cpu_call(struct cpu* c, void (*fn)(void*), void* arg) {
+    while (c->call_fn) cpu_relax();
+    c->call_arg = arg;
+    c->call_fn = fn;
+    cpu_wake(c);
+}
+
+static void idle_init(void) {
+    uint32_t method = cpu_has_mwait ? IDLE_MWAIT : IDLE_HLT;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) cpus[i].idle_method = method;
+    register_interrupt(IPI_WAKE_VECTOR, ipi_wake_handler);
+    register_interrupt(SPURIOUS_VECTOR, spurious_handler);
+}
+
+// ==================== THREADS ====================
+#define THREAD_FREE     0
+#define THREAD_RUNNING  1
+#define THREAD_RUNNABLE 2
+#define THREAD_BLOCKED  3
+#define THREAD_DEAD     4
+
+#define SCHED_FAIR      0
+#define SCHED_RT        1
+#define SCHED_CLASSES   2
+
+struct thread {
+    uint32_t esp;                   // Saved by context_switch
+    uint32_t id;
+    const char* name;
+    volatile uint32_t state;
+    volatile bool on_cpu;           // Still executing on its stack
+    bool on_rq;
+    uint8_t sched_class;
+    uint8_t rt_priority;            // SCHED_RT: higher runs first
+    struct thread* next;            // Run queue link
+    uint64_t vruntime;              // SCHED_FAIR: weighted CPU time used
+    uint64_t exec_start;            // TSC when last put on a CPU
+    uint64_t runnable_since;        // TSC when queued, for the latency tracer
+    void (*entry)(void*);
+    void* arg;
+    uint8_t* stack;
+    struct file* fds[THREAD_MAX_FDS];   // Descriptors, into the VFS's open files
+};
+
+struct run_list {
+    struct thread* head;
+    struct thread* tail;
+};
+
+// Runnable-to-running delay per class, see sched_trace_latency()
+struct sched_latency {
+    uint32_t samples;
+    uint64_t total_ns;
+    uint32_t max_ns;
+    uint32_t buckets[SCHED_LAT_BUCKETS];
+};
+
+extern void context_switch(uint32_t* save_esp, uint32_t new_esp);
+
+static struct thread threads[MAX_THREADS];
+static uint32_t next_thread_id = 0;
+
+// Run queues are global. SCHED_RT is fixed-priority FIFO with one list
+// per priority; SCHED_FAIR is kept sorted by vruntime. sched_lock is held
+// across context_switch and released by the thread that resumes
+// (sched_finish_switch).
+static spinlock_t sched_lock;
+static struct run_list rt_runq[RT_PRIORITIES];
+static uint32_t rt_runq_bitmap = 0;
+static struct run_list fair_runq;
+static uint64_t fair_min_vruntime = 0;
+static uint64_t sched_slice_cycles = 0;
+static struct sched_latency sched_lat[SCHED_CLASSES];
+static const char* const sched_class_names[SCHED_CLASSES] = { "fair", "rt" };
+
+static inline struct thread* current_thread(void) {
+    return percpu_read(current);
+}
+
+static inline bool sched_has_work(void) {
+    return rt_runq_bitmap || fair_runq.head;
+}
+
+static struct thread* thread_alloc(const char* name) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    struct thread* t = 0;
+    for (uint32_t i = 0; i < MAX_THREADS; i++) {
+        uint32_t state = threads[i].state;
+        if (state == THREAD_FREE || (state == THREAD_DEAD && !threads[i].on_cpu)) {
+            t = &threads[i];
+            uint8_t* stack = t->stack;      // Slots keep their stack page
+            memset(t, 0, sizeof(*t));
+            t->id = next_thread_id++;
+            t->name = name;
+            t->stack = stack;
+            t->state = THREAD_BLOCKED;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return t;
+}
+
+static void run_list_append(struct run_list* list, struct thread* t) {
+    t->next = 0;
+    if (list->tail) list->tail->next = t;
+    else list->head = t;
+    list->tail = t;
+}
+
+static bool run_list_remove(struct run_list* list, struct thread* t) {
+    struct thread* prev = 0;
+    for (struct thread* q = list->head; q; prev = q, q = q->next) {
+        if (q != t) continue;
+        if (prev) prev->next = t->next;
+        else list->head = t->next;
+        if (list->tail == t) list->tail = prev;
+        t->next = 0;
+        return true;
+    }
+    return false;
+}
+
+// Caller holds sched_lock
+static void runq_push(struct thread* t) {
+    if (t->on_rq) return;
+    t->on_rq = true;
+    t->runnable_since = rdtsc();
+
+    if (t->sched_class == SCHED_RT) {
+        run_list_append(&rt_runq[t->rt_priority], t);
+        rt_runq_bitmap |= 1u << t->rt_priority;
+        return;
+    }
+
+    struct thread** link = &fair_runq.head;
+    while (*link && (*link)->vruntime <= t->vruntime) link = &(*link)->next;
+    t->next = *link;
+    *link = t;
+    if (!t->next) fair_runq.tail = t;
+}
+
+// Caller holds sched_lock
+static void runq_remove(struct thread* t) {
+    if (t->sched_class == SCHED_RT) {
+        run_list_remove(&rt_runq[t->rt_priority], t);
+        if (!rt_runq[t->rt_priority].head) rt_runq_bitmap &= ~(1u << t->rt_priority);
+    } else {
+        run_list_remove(&fair_runq, t);
+    }
+    t->on_rq = false;
+}
+
+// Caller holds sched_lock. Skips threads another CPU is still switching away from.
+static struct thread* runq_pop(struct thread* self) {
+    uint32_t bitmap = rt_runq_bitmap;
+    while (bitmap) {
+        uint32_t prio = 31 - __builtin_clz(bitmap);
+        for (struct thread* t = rt_runq[prio].head; t; t = t->next) {
+            if (t->on_cpu && t != self) continue;
+            runq_remove(t);
+            return t;
+        }
+        bitmap &= ~(1u << prio);
+    }
+    for (struct thread* t = fair_runq.head; t; t = t->next) {
+        if (t->on_cpu && t != self) continue;
+        runq_remove(t);
+        if (t->vruntime > fair_min_vruntime) fair_min_vruntime = t->vruntime;
+        return t;
+    }
+    return 0;
+}
+
+// Would t run before whatever is on this CPU right now?
+static bool sched_preempts(const struct thread* t, const struct thread* cur) {
+    if (t->sched_class != SCHED_RT) return false;
+    return cur->sched_class != SCHED_RT || cur->rt_priority < t->rt_priority;
+}
+
+// Caller holds sched_lock. Find a CPU for a newly runnable thread: an idle
+// one if possible, otherwise (for RT) one running something less urgent.
+static void sched_place(struct thread* t) {
+    struct cpu* self = this_cpu();
+    struct cpu* victim = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        struct cpu* c = &cpus[i];
+        if (!c->online) continue;
+        if (c->current == c->idle) {
+            if (c != self) cpu_wake(c);   // Our own idle loop rechecks the queues
+            return;
+        }
+        if (sched_preempts(t, c->current)) {
+            if (!victim || victim->current->sched_class == SCHED_RT) victim = c;
+        }
+    }
+    if (!victim) return;
+    victim->need_resched = 1;
+    if (victim != self) lapic_send_ipi(victim->apic_id, ICR_FIXED | RESCHED_VECTOR);
+}
+
+// Caller holds sched_lock
+static void sched_trace_latency(struct thread* t, uint64_t now) {
+    struct sched_latency* lat = &sched_lat[t->sched_class];
+    uint32_t ns = cycles_to_ns(now - t->runnable_since);
+    uint32_t bucket = 0;
+    for (uint32_t limit = 10000; bucket < SCHED_LAT_BUCKETS - 1 && ns >= limit; limit *= 10) bucket++;
+    lat->samples++;
+    lat->total_ns += ns;
+    if (ns > lat->max_ns) lat->max_ns = ns;
+    lat->buckets[bucket]++;
+}
+
+static void sched_finish_switch(void) {
+    struct cpu* c = this_cpu();
+    c->last->on_cpu = false;
+    spin_unlock(&sched_lock);
+}
+
+static void __schedule(bool preempt) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    struct cpu* c = this_cpu();
+    struct thread* prev = c->current;
+    uint64_t now = rdtsc();
+    c->need_resched = 0;
+
+    if (prev != c->idle) {
+        if (prev->sched_class == SCHED_FAIR) prev->vruntime += now - prev->exec_start;
+        // A preempted thread stays queued even if it was about to sleep;
+        // it re-checks its wait condition when it runs again.
+        if (prev->state == THREAD_RUNNING || (preempt && prev->state == THREAD_BLOCKED)) {
+            if (prev->state == THREAD_RUNNING) prev->state = THREAD_RUNNABLE;
+            runq_push(prev);
+        }
+    }
+
+    struct thread* next = runq_pop(prev);
+    if (!next) next = (prev->state == THREAD_RUNNING) ? prev : c->idle;
+
+    next->state = THREAD_RUNNING;
+    next->exec_start = now;
+    if (next == prev) {
+        spin_unlock_irqrestore(&sched_lock, flags);
+        return;
+    }
+    if (next != c->idle) sched_trace_latency(next, now);
+
+    next->on_cpu = true;
+    c->current = next;
+    c->context_switches++;
+    c->last = prev;
+    context_switch(&prev->esp, next->esp);
+
+    sched_finish_switch();
+    irq_restore(flags);
+}
+
+static void schedule(void) {
+    __schedule(false);
+}
+
+static void preempt_schedule(void) {
+    __schedule(true);
+}
+
+static void thread_wake(struct thread* t) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    if (t->state == THREAD_BLOCKED) {
+        t->state = THREAD_RUNNABLE;
+        // Sleepers don't bank credit: rejoin at the current minimum
+        if (t->sched_class == SCHED_FAIR && t->vruntime < fair_min_vruntime) {
+            t->vruntime = fair_min_vruntime;
+        }
+        runq_push(t);
+        sched_place(t);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// Undo a sleep that was prepared but not needed (condition already true)
+static void thread_set_running(struct thread* t) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    if (t->on_rq) runq_remove(t);
+    t->state = THREAD_RUNNING;
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+static void vfs_exit_files(void);
+
+static void thread_exit(void) {
+    vfs_exit_files();
+    current_thread()->state = THREAD_DEAD;
+    schedule();
+    while (1);
+}
+
+static void thread_start(void) {
+    sched_finish_switch();
+    asm volatile ("sti");
+    struct thread* t = current_thread();
+    t->entry(t->arg);
+    thread_exit();
+}
+
+static struct thread* thread_create_class(const char* name, void (*entry)(void*), void* arg,
+                                          uint8_t sched_class, uint8_t rt_priority) {
+    struct thread* t = thread_alloc(name);
+    if (!t) return 0;
+    if (!t->stack) t->stack = (uint8_t*)pmm_alloc_page();
+    if (!t->stack) {
+        t->state = THREAD_FREE;
+        return 0;
+    }
+    t->entry = entry;
+    t->arg = arg;
+    t->sched_class = sched_class;
+    t->rt_priority = rt_priority < RT_PRIORITIES ? rt_priority : RT_PRIORITIES - 1;
+    t->vruntime = fair_min_vruntime;
+
+    // Initial frame popped by context_switch: edi, esi, ebx, ebp, return address
+    uint32_t* sp = (uint32_t*)(t->stack + THREAD_STACK_SIZE);
+    *--sp = (uint32_t)thread_start;
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = 0;
+    t->esp = (uint32_t)sp;
+
+    thread_wake(t);
+    return t;
+}
+
+static struct thread* thread_create(const char* name, void (*entry)(void*), void* arg) {
+    return thread_create_class(name, entry, arg, SCHED_FAIR, 0);
+}
+
+static inline void thread_yield(void) {
+    schedule();
+}
+
+// Turn the code already running on this CPU into its idle thread
+static void sched_init_cpu(struct cpu* c) {
+    struct thread* t = thread_alloc("idle");
+    t->state = THREAD_RUNNING;
+    t->on_cpu = true;
+    c->idle = t;
+    c->current = t;
+}
+
+static void pmm_init_help(void);
+
+static void idle_loop(struct cpu* c) {
+    while (1) {
+        if (pmm_init_active) pmm_init_help();
+        if (sched_has_work()) schedule();
+        cpu_idle(c);
+        void (*fn)(void*) = c->call_fn;
+        if (fn) {
+            void* arg = c->call_arg;
+            c->call_fn = 0;
+            fn(arg);
+        }
+    }
+}
+
+// ==================== TIMER ====================
+// Periodic tick (LAPIC timer per CPU, PIT on IRQ0 without an APIC) used
+// only to end fair time slices; RT threads run until they block.
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+
+static uint32_t lapic_timer_count = 0;
+static volatile uint32_t jiffies = 0;       // Ticks seen by CPU 0
+
+static void timer_wake_sleepers(void);
+static void io_ring_timer(void);
+static void fdc_timer(void);
+
+static void timer_tick(void) {
+    struct cpu* c = this_cpu();
+    struct thread* t = c->current;
+
+    if (c->index == 0) {
+        jiffies++;
+        timer_wake_sleepers();
+        io_ring_timer();
+        fdc_timer();
+    }
+
+    if (t != c->idle && t->sched_class == SCHED_FAIR &&
+        rdtsc() - t->exec_start >= sched_slice_cycles && sched_has_work()) {
+        c->need_resched = 1;
+    }
+}
+
+static void lapic_timer_handler(void) {
+    lapic_eoi();
+    timer_tick();
+}
+
+static void resched_ipi_handler(void) {
+    lapic_eoi();    // need_resched is already set; interrupt exit switches
+}
+
+// Start this CPU's tick; the first call calibrates against the TSC
+static void timer_init_cpu(void) {
+    if (!lapic) return;
+    if (!lapic_timer_count) {
+        lapic_write(LAPIC_TIMER_DIV, 0x3);          // Divide by 16
+        lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+        udelay(10000);
+        uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+        lapic_timer_count = elapsed * 100 / TIMER_HZ;
+    }
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, 0x20000 | TIMER_VECTOR);  // Periodic
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
+
+// Runs before smp_init, so this is the BSP; interrupts stay off so the
+// calibration window can't be stretched by a preemption
+static void timer_init(void) {
+    sched_slice_cycles = (uint64_t)tsc_per_us * SCHED_SLICE_US;
+    register_interrupt(RESCHED_VECTOR, resched_ipi_handler);
+    if (lapic) {
+        register_interrupt(TIMER_VECTOR, lapic_timer_handler);
+        uint32_t flags = irq_save();
+        timer_init_cpu();
+        irq_restore(flags);
+        return;
+    }
+    uint16_t divisor = 1193182 / TIMER_HZ;
+    outb(0x43, 0x36);                               // Channel 0, mode 3
+    outb(0x40, divisor & 0xFF);
+    outb(0x40, divisor >> 8);
+    request_irq(isa_irq(0), "timer", timer_tick);
+}
+
+// ==================== SCHEDULER LATENCY ====================
+static void show_sched_latency(void) {
+    static const char* const bucket_names[SCHED_LAT_BUCKETS] = {
+        "<10us", "<100us", "<1ms", "<10ms", ">=10ms"
+    };
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    struct sched_latency snap[SCHED_CLASSES];
+    memcpy(snap, sched_lat, sizeof(snap));
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    vga_puts("\nRunnable -> running latency:");
+    for (uint32_t c = 0; c < SCHED_CLASSES; c++) {
+        struct sched_latency* lat = &snap[c];
+        vga_puts("\n  ");
+        vga_puts(sched_class_names[c]);
+        vga_puts(": ");
+        vga_put_dec(lat->samples);
+        vga_puts(" runs, avg ");
+        vga_put_dec(lat->samples ? (uint32_t)div64_32(lat->total_ns, lat->samples) / 1000 : 0);
+        vga_puts("us, max ");
+        vga_put_dec(lat->max_ns / 1000);
+        vga_puts("us\n   ");
+        for (uint32_t b = 0; b < SCHED_LAT_BUCKETS; b++) {
+            vga_puts(" ");
+            vga_puts(bucket_names[b]);
+            vga_puts(":");
+            vga_put_dec(lat->buckets[b]);
+        }
+    }
+}
+
+static void reset_sched_latency(void) {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    memset(sched_lat, 0, sizeof(sched_lat));
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// Burn CPU in the fair class so input latency can be checked under load
+static void hog_thread(void* arg) {
+    uint64_t end = rdtsc() + (uint64_t)tsc_per_us * 1000000 * (uint32_t)arg;
+    while (rdtsc() < end) cpu_relax();
+}
+
+static void start_hogs(uint32_t seconds) {
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        thread_create("hog", hog_thread, (void*)seconds);
+    }
+}
+
+// ==================== WAIT QUEUES ====================
+// Non-exclusive waiters are all woken; exclusive waiters (queued at the
+// tail) are woken one per wake_up() so a release doesn't stampede.
+struct wait_entry {
+    struct thread* thread;
+    const volatile void* key;       // Futex address, 0 for plain queues
+    bool exclusive;
+    bool queued;
+    struct wait_entry* next;
+};
+
+struct wait_queue {
+    spinlock_t lock;
+    struct wait_entry* head;
+};
+
+// Caller holds wq->lock
+static void __wait_queue_add(struct wait_queue* wq, struct wait_entry* e) {
+    e->queued = true;
+    e->next = 0;
+    if (!e->exclusive) {
+        e->next = wq->head;
+        wq->head = e;
+        return;
+    }
+    struct wait_entry** link = &wq->head;
+    while (*link) link = &(*link)->next;
+    *link = e;
+}
+
+// Caller holds wq->lock
+static void __wait_queue_remove(struct wait_queue* wq, struct wait_entry* e) {
+    for (struct wait_entry** link = &wq->head; *link; link = &(*link)->next) {
+        if (*link == e) {
+            *link = e->next;
+            break;
+        }
+    }
+    e->queued = false;
+}
+
+static void prepare_to_wait(struct wait_queue* wq, struct wait_entry* e, bool exclusive) {
+    struct thread* t = current_thread();
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    e->thread = t;
+    e->key = 0;
+    e->exclusive = exclusive;
+    if (!e->queued) __wait_queue_add(wq, e);
+    t->state = THREAD_BLOCKED;
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+static void finish_wait(struct wait_queue* wq, struct wait_entry* e) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    if (e->queued) __wait_queue_remove(wq, e);
+    spin_unlock_irqrestore(&wq->lock, flags);
+    thread_set_running(e->thread);
+}
+
+// Caller holds wq->lock. Wake waiters matching key (0 = any). Returns
+// the number woken.
+static uint32_t __wake_up_locked(struct wait_queue* wq, const volatile void* key, uint32_t nr_exclusive) {
+    uint32_t woken = 0;
+    struct wait_entry* e = wq->head;
+    while (e) {
+        struct wait_entry* next = e->next;
+        if (!key || e->key == key) {
+            bool exclusive = e->exclusive;
+            struct thread* t = e->thread;
+            __wait_queue_remove(wq, e);     // e may vanish once t runs
+            thread_wake(t);
+            woken++;
+            if (exclusive && --nr_exclusive == 0) break;
+        }
+        e = next;
+    }
+    return woken;
+}
+
+static uint32_t __wake_up(struct wait_queue* wq, const volatile void* key, uint32_t nr_exclusive) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    uint32_t woken = __wake_up_locked(wq, key, nr_exclusive);
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
+
+static void wake_up(struct wait_queue* wq) {
+    __wake_up(wq, 0, 1);
+}
+
+static inline void wake_up_all(struct wait_queue* wq) {
+    __wake_up(wq, 0, 0xFFFFFFFF);
+}
+
+#define __wait_event(wq, cond, exclusive)               \
+    do {                                                \
+        struct wait_entry __we = {0};                   \
+        while (1) {                                     \
+            prepare_to_wait(&(wq), &__we, exclusive);   \
+            if (cond) break;                            \
+            schedule();                                 \
+        }                                               \
+        finish_wait(&(wq), &__we);                      \
+    } while (0)
+
+#define wait_event(wq, cond) __wait_event(wq, cond, false)
+#define wait_event_exclusive(wq, cond) __wait_event(wq, cond, true)
+
+// Sleepers recheck their deadline on every CPU 0 tick
+static struct wait_queue sleep_wait;
+
+static void timer_wake_sleepers(void) {
+    if (sleep_wait.head) wake_up_all(&sleep_wait);
+}
+
+static void msleep(uint32_t ms) {
+    uint32_t until = jiffies + (ms * TIMER_HZ + 999) / 1000;
+    wait_event(sleep_wait, (int32_t)(jiffies - until) >= 0);
+}
+
+// ==================== FUTEX ====================
+// Sleep/wake keyed by address. Waiters hash into FUTEX_BUCKETS queues;
+// every futex waiter is exclusive so futex_wake(addr, 1) wakes one.
+static struct wait_queue futex_queues[FUTEX_BUCKETS];
+
+static struct wait_queue* futex_bucket(const volatile void* addr) {
+    uint32_t hash = ((uint32_t)addr >> 2) * 2654435761u;   // Fibonacci hashing
+    return &futex_queues[hash >> (32 - FUTEX_HASH_BITS)];
+}
+
+// Sleep only if *addr still equals expected, checked under the bucket lock
+static bool futex_wait(const volatile uint32_t* addr, uint32_t expected) {
+    struct wait_queue* wq = futex_bucket(addr);
+    struct thread* t = current_thread();
+    struct wait_entry e = {0};
+
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    if (*addr != expected) {
+        spin_unlock_irqrestore(&wq->lock, flags);
+        return false;
+    }
+    e.thread = t;
+    e.key = addr;
+    e.exclusive = true;
+    __wait_queue_add(wq, &e);
+    t->state = THREAD_BLOCKED;
+    spin_unlock_irqrestore(&wq->lock, flags);
+
+    schedule();
+    finish_wait(wq, &e);
+    return true;
+}
+
+static uint32_t futex_wake(const volatile uint32_t* addr, uint32_t count) {
+    return __wake_up(futex_bucket(addr), addr, count);
+}
+
+// ==================== MUTEX & SEMAPHORE ====================
+// Both stay in user-style atomics when uncontended; only a real
+// conflict reaches futex_wait/futex_wake.
+struct mutex {
+    volatile uint32_t state;        // 0 free, 1 locked, 2 locked with waiters
+};
+
+static inline void mutex_lock(struct mutex* m) {
+    uint32_t c = 0;
+    if (__atomic_compare_exchange_n(&m->state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+    if (c != 2) c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        futex_wait(&m->state, 2);
+        c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline bool mutex_trylock(struct mutex* m) {
+    uint32_t c = 0;
+    return __atomic_compare_exchange_n(&m->state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void mutex_unlock(struct mutex* m) {
+    if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2) futex_wake(&m->state, 1);
+}
+
+struct semaphore {
+    volatile uint32_t count;
+    volatile uint32_t waiters;
+};
+
+static inline void sem_down(struct semaphore* s) {
+    while (1) {
+        uint32_t c = s->count;
+        if (c > 0) {
+            if (__atomic_compare_exchange_n(&s->count, &c, c - 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+            continue;
+        }
+        __atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&s->count, 0);
+        __atomic_fetch_sub(&s->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static inline void sem_up(struct semaphore* s) {
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST)) futex_wake(&s->count, 1);
+}
+
+static void show_cpus(void) {
+    vga_puts("\nCPU  APIC  IDLE   INTERRUPTS  SWITCHES  WAKEUPS");
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        struct cpu* c = &cpus[i];
+        if (!c->online) continue;
+        vga_puts("\n");
+        vga_put_dec(i);
+        vga_puts("    ");
+        vga_put_dec(c->apic_id);
+        vga_puts("     ");
+        vga_puts(c->idle_method == IDLE_MWAIT ? "mwait  " : "hlt    ");
+        vga_put_dec(c->interrupts);
+        vga_puts("  ");
+        vga_put_dec(c->context_switches);
+        vga_puts("  ");
+        vga_put_dec(c->wakeups);
+    }
+}
+
+// ==================== MEMORY INIT ====================
+// Frames above PMM_EARLY_LIMIT are set up by whoever is free: the
+// "memory" initcall thread and every idle CPU, including APs as soon as
+// they reach idle_loop. The initcall sleeps on pmm_init_wait until the
+// last chunk is in.
+static struct wait_queue pmm_init_wait;
+
+static void pmm_init_help(void) {
+    while (1) {
+        uint32_t chunk = __atomic_fetch_add(&pmm_chunk_next, 1, __ATOMIC_RELAXED);
+        if (chunk >= pmm_chunk_count) break;
+        pmm_init_chunk(chunk);
+        // An idle CPU goes back to running threads once any are queued
+        bool in_idle = percpu_read(current) == percpu_read(idle);
+        __atomic_add_fetch(&pmm_chunks_by_cpu[percpu_read(index)], 1, __ATOMIC_RELAXED);
+        if (__atomic_add_fetch(&pmm_chunks_done, 1, __ATOMIC_ACQ_REL) == pmm_chunk_count) {
+            pmm_init_active = false;
+            wake_up_all(&pmm_init_wait);
+        }
+        if (in_idle && sched_has_work()) break;
+    }
+}
+
+static void pmm_init_late(void) {
+    if (!pmm_chunk_count) return;
+    pmm_init_active = true;
+    struct cpu* self = this_cpu();
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (cpus[i].online && &cpus[i] != self) cpu_wake(&cpus[i]);
+    }
+    pmm_init_help();
+    wait_event(pmm_init_wait, pmm_chunks_done == pmm_chunk_count);
+}
+
+static void show_pmm_init(void) {
+    vga_puts("\nFrame init: ");
+    vga_put_dec(pmm_chunks_done);
+    vga_puts("/");
+    vga_put_dec(pmm_chunk_count);
+    vga_puts(" chunks of ");
+    vga_put_dec(PMM_CHUNK_FRAMES * PAGE_SIZE / (1024 * 1024));
+    vga_puts("MB");
+    vga_puts(PMM_PREZERO ? " (pre-zeroed)" : "");
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        vga_puts(i ? ", cpu" : "\n  cpu");
+        vga_put_dec(i);
+        vga_puts(": ");
+        vga_put_dec(pmm_chunks_by_cpu[i]);
+    }
+}
+
+// ==================== IRQ BALANCER ====================
+// Once a second, work out each IRQ's rate and each CPU's interrupt load
+// and move at most one IRQ from the busiest CPU to the least loaded CPU
+// its affinity allows, and only if that leaves both below the old peak.
+// A moved IRQ then stays put for IRQ_BALANCE_HOLD intervals so its
+// handler keeps a warm cache instead of bouncing between CPUs.
+static volatile bool irq_balance_on = false;
+static struct wait_queue irq_balance_wait;
+static uint32_t irq_balance_moves = 0;
+
+static uint32_t irq_total(uint32_t irq) {
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) total += cpus[i].irq_counts[irq];
+    return total;
+}
+
+static void irq_balance(void) {
+    uint32_t load[MAX_CPUS] = {0};
+    uint32_t online = cpus_online_mask();
+
+    uint32_t flags = spin_lock_irqsave(&irq_lock);
+    for (uint32_t irq = 0; irq < NR_IRQS; irq++) {
+        struct irq_desc* desc = &irqs[irq];
+        if (!desc->nr_handlers) continue;
+        uint32_t total = irq_total(irq);
+        desc->rate = (total - desc->last_total) * 1000 / IRQ_BALANCE_MS;
+        desc->last_total = total;
+        if (desc->hold) desc->hold--;
+        load[desc->target] += desc->rate;
+    }
+
+    uint32_t busiest = 0;
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        if (load[i] > load[busiest]) busiest = i;
+    }
+
+    struct irq_desc* best = 0;
+    uint32_t best_dest = 0;
+    uint32_t best_peak = load[busiest];
+    for (uint32_t irq = 0; irq < NR_IRQS && load[busiest] >= IRQ_BALANCE_MIN_RATE; irq++) {
+        struct irq_desc* desc = &irqs[irq];
+        if (!desc->nr_handlers || desc->target != busiest || !desc->rate || desc->hold) continue;
+        uint32_t allowed = desc->affinity & online & ~(1u << busiest);
+        for (uint32_t d = 0; d < cpu_count; d++) {
+            if (!(allowed & (1u << d))) continue;
+            uint32_t src = load[busiest] - desc->rate;
+            uint32_t dst = load[d] + desc->rate;
+            uint32_t peak = src > dst ? src : dst;
+            if (peak < best_peak) {
+                best = desc;
+                best_dest = d;
+                best_peak = peak;
+            }
+        }
+    }
+    if (best) {
+        best->target = best_dest;
+        best->hold = IRQ_BALANCE_HOLD;
+        irq_route(best - irqs);
+        irq_balance_moves++;
+    }
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+static void irq_balance_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        wait_event(irq_balance_wait, irq_balance_on);
+        msleep(IRQ_BALANCE_MS);
+        if (irq_balance_on) irq_balance();
+    }
+}
+
+static void irq_balance_enable(bool on) {
+    irq_balance_on = on && ioapic;
+    if (irq_balance_on) wake_up(&irq_balance_wait);
+}
+
+static void show_irqs(void) {
+    if (!ioapic) vga_puts("\nNo IOAPIC: all IRQs go through the PIC to cpu0");
+    vga_puts("\nIRQ  name     affinity    cpu  rate/s  per-CPU counts");
+    for (uint32_t irq = 0; irq < NR_IRQS; irq++) {
+        const struct irq_desc* desc = &irqs[irq];
+        if (!desc->nr_handlers) continue;
+        vga_puts("\n ");
+        if (irq < 10) vga_putc(' ');
+        vga_put_dec(irq);
+        vga_puts("  ");
+        vga_puts(desc->name);
+        for (size_t n = strlen(desc->name); n < 9; n++) vga_putc(' ');
+        vga_put_hex(desc->affinity);
+        vga_puts("  ");
+        vga_put_dec(desc->target);
+        vga_puts("    ");
+        vga_put_dec(desc->rate);
+        vga_puts("  ");
+        for (uint32_t i = 0; i < cpu_count; i++) {
+            vga_puts(" ");
+            vga_put_dec(cpus[i].irq_counts[irq]);
+        }
+    }
+    vga_puts("\nBalancer: ");
+    vga_puts(irq_balance_on ? "on" : "off");
+    vga_puts(", ");
+    vga_put_dec(irq_balance_moves);
+    vga_puts(" moves");
+}
+
+// ==================== PCI ====================
+// Configuration mechanism #1. pci_init() walks bus 0 and everything
+// behind PCI-PCI bridges once; drivers look devices up by class.
+#define PCI_CONFIG_ADDR 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+#define PCI_COMMAND     0x04
+#define PCI_CMD_IO      0x0001
+#define PCI_CMD_MEMORY  0x0002
+#define PCI_CMD_MASTER  0x0004
+#define PCI_STATUS_CAPS 0x0010      // In the upper half of PCI_COMMAND
+#define PCI_CAP_PTR     0x34
+#define PCI_CAP_VENDOR  0x09
+#define PCI_CAP_MSIX    0x11
+#define MSIX_FUNCTION_MASK 0x4000
+#define MSIX_ENABLE     0x8000
+
+struct pci_device {
+    uint8_t bus, slot, func;
+    uint8_t class_code, subclass, prog_if;
+    uint16_t vendor, device;
+    uint8_t irq_line;
+};
+
+static struct pci_device pci_devices[PCI_MAX_DEVICES];
+static uint32_t pci_device_count = 0;
+static spinlock_t pci_lock;
+
+static uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off) {
+    uint32_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (bus << 16) | (slot << 11) | (func << 8) | (off & 0xFC));
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    spin_unlock_irqrestore(&pci_lock, flags);
+    return value;
+}
+
+static uint32_t pci_read(const struct pci_device* dev, uint8_t off) {
+    return pci_config_read(dev->bus, dev->slot, dev->func, off);
+}
+
+static void pci_write(const struct pci_device* dev, uint8_t off, uint32_t value) {
+    uint32_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (dev->bus << 16) | (dev->slot << 11) | (dev->func << 8) | (off & 0xFC));
+    outl(PCI_CONFIG_DATA, value);
+    spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+static uint32_t pci_bar(const struct pci_device* dev, uint32_t n) {
+    return pci_read(dev, 0x10 + n * 4);
+}
+
+static void pci_enable(const struct pci_device* dev, uint32_t bits) {
+    uint32_t cmd = pci_read(dev, PCI_COMMAND);
+    pci_write(dev, PCI_COMMAND, (cmd & 0xFFFF) | bits);
+}
+
+// A memory BAR's address, or 0 for I/O BARs and 64-bit BARs above 4GB
+static uint32_t pci_mem_bar(const struct pci_device* dev, uint32_t n) {
+    uint32_t bar = pci_bar(dev, n);
+    if (bar & 1) return 0;
+    if ((bar & 6) == 4 && pci_bar(dev, n + 1)) return 0;
+    return bar & ~0xF;
+}
+
+// Config offset of the next capability with this ID after prev (0 = first)
+static uint8_t pci_find_capability(const struct pci_device* dev, uint8_t id, uint8_t prev) {
+    if (!(pci_read(dev, PCI_COMMAND) & (PCI_STATUS_CAPS << 16))) return 0;
+    uint8_t off = (prev ? pci_read(dev, prev) >> 8 : pci_read(dev, PCI_CAP_PTR)) & 0xFC;
+    for (int guard = 0; off && guard < 48; guard++) {
+        uint32_t reg = pci_read(dev, off);
+        if ((reg & 0xFF) == id) return off;
+        off = (reg >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+// Vectors for MSI-X, which bypass the IOAPIC: each table entry is a
+// message straight to one CPU's local APIC. Handlers EOI themselves.
+static uint32_t msi_next_vector = MSI_VECTOR_BASE;
+static spinlock_t msi_lock;
+
+// count consecutive vectors all running handler, or 0 if none are left
+static uint32_t msi_alloc_vectors(uint32_t count, void (*handler)(void)) {
+    uint32_t flags = spin_lock_irqsave(&msi_lock);
+    uint32_t first = msi_next_vector;
+    if (first + count > MSI_VECTOR_BASE + MSI_VECTORS) first = 0;
+    else msi_next_vector += count;
+    spin_unlock_irqrestore(&msi_lock, flags);
+    for (uint32_t i = 0; first && i < count; i++) register_interrupt(first + i, handler);
+    return first;
+}
+
+// Map the MSI-X table and switch the function over to it with every
+// entry masked. Returns the table and its entry count, or 0.
+static volatile uint32_t* pci_msix_enable(const struct pci_device* dev, uint32_t* entries) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSIX, 0);
+    if (!cap) return 0;
+    uint32_t ctrl = pci_read(dev, cap);
+    uint32_t table = pci_read(dev, cap + 4);
+    uint32_t base = pci_mem_bar(dev, table & 7);
+    if (!base) return 0;
+    *entries = ((ctrl >> 16) & 0x7FF) + 1;
+    volatile uint32_t* t = ioremap(base + (table & ~7), *entries * 16);
+    if (!t) return 0;
+    for (uint32_t i = 0; i < *entries; i++) t[i * 4 + 3] = 1;
+    pci_write(dev, cap, (ctrl & ~(MSIX_FUNCTION_MASK << 16)) | (MSIX_ENABLE << 16));
+    return t;
+}
+
+// Deliver entry as vector to one CPU (fixed, edge, physical destination)
+static void pci_msix_set(volatile uint32_t* table, uint32_t entry, uint32_t vector, uint32_t cpu) {
+    volatile uint32_t* e = &table[entry * 4];
+    e[0] = 0xFEE00000 | (cpus[cpu].apic_id << 12);
+    e[1] = 0;
+    e[2] = vector;
+    e[3] = 0;
+}
+
+// Next device of the class after prev (0 = from the start)
+static struct pci_device* pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device* prev) {
+    uint32_t i = prev ? (uint32_t)(prev - pci_devices) + 1 : 0;
+    for (; i < pci_device_count; i++) {
+        if (pci_devices[i].class_code == class_code && pci_devices[i].subclass == subclass) {
+            return &pci_devices[i];
+        }
+    }
+    return 0;
+}
+
+static void pci_scan_bus(uint8_t bus);
+
+static void pci_scan_function(uint8_t bus, uint8_t slot, uint8_t func) {
+    uint32_t id = pci_config_read(bus, slot, func, 0x00);
+    if ((id & 0xFFFF) == 0xFFFF) return;
+    uint32_t class_reg = pci_config_read(bus, slot, func, 0x08);
+    if (pci_device_count < PCI_MAX_DEVICES) {
+        struct pci_device* dev = &pci_devices[pci_device_count++];
+        dev->bus = bus;
+        dev->slot = slot;
+        dev->func = func;
+        dev->vendor = id & 0xFFFF;
+        dev->device = id >> 16;
+        dev->class_code = class_reg >> 24;
+        dev->subclass = (class_reg >> 16) & 0xFF;
+        dev->prog_if = (class_reg >> 8) & 0xFF;
+        dev->irq_line = pci_config_read(bus, slot, func, 0x3C) & 0xFF;
+    }
+    // PCI-PCI bridge: scan its secondary bus
+    if ((class_reg >> 16) == 0x0604) {
+        uint8_t secondary = (pci_config_read(bus, slot, func, 0x18) >> 8) & 0xFF;
+        if (secondary > bus) pci_scan_bus(secondary);
+    }
+}
+
+static void pci_scan_bus(uint8_t bus) {
+    for (uint8_t slot = 0; slot < 32; slot++) {
+        if ((pci_config_read(bus, slot, 0, 0x00) & 0xFFFF) == 0xFFFF) continue;
+        bool multi = (pci_config_read(bus, slot, 0, 0x0C) >> 16) & 0x80;
+        for (uint8_t func = 0; func < (multi ? 8 : 1); func++) pci_scan_function(bus, slot, func);
+    }
+}
+
+static void pci_init(void) {
+    pci_scan_bus(0);
+}
+
+static void show_pci(void) {
+    for (uint32_t i = 0; i < pci_device_count; i++) {
+        const struct pci_device* dev = &pci_devices[i];
+        vga_puts("\n");
+        vga_put_dec(dev->bus);
+        vga_puts(":");
+        vga_put_dec(dev->slot);
+        vga_puts(".");
+        vga_put_dec(dev->func);
+        vga_puts("  ");
+        vga_put_hex(dev->vendor);
+        vga_puts(":");
+        vga_put_hex(dev->device);
+        vga_puts("  class ");
+        vga_put_hex((dev->class_code << 16) | (dev->subclass << 8) | dev->prog_if);
+        vga_puts("  irq ");
+        vga_put_dec(dev->irq_line);
+    }
+}
+
+// ==================== ERRORS ====================
+// Negative errno values, Linux numbering, for interfaces that have to
+// say more than "failed"
+#define ENOENT       2
+#define EIO          5
+#define EBADF        9
+#define ENOMEM       12
+#define EACCES       13
+#define EBUSY        16
+#define EEXIST       17
+#define ENOTDIR      20
+#define EISDIR       21
+#define EINVAL       22
+#define ENFILE       23
+#define EMFILE       24
+#define EFBIG        27
+#define ENOSPC       28
+#define EROFS        30
+#define ENAMETOOLONG 36
+#define ENOTEMPTY    39
+#define ETIME        62
+
+static const char* strerror(int32_t err) {
+    switch (-err) {
+    case ENOENT:       return "No such file or directory";
+    case EIO:          return "I/O error";
+    case EBADF:        return "Bad file descriptor";
+    case ENOMEM:       return "Out of memory";
+    case EACCES:       return "Permission denied";
+    case EBUSY:        return "Device or resource busy";
+    case EEXIST:       return "File exists";
+    case ENOTDIR:      return "Not a directory";
+    case EISDIR:       return "Is a directory";
+    case EINVAL:       return "Invalid argument";
+    case ENFILE:       return "Too many open files in system";
+    case EMFILE:       return "Too many open files";
+    case EFBIG:        return "File too large";
+    case ENOSPC:       return "No space left on device";
+    case EROFS:        return "Read-only file system";
+    case ENAMETOOLONG: return "File name too long";
+    case ENOTEMPTY:    return "Directory not empty";
+    case ETIME:        return "Timer expired";
+    default:           return "Unknown error";
+    }
+}
+
+// ==================== BLOCK LAYER ====================
+// Drivers take struct block_request from blk_submit() (through the
+// device's I/O scheduler) and call blk_complete() (usually from their
+// interrupt handler, but never holding their own lock: the scheduler
+// may hand them the next request from there) when it is done; end_io
+// then runs in that context, so it may only wake or account, not
+// submit more I/O. blk_read()/blk_write() are the
+// synchronous wrappers that sleep on the request's own wait queue.
+// Data is either one virtual buffer or a list of physical segments
+// (sector-multiple lengths); drivers use blk_data_at() for PIO and
+// blk_phys_at() to build DMA descriptors, and don't care which it is.
+struct block_request;
+struct block_device;
+
+struct blk_segment {
+    uint32_t phys;
+    uint32_t len;                   // Bytes, a multiple of SECTOR_SIZE
+};
+
+struct block_ops {
+    void (*submit)(struct block_device* dev, struct block_request* req);
+    void (*poll)(struct block_device* dev);     // Optional: reap completions now
+};
+
+struct block_stats {
+    uint32_t interrupts;
+    uint32_t kicks;                     // Doorbell writes, by drivers that count them
+    uint32_t polls;                     // blk_poll() calls
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t read_sectors;
+    uint32_t write_sectors;
+    uint32_t errors;
+};
+
+#define ELV_NOOP     0
+#define ELV_DEADLINE 1
+
+struct elv_stats {
+    uint32_t requests[2];               // Submitted: reads, writes
+    uint32_t dispatched;                // Commands the driver got
+    uint32_t back_merges;
+    uint32_t front_merges;
+    uint32_t expired;                   // Batches started by a deadline
+    uint64_t seek;                      // Sectors between consecutive commands
+    uint64_t wait_us[2];                // Submit to dispatch, summed
+    uint32_t wait_max[2];
+    uint64_t total_us[2];               // Submit to completion
+    uint32_t total_max[2];
+};
+
+struct elevator {
+    spinlock_t lock;
+    uint32_t mode;
+    uint32_t depth;                     // Commands the driver may hold
+    volatile uint32_t in_flight;
+    volatile uint32_t pending;
+    struct block_request* sorted[2];    // Pending, by sector
+    struct block_request* fifo[2];      // Pending, oldest first
+    struct block_request* fifo_tail[2];
+    struct block_request* carriers;     // Free requests for merges
+    uint64_t expire[2];                 // TSC
+    uint32_t head_pos;                  // Sector after the last command
+    uint32_t dir;                       // Of the current batch
+    uint32_t batch;
+    uint32_t starved;                   // Read batches while writes waited
+    struct elv_stats stats;
+};
+
+struct block_device {
+    char name[8];
+    char model[41];
+    uint32_t sectors;
+    const struct block_ops* ops;
+    void* priv;
+    struct block_stats stats;
+    struct elevator elv;
+};
+
+struct block_request {
+    struct block_device* dev;
+    uint32_t sector;
+    uint32_t count;                 // Sectors
+    uint8_t* buffer;                // Either this...
+    const struct blk_segment* segs; // ...or these
+    uint32_t nr_segs;
+    bool write;
+    uint32_t done;                  // Sectors transferred (driver progress)
+    volatile bool complete;         // blk_rw(): set by blk_end_sync()
+    bool error;
+    void (*end_io)(struct block_request* req);
+    void* private;
+    struct block_request* next;     // Driver queue link
+    struct wait_queue wait;         // For blk_read()/blk_write()
+    uint64_t queued;                // TSC at blk_submit()
+    struct block_request* fifo_next;
+    struct block_request* parts;    // A merge carrier's requests, by sector
+};
+
+static struct block_device* block_devices[MAX_BLOCK_DEVS];
+static uint32_t block_device_count = 0;
+
+static void elv_init(struct elevator* e, uint32_t mode, uint32_t depth);
+
+// depth: how many commands the driver can usefully hold at once
+static void blk_register(struct block_device* dev, uint32_t sched, uint32_t depth) {
+    elv_init(&dev->elv, sched, depth);
+    if (block_device_count < MAX_BLOCK_DEVS) block_devices[block_device_count++] = dev;
+}
+
+static struct block_device* blk_find(const char* name) {
+    for (uint32_t i = 0; i < block_device_count; i++) {
+        if (strcmp(block_devices[i]->name, name) == 0) return block_devices[i];
+    }
+    return 0;
+}
+
+// Find the segment holding byte off; *seg_off is the offset inside it
+static const struct blk_segment* blk_segment_at(const struct block_request* req, uint32_t off,
+                                                uint32_t* seg_off) {
+    for (uint32_t i = 0; i < req->nr_segs; i++) {
+        if (off < req->segs[i].len) {
+            *seg_off = off;
+            return &req->segs[i];
+        }
+        off -= req->segs[i].len;
+    }
+    return 0;
+}
+
+// Merge carrier: the part holding byte *off, which becomes relative to it
+static const struct block_request* blk_part_at(const struct block_request* req, uint32_t* off) {
+    const struct block_request* p = req->parts;
+    while (*off >= p->count * SECTOR_SIZE) {
+        *off -= p->count * SECTOR_SIZE;
+        p = p->next;
+    }
+    return p;
+}
+
+// Kernel pointer to byte off of the request's data (RAM is identity-mapped)
+static uint8_t* blk_data_at(const struct block_request* req, uint32_t off) {
+    if (req->parts) req = blk_part_at(req, &off);
+    if (!req->segs) return req->buffer + off;
+    uint32_t seg_off;
+    const struct blk_segment* seg = blk_segment_at(req, off, &seg_off);
+    return (uint8_t*)(seg->phys + seg_off);
+}
+
+// Physical address of byte off; *len is how many bytes are contiguous from there
+static uint32_t blk_phys_at(const struct block_request* req, uint32_t off, uint32_t* len) {
+    if (req->parts) {
+        req = blk_part_at(req, &off);
+        uint32_t phys = blk_phys_at(req, off, len);
+        if (*len > req->count * SECTOR_SIZE - off) *len = req->count * SECTOR_SIZE - off;
+        return phys;
+    }
+    if (!req->segs) {
+        uint32_t phys = virt_to_phys(req->buffer + off);
+        *len = PAGE_SIZE - (phys & (PAGE_SIZE - 1));
+        return phys;
+    }
+    uint32_t seg_off;
+    const struct blk_segment* seg = blk_segment_at(req, off, &seg_off);
+    *len = seg->len - seg_off;
+    return seg->phys + seg_off;
+}
+
+// ---- I/O scheduler ----
+// Every device has an elevator between blk_submit() and its driver.
+// ELV_NOOP passes requests straight through (virtio, AHCI: the device
+// or its queues do their own ordering). ELV_DEADLINE holds them and
+// keeps at most depth in the driver: pending requests sit on a
+// per-direction list sorted by sector and on a per-direction FIFO.
+// Dispatch sweeps upwards from the last position in batches of
+// ELV_FIFO_BATCH; a new batch prefers reads, serves writes after
+// ELV_WRITES_STARVED read batches, and starts at the oldest request
+// instead once that one has waited past its deadline. A request that
+// continues (back merge) or precedes (front merge) a pending one of
+// the same direction joins it: both ride in a carrier request whose
+// data is the parts' data in order, so drivers see one command.
+static void elv_end_merged(struct block_request* carrier);
+
+static void elv_init(struct elevator* e, uint32_t mode, uint32_t depth) {
+    e->mode = mode;
+    e->depth = depth;
+    e->expire[0] = (uint64_t)ELV_READ_EXPIRE_MS * 1000 * tsc_per_us;
+    e->expire[1] = (uint64_t)ELV_WRITE_EXPIRE_MS * 1000 * tsc_per_us;
+    struct block_request* carriers = (struct block_request*)pmm_alloc_page();
+    for (uint32_t i = 0; carriers && i < PAGE_SIZE / sizeof(struct block_request); i++) {
+        carriers[i].next = e->carriers;
+        e->carriers = &carriers[i];
+    }
+}
+
+static void elv_max(uint32_t* max, uint32_t value) {
+    uint32_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > old && !__atomic_compare_exchange_n(max, &old, value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Time since blk_submit(), into the queue wait or total latency stats
+static void elv_account(struct elevator* e, const struct block_request* req, uint64_t now, bool total) {
+    uint32_t us = (uint32_t)div64_32(now - req->queued, tsc_per_us);
+    __atomic_add_fetch(total ? &e->stats.total_us[req->write] : &e->stats.wait_us[req->write], us, __ATOMIC_RELAXED);
+    elv_max(total ? &e->stats.total_max[req->write] : &e->stats.wait_max[req->write], us);
+}
+
+// One command leaves for the driver: how far the heads move
+static void elv_account_dispatch(struct elevator* e, const struct block_request* req, uint64_t now) {
+    uint32_t prev = __atomic_exchange_n(&e->head_pos, req->sector + req->count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&e->stats.seek, req->sector > prev ? req->sector - prev : prev - req->sector, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&e->stats.dispatched, 1, __ATOMIC_RELAXED);
+    if (!req->parts) elv_account(e, req, now, false);
+    for (const struct block_request* p = req->parts; p; p = p->next) elv_account(e, p, now, false);
+}
+
+// Caller holds e->lock
+static void elv_fifo_remove(struct elevator* e, struct block_request* req, struct block_request* replace) {
+    uint32_t dir = req->write;
+    struct block_request** link = &e->fifo[dir];
+    struct block_request* prev = 0;
+    while (*link != req) {
+        prev = *link;
+        link = &(*link)->fifo_next;
+    }
+    if (replace) {
+        replace->fifo_next = req->fifo_next;
+        *link = replace;
+        if (e->fifo_tail[dir] == req) e->fifo_tail[dir] = replace;
+    } else {
+        *link = req->fifo_next;
+        if (e->fifo_tail[dir] == req) e->fifo_tail[dir] = prev;
+    }
+}
+
+// Caller holds e->lock
+static void elv_sort_insert(struct elevator* e, struct block_request* req) {
+    struct block_request** link = &e->sorted[req->write];
+    while (*link && (*link)->sector <= req->sector) link = &(*link)->next;
+    req->next = *link;
+    *link = req;
+}
+
+// Caller holds e->lock. Let req join a pending neighbour; false if it
+// has none, the result would be too big or there is no free carrier.
+static bool elv_merge(struct elevator* e, struct block_request* req) {
+    for (struct block_request** link = &e->sorted[req->write]; *link; link = &(*link)->next) {
+        struct block_request* p = *link;
+        bool back = p->sector + p->count == req->sector;
+        if ((!back && req->sector + req->count != p->sector) || p->count + req->count > ELV_MAX_SECTORS) continue;
+
+        struct block_request* c = p;
+        if (!p->parts) {
+            if (!(c = e->carriers)) return false;
+            e->carriers = c->next;
+            memset(c, 0, sizeof(*c));
+            c->dev = p->dev;
+            c->sector = p->sector;
+            c->count = p->count;
+            c->write = p->write;
+            c->queued = p->queued;
+            c->end_io = elv_end_merged;
+            c->parts = p;
+            c->next = p->next;
+            *link = c;
+            elv_fifo_remove(e, p, c);
+            p->next = 0;
+        }
+        c->count += req->count;
+        req->next = 0;
+        if (back) {
+            struct block_request* last = c->parts;
+            while (last->next) last = last->next;
+            last->next = req;
+            e->stats.back_merges++;
+        } else {
+            req->next = c->parts;
+            c->parts = req;
+            c->sector = req->sector;
+            *link = c->next;                // It starts lower now: re-sort
+            elv_sort_insert(e, c);
+            e->stats.front_merges++;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Caller holds e->lock. First pending request at or after sector.
+static struct block_request* elv_after(struct elevator* e, uint32_t dir, uint32_t sector) {
+    struct block_request* r = e->sorted[dir];
+    while (r && r->sector < sector) r = r->next;
+    return r;
+}
+
+// Caller holds e->lock. Choose the next request and take it off both lists.
+static struct block_request* elv_pick(struct elevator* e, uint64_t now) {
+    struct block_request* r = 0;
+    uint32_t dir = e->dir;
+    if (!e->sorted[0] && !e->sorted[1]) return 0;
+    if (e->mode == ELV_NOOP) {
+        // Oldest first, whichever direction
+        dir = e->fifo[0] && (!e->fifo[1] || e->fifo[0]->queued <= e->fifo[1]->queued) ? 0 : 1;
+        r = e->fifo[dir];
+    } else if (e->batch < ELV_FIFO_BATCH) {
+        r = elv_after(e, dir, e->head_pos);
+    }
+    if (!r) {
+        // New batch
+        bool writes = e->sorted[1];
+        if (e->sorted[0] && (!writes || e->starved < ELV_WRITES_STARVED)) {
+            dir = 0;
+            if (writes) e->starved++;
+        } else {
+            dir = 1;
+            e->starved = 0;
+        }
+        r = e->fifo[dir];
+        if (now - r->queued >= e->expire[dir]) {
+            e->stats.expired++;
+        } else {
+            r = elv_after(e, dir, e->head_pos);
+            if (!r) r = e->sorted[dir];     // Wrap to the lowest sector
+        }
+        e->dir = dir;
+        e->batch = 0;
+    }
+
+    struct block_request** link = &e->sorted[dir];
+    while (*link != r) link = &(*link)->next;
+    *link = r->next;
+    elv_fifo_remove(e, r, 0);
+    r->next = 0;
+    e->batch++;
+    e->pending--;
+    return r;
+}
+
+// Hand the driver what it has room for. Called after every submit and
+// completion, never with a driver lock held.
+static void elv_dispatch(struct block_device* dev) {
+    struct elevator* e = &dev->elv;
+    if (!__atomic_load_n(&e->pending, __ATOMIC_SEQ_CST)) return;
+    struct block_request* list = 0;
+    struct block_request** tail = &list;
+    uint32_t flags = spin_lock_irqsave(&e->lock);
+    uint64_t now = rdtsc();
+    while (e->mode == ELV_NOOP || __atomic_load_n(&e->in_flight, __ATOMIC_SEQ_CST) < e->depth) {
+        struct block_request* r = elv_pick(e, now);
+        if (!r) break;
+        __atomic_add_fetch(&e->in_flight, 1, __ATOMIC_SEQ_CST);
+        elv_account_dispatch(e, r, now);
+        *tail = r;
+        tail = &r->next;
+    }
+    spin_unlock_irqrestore(&e->lock, flags);
+
+    while (list) {
+        struct block_request* r = list;
+        list = r->next;
+        r->next = 0;
+        dev->ops->submit(dev, r);
+    }
+}
+
+static void elv_add(struct block_device* dev, struct block_request* req) {
+    struct elevator* e = &dev->elv;
+    __atomic_add_fetch(&e->stats.requests[req->write], 1, __ATOMIC_RELAXED);
+    // Pass-through: nothing queued to overtake, no lock shared with
+    // the other submitters
+    if (e->mode == ELV_NOOP && !__atomic_load_n(&e->pending, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&e->in_flight, 1, __ATOMIC_SEQ_CST);
+        elv_account_dispatch(e, req, req->queued);
+        dev->ops->submit(dev, req);
+        return;
+    }
+    uint32_t flags = spin_lock_irqsave(&e->lock);
+    if (e->mode == ELV_NOOP || !elv_merge(e, req)) {
+        elv_sort_insert(e, req);
+        req->fifo_next = 0;
+        if (e->fifo_tail[req->write]) e->fifo_tail[req->write]->fifo_next = req;
+        else e->fifo[req->write] = req;
+        e->fifo_tail[req->write] = req;
+        __atomic_add_fetch(&e->pending, 1, __ATOMIC_SEQ_CST);
+    }
+    spin_unlock_irqrestore(&e->lock, flags);
+    elv_dispatch(dev);
+}
+
+// A command the elevator dispatched is done (from blk_complete)
+static void elv_completed(struct block_request* req) {
+    struct elevator* e = &req->dev->elv;
+    if (!req->parts) elv_account(e, req, rdtsc(), true);
+    __atomic_sub_fetch(&e->in_flight, 1, __ATOMIC_SEQ_CST);
+}
+
+// end_io of a carrier: finish every part, then free the carrier. As in
+// blk_complete(), a part's end_io is the last use of it.
+static void elv_end_merged(struct block_request* c) {
+    struct elevator* e = &c->dev->elv;
+    uint64_t now = rdtsc();
+    for (struct block_request* p = c->parts, *next; p; p = next) {
+        next = p->next;
+        elv_account(e, p, now, true);
+        p->done = c->error ? 0 : p->count;
+        p->error = c->error;
+        if (p->end_io) p->end_io(p);
+    }
+    uint32_t flags = spin_lock_irqsave(&e->lock);
+    c->next = e->carriers;
+    e->carriers = c;
+    spin_unlock_irqrestore(&e->lock, flags);
+}
+
+static void elv_set_mode(struct block_device* dev, uint32_t mode) {
+    uint32_t flags = spin_lock_irqsave(&dev->elv.lock);
+    dev->elv.mode = mode;
+    spin_unlock_irqrestore(&dev->elv.lock, flags);
+    elv_dispatch(dev);
+}
+
+static void blk_submit(struct block_request* req) {
+    req->done = 0;
+    req->complete = false;
+    req->error = false;
+    req->next = 0;
+    req->parts = 0;
+    req->queued = rdtsc();
+    elv_add(req->dev, req);
+}
+
+// Called by the driver, typically from its interrupt handler, without
+// its own locks held. end_io is the last use of req: it may belong to
+// a waiter that returns as soon as it has been told.
+static void blk_complete(struct block_request* req, bool error) {
+    struct block_device* dev = req->dev;
+    struct block_stats* st = &dev->stats;
+    if (error) st->errors++;
+    else if (req->write) {
+        st->writes++;
+        st->write_sectors += req->count;
+    } else {
+        st->reads++;
+        st->read_sectors += req->count;
+    }
+    elv_completed(req);
+    req->error = error;
+    if (req->end_io) req->end_io(req);
+    elv_dispatch(dev);
+}
+
+// Retire whatever the device has finished without waiting for its
+// interrupt. Completions run end_io here, with interrupts off as they
+// would be in the handler. False if the driver can't poll.
+static bool blk_poll(struct block_device* dev) {
+    if (!dev->ops->poll) return false;
+    uint32_t flags = irq_save();
+    dev->ops->poll(dev);
+    irq_restore(flags);
+    __atomic_add_fetch(&dev->stats.polls, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// req is on blk_rw()'s stack. complete is set under the wait queue's
+// lock, which the waiter's finish_wait() takes before it can return,
+// and nothing touches req after the unlock.
+static void blk_end_sync(struct block_request* req) {
+    struct wait_queue* wq = &req->wait;
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    req->complete = true;
+    __wake_up_locked(wq, 0, 1);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+static bool blk_rw(struct block_device* dev, uint32_t sector, uint32_t count, void* buf, bool write) {
+    if (!count || sector >= dev->sectors || count > dev->sectors - sector) return false;
+    struct block_request req = {0};
+    req.dev = dev;
+    req.sector = sector;
+    req.count = count;
+    req.buffer = buf;
+    req.write = write;
+    req.end_io = blk_end_sync;
+    blk_submit(&req);
+    wait_event(req.wait, req.complete);
+    return !req.error;
+}
+
+static bool blk_read(struct block_device* dev, uint32_t sector, uint32_t count, void* buf) {
+    return blk_rw(dev, sector, count, buf, false);
+}
+
+static inline bool blk_write(struct block_device* dev, uint32_t sector, uint32_t count, const void* buf) {
+    return blk_rw(dev, sector, count, (void*)buf, true);
+}
+
+static void show_block_devices(void) {
+    if (!block_device_count) vga_puts("\nNo block devices");
+    for (uint32_t i = 0; i < block_device_count; i++) {
+        struct block_device* dev = block_devices[i];
+        vga_puts("\n");
+        vga_puts(dev->name);
+        vga_puts("  ");
+        vga_put_dec(dev->sectors / 2048);
+        vga_puts("MB  ");
+        vga_puts(dev->model);
+        vga_puts("\n     reads ");
+        vga_put_dec(dev->stats.reads);
+        vga_puts(" (");
+        vga_put_dec(dev->stats.read_sectors / 2);
+        vga_puts("KB), writes ");
+        vga_put_dec(dev->stats.writes);
+        vga_puts(" (");
+        vga_put_dec(dev->stats.write_sectors / 2);
+        vga_puts("KB), errors ");
+        vga_put_dec(dev->stats.errors);
+        vga_puts(", irqs ");
+        vga_put_dec(dev->stats.interrupts);
+        vga_puts(", kicks ");
+        vga_put_dec(dev->stats.kicks);
+    }
+}
+
+static void elv_put_latency(const char* what, uint32_t requests, uint64_t sum, uint32_t max) {
+    vga_puts(what);
+    vga_puts(" avg ");
+    vga_put_dec(requests ? (uint32_t)div64_32(sum, requests) : 0);
+    vga_puts(" max ");
+    vga_put_dec(max);
+    vga_puts("us");
+}
+
+static void show_iosched(void) {
+    static const char* const dir_names[2] = { "\n     reads:  ", "\n     writes: " };
+    for (uint32_t i = 0; i < block_device_count; i++) {
+        struct block_device* dev = block_devices[i];
+        struct elevator* e = &dev->elv;
+        struct elv_stats* st = &e->stats;
+        vga_puts("\n");
+        vga_puts(dev->name);
+        vga_puts(e->mode == ELV_NOOP ? "  noop" : "  deadline");
+        vga_puts(", depth ");
+        vga_put_dec(e->depth);
+        vga_puts(", ");
+        vga_put_dec(e->pending);
+        vga_puts(" pending, ");
+        vga_put_dec(e->in_flight);
+        vga_puts(" in flight");
+        vga_puts("\n     ");
+        vga_put_dec(st->requests[0] + st->requests[1]);
+        vga_puts(" requests -> ");
+        vga_put_dec(st->dispatched);
+        vga_puts(" commands; merges ");
+        vga_put_dec(st->back_merges);
+        vga_puts(" back, ");
+        vga_put_dec(st->front_merges);
+        vga_puts(" front; ");
+        vga_put_dec(st->expired);
+        vga_puts(" expired; seek ");
+        vga_put_dec(st->dispatched ? (uint32_t)div64_32(st->seek, st->dispatched) : 0);
+        vga_puts(" sectors/command");
+        for (uint32_t dir = 0; dir < 2; dir++) {
+            if (!st->requests[dir]) continue;
+            vga_puts(dir_names[dir]);
+            vga_put_dec(st->requests[dir]);
+            elv_put_latency(", queued", st->requests[dir], st->wait_us[dir], st->wait_max[dir]);
+            elv_put_latency(", total", st->requests[dir], st->total_us[dir], st->total_max[dir]);
+        }
+    }
+}
+
+// ==================== IO RINGS ====================
+// Asynchronous block I/O through a pair of rings in shared memory, after
+// Linux's io_uring. The submitter fills SQEs and advances sq_tail;
+// io_ring_enter() consumes them, starts each operation without waiting
+// for it and then optionally waits for completions, which come back as
+// CQEs from cq_head on. One call can put a whole batch in flight. Every
+// operation in flight has its CQE slot reserved, so the CQ never
+// overflows: submission stops when it is full of unreaped entries.
+// Rings set up with IORING_SETUP_IOPOLL never sleep: enter spins on the
+// drivers' poll hooks and checks timeouts against the TSC, so they
+// don't need the completion interrupt (devices without a poll hook
+// still complete through theirs). Other rings are woken from end_io and
+// their timeouts expire on the CPU 0 tick.
+#define IORING_OP_NOP     0
+#define IORING_OP_READ    1
+#define IORING_OP_WRITE   2
+#define IORING_OP_FSYNC   3
+#define IORING_OP_TIMEOUT 4
+
+#define IORING_SETUP_IOPOLL 0x01
+
+// READ/WRITE move len bytes at byte offset off of block_devices[dev]
+// to or from the buffer at addr; len and off are sector multiples.
+// FSYNC completes once every write submitted before it on the same ring
+// has, with -EIO if any write on the ring failed since the previous
+// FSYNC was submitted (a failure is reported once). TIMEOUT completes with -ETIME
+// after off microseconds, or with 0 as soon as len other operations have
+// completed since it was submitted (len 0: time only).
+struct io_uring_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t dev;
+    uint32_t len;
+    uint64_t off;
+    uint32_t addr;
+    uint32_t reserved;
+    uint64_t user_data;             // Copied to the CQE
+};
+
+struct io_uring_cqe {
+    uint64_t user_data;
+    int32_t res;                    // Bytes moved, 0 or -errno
+    uint32_t flags;
+};
+
+// Start of the shared area; the SQE and CQE arrays follow. Each index
+// has one writer: the kernel moves sq_head and cq_tail, the submitter
+// sq_tail and cq_head.
+struct io_uring_shared {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t reserved[2];
+};
+
+struct io_ring;
+
+struct io_ring_op {
+    struct block_request req;       // First: end_io casts back
+    struct io_ring* ring;
+    uint64_t user_data;
+    uint8_t opcode;
+    uint32_t seq;                   // WRITE: submission order; FSYNC: writes before it; TIMEOUT: count
+    uint32_t target;                // TIMEOUT: ring->completed value that ends it early
+    uint64_t expires;               // TIMEOUT: TSC
+    struct io_ring_op* next;        // Free, pending fsync or timeout list
+    struct io_ring_op* write_next;  // Writes in flight, oldest first
+};
+
+struct io_ring_stats {
+    uint32_t enters;
+    uint32_t submitted;
+    uint32_t completed;
+    uint32_t full;                  // Submissions stopped by a full CQ
+    uint32_t polls;
+    uint32_t timeouts;              // Timeouts that fired
+};
+
+struct io_ring {
+    volatile bool active;           // Changed under io_rings_lock
+    uint32_t flags;
+    struct io_uring_shared* sh;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    uint32_t sq_mask;
+    uint32_t cq_mask;
+    uint32_t pages;
+    struct io_ring_op* ops;         // One per CQ entry
+    uint32_t op_pages;
+    struct mutex submit_lock;
+    spinlock_t lock;                // Everything below
+    struct io_ring_op* free;
+    volatile uint32_t inflight;
+    uint32_t completed;
+    uint32_t write_seq;
+    bool write_error;               // A write failed that no fsync has reported yet
+    struct io_ring_op* writes;
+    struct io_ring_op* writes_tail;
+    struct io_ring_op* fsyncs;
+    struct io_ring_op* timeouts;
+    uint32_t devs;                  // block_devices[] this ring has used, to poll
+    struct wait_queue wait;
+    struct io_ring_stats stats;
+};
+
+static struct io_ring io_rings[IORING_MAX_RINGS];
+static spinlock_t io_rings_lock;
+
+static inline uint32_t io_ring_ready(struct io_ring* r) {
+    return __atomic_load_n(&r->sh->cq_tail, __ATOMIC_ACQUIRE) - r->sh->cq_head;
+}
+
+// Caller holds r->lock, and reserved the CQE when it took the op
+static void io_ring_post(struct io_ring* r, struct io_ring_op* op, int32_t res) {
+    struct io_uring_shared* sh = r->sh;
+    uint32_t tail = sh->cq_tail;
+    struct io_uring_cqe* cqe = &r->cqes[tail & r->cq_mask];
+    cqe->user_data = op->user_data;
+    cqe->res = res;
+    cqe->flags = 0;
+    __atomic_store_n(&sh->cq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (op->opcode != IORING_OP_TIMEOUT) r->completed++;
+    r->stats.completed++;
+    op->next = r->free;
+    r->free = op;
+    r->inflight--;
+}
+
+// Caller holds r->lock. Fsyncs whose writes have all completed finish.
+static void io_ring_fsyncs(struct io_ring* r) {
+    uint32_t oldest = r->writes ? r->writes->seq : r->write_seq;
+    struct io_ring_op** link = &r->fsyncs;
+    while (*link) {
+        struct io_ring_op* op = *link;
+        if ((int32_t)(op->seq - oldest) > 0) {
+            link = &op->next;
+            continue;
+        }
+        *link = op->next;
+        io_ring_post(r, op, op->req.error ? -EIO : 0);
+    }
+}
+
+// Caller holds r->lock. Timeouts that have seen their count finish;
+// with a nonzero now, so do the ones whose time is up.
+static void io_ring_timeouts(struct io_ring* r, uint64_t now) {
+    struct io_ring_op** link = &r->timeouts;
+    while (*link) {
+        struct io_ring_op* op = *link;
+        int32_t res;
+        if (op->seq && (int32_t)(r->completed - op->target) >= 0) {
+            res = 0;
+        } else if (now && now >= op->expires) {
+            res = -ETIME;
+            r->stats.timeouts++;
+        } else {
+            link = &op->next;
+            continue;
+        }
+        *link = op->next;
+        io_ring_post(r, op, res);
+    }
+}
+
+static void io_ring_end_io(struct block_request* req) {
+    struct io_ring_op* op = (struct io_ring_op*)req;
+    struct io_ring* r = op->ring;
+
+    uint32_t flags = spin_lock_irqsave(&r->lock);
+    if (op->opcode == IORING_OP_WRITE) {
+        struct io_ring_op** link = &r->writes;
+        struct io_ring_op* prev = 0;
+        while (*link != op) {
+            prev = *link;
+            link = &prev->write_next;
+        }
+        *link = op->write_next;
+        if (r->writes_tail == op) r->writes_tail = prev;
+        if (req->error) {
+            bool reported = false;
+            for (struct io_ring_op* f = r->fsyncs; f; f = f->next) {
+                if ((int32_t)(f->seq - op->seq) > 0) f->req.error = reported = true;
+            }
+            if (!reported) r->write_error = true;
+        }
+    }
+    io_ring_post(r, op, req->error ? -EIO : (int32_t)(req->count * SECTOR_SIZE));
+    if (op->opcode == IORING_OP_WRITE) io_ring_fsyncs(r);
+    io_ring_timeouts(r, 0);
+    // Still under the lock: once io_ring_exit() has seen inflight reach
+    // 0 under it, nothing here touches the ring again
+    if (!(r->flags & IORING_SETUP_IOPOLL)) wake_up(&r->wait);
+    spin_unlock_irqrestore(&r->lock, flags);
+}
+
+static int32_t io_ring_prep_rw(struct io_ring_op* op, const struct io_uring_sqe* sqe) {
+    if (sqe->dev >= block_device_count || !sqe->addr || !sqe->len) return -EINVAL;
+    if ((sqe->len | (uint32_t)sqe->off) % SECTOR_SIZE) return -EINVAL;
+    struct block_device* dev = block_devices[sqe->dev];
+    uint64_t sector = sqe->off >> 9;
+    uint32_t count = sqe->len / SECTOR_SIZE;
+    if (sector >= dev->sectors || count > dev->sectors - (uint32_t)sector) return -EINVAL;
+    op->req.dev = dev;
+    op->req.sector = (uint32_t)sector;
+    op->req.count = count;
+    op->req.buffer = (uint8_t*)sqe->addr;
+    op->req.write = sqe->opcode == IORING_OP_WRITE;
+    op->req.end_io = io_ring_end_io;
+    return 0;
+}
+
+// Consume up to n SQEs. Reads and writes are handed to the block layer
+// after the ring lock is dropped, since they may complete right away.
+static uint32_t io_ring_submit(struct io_ring* r, uint32_t n) {
+    struct io_uring_shared* sh = r->sh;
+    uint32_t head = sh->sq_head;
+    uint32_t tail = __atomic_load_n(&sh->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t done = 0;
+
+    while (done < n && head != tail) {
+        const struct io_uring_sqe* sqe = &r->sqes[head & r->sq_mask];
+        uint32_t flags = spin_lock_irqsave(&r->lock);
+        if (r->inflight + io_ring_ready(r) > r->cq_mask) {
+            r->stats.full++;
+            spin_unlock_irqrestore(&r->lock, flags);
+            break;
+        }
+        struct io_ring_op* op = r->free;
+        r->free = op->next;
+        r->inflight++;
+        memset(op, 0, sizeof(*op));
+        op->ring = r;
+        op->user_data = sqe->user_data;
+        op->opcode = sqe->opcode;
+
+        bool start = false;
+        int32_t res = 0;
+        switch (sqe->opcode) {
+        case IORING_OP_NOP:
+            break;
+        case IORING_OP_READ:
+        case IORING_OP_WRITE:
+            res = io_ring_prep_rw(op, sqe);
+            if (res) break;
+            start = true;
+            r->devs |= 1u << sqe->dev;
+            if (op->req.write) {
+                op->seq = r->write_seq++;
+                if (r->writes_tail) r->writes_tail->write_next = op;
+                else r->writes = op;
+                r->writes_tail = op;
+            }
+            break;
+        case IORING_OP_FSYNC:
+            op->seq = r->write_seq;
+            op->req.error = r->write_error;
+            r->write_error = false;
+            op->next = r->fsyncs;
+            r->fsyncs = op;
+            io_ring_fsyncs(r);
+            op = 0;
+            break;
+        case IORING_OP_TIMEOUT:
+            op->seq = sqe->len;
+            op->target = r->completed + sqe->len;
+            op->expires = rdtsc() + sqe->off * tsc_per_us;
+            op->next = r->timeouts;
+            r->timeouts = op;
+            op = 0;
+            break;
+        default:
+            res = -EINVAL;
+        }
+        if (op && !start) {
+            io_ring_post(r, op, res);
+            io_ring_timeouts(r, 0);
+        }
+        spin_unlock_irqrestore(&r->lock, flags);
+        if (start) blk_submit(&op->req);
+        head++;
+        done++;
+    }
+    __atomic_store_n(&sh->sq_head, head, __ATOMIC_RELEASE);
+    r->stats.submitted += done;
+    return done;
+}
+
+static void io_ring_poll(struct io_ring* r) {
+    for (uint32_t devs = r->devs; devs; devs &= devs - 1) {
+        blk_poll(block_devices[__builtin_ctz(devs)]);
+    }
+    if (r->timeouts) {
+        uint32_t flags = spin_lock_irqsave(&r->lock);
+        io_ring_timeouts(r, rdtsc());
+        spin_unlock_irqrestore(&r->lock, flags);
+    }
+    r->stats.polls++;
+    cpu_relax();
+}
+
+// Submit up to to_submit SQEs, then wait until min_complete CQEs are
+// ready or nothing left in flight could post one. Returns the number of
+// SQEs consumed.
+static uint32_t io_ring_enter(struct io_ring* r, uint32_t to_submit, uint32_t min_complete) {
+    mutex_lock(&r->submit_lock);
+    uint32_t submitted = io_ring_submit(r, to_submit);
+    r->stats.enters++;
+    mutex_unlock(&r->submit_lock);
+
+    if (r->flags & IORING_SETUP_IOPOLL) {
+        while (io_ring_ready(r) < min_complete && r->inflight) io_ring_poll(r);
+    } else if (min_complete) {
+        wait_event(r->wait, io_ring_ready(r) >= min_complete || !r->inflight);
+    }
+    return submitted;
+}
+
+// CPU 0 tick: expire the timeouts of rings that sleep. io_rings_lock
+// keeps each active ring from being torn down underneath.
+static void io_ring_timer(void) {
+    uint64_t now = rdtsc();
+    spin_lock(&io_rings_lock);
+    for (uint32_t i = 0; i < IORING_MAX_RINGS; i++) {
+        struct io_ring* r = &io_rings[i];
+        if (!r->active || (r->flags & IORING_SETUP_IOPOLL)) continue;
+        spin_lock(&r->lock);
+        if (r->timeouts) {
+            io_ring_timeouts(r, now);
+            wake_up(&r->wait);
+        }
+        spin_unlock(&r->lock);
+    }
+    spin_unlock(&io_rings_lock);
+}
+
+// entries is rounded up to a power of two; the CQ gets twice as many
+static struct io_ring* io_ring_setup(uint32_t entries, uint32_t flags) {
+    if (!entries || entries > IORING_MAX_ENTRIES) return 0;
+    uint32_t n = 1;
+    while (n < entries) n <<= 1;
+
+    struct io_ring* r = 0;
+    uint32_t irq = spin_lock_irqsave(&io_rings_lock);
+    for (uint32_t i = 0; i < IORING_MAX_RINGS && !r; i++) {
+        if (!io_rings[i].sh) r = &io_rings[i];
+    }
+    if (r) r->sh = (struct io_uring_shared*)1;     // Claimed
+    spin_unlock_irqrestore(&io_rings_lock, irq);
+    if (!r) return 0;
+
+    uint32_t bytes = sizeof(struct io_uring_shared) + n * sizeof(struct io_uring_sqe) +
+                     2 * n * sizeof(struct io_uring_cqe);
+    uint32_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t op_pages = (2 * n * sizeof(struct io_ring_op) + PAGE_SIZE - 1) / PAGE_SIZE;
+    struct io_uring_shared* sh = vmalloc(pages);
+    struct io_ring_op* ops = sh ? vmalloc(op_pages) : 0;
+    if (!ops) {
+        if (sh) vfree(sh, pages);
+        r->sh = 0;
+        return 0;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->flags = flags;
+    r->sh = sh;
+    r->sqes = (struct io_uring_sqe*)(sh + 1);
+    r->cqes = (struct io_uring_cqe*)(r->sqes + n);
+    r->sq_mask = n - 1;
+    r->cq_mask = 2 * n - 1;
+    r->pages = pages;
+    r->ops = ops;
+    r->op_pages = op_pages;
+    sh->sq_entries = n;
+    sh->cq_entries = 2 * n;
+    for (uint32_t i = 0; i < 2 * n; i++) {
+        ops[i].next = r->free;
+        r->free = &ops[i];
+    }
+    irq = spin_lock_irqsave(&io_rings_lock);
+    r->active = true;
+    spin_unlock_irqrestore(&io_rings_lock, irq);
+    return r;
+}
+
+// Pending timeouts are dropped without a CQE; reads and writes in
+// flight are waited for
+static void io_ring_exit(struct io_ring* r) {
+    uint32_t flags = spin_lock_irqsave(&r->lock);
+    while (r->timeouts) {
+        struct io_ring_op* op = r->timeouts;
+        r->timeouts = op->next;
+        r->inflight--;
+    }
+    spin_unlock_irqrestore(&r->lock, flags);
+    for (;;) {
+        if (r->flags & IORING_SETUP_IOPOLL) io_ring_poll(r);
+        else wait_event(r->wait, !r->inflight);
+        flags = spin_lock_irqsave(&r->lock);
+        bool idle = !r->inflight;
+        spin_unlock_irqrestore(&r->lock, flags);
+        if (idle) break;
+    }
+    flags = spin_lock_irqsave(&io_rings_lock);
+    r->active = false;
+    spin_unlock_irqrestore(&io_rings_lock, flags);
+    vfree(r->ops, r->op_pages);
+    vfree(r->sh, r->pages);
+    __atomic_store_n(&r->sh, (struct io_uring_shared*)0, __ATOMIC_RELEASE);
+}
+
+// Submitter side, as a program sharing the rings would do it: the next
+// SQE to fill (0 if the SQ is full), published by io_ring_queue()
+static struct io_uring_sqe* io_ring_get_sqe(struct io_ring* r) {
+    struct io_uring_shared* sh = r->sh;
+    if (sh->sq_tail - __atomic_load_n(&sh->sq_head, __ATOMIC_ACQUIRE) > r->sq_mask) return 0;
+    struct io_uring_sqe* sqe = &r->sqes[sh->sq_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static inline void io_ring_queue(struct io_ring* r) {
+    __atomic_store_n(&r->sh->sq_tail, r->sh->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline struct io_uring_cqe* io_ring_peek_cqe(struct io_ring* r) {
+    return io_ring_ready(r) ? &r->cqes[r->sh->cq_head & r->cq_mask] : 0;
+}
+
+static inline void io_ring_cqe_seen(struct io_ring* r) {
+    __atomic_store_n(&r->sh->cq_head, r->sh->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static void io_ring_prep(struct io_uring_sqe* sqe, uint8_t opcode, uint32_t dev,
+                         uint64_t off, uint32_t len, void* addr, uint64_t user_data) {
+    sqe->opcode = opcode;
+    sqe->dev = dev;
+    sqe->off = off;
+    sqe->len = len;
+    sqe->addr = (uint32_t)addr;
+    sqe->user_data = user_data;
+}
+
+// ==================== ATA DRIVER ====================
+// Legacy IDE channels (primary 0x1F0/IRQ14, secondary 0x170/IRQ15), up
+// to two drives each. Requests queue per channel; the head one is on the
+// wire. With a PCI IDE controller that can bus-master (PIIX), drives
+// that support DMA move data through a PRD table built from the
+// request's physical pages and interrupt once per command. Otherwise
+// PIO with READ/WRITE MULTIPLE moves up to ATA_MULTIPLE_MAX sectors per
+// interrupt. LBA48 commands are used when the drive has them and the
+// request needs them, LBA28 otherwise. Probing polls with nIEN set.
+#define ATA_DATA      0
+#define ATA_ERROR     1
+#define ATA_COUNT     2
+#define ATA_LBA0      3
+#define ATA_LBA1      4
+#define ATA_LBA2      5
+#define ATA_DRIVE     6
+#define ATA_STATUS    7
+#define ATA_COMMAND   7
+
+#define ATA_SR_ERR    0x01
+#define ATA_SR_DRQ    0x08
+#define ATA_SR_DF     0x20
+#define ATA_SR_BSY    0x80
+#define ATA_CTRL_NIEN 0x02
+
+#define ATA_CMD_READ           0x20
+#define ATA_CMD_READ_EXT       0x24
+#define ATA_CMD_READ_DMA_EXT   0x25
+#define ATA_CMD_READ_MULT_EXT  0x29
+#define ATA_CMD_WRITE          0x30
+#define ATA_CMD_WRITE_EXT      0x34
+#define ATA_CMD_WRITE_DMA_EXT  0x35
+#define ATA_CMD_WRITE_MULT_EXT 0x39
+#define ATA_CMD_READ_MULT      0xC4
+#define ATA_CMD_WRITE_MULT     0xC5
+#define ATA_CMD_SET_MULT       0xC6
+#define ATA_CMD_READ_DMA       0xC8
+#define ATA_CMD_WRITE_DMA      0xCA
+#define ATA_CMD_IDENTIFY       0xEC
+
+// Bus-master registers, per channel at BAR4 + 8 * channel
+#define BM_COMMAND    0
+#define BM_STATUS     2
+#define BM_PRDT       4
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08              // Device to memory
+#define BM_SR_ACTIVE  0x01
+#define BM_SR_ERR     0x02
+#define BM_SR_IRQ     0x04
+#define PRD_EOT       0x80000000
+
+struct ata_prd {
+    uint32_t phys;
+    uint32_t len;                       // Bytes in bits 0-15 (0 = 64KB), PRD_EOT
+};
+
+struct ata_channel {
+    uint16_t io;
+    uint16_t ctrl;
+    uint16_t bmide;                     // Bus-master base, 0 without DMA
+    uint32_t isa_irq;
+    spinlock_t lock;
+    struct block_request* head;         // Active request
+    struct block_request* tail;
+    uint32_t cmd_left;                  // PIO: sectors left in the command
+    uint32_t dma_sectors;               // DMA: sectors in the command, 0 = PIO
+    struct ata_prd* prdt;
+    uint64_t cpu_cycles;                // Spent in submit and interrupt paths
+    struct block_request* done;         // Finished, completed once the lock is dropped
+    bool completing;                    // ata_complete() is running for this channel
+};
+
+struct ata_drive {
+    struct ata_channel* ch;
+    uint8_t slave;
+    bool lba48;
+    bool dma;                           // Use bus-master DMA
+    bool dma_capable;
+    uint32_t multiple;                  // Sectors per DRQ block (1 = no MULTIPLE)
+    struct block_device dev;
+};
+
+static struct ata_channel ata_channels[2] = {
+    { .io = 0x1F0, .ctrl = 0x3F6, .isa_irq = 14 },
+    { .io = 0x170, .ctrl = 0x376, .isa_irq = 15 },
+};
+static struct ata_drive ata_drives[4];
+
+// Reading the alternate status register takes ~100ns; four make the
+// 400ns the device needs after a select or command
+static void ata_delay(struct ata_channel* ch) {
+    for (int i = 0; i < 4; i++) inb(ch->ctrl);
+}
+
+static bool ata_wait(struct ata_channel* ch, uint8_t mask, uint8_t value, uint32_t timeout_us) {
+    for (uint32_t t = 0; t < timeout_us; t += 10) {
+        uint8_t status = inb(ch->io + ATA_STATUS);
+        if (status & (ATA_SR_ERR | ATA_SR_DF) && !(status & ATA_SR_BSY)) return false;
+        if ((status & mask) == value) return true;
+        udelay(10);
+    }
+    return false;
+}
+
+static void ata_copy_string(char* dest, const uint16_t* words, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        dest[i * 2] = words[i] >> 8;
+        dest[i * 2 + 1] = words[i] & 0xFF;
+    }
+    uint32_t len = count * 2;
+    while (len && dest[len - 1] == ' ') len--;
+    dest[len] = '\0';
+}
+
+// Caller holds ch->lock. Move the next DRQ block of the active request.
+static void ata_pio_block(struct ata_channel* ch) {
+    struct block_request* req = ch->head;
+    struct ata_drive* d = req->dev->priv;
+    uint32_t n = ch->cmd_left < d->multiple ? ch->cmd_left : d->multiple;
+    // Segments (and merged parts) are sector multiples, so a block may
+    // span several; move it one sector at a time unless it's a plain buffer
+    for (uint32_t i = 0; i < n; i += req->buffer ? n : 1) {
+        uint32_t sectors = req->buffer ? n : 1;
+        uint8_t* buf = blk_data_at(req, (req->done + i) * SECTOR_SIZE);
+        if (req->write) outsw(ch->io + ATA_DATA, buf, sectors * SECTOR_SIZE / 2);
+        else insw(ch->io + ATA_DATA, buf, sectors * SECTOR_SIZE / 2);
+    }
+    req->done += n;
+    ch->cmd_left -= n;
+}
+
+// Caller holds ch->lock. Fill the PRD table for up to count sectors from
+// req->done on; returns how many sectors it covers (fewer if it filled).
+static uint32_t ata_build_prdt(struct ata_channel* ch, struct block_request* req, uint32_t count) {
+    uint32_t start = req->done * SECTOR_SIZE;
+    uint32_t off = start;
+    uint32_t end = start + count * SECTOR_SIZE;
+    uint32_t n = 0;
+    while (off < end) {
+        uint32_t len;
+        uint32_t phys = blk_phys_at(req, off, &len);
+        if (len > end - off) len = end - off;
+        uint32_t boundary = 0x10000 - (phys & 0xFFFF);     // A PRD may not cross 64KB
+        if (len > boundary) len = boundary;
+        struct ata_prd* last = n ? &ch->prdt[n - 1] : 0;
+        if (last && last->phys + last->len == phys && (phys & 0xFFFF)) {
+            last->len += len;                               // Contiguous, same 64KB
+        } else if (n < ATA_PRD_ENTRIES) {
+            ch->prdt[n].phys = phys;
+            ch->prdt[n].len = len;
+            n++;
+        } else {
+            break;
+        }
+        off += len;
+    }
+
+    // Table full mid-sector: give the partial sector back
+    uint32_t excess = (off - start) % SECTOR_SIZE;
+    while (excess) {
+        struct ata_prd* last = &ch->prdt[n - 1];
+        uint32_t cut = last->len < excess ? last->len : excess;
+        last->len -= cut;
+        excess -= cut;
+        off -= cut;
+        if (!last->len) n--;
+    }
+    for (uint32_t i = 0; i < n; i++) ch->prdt[i].len &= 0xFFFF;     // 64KB is 0
+    ch->prdt[n - 1].len |= PRD_EOT;
+    return (off - start) / SECTOR_SIZE;
+}
+
+// Caller holds ch->lock. Issue a command for the rest of the head
+// request; false if it failed to start (see ata_start()).
+static bool ata_issue(struct ata_channel* ch) {
+    struct block_request* req = ch->head;
+    struct ata_drive* d = req->dev->priv;
+    uint32_t lba = req->sector + req->done;
+    uint32_t remaining = req->count - req->done;
+    bool ext = d->lba48 && (lba + remaining > 0x0FFFFFFF || remaining > 256);
+    uint32_t count = remaining < (ext ? 65536u : 256u) ? remaining : (ext ? 65536u : 256u);
+    bool mult = d->multiple > 1;
+
+    ch->dma_sectors = 0;
+    if (d->dma) {
+        count = ata_build_prdt(ch, req, count);
+        ch->dma_sectors = count;
+        outb(ch->bmide + BM_COMMAND, 0);
+        outb(ch->bmide + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+        outl(ch->bmide + BM_PRDT, virt_to_phys(ch->prdt));
+        outb(ch->bmide + BM_COMMAND, req->write ? 0 : BM_CMD_READ);
+    }
+
+    ch->cmd_left = count;
+    if (ext) {
+        outb(ch->io + ATA_DRIVE, 0x40 | (d->slave << 4));
+        ata_delay(ch);
+        outb(ch->io + ATA_COUNT, count >> 8);
+        outb(ch->io + ATA_LBA0, lba >> 24);
+        outb(ch->io + ATA_LBA1, 0);
+        outb(ch->io + ATA_LBA2, 0);
+    } else {
+        outb(ch->io + ATA_DRIVE, 0xE0 | (d->slave << 4) | ((lba >> 24) & 0x0F));
+        ata_delay(ch);
+    }
+    outb(ch->io + ATA_COUNT, count & 0xFF);
+    outb(ch->io + ATA_LBA0, lba & 0xFF);
+    outb(ch->io + ATA_LBA1, (lba >> 8) & 0xFF);
+    outb(ch->io + ATA_LBA2, (lba >> 16) & 0xFF);
+
+    uint8_t cmd;
+    if (d->dma) cmd = req->write ? (ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+                                 : (ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+    else if (req->write) cmd = ext ? (mult ? ATA_CMD_WRITE_MULT_EXT : ATA_CMD_WRITE_EXT)
+                                   : (mult ? ATA_CMD_WRITE_MULT : ATA_CMD_WRITE);
+    else cmd = ext ? (mult ? ATA_CMD_READ_MULT_EXT : ATA_CMD_READ_EXT)
+                   : (mult ? ATA_CMD_READ_MULT : ATA_CMD_READ);
+    outb(ch->io + ATA_COMMAND, cmd);
+
+    if (d->dma) {
+        outb(ch->bmide + BM_COMMAND, inb(ch->bmide + BM_COMMAND) | BM_CMD_START);
+        return true;
+    }
+
+    // PIO writes get no interrupt before the first block; the rest are
+    // sent from ata_interrupt() as the drive asks for them
+    if (req->write) {
+        ata_delay(ch);
+        if (!ata_wait(ch, ATA_SR_BSY | ATA_SR_DRQ, ATA_SR_DRQ, 100000)) return false;
+        ata_pio_block(ch);
+    }
+    return true;
+}
+
+// Caller holds ch->lock. Move the head request to the done list.
+static void ata_retire(struct ata_channel* ch, bool error) {
+    struct block_request* req = ch->head;
+    ch->head = req->next;
+    if (!ch->head) ch->tail = 0;
+    req->error = error;
+    req->next = ch->done;
+    ch->done = req;
+}
+
+// Caller holds ch->lock. Issue the head request; one that fails to
+// start is retired and the next one tried, in a loop, so a drive that
+// keeps failing can't recurse down the queue.
+static void ata_start(struct ata_channel* ch) {
+    while (ch->head && !ata_issue(ch)) ata_retire(ch, true);
+}
+
+// Caller holds ch->lock. Retire the head request and start the next.
+static void ata_finish(struct ata_channel* ch, bool error) {
+    ata_retire(ch, error);
+    ata_start(ch);
+}
+
+// Called with ch->lock dropped. blk_complete() can dispatch the next
+// request into ata_submit(), which may fail it at once; rather than
+// completing that from inside this one (and so on, for as long as the
+// drive keeps failing), a nested call leaves it to the loop here.
+static void ata_complete(struct ata_channel* ch) {
+    uint32_t flags = spin_lock_irqsave(&ch->lock);
+    if (ch->completing) {
+        spin_unlock_irqrestore(&ch->lock, flags);
+        return;
+    }
+    ch->completing = true;
+    while (ch->done) {
+        struct block_request* done = ch->done;
+        ch->done = 0;
+        spin_unlock_irqrestore(&ch->lock, flags);
+        while (done) {
+            struct block_request* req = done;
+            done = req->next;
+            blk_complete(req, req->error);
+        }
+        flags = spin_lock_irqsave(&ch->lock);
+    }
+    ch->completing = false;
+    spin_unlock_irqrestore(&ch->lock, flags);
+}
+
+static void ata_submit(struct block_device* dev, struct block_request* req) {
+    struct ata_channel* ch = ((struct ata_drive*)dev->priv)->ch;
+    uint32_t flags = spin_lock_irqsave(&ch->lock);
+    uint64_t start = rdtsc();
+    if (ch->tail) {
+        ch->tail->next = req;
+        ch->tail = req;
+    } else {
+        ch->head = ch->tail = req;
+        ata_start(ch);
+    }
+    ch->cpu_cycles += rdtsc() - start;
+    spin_unlock_irqrestore(&ch->lock, flags);
+    ata_complete(ch);
+}
+
+// DMA command finished (or failed): account it and move on
+static void ata_dma_interrupt(struct ata_channel* ch, uint8_t status) {
+    struct block_request* req = ch->head;
+    uint8_t bm_status = inb(ch->bmide + BM_STATUS);
+    outb(ch->bmide + BM_COMMAND, 0);
+    outb(ch->bmide + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    if ((status & (ATA_SR_ERR | ATA_SR_DF)) || (bm_status & BM_SR_ERR)) {
+        ata_finish(ch, true);
+        return;
+    }
+    req->done += ch->dma_sectors;
+    if (req->done < req->count) ata_start(ch);
+    else ata_finish(ch, false);
+}
+
+static void ata_interrupt(struct ata_channel* ch) {
+    spin_lock(&ch->lock);
+    uint64_t start = rdtsc();
+    uint8_t status = inb(ch->io + ATA_STATUS);      // Also acknowledges the IRQ
+    struct block_request* req = ch->head;
+    if (req) req->dev->stats.interrupts++;
+    if (!req || (status & ATA_SR_BSY)) {
+        // Nothing for us
+    } else if (ch->dma_sectors) {
+        ata_dma_interrupt(ch, status);
+    } else if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        ata_finish(ch, true);
+    } else if (!req->write) {
+        if (status & ATA_SR_DRQ) ata_pio_block(ch);
+        if (!ch->cmd_left) {
+            if (req->done < req->count) ata_start(ch);
+            else ata_finish(ch, false);
+        }
+    } else if (ch->cmd_left) {
+        ata_pio_block(ch);
+    } else if (req->done < req->count) {
+        ata_start(ch);
+    } else {
+        ata_finish(ch, false);
+    }
+    ch->cpu_cycles += rdtsc() - start;
+    spin_unlock(&ch->lock);
+    ata_complete(ch);
+}
+
+static void ata_irq_primary(void) {
+    ata_interrupt(&ata_channels[0]);
+}
+
+static void ata_irq_secondary(void) {
+    ata_interrupt(&ata_channels[1]);
+}
+
+static const struct block_ops ata_ops = {
+    .submit = ata_submit,
+};
+
+static bool ata_probe_drive(struct ata_drive* d) {
+    struct ata_channel* ch = d->ch;
+    uint16_t id[256];
+
+    outb(ch->io + ATA_DRIVE, 0xA0 | (d->slave << 4));
+    ata_delay(ch);
+    outb(ch->io + ATA_COUNT, 0);
+    outb(ch->io + ATA_LBA0, 0);
+    outb(ch->io + ATA_LBA1, 0);
+    outb(ch->io + ATA_LBA2, 0);
+    outb(ch->io + ATA_COMMAND, ATA_CMD_IDENTIFY);
+    ata_delay(ch);
+    uint8_t status = inb(ch->io + ATA_STATUS);
+    if (status == 0 || status == 0xFF) return false;
+    if (!ata_wait(ch, ATA_SR_BSY, 0, 1000000)) return false;
+    if (inb(ch->io + ATA_LBA1) || inb(ch->io + ATA_LBA2)) return false;    // ATAPI
+    if (!ata_wait(ch, ATA_SR_DRQ, ATA_SR_DRQ, 1000000)) return false;
+    insw(ch->io + ATA_DATA, id, 256);
+
+    if (!(id[49] & (1 << 9))) return false;                                 // No LBA
+    d->lba48 = id[83] & (1 << 10);
+    d->dev.sectors = d->lba48 && (id[102] || id[103]) ? 0xFFFFFFFF
+                   : d->lba48 ? (id[100] | ((uint32_t)id[101] << 16))
+                   : (id[60] | ((uint32_t)id[61] << 16));
+    if (!d->dev.sectors) return false;
+    ata_copy_string(d->dev.model, &id[27], 20);
+    d->dma_capable = ch->bmide && (id[49] & (1 << 8));
+    d->dma = d->dma_capable;
+
+    // SET MULTIPLE to as many sectors per interrupt as the drive allows
+    d->multiple = 1;
+    uint32_t max = id[47] & 0xFF;
+    if (max > 1) {
+        uint32_t m = max < ATA_MULTIPLE_MAX ? max : ATA_MULTIPLE_MAX;
+        outb(ch->io + ATA_COUNT, m);
+        outb(ch->io + ATA_COMMAND, ATA_CMD_SET_MULT);
+        ata_delay(ch);
+        if (ata_wait(ch, ATA_SR_BSY, 0, 100000)) d->multiple = m;
+    }
+    return true;
+}
+
+// PCI IDE controller in legacy mode: only BAR4 (bus master) matters
+static void ata_find_busmaster(void) {
+    struct pci_device* pci = pci_find_class(0x01, 0x01, 0);
+    if (!pci || (pci->prog_if & 0x05) || !(pci->prog_if & 0x80)) return;
+    uint32_t bar4 = pci_bar(pci, 4);
+    if (!(bar4 & 1)) return;
+    pci_enable(pci, PCI_CMD_IO | PCI_CMD_MASTER);
+    for (uint32_t c = 0; c < 2; c++) {
+        uint32_t prdt = pmm_alloc_page();           // Page-aligned: never crosses 64KB
+        if (!prdt) return;
+        ata_channels[c].prdt = (struct ata_prd*)prdt;
+        ata_channels[c].bmide = (bar4 & 0xFFFC) + c * 8;
+    }
+}
+
+static void ata_init(void) {
+    ata_find_busmaster();
+    for (uint32_t c = 0; c < 2; c++) {
+        struct ata_channel* ch = &ata_channels[c];
+        if (inb(ch->io + ATA_STATUS) == 0xFF) continue;     // Floating bus
+        outb(ch->ctrl, ATA_CTRL_NIEN);
+
+        bool found = false;
+        for (uint32_t slave = 0; slave < 2; slave++) {
+            struct ata_drive* d = &ata_drives[c * 2 + slave];
+            d->ch = ch;
+            d->slave = slave;
+            if (!ata_probe_drive(d)) continue;
+            d->dev.name[0] = 'h';
+            d->dev.name[1] = 'd';
+            d->dev.name[2] = 'a' + c * 2 + slave;
+            d->dev.ops = &ata_ops;
+            d->dev.priv = d;
+            blk_register(&d->dev, ELV_DEADLINE, 1);
+            found = true;
+        }
+        if (!found) continue;
+        request_irq(isa_irq(ch->isa_irq), c ? "ata1" : "ata0", c ? ata_irq_secondary : ata_irq_primary);
+        inb(ch->io + ATA_STATUS);
+        outb(ch->ctrl, 0);
+    }
+}
+
+static struct ata_drive* ata_drive_of(struct block_device* dev) {
+    return dev->ops == &ata_ops ? dev->priv : 0;
+}
+
+// ==================== AHCI DRIVER ====================
+// SATA disks behind an AHCI HBA. Each port gets as many command slots as
+// the HBA and drive allow; with NCQ every slot can hold a READ/WRITE
+// FPDMA QUEUED at once, otherwise one command is outstanding. Requests
+// that find no free slot wait on the port's pending list. The interrupt
+// handler retires every slot that finished since the last interrupt in
+// one pass and completes them after dropping the port lock. An error
+// masks the port and leaves it to the ahci_eh thread, since stopping
+// the port can take half a second.
+#define AHCI_CAP        0x00
+#define AHCI_GHC        0x04
+#define AHCI_IS         0x08
+#define AHCI_PI         0x0C
+#define AHCI_GHC_IE     0x00000002
+#define AHCI_GHC_AE     0x80000000
+#define AHCI_CAP_SNCQ   0x40000000
+
+#define PORT_CLB        0x00
+#define PORT_CLBU       0x04
+#define PORT_FB         0x08
+#define PORT_FBU        0x0C
+#define PORT_IS         0x10
+#define PORT_IE         0x14
+#define PORT_CMD        0x18
+#define PORT_TFD        0x20
+#define PORT_SIG        0x24
+#define PORT_SSTS       0x28
+#define PORT_SERR       0x30
+#define PORT_SACT       0x34
+#define PORT_CI         0x38
+
+#define PORT_CMD_ST     0x0001
+#define PORT_CMD_FRE    0x0010
+#define PORT_CMD_FR     0x4000
+#define PORT_CMD_CR     0x8000
+#define PORT_IS_ERR     0x78000000      // TFES, HBFS, HBDS, IFS
+#define PORT_IE_ALL     0x7800002F      // D2H, PIO setup, DMA setup, SDB, DPS + errors
+#define SATA_SIG_DISK   0x00000101
+
+#define FIS_H2D             0x27
+#define ATA_CMD_READ_FPDMA  0x60
+#define ATA_CMD_WRITE_FPDMA 0x61
+
+struct ahci_cmd_header {
+    uint32_t flags;                     // FIS length, write, PRD count << 16
+    volatile uint32_t prdbc;
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+};
+
+struct ahci_prd {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;                       // Bytes - 1
+};
+
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRDS];
+};
+
+struct ahci_port {
+    volatile uint32_t* regs;
+    uint32_t number;                    // HBA port, bit in AHCI_IS
+    spinlock_t lock;
+    bool ncq;
+    uint32_t depth;                     // Slots we use
+    uint32_t active;                    // Slots with a command outstanding
+    struct block_request* slot_req[AHCI_SLOTS];
+    uint32_t slot_sectors[AHCI_SLOTS];
+    struct block_request* pending;      // Waiting for a slot
+    struct block_request* pending_tail;
+    struct ahci_cmd_header* cmd_list;
+    struct ahci_cmd_table* tables[AHCI_SLOTS];
+    bool recovering;                    // Masked until ahci_eh restarts it
+    struct block_device dev;
+};
+
+static volatile uint32_t* ahci_hba = 0;
+static struct ahci_port ahci_ports[AHCI_MAX_DISKS];
+static uint32_t ahci_disk_count = 0;
+static volatile uint32_t ahci_eh_pending = 0;   // ahci_ports[] indices to recover
+static struct wait_queue ahci_eh_wait;
+
+static uint32_t ahci_port_read(struct ahci_port* p, uint32_t reg) {
+    return p->regs[reg / 4];
+}
+
+static void ahci_port_write(struct ahci_port* p, uint32_t reg, uint32_t value) {
+    p->regs[reg / 4] = value;
+}
+
+static bool ahci_port_stop(struct ahci_port* p) {
+    ahci_port_write(p, PORT_CMD, ahci_port_read(p, PORT_CMD) & ~(PORT_CMD_ST | PORT_CMD_FRE));
+    for (int t = 0; t < 5000; t++) {
+        if (!(ahci_port_read(p, PORT_CMD) & (PORT_CMD_CR | PORT_CMD_FR))) return true;
+        udelay(100);
+    }
+    return false;
+}
+
+static void ahci_port_start(struct ahci_port* p) {
+    ahci_port_write(p, PORT_SERR, 0xFFFFFFFF);
+    ahci_port_write(p, PORT_IS, 0xFFFFFFFF);
+    ahci_port_write(p, PORT_CMD, ahci_port_read(p, PORT_CMD) | PORT_CMD_FRE);
+    ahci_port_write(p, PORT_CMD, ahci_port_read(p, PORT_CMD) | PORT_CMD_ST);
+}
+
+// Caller holds p->lock (or owns the port during probe). Fill the slot's
+// FIS, PRDs and header for count sectors of req from req->done on and
+// hand it to the HBA. Returns the sectors covered, fewer than count if
+// the request is too fragmented for one table.
+static uint32_t ahci_issue(struct ahci_port* p, uint32_t slot, uint8_t cmd,
+                           struct block_request* req, uint32_t count) {
+    struct ahci_cmd_table* table = p->tables[slot];
+    uint32_t start = req->done * SECTOR_SIZE;
+    uint32_t end = start + count * SECTOR_SIZE;
+    uint32_t off = start;
+    uint32_t n = 0;
+    while (off < end) {
+        uint32_t len;
+        uint32_t phys = blk_phys_at(req, off, &len);
+        if (len > end - off) len = end - off;
+        if (n && table->prdt[n - 1].dba + table->prdt[n - 1].dbc + 1 == phys) {
+            table->prdt[n - 1].dbc += len;
+        } else {
+            if (n == AHCI_PRDS) break;
+            table->prdt[n].dba = phys;
+            table->prdt[n].dbau = 0;
+            table->prdt[n].dbc = len - 1;
+            n++;
+        }
+        off += len;
+    }
+    // Out of PRDs mid-sector: trim back to a sector boundary
+    uint32_t excess = (off - start) % SECTOR_SIZE;
+    table->prdt[n - 1].dbc -= excess;
+    count = (off - excess - start) / SECTOR_SIZE;
+
+    uint32_t lba = req->sector + req->done;
+    bool ncq = cmd == ATA_CMD_READ_FPDMA || cmd == ATA_CMD_WRITE_FPDMA;
+    uint8_t* fis = table->cfis;
+    memset(fis, 0, 20);
+    fis[0] = FIS_H2D;
+    fis[1] = 0x80;                      // Command register update
+    fis[2] = cmd;
+    fis[4] = lba & 0xFF;
+    fis[5] = (lba >> 8) & 0xFF;
+    fis[6] = (lba >> 16) & 0xFF;
+    fis[7] = cmd == ATA_CMD_IDENTIFY ? 0 : 0x40;
+    fis[8] = lba >> 24;
+    if (ncq) {
+        fis[3] = count & 0xFF;          // NCQ carries the count in features
+        fis[11] = (count >> 8) & 0xFF;
+        fis[12] = slot << 3;            // and the tag in count
+    } else {
+        fis[12] = count & 0xFF;
+        fis[13] = (count >> 8) & 0xFF;
+    }
+
+    struct ahci_cmd_header* hdr = &p->cmd_list[slot];
+    hdr->flags = 5 | (req->write ? 0x40 : 0) | (n << 16);
+    hdr->prdbc = 0;
+    if (ncq) ahci_port_write(p, PORT_SACT, 1u << slot);
+    ahci_port_write(p, PORT_CI, 1u << slot);
+    p->dev.stats.kicks++;
+    return count;
+}
+
+// Caller holds p->lock. Start, or continue, req in slot.
+static void ahci_issue_request(struct ahci_port* p, uint32_t slot, struct block_request* req) {
+    uint32_t count = req->count - req->done;
+    if (count > AHCI_MAX_SECTORS) count = AHCI_MAX_SECTORS;
+    uint8_t cmd = p->ncq ? (req->write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA)
+                         : (req->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    p->slot_req[slot] = req;
+    p->active |= 1u << slot;
+    p->slot_sectors[slot] = ahci_issue(p, slot, cmd, req, count);
+}
+
+// Caller holds p->lock. Move pending requests into free slots.
+static void ahci_start_pending(struct ahci_port* p) {
+    if (p->recovering) return;
+    uint32_t slots = p->depth == 32 ? 0xFFFFFFFF : (1u << p->depth) - 1;
+    while (p->pending && (slots & ~p->active)) {
+        struct block_request* req = p->pending;
+        p->pending = req->next;
+        if (!p->pending) p->pending_tail = 0;
+        req->next = 0;
+        ahci_issue_request(p, __builtin_ctz(slots & ~p->active), req);
+    }
+}
+
+static void ahci_submit(struct block_device* dev, struct block_request* req) {
+    struct ahci_port* p = dev->priv;
+    uint32_t flags = spin_lock_irqsave(&p->lock);
+    if (p->pending_tail) p->pending_tail->next = req;
+    else p->pending = req;
+    p->pending_tail = req;
+    ahci_start_pending(p);
+    spin_unlock_irqrestore(&p->lock, flags);
+}
+
+static void ahci_port_interrupt(struct ahci_port* p) {
+    struct block_request* done = 0;
+
+    spin_lock(&p->lock);
+    uint32_t is = ahci_port_read(p, PORT_IS);
+    ahci_port_write(p, PORT_IS, is);
+    p->dev.stats.interrupts++;
+    if (p->recovering) {
+        spin_unlock(&p->lock);
+        return;
+    }
+    if (is & PORT_IS_ERR) {
+        // The slots stay active until ahci_eh has stopped the port
+        p->recovering = true;
+        ahci_port_write(p, PORT_IE, 0);
+        __atomic_fetch_or(&ahci_eh_pending, 1u << (p - ahci_ports), __ATOMIC_SEQ_CST);
+        spin_unlock(&p->lock);
+        wake_up(&ahci_eh_wait);
+        return;
+    }
+    uint32_t finished = p->active & ~(ahci_port_read(p, PORT_SACT) | ahci_port_read(p, PORT_CI));
+    while (finished) {
+        uint32_t slot = __builtin_ctz(finished);
+        finished &= finished - 1;
+        struct block_request* req = p->slot_req[slot];
+        req->done += p->slot_sectors[slot];
+        if (req->done < req->count) {
+            ahci_issue_request(p, slot, req);
+            continue;
+        }
+        p->active &= ~(1u << slot);
+        req->error = false;
+        req->next = done;
+        done = req;
+    }
+    ahci_start_pending(p);
+    spin_unlock(&p->lock);
+
+    while (done) {
+        struct block_request* req = done;
+        done = req->next;
+        blk_complete(req, req->error);
+    }
+}
+
+// Can't tell which tag failed without READ LOG EXT: every command the
+// port had outstanding fails, then it restarts with what is pending
+static void ahci_port_recover(struct ahci_port* p) {
+    ahci_port_stop(p);                  // Nothing is issued while recovering
+    struct block_request* done = 0;
+    uint32_t flags = spin_lock_irqsave(&p->lock);
+    for (uint32_t active = p->active; active; active &= active - 1) {
+        struct block_request* req = p->slot_req[__builtin_ctz(active)];
+        req->error = true;
+        req->next = done;
+        done = req;
+    }
+    p->active = 0;
+    p->recovering = false;
+    ahci_port_start(p);
+    ahci_port_write(p, PORT_IE, PORT_IE_ALL);
+    ahci_start_pending(p);
+    spin_unlock_irqrestore(&p->lock, flags);
+
+    while (done) {
+        struct block_request* req = done;
+        done = req->next;
+        blk_complete(req, true);
+    }
+}
+
+static void ahci_eh_thread(void* arg) {
+    (void)arg;
+    for (;;) {
+        wait_event(ahci_eh_wait, ahci_eh_pending != 0);
+        uint32_t ports = __atomic_exchange_n(&ahci_eh_pending, 0, __ATOMIC_SEQ_CST);
+        for (; ports; ports &= ports - 1) ahci_port_recover(&ahci_ports[__builtin_ctz(ports)]);
+    }
+}
+
+static void ahci_interrupt(void) {
+    uint32_t is = ahci_hba[AHCI_IS / 4];
+    for (uint32_t i = 0; i < ahci_disk_count; i++) {
+        if (is & (1u << ahci_ports[i].number)) ahci_port_interrupt(&ahci_ports[i]);
+    }
+    ahci_hba[AHCI_IS / 4] = is;
+}
+
+static void ahci_poll(struct block_device* dev) {
+    struct ahci_port* p = dev->priv;
+    if (ahci_port_read(p, PORT_IS)) ahci_port_interrupt(p);
+}
+
+static const struct block_ops ahci_ops = {
+    .submit = ahci_submit,
+    .poll = ahci_poll,
+};
+
+// One page for the command list and received-FIS area, one per table.
+// On failure ahci_port_free() takes back whatever was allocated.
+static bool ahci_port_setup(struct ahci_port* p) {
+    if (!ahci_port_stop(p)) return false;
+    uint32_t list = pmm_alloc_page();
+    if (!list) return false;
+    p->cmd_list = (struct ahci_cmd_header*)list;
+    for (uint32_t slot = 0; slot < p->depth; slot++) {
+        uint32_t table = pmm_alloc_page();
+        if (!table) return false;
+        p->tables[slot] = (struct ahci_cmd_table*)table;
+        p->cmd_list[slot].ctba = table;
+    }
+    ahci_port_write(p, PORT_CLB, list);
+    ahci_port_write(p, PORT_CLBU, 0);
+    ahci_port_write(p, PORT_FB, list + 1024);
+    ahci_port_write(p, PORT_FBU, 0);
+    ahci_port_start(p);
+    return true;
+}
+
+// A port that failed its probe. If it won't stop, the HBA may still
+// write to its received-FIS area, so its pages are given up instead.
+static void ahci_port_free(struct ahci_port* p) {
+    bool stopped = ahci_port_stop(p);
+    for (uint32_t slot = 0; slot < AHCI_SLOTS; slot++) {
+        if (stopped && p->tables[slot]) pmm_free_page((uint32_t)p->tables[slot]);
+        p->tables[slot] = 0;
+    }
+    if (stopped && p->cmd_list) pmm_free_page((uint32_t)p->cmd_list);
+    p->cmd_list = 0;
+}
+
+// Polled IDENTIFY through slot 0, before the port interrupts
+static bool ahci_identify(struct ahci_port* p, uint16_t* id) {
+    struct blk_segment seg = { (uint32_t)id, SECTOR_SIZE };
+    struct block_request req = {0};
+    req.segs = &seg;
+    req.nr_segs = 1;
+    req.count = 1;
+    ahci_issue(p, 0, ATA_CMD_IDENTIFY, &req, 1);
+    for (int t = 0; t < 100000; t++) {
+        if (ahci_port_read(p, PORT_TFD) & ATA_SR_ERR) break;
+        if (!(ahci_port_read(p, PORT_CI) & 1)) {
+            ahci_port_write(p, PORT_IS, 0xFFFFFFFF);
+            return true;
+        }
+        udelay(10);
+    }
+    return false;
+}
+
+static void ahci_probe_port(uint32_t number, uint32_t hba_slots, bool hba_ncq) {
+    struct ahci_port* p = &ahci_ports[ahci_disk_count];
+    p->regs = ahci_hba + (0x100 + number * 0x80) / 4;
+    p->number = number;
+    if ((ahci_port_read(p, PORT_SSTS) & 0x0F) != 3) return;     // No link
+    if (ahci_port_read(p, PORT_SIG) != SATA_SIG_DISK) return;
+
+    // Tables for every slot the HBA has; the drive may use fewer
+    p->depth = hba_slots;
+    uint16_t* id = (uint16_t*)pmm_alloc_page();
+    bool ok = id && ahci_port_setup(p) && ahci_identify(p, id);
+    ok = ok && (id[83] & (1 << 10));    // LBA48-only driver
+    if (!ok) {
+        if (id) pmm_free_page((uint32_t)id);
+        ahci_port_free(p);
+        return;
+    }
+    p->dev.sectors = id[102] || id[103] ? 0xFFFFFFFF : id[100] | ((uint32_t)id[101] << 16);
+    ata_copy_string(p->dev.model, &id[27], 20);
+    p->ncq = hba_ncq && (id[76] & (1 << 8));
+    uint32_t queue_depth = (id[75] & 0x1F) + 1;
+    p->depth = !p->ncq ? 1 : queue_depth < hba_slots ? queue_depth : hba_slots;
+    pmm_free_page((uint32_t)id);
+
+    p->dev.name[0] = 's';
+    p->dev.name[1] = 'd';
+    p->dev.name[2] = 'a' + ahci_disk_count;
+    p->dev.ops = &ahci_ops;
+    p->dev.priv = p;
+    ahci_port_write(p, PORT_IE, PORT_IE_ALL);
+    ahci_disk_count++;
+    blk_register(&p->dev, ELV_NOOP, p->depth);
+}
+
+static void ahci_init(void) {
+    struct pci_device* pci = pci_find_class(0x01, 0x06, 0);
+    if (!pci) return;
+    pci_enable(pci, PCI_CMD_MEMORY | PCI_CMD_MASTER);
+    ahci_hba = ioremap(pci_bar(pci, 5) & ~0xF, 0x1100);
+    if (!ahci_hba) return;
+    ahci_hba[AHCI_GHC / 4] |= AHCI_GHC_AE;
+
+    uint32_t cap = ahci_hba[AHCI_CAP / 4];
+    uint32_t slots = ((cap >> 8) & 0x1F) + 1;
+    uint32_t implemented = ahci_hba[AHCI_PI / 4];
+    for (uint32_t port = 0; port < 32 && ahci_disk_count < AHCI_MAX_DISKS; port++) {
+        if (implemented & (1u << port)) ahci_probe_port(port, slots, cap & AHCI_CAP_SNCQ);
+    }
+    if (!ahci_disk_count) return;
+    thread_create("ahci_eh", ahci_eh_thread, 0);
+    request_pci_irq(pci->irq_line, "ahci", ahci_interrupt);
+    ahci_hba[AHCI_IS / 4] = 0xFFFFFFFF;
+    ahci_hba[AHCI_GHC / 4] |= AHCI_GHC_IE;
+}
+
+// ==================== VIRTIO-BLK DRIVER ====================
+// virtio-blk over the modern (1.0) PCI transport with split virtqueues.
+// There is one queue per CPU, up to what the device offers, and a
+// request goes on the queue of the CPU submitting it, so submitters on
+// different CPUs never share a lock. With MSI-X each queue interrupts
+// its own CPU; otherwise everything arrives on the shared INTx line.
+// Every request takes one ring descriptor pointing at an indirect table
+// (header, data segments, status byte), so the ring holds as many
+// requests as it has entries. With VIRTIO_F_EVENT_IDX the driver only
+// notifies when the device has caught up with what it last saw, and
+// asks for an interrupt only once all used entries it knows of are
+// processed.
+#define VIRTIO_VENDOR           0x1AF4
+#define VIRTIO_DEV_BLK          0x1042
+#define VIRTIO_DEV_BLK_LEGACY   0x1001      // Transitional, also has the modern caps
+
+#define VIRTIO_PCI_CAP_COMMON   1
+#define VIRTIO_PCI_CAP_NOTIFY   2
+#define VIRTIO_PCI_CAP_ISR      3
+#define VIRTIO_PCI_CAP_DEVICE   4
+
+#define VIRTIO_STATUS_ACK       0x01
+#define VIRTIO_STATUS_DRIVER    0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+
+#define VIRTIO_BLK_F_SEG_MAX    (1u << 2)
+#define VIRTIO_BLK_F_MQ         (1u << 12)
+#define VIRTIO_F_INDIRECT_DESC  (1u << 28)
+#define VIRTIO_F_EVENT_IDX      (1u << 29)
+#define VIRTIO_F_VERSION_1      (1u << 0)   // Bit 32, in the high word
+
+#define VIRTQ_DESC_F_NEXT       1
+#define VIRTQ_DESC_F_WRITE      2
+#define VIRTQ_DESC_F_INDIRECT   4
+#define VIRTQ_USED_F_NO_NOTIFY  1
+#define VIRTIO_MSI_NO_VECTOR    0xFFFF
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+
+struct virtio_pci_common_cfg {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint32_t queue_desc[2];
+    uint32_t queue_driver[2];
+    uint32_t queue_device[2];
+};
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];                // Then used_event
+};
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[];  // Then avail_event
+};
+
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+// One per ring entry: its indirect table plus the header and status
+// the table points at
+struct virtio_blk_slot {
+    struct virtq_desc table[VIRTIO_BLK_SEGS + 2];
+    struct virtio_blk_outhdr hdr;
+    volatile uint8_t status;
+};
+
+struct virtio_blk;
+
+struct virtio_blk_queue {
+    struct virtio_blk* vb;
+    spinlock_t lock;
+    uint16_t index;
+    uint16_t size;
+    struct virtq_desc* desc;
+    volatile struct virtq_avail* avail;
+    volatile struct virtq_used* used;
+    volatile uint16_t* used_event;      // In the avail ring, after ring[size]
+    volatile uint16_t* avail_event;     // In the used ring, after ring[size]
+    volatile uint16_t* notify;
+    uint16_t avail_idx;                 // Next avail->idx to publish
+    uint16_t last_used;                 // Used entries consumed so far
+    uint16_t free[VIRTIO_QUEUE_SIZE];   // Unused ring entries
+    uint32_t nr_free;
+    struct virtio_blk_slot* slots[VIRTIO_QUEUE_SIZE];
+    struct block_request* slot_req[VIRTIO_QUEUE_SIZE];
+    uint32_t slot_sectors[VIRTIO_QUEUE_SIZE];
+    struct block_request* pending;      // Waiting for a ring entry
+    struct block_request* pending_tail;
+};
+
+struct virtio_blk {
+    volatile struct virtio_pci_common_cfg* common;
+    volatile uint8_t* isr;
+    volatile uint8_t* config;
+    bool event_idx;
+    bool msix;
+    uint32_t seg_max;
+    uint32_t nr_queues;
+    struct virtio_blk_queue queues[VIRTIO_BLK_MAX_QUEUES];
+    struct block_device dev;
+};
+
+static struct virtio_blk virtio_blks[VIRTIO_BLK_MAX_DEVS];
+static uint32_t virtio_blk_count = 0;
+static struct virtio_blk_queue* virtio_blk_vectors[MSI_VECTORS];    // By vector - MSI_VECTOR_BASE
+
+// Did the other side ask to be told once idx passes event?
+static inline bool vring_need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+// Caller holds q->lock. Fill slot's indirect table for req from
+// req->done on and add it to the avail ring (unpublished until kick).
+static void virtio_blk_issue(struct virtio_blk* vb, struct virtio_blk_queue* q,
+                             uint16_t slot, struct block_request* req) {
+    struct virtio_blk_slot* s = q->slots[slot];
+    uint32_t remaining = req->count - req->done;
+    uint32_t start = req->done * SECTOR_SIZE;
+    uint32_t end = start + (remaining < VIRTIO_BLK_MAX_SECTORS ? remaining : VIRTIO_BLK_MAX_SECTORS) * SECTOR_SIZE;
+    uint16_t data_flags = VIRTQ_DESC_F_NEXT | (req->write ? 0 : VIRTQ_DESC_F_WRITE);
+
+    s->hdr.type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    s->hdr.reserved = 0;
+    s->hdr.sector = req->sector + req->done;
+    s->status = 0xFF;
+    s->table[0] = (struct virtq_desc){ (uint32_t)&s->hdr, sizeof(s->hdr), VIRTQ_DESC_F_NEXT, 1 };
+
+    uint32_t n = 1;
+    uint32_t off = start;
+    while (off < end) {
+        uint32_t len;
+        uint32_t phys = blk_phys_at(req, off, &len);
+        if (len > end - off) len = end - off;
+        struct virtq_desc* last = &s->table[n - 1];
+        if (n > 1 && last->addr + last->len == phys) {
+            last->len += len;
+        } else {
+            if (n > vb->seg_max) break;
+            s->table[n] = (struct virtq_desc){ phys, len, data_flags, n + 1 };
+            n++;
+        }
+        off += len;
+    }
+    // Out of segments mid-sector: trim back to a sector boundary
+    uint32_t excess = (off - start) % SECTOR_SIZE;
+    s->table[n - 1].len -= excess;
+    s->table[n] = (struct virtq_desc){ (uint32_t)&s->status, 1, VIRTQ_DESC_F_WRITE, 0 };
+
+    q->desc[slot] = (struct virtq_desc){ (uint32_t)s->table, (n + 1) * sizeof(struct virtq_desc),
+                                         VIRTQ_DESC_F_INDIRECT, 0 };
+    q->slot_req[slot] = req;
+    q->slot_sectors[slot] = (off - excess - start) / SECTOR_SIZE;
+    q->avail->ring[q->avail_idx % q->size] = slot;
+    q->avail_idx++;
+}
+
+// Caller holds q->lock. Publish the avail entries added since old and
+// notify the device unless EVENT_IDX (or NO_NOTIFY) says it is still
+// going to look.
+static void virtio_blk_kick(struct virtio_blk* vb, struct virtio_blk_queue* q, uint16_t old) {
+    if (q->avail_idx == old) return;
+    asm volatile ("" ::: "memory");     // Entries before the index (x86 keeps store order)
+    q->avail->idx = q->avail_idx;
+    __sync_synchronize();               // Index visible before reading the event
+    bool notify = vb->event_idx ? vring_need_event(*q->avail_event, q->avail_idx, old)
+                                : !(q->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    if (notify) {
+        *q->notify = q->index;
+        __atomic_add_fetch(&vb->dev.stats.kicks, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Caller holds q->lock. Move pending requests into free ring entries.
+static void virtio_blk_start_pending(struct virtio_blk* vb, struct virtio_blk_queue* q) {
+    while (q->pending && q->nr_free) {
+        struct block_request* req = q->pending;
+        q->pending = req->next;
+        if (!q->pending) q->pending_tail = 0;
+        req->next = 0;
+        virtio_blk_issue(vb, q, q->free[--q->nr_free], req);
+    }
+}
+
+static void virtio_blk_submit(struct block_device* dev, struct block_request* req) {
+    struct virtio_blk* vb = dev->priv;
+    struct virtio_blk_queue* q = &vb->queues[percpu_read(index) % vb->nr_queues];
+    uint32_t flags = spin_lock_irqsave(&q->lock);
+    uint16_t old = q->avail_idx;
+    if (q->pending_tail) q->pending_tail->next = req;
+    else q->pending = req;
+    q->pending_tail = req;
+    virtio_blk_start_pending(vb, q);
+    virtio_blk_kick(vb, q, old);
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+// Retire everything on q's used ring, then complete outside the lock
+static void virtio_blk_process(struct virtio_blk* vb, struct virtio_blk_queue* q) {
+    struct block_request* done = 0;
+
+    spin_lock(&q->lock);
+    uint16_t old = q->avail_idx;
+    for (;;) {
+        while (q->last_used != q->used->idx) {
+            asm volatile ("" ::: "memory");
+            uint16_t slot = q->used->ring[q->last_used % q->size].id;
+            q->last_used++;
+            struct block_request* req = q->slot_req[slot];
+            bool error = q->slots[slot]->status != 0;
+            req->done += q->slot_sectors[slot];
+            if (!error && req->done < req->count) {
+                virtio_blk_issue(vb, q, slot, req);
+                continue;
+            }
+            q->free[q->nr_free++] = slot;
+            req->error = error;
+            req->next = done;
+            done = req;
+        }
+        if (!vb->event_idx) break;
+        // Interrupt again only for entries after these; recheck so one
+        // that raced in before the store isn't left without an interrupt
+        *q->used_event = q->last_used;
+        __sync_synchronize();
+        if (q->used->idx == q->last_used) break;
+    }
+    virtio_blk_start_pending(vb, q);
+    virtio_blk_kick(vb, q, old);
+    spin_unlock(&q->lock);
+
+    while (done) {
+        struct block_request* req = done;
+        done = req->next;
+        blk_complete(req, req->error);
+    }
+}
+
+static void virtio_blk_poll(struct virtio_blk* vb) {
+    bool work = false;
+    for (uint32_t i = 0; i < vb->nr_queues; i++) {
+        struct virtio_blk_queue* q = &vb->queues[(percpu_read(index) + i) % vb->nr_queues];
+        if (q->last_used == q->used->idx) continue;
+        virtio_blk_process(vb, q);
+        work = true;
+    }
+    if (work) __atomic_add_fetch(&vb->dev.stats.interrupts, 1, __ATOMIC_RELAXED);
+}
+
+// Shared INTx line: reading the ISR acknowledges it
+static void virtio_blk_interrupt(void) {
+    for (uint32_t i = 0; i < virtio_blk_count; i++) {
+        if (!virtio_blks[i].msix && (*virtio_blks[i].isr & 1)) virtio_blk_poll(&virtio_blks[i]);
+    }
+}
+
+// MSI-X: one vector per queue, aimed at that queue's CPU, and each
+// vector services only its own queue
+static void virtio_blk_msix_interrupt(void) {
+    struct virtio_blk_queue* q = virtio_blk_vectors[percpu_read(vector) - MSI_VECTOR_BASE];
+    if (q && q->last_used != q->used->idx) {
+        virtio_blk_process(q->vb, q);
+        __atomic_add_fetch(&q->vb->dev.stats.interrupts, 1, __ATOMIC_RELAXED);
+    }
+    lapic_eoi();
+}
+
+static void virtio_blk_dev_poll(struct block_device* dev) {
+    virtio_blk_poll(dev->priv);
+}
+
+static const struct block_ops virtio_blk_ops = {
+    .submit = virtio_blk_submit,
+    .poll = virtio_blk_dev_poll,
+};
+
+// Ring in one page: descriptors, then avail at 1KB, used at 2KB.
+// Indirect tables are packed several to a page.
+static bool virtio_blk_setup_queue(struct virtio_blk* vb, struct virtio_blk_queue* q,
+                                   volatile uint8_t* notify_base, uint32_t notify_mult, uint32_t vector) {
+    volatile struct virtio_pci_common_cfg* c = vb->common;
+    c->queue_select = q->index;
+    uint32_t size = c->queue_size;
+    if (!size) return false;
+    if (size > VIRTIO_QUEUE_SIZE) size = VIRTIO_QUEUE_SIZE;
+    c->queue_size = size;
+
+    uint32_t ring = pmm_alloc_page();
+    if (!ring) return false;
+    q->size = size;
+    q->desc = (struct virtq_desc*)ring;
+    q->avail = (struct virtq_avail*)(ring + 1024);
+    q->used = (struct virtq_used*)(ring + 2048);
+    q->used_event = &q->avail->ring[size];
+    q->avail_event = (volatile uint16_t*)&q->used->ring[size];
+
+    uint32_t per_page = PAGE_SIZE / sizeof(struct virtio_blk_slot);
+    uint32_t page = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        if (i % per_page == 0 && !(page = pmm_alloc_page())) return false;
+        q->slots[i] = (struct virtio_blk_slot*)page + i % per_page;
+        q->free[q->nr_free++] = size - 1 - i;
+    }
+
+    c->queue_desc[0] = (uint32_t)q->desc;
+    c->queue_desc[1] = 0;
+    c->queue_driver[0] = (uint32_t)q->avail;
+    c->queue_driver[1] = 0;
+    c->queue_device[0] = (uint32_t)q->used;
+    c->queue_device[1] = 0;
+    if (vb->msix) {
+        c->queue_msix_vector = vector;
+        if (c->queue_msix_vector != vector) return false;
+    }
+    q->notify = (volatile uint16_t*)(notify_base + c->queue_notify_off * notify_mult);
+    c->queue_enable = 1;
+    return true;
+}
+
+static void virtio_blk_probe(struct pci_device* pci) {
+    struct virtio_blk* vb = &virtio_blks[virtio_blk_count];
+    memset(vb, 0, sizeof(*vb));
+    volatile uint8_t* notify_base = 0;
+    uint32_t notify_mult = 0;
+    pci_enable(pci, PCI_CMD_MEMORY | PCI_CMD_MASTER);
+    for (uint8_t cap = pci_find_capability(pci, PCI_CAP_VENDOR, 0); cap;
+         cap = pci_find_capability(pci, PCI_CAP_VENDOR, cap)) {
+        uint32_t type = pci_read(pci, cap) >> 24;
+        uint32_t base = pci_mem_bar(pci, pci_read(pci, cap + 4) & 0xFF);
+        uint32_t offset = pci_read(pci, cap + 8);
+        uint32_t length = pci_read(pci, cap + 12);
+        if (!base) continue;
+        if (type == VIRTIO_PCI_CAP_COMMON && !vb->common) vb->common = ioremap(base + offset, length);
+        else if (type == VIRTIO_PCI_CAP_ISR && !vb->isr) vb->isr = ioremap(base + offset, length);
+        else if (type == VIRTIO_PCI_CAP_DEVICE && !vb->config) vb->config = ioremap(base + offset, length);
+        else if (type == VIRTIO_PCI_CAP_NOTIFY && !notify_base) {
+            notify_base = ioremap(base + offset, length);
+            notify_mult = pci_read(pci, cap + 16);
+        }
+    }
+    volatile struct virtio_pci_common_cfg* c = vb->common;
+    if (!c || !vb->isr || !vb->config || !notify_base) return;
+
+    c->device_status = 0;
+    while (c->device_status) cpu_relax();
+    c->device_status = VIRTIO_STATUS_ACK;
+    c->device_status |= VIRTIO_STATUS_DRIVER;
+
+    // Indirect descriptors are required; everything else is optional
+    c->device_feature_select = 0;
+    uint32_t features = c->device_feature;
+    c->device_feature_select = 1;
+    if (!(c->device_feature & VIRTIO_F_VERSION_1) || !(features & VIRTIO_F_INDIRECT_DESC)) return;
+    features &= VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX | VIRTIO_BLK_F_MQ | VIRTIO_BLK_F_SEG_MAX;
+    c->driver_feature_select = 0;
+    c->driver_feature = features;
+    c->driver_feature_select = 1;
+    c->driver_feature = VIRTIO_F_VERSION_1;
+    c->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(c->device_status & VIRTIO_STATUS_FEATURES_OK)) return;
+
+    volatile uint32_t* cfg32 = (volatile uint32_t*)vb->config;
+    vb->dev.sectors = cfg32[1] ? 0xFFFFFFFF : cfg32[0];
+    vb->event_idx = features & VIRTIO_F_EVENT_IDX;
+    vb->seg_max = VIRTIO_BLK_SEGS;
+    if ((features & VIRTIO_BLK_F_SEG_MAX) && cfg32[3] && cfg32[3] < vb->seg_max) vb->seg_max = cfg32[3];
+    uint32_t queues = (features & VIRTIO_BLK_F_MQ) ? *(volatile uint16_t*)(vb->config + 34) : 1;
+    if (queues > cpu_count) queues = cpu_count;
+    if (queues > VIRTIO_BLK_MAX_QUEUES) queues = VIRTIO_BLK_MAX_QUEUES;
+    if (!queues) queues = 1;
+
+    // One MSI-X vector per queue if the table and vector pool allow it
+    uint32_t entries = 0;
+    uint32_t vector = 0;
+    volatile uint32_t* msix = pci_msix_enable(pci, &entries);
+    if (msix) {
+        if (queues > entries) queues = entries;
+        vector = msi_alloc_vectors(queues, virtio_blk_msix_interrupt);
+        vb->msix = vector != 0;
+        c->msix_config = VIRTIO_MSI_NO_VECTOR;
+    }
+    if (msix && !vb->msix) return;
+
+    vb->nr_queues = queues;
+    for (uint32_t i = 0; i < queues; i++) {
+        struct virtio_blk_queue* q = &vb->queues[i];
+        q->vb = vb;
+        q->index = i;
+        if (!virtio_blk_setup_queue(vb, q, notify_base, notify_mult, i)) return;
+        if (!vb->msix) continue;
+        virtio_blk_vectors[vector + i - MSI_VECTOR_BASE] = q;
+        pci_msix_set(msix, i, vector + i, cpus[i].online ? i : 0);
+    }
+
+    vb->dev.name[0] = 'v';
+    vb->dev.name[1] = 'd';
+    vb->dev.name[2] = 'a' + virtio_blk_count;
+    strcpy(vb->dev.model, vb->msix ? "virtio-blk (MSI-X)" : "virtio-blk");
+    vb->dev.ops = &virtio_blk_ops;
+    vb->dev.priv = vb;
+    virtio_blk_count++;
+    if (!vb->msix) request_pci_irq(pci->irq_line, "virtio", virtio_blk_interrupt);
+    c->device_status |= VIRTIO_STATUS_DRIVER_OK;
+    blk_register(&vb->dev, ELV_NOOP, vb->nr_queues * VIRTIO_QUEUE_SIZE);
+}
+
+static void virtio_blk_init(void) {
+    for (uint32_t i = 0; i < pci_device_count && virtio_blk_count < VIRTIO_BLK_MAX_DEVS; i++) {
+        struct pci_device* pci = &pci_devices[i];
+        if (pci->vendor == VIRTIO_VENDOR &&
+            (pci->device == VIRTIO_DEV_BLK || pci->device == VIRTIO_DEV_BLK_LEGACY)) {
+            virtio_blk_probe(pci);
+        }
+    }
+}
+
+// ==================== FLOPPY DRIVER ====================
+// 82077AA (or plain 765-compatible) controller at 0x3F0 on IRQ6; drive 0
+// becomes fd0 when the CMOS says it is a 1.44MB 3.5" drive. Data moves
+// by ISA DMA on channel 2 through one buffer in the kernel image, which
+// the 8237's 24-bit addresses can reach. Seeks and transfers take
+// milliseconds and the motor needs FDC_SPINUP_MS to come up to speed,
+// so the "floppy" thread runs requests one at a time and sleeps on the
+// interrupt rather than the handler driving a state machine.
+//
+// Reads always fetch a whole cylinder, both heads in one multi-track
+// READ DATA, into a small LRU track cache; any later read on that
+// cylinder is a memory copy. Writes go through to the disk and update
+// the cached copy. The motor stays on until the drive has been idle for
+// FDC_MOTOR_OFF_MS, so a burst of commands pays for one spin-up.
+#define FDC_DOR       0x3F2
+#define FDC_MSR       0x3F4             // Read: main status
+#define FDC_FIFO      0x3F5
+#define FDC_CCR       0x3F7             // Write: data rate
+
+#define FDC_DOR_RESET  0x04             // Clear = controller held in reset
+#define FDC_DOR_DMA    0x08             // IRQ and DMA enabled
+#define FDC_DOR_MOTOR0 0x10
+#define FDC_MSR_DIO    0x40             // FIFO has a byte for the CPU
+#define FDC_MSR_RQM    0x80             // FIFO ready
+#define FDC_ST0_SE     0x20             // Seek end
+
+#define FDC_CMD_SPECIFY     0x03
+#define FDC_CMD_WRITE       0x05
+#define FDC_CMD_READ        0x06
+#define FDC_CMD_RECALIBRATE 0x07
+#define FDC_CMD_SENSE_INT   0x08
+#define FDC_CMD_SEEK        0x0F
+#define FDC_CMD_VERSION     0x10
+#define FDC_CMD_CONFIGURE   0x13
+#define FDC_CMD_MFM         0x40
+#define FDC_CMD_MT          0x80        // Multi-track: head 0 runs on into head 1
+
+#define FDC_CYLINDERS   80
+#define FDC_SPT         18              // Sectors per track
+#define FDC_CYL_SECTORS (2 * FDC_SPT)
+#define FDC_CYL_BYTES   (FDC_CYL_SECTORS * SECTOR_SIZE)
+#define FDC_CYL_PAGES   ((FDC_CYL_BYTES + PAGE_SIZE - 1) / PAGE_SIZE)
+
+// 8237 DMA controller, channel 2
+#define DMA_MASK        0x0A
+#define DMA_MODE        0x0B
+#define DMA_FLIPFLOP    0x0C
+#define DMA2_ADDR       0x04
+#define DMA2_COUNT      0x05
+#define DMA2_PAGE       0x81
+#define DMA_MODE_TO_MEM   0x46          // Single transfer, device to memory, channel 2
+#define DMA_MODE_FROM_MEM 0x4A          // Single transfer, memory to device, channel 2
+
+struct fdc_track {
+    uint32_t cyl;                       // FDC_CYLINDERS = empty
+    uint32_t last_use;                  // fdc.clock when last looked up, 0 = empty
+    uint8_t* data;                      // FDC_CYL_BYTES: head 0, then head 1
+};
+
+struct fdc_cyl_stats {
+    uint32_t reads;                     // Times the cylinder came from the disk
+    uint32_t seek_us;                   // For the last of them; 0 = no seek needed
+    uint32_t read_us;
+};
+
+struct fdc_stats {
+    uint32_t hits;                      // Cylinder lookups served by the track cache
+    uint32_t misses;
+    uint32_t spinups;
+    uint32_t motor_offs;
+    uint32_t seeks;
+    uint64_t seek_us;
+    uint32_t seek_max;
+    uint32_t track_reads;
+    uint64_t read_us;
+    uint32_t read_max;
+    uint32_t writes;                    // WRITE DATA commands
+    uint32_t retries;
+    uint32_t resets;
+};
+
+struct fdc_controller {
+    spinlock_t lock;
+    bool present;
+    bool enhanced;                      // 82077AA: has CONFIGURE and a FIFO
+    struct block_request* head;         // Queued; the head one is being run
+    struct block_request* tail;
+    struct wait_queue wait;             // The thread, for requests
+    struct wait_queue irq_wait;         // The thread, for IRQ6
+    volatile bool irq;
+    volatile bool waiting;              // irq_wait has a timeout for the tick to check
+    volatile bool busy;                 // Running a request: the motor must stay on
+    volatile bool motor;
+    uint32_t idle_since;                // jiffies when the last request ended
+    int32_t cur_cyl;                    // Under the head, -1 = unknown
+    uint32_t clock;                     // Track cache LRU
+    struct fdc_track tracks[FDC_TRACK_CACHE];
+    struct fdc_cyl_stats cyls[FDC_CYLINDERS];
+    struct fdc_stats stats;
+    struct block_device dev;
+};
+
+static struct fdc_controller fdc;
+
+// Identity-mapped and below 1MB like the rest of the kernel; the
+// alignment keeps a whole cylinder inside one 64KB DMA page
+static uint8_t fdc_dma_buf[FDC_CYL_BYTES] __attribute__((aligned(32768)));
+
+static bool fdc_out(uint8_t byte) {
+    for (uint32_t t = 0; t < 100000; t += 10) {
+        if ((inb(FDC_MSR) & (FDC_MSR_RQM | FDC_MSR_DIO)) == FDC_MSR_RQM) {
+            outb(FDC_FIFO, byte);
+            return true;
+        }
+        udelay(10);
+    }
+    return false;
+}
+
+// A result byte, -1 on timeout
+static int fdc_in(void) {
+    for (uint32_t t = 0; t < 100000; t += 10) {
+        if ((inb(FDC_MSR) & (FDC_MSR_RQM | FDC_MSR_DIO)) == (FDC_MSR_RQM | FDC_MSR_DIO)) {
+            return inb(FDC_FIFO);
+        }
+        udelay(10);
+    }
+    return -1;
+}
+
+static bool fdc_command(const uint8_t* cmd, uint32_t len) {
+    fdc.irq = false;
+    for (uint32_t i = 0; i < len; i++) {
+        if (!fdc_out(cmd[i])) return false;
+    }
+    return true;
+}
+
+static bool fdc_results(uint8_t* res, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        int b = fdc_in();
+        if (b < 0) return false;
+        res[i] = b;
+    }
+    return true;
+}
+
+// Sleep until IRQ6 or for ms; the CPU 0 tick wakes us to check the time
+static bool fdc_wait_irq(uint32_t ms) {
+    uint32_t until = jiffies + (ms * TIMER_HZ + 999) / 1000;
+    fdc.waiting = true;
+    wait_event(fdc.irq_wait, fdc.irq || (int32_t)(jiffies - until) >= 0);
+    fdc.waiting = false;
+    return fdc.irq;
+}
+
+// After a seek, recalibrate or reset. With nothing pending the
+// controller answers a single 0x80, which is not an interrupt status.
+static bool fdc_sense(uint8_t* st0, uint8_t* cyl) {
+    if (!fdc_out(FDC_CMD_SENSE_INT)) return false;
+    int b = fdc_in();
+    if (b < 0 || b == 0x80) return false;
+    *st0 = b;
+    b = fdc_in();
+    *cyl = b;
+    return b >= 0;
+}
+
+static bool fdc_configure(void) {
+    // FIFO on with a threshold of 8, drive polling off, no implied seeks:
+    // seek times are measured separately
+    static const uint8_t configure[4] = { FDC_CMD_CONFIGURE, 0, 0x17, 0 };
+    static const uint8_t specify[3] = { FDC_CMD_SPECIFY, 0xDF, 0x02 };  // 3ms step, 240ms unload; 2ms load, DMA
+    outb(FDC_CCR, 0);                                                   // 500Kbps
+    if (fdc.enhanced && !fdc_command(configure, sizeof(configure))) return false;
+    return fdc_command(specify, sizeof(specify));
+}
+
+// Also the way out of a command that never finished. The head position
+// is lost, so the next seek recalibrates first.
+static bool fdc_reset(void) {
+    uint8_t st0, cyl;
+    fdc.stats.resets++;
+    fdc.irq = false;
+    outb(FDC_DOR, 0);
+    udelay(20);
+    outb(FDC_DOR, FDC_DOR_RESET | FDC_DOR_DMA | (fdc.motor ? FDC_DOR_MOTOR0 : 0));
+    if (!fdc_wait_irq(1000)) return false;
+    for (uint32_t drive = 0; drive < 4; drive++) fdc_sense(&st0, &cyl);
+    fdc.cur_cyl = -1;
+    return fdc_configure();
+}
+
+static uint32_t fdc_elapsed_us(uint64_t start) {
+    return (uint32_t)div64_32(rdtsc() - start, tsc_per_us);
+}
+
+// Put the head on cyl. *us is the time it took, 0 if it was already there.
+static bool fdc_seek(uint32_t cyl, uint32_t* us) {
+    uint8_t st0, pcn;
+    *us = 0;
+    if (fdc.cur_cyl == (int32_t)cyl) return true;
+    uint64_t start = rdtsc();
+    if (fdc.cur_cyl < 0) {
+        // Recalibrate steps at most 77 times, so an 80-cylinder drive
+        // may need a second one to reach track 0
+        static const uint8_t recalibrate[2] = { FDC_CMD_RECALIBRATE, 0 };
+        for (uint32_t i = 0; i < 2 && fdc.cur_cyl < 0; i++) {
+            if (!fdc_command(recalibrate, sizeof(recalibrate)) || !fdc_wait_irq(3000) ||
+                !fdc_sense(&st0, &pcn)) return false;
+            if ((st0 & FDC_ST0_SE) && pcn == 0) fdc.cur_cyl = 0;
+        }
+        if (fdc.cur_cyl < 0) return false;
+    }
+    if (fdc.cur_cyl != (int32_t)cyl) {
+        uint8_t seek[3] = { FDC_CMD_SEEK, 0, cyl };
+        if (!fdc_command(seek, sizeof(seek)) || !fdc_wait_irq(3000) || !fdc_sense(&st0, &pcn) ||
+            !(st0 & FDC_ST0_SE) || pcn != cyl) {
+            fdc.cur_cyl = -1;
+            return false;
+        }
+        fdc.cur_cyl = cyl;
+    }
+    *us = fdc_elapsed_us(start);
+    fdc.stats.seeks++;
+    fdc.stats.seek_us += *us;
+    if (*us > fdc.stats.seek_max) fdc.stats.seek_max = *us;
+    return true;
+}
+
+static void fdc_dma_setup(uint32_t len, bool write) {
+    uint32_t phys = virt_to_phys(fdc_dma_buf);
+    outb(DMA_MASK, 0x04 | 2);                   // Mask channel 2
+    outb(DMA_FLIPFLOP, 0xFF);
+    outb(DMA2_ADDR, phys & 0xFF);
+    outb(DMA2_ADDR, (phys >> 8) & 0xFF);
+    outb(DMA2_PAGE, phys >> 16);
+    outb(DMA_FLIPFLOP, 0xFF);
+    outb(DMA2_COUNT, (len - 1) & 0xFF);
+    outb(DMA2_COUNT, (len - 1) >> 8);
+    outb(DMA_MODE, write ? DMA_MODE_FROM_MEM : DMA_MODE_TO_MEM);
+    outb(DMA_MASK, 2);                          // Unmask
+}
+
+// Caller holds fdc.busy, so the tick leaves the motor alone
+static void fdc_motor_on(void) {
+    if (fdc.motor) return;
+    outb(FDC_DOR, FDC_DOR_RESET | FDC_DOR_DMA | FDC_DOR_MOTOR0);
+    fdc.motor = true;
+    fdc.stats.spinups++;
+    msleep(FDC_SPINUP_MS);
+}
+
+// count sectors from sector first of cylinder cyl (18 and up are head 1)
+// through fdc_dma_buf, in one command: the DMA count ends it
+static bool fdc_transfer(uint32_t cyl, uint32_t first, uint32_t count, bool write,
+                         uint32_t* seek_us, uint32_t* xfer_us) {
+    fdc_motor_on();
+    for (uint32_t attempt = 0; attempt < FDC_RETRIES; attempt++) {
+        if (attempt) fdc.stats.retries++;
+        if (!fdc_seek(cyl, seek_us)) {
+            fdc_reset();
+            continue;
+        }
+        uint32_t head = first / FDC_SPT;
+        uint8_t cmd[9] = {
+            (write ? FDC_CMD_WRITE : FDC_CMD_READ) | FDC_CMD_MT | FDC_CMD_MFM,
+            head << 2, cyl, head, first % FDC_SPT + 1,
+            2,                                  // 512-byte sectors
+            FDC_SPT,                            // Last sector of a track
+            0x1B,                               // Gap length for 1.44MB
+            0xFF,
+        };
+        uint8_t res[7];
+        fdc_dma_setup(count * SECTOR_SIZE, write);
+        uint64_t start = rdtsc();
+        if (!fdc_command(cmd, sizeof(cmd)) || !fdc_wait_irq(2000) || !fdc_results(res, sizeof(res))) {
+            fdc_reset();
+            continue;
+        }
+        *xfer_us = fdc_elapsed_us(start);
+        if (!(res[0] & 0xC0)) return true;
+        if (res[1] & 0x02) return false;        // Write protected: retrying won't help
+        fdc.cur_cyl = -1;                       // Recalibrate for the retry
+    }
+    return false;
+}
+
+static struct fdc_track* fdc_track_find(uint32_t cyl) {
+    for (uint32_t i = 0; i < FDC_TRACK_CACHE; i++) {
+        if (fdc.tracks[i].cyl == cyl) return &fdc.tracks[i];
+    }
+    return 0;
+}
+
+static void fdc_track_drop(struct fdc_track* t) {
+    t->cyl = FDC_CYLINDERS;
+    t->last_use = 0;
+}
+
+// Cylinder cyl from the track cache, read in (both heads) on a miss
+static struct fdc_track* fdc_track_get(uint32_t cyl) {
+    struct fdc_track* t = fdc_track_find(cyl);
+    if (t) {
+        fdc.stats.hits++;
+        t->last_use = ++fdc.clock;
+        return t;
+    }
+    fdc.stats.misses++;
+    t = &fdc.tracks[0];
+    for (uint32_t i = 1; i < FDC_TRACK_CACHE; i++) {
+        if (fdc.tracks[i].last_use < t->last_use) t = &fdc.tracks[i];
+    }
+    fdc_track_drop(t);
+
+    uint32_t seek_us = 0, read_us = 0;
+    if (!fdc_transfer(cyl, 0, FDC_CYL_SECTORS, false, &seek_us, &read_us)) return 0;
+    memcpy(t->data, fdc_dma_buf, FDC_CYL_BYTES);
+    t->cyl = cyl;
+    t->last_use = ++fdc.clock;
+
+    struct fdc_cyl_stats* cs = &fdc.cyls[cyl];
+    cs->reads++;
+    cs->seek_us = seek_us;
+    cs->read_us = read_us;
+    fdc.stats.track_reads++;
+    fdc.stats.read_us += read_us;
+    if (read_us > fdc.stats.read_max) fdc.stats.read_max = read_us;
+    return t;
+}
+
+// Write through, then bring a cached copy of the cylinder up to date
+static bool fdc_write(struct block_request* req, uint32_t off, uint32_t cyl, uint32_t first, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(fdc_dma_buf + i * SECTOR_SIZE, blk_data_at(req, off + i * SECTOR_SIZE), SECTOR_SIZE);
+    }
+    struct fdc_track* t = fdc_track_find(cyl);
+    uint32_t seek_us, write_us;
+    fdc.stats.writes++;
+    if (!fdc_transfer(cyl, first, count, true, &seek_us, &write_us)) {
+        if (t) fdc_track_drop(t);               // The disk may hold part of it
+        return false;
+    }
+    if (t) memcpy(t->data + first * SECTOR_SIZE, fdc_dma_buf, count * SECTOR_SIZE);
+    return true;
+}
+
+static bool fdc_run(struct block_request* req) {
+    while (req->done < req->count) {
+        uint32_t lba = req->sector + req->done;
+        uint32_t cyl = lba / FDC_CYL_SECTORS;
+        uint32_t first = lba % FDC_CYL_SECTORS;
+        uint32_t count = FDC_CYL_SECTORS - first;
+        if (count > req->count - req->done) count = req->count - req->done;
+        if (cyl >= FDC_CYLINDERS) return false;
+        uint32_t off = req->done * SECTOR_SIZE;
+        if (req->write) {
+            if (!fdc_write(req, off, cyl, first, count)) return false;
+        } else {
+            struct fdc_track* t = fdc_track_get(cyl);
+            if (!t) return false;
+            for (uint32_t i = 0; i < count; i++) {
+                memcpy(blk_data_at(req, off + i * SECTOR_SIZE), t->data + (first + i) * SECTOR_SIZE, SECTOR_SIZE);
+            }
+        }
+        req->done += count;
+    }
+    return true;
+}
+
+static void fdc_thread(void* arg) {
+    (void)arg;
+    for (;;) {
+        wait_event(fdc.wait, fdc.head != 0);
+        uint32_t flags = spin_lock_irqsave(&fdc.lock);
+        struct block_request* req = fdc.head;
+        fdc.busy = true;
+        spin_unlock_irqrestore(&fdc.lock, flags);
+
+        req->done = 0;
+        bool ok = fdc_run(req);
+
+        flags = spin_lock_irqsave(&fdc.lock);
+        fdc.head = req->next;
+        if (!fdc.head) fdc.tail = 0;
+        fdc.busy = false;
+        fdc.idle_since = jiffies;
+        spin_unlock_irqrestore(&fdc.lock, flags);
+        blk_complete(req, !ok);
+    }
+}
+
+static void fdc_submit(struct block_device* dev, struct block_request* req) {
+    (void)dev;
+    req->next = 0;
+    uint32_t flags = spin_lock_irqsave(&fdc.lock);
+    if (fdc.tail) fdc.tail->next = req;
+    else fdc.head = req;
+    fdc.tail = req;
+    spin_unlock_irqrestore(&fdc.lock, flags);
+    wake_up(&fdc.wait);
+}
+
+static const struct block_ops fdc_ops = {
+    .submit = fdc_submit,
+};
+
+static void fdc_interrupt(void) {
+    fdc.dev.stats.interrupts++;
+    fdc.irq = true;
+    wake_up(&fdc.irq_wait);
+}
+
+// CPU 0 tick: time out fdc_wait_irq() and switch the motor off once the
+// drive has been idle for FDC_MOTOR_OFF_MS
+static void fdc_timer(void) {
+    if (fdc.waiting) wake_up(&fdc.irq_wait);
+    if (!fdc.motor || fdc.busy) return;
+    spin_lock(&fdc.lock);
+    if (fdc.motor && !fdc.busy && jiffies - fdc.idle_since >= FDC_MOTOR_OFF_MS * TIMER_HZ / 1000) {
+        outb(FDC_DOR, FDC_DOR_RESET | FDC_DOR_DMA);
+        fdc.motor = false;
+        fdc.stats.motor_offs++;
+    }
+    spin_unlock(&fdc.lock);
+}
+
+// Runs after the filesystem scans, which have nothing to find on a
+// floppy and would only pay for a spin-up at boot
+static void floppy_init(void) {
+    if (cmos_read(0x10) >> 4 != 4) return;      // Drive 0 isn't 1.44MB
+    if (inb(FDC_MSR) == 0xFF) return;           // No controller
+    for (uint32_t i = 0; i < FDC_TRACK_CACHE; i++) {
+        if (!(fdc.tracks[i].data = vmalloc(FDC_CYL_PAGES))) return;
+        fdc_track_drop(&fdc.tracks[i]);
+    }
+    fdc.cur_cyl = -1;
+    request_irq(isa_irq(6), "floppy", fdc_interrupt);
+    if (!fdc_reset()) return;
+    int version = -1;
+    if (fdc_out(FDC_CMD_VERSION)) version = fdc_in();
+    fdc.enhanced = version == 0x90;
+    if (fdc.enhanced && !fdc_configure()) return;
+
+    strcpy(fdc.dev.name, "fd0");
+    strcpy(fdc.dev.model, fdc.enhanced ? "82077AA floppy, 1.44MB" : "765 floppy, 1.44MB");
+    fdc.dev.sectors = FDC_CYLINDERS * FDC_CYL_SECTORS;
+    fdc.dev.ops = &fdc_ops;
+    fdc.dev.priv = &fdc;
+    if (!thread_create("floppy", fdc_thread, 0)) return;
+    fdc.present = true;
+    blk_register(&fdc.dev, ELV_DEADLINE, 1);
+}
+
+static void fdc_put_avg(const char* what, uint32_t n, uint64_t sum, uint32_t max) {
+    vga_puts(what);
+    vga_put_dec(n);
+    vga_puts(" avg ");
+    vga_put_dec(n ? (uint32_t)div64_32(sum, n) : 0);
+    vga_puts(" max ");
+    vga_put_dec(max);
+    vga_puts("us");
+}
+
+static void show_floppy(void) {
+    if (!fdc.present) {
+        vga_puts("\nNo floppy drive");
+        return;
+    }
+    struct fdc_stats* st = &fdc.stats;
+    vga_puts("\nfd0  ");
+    vga_puts(fdc.dev.model);
+    vga_puts(", motor ");
+    vga_puts(fdc.motor ? "on" : "off");
+    vga_puts(", head ");
+    if (fdc.cur_cyl < 0) vga_puts("not calibrated");
+    else {
+        vga_puts("on cylinder ");
+        vga_put_dec(fdc.cur_cyl);
+    }
+    vga_puts("\n     track cache ");
+    vga_put_dec(FDC_TRACK_CACHE);
+    vga_puts(" x 18KB: ");
+    vga_put_dec(st->hits);
+    vga_puts(" hits, ");
+    vga_put_dec(st->misses);
+    vga_puts(" misses; ");
+    vga_put_dec(st->writes);
+    vga_puts(" writes");
+    vga_puts("\n     spin-ups ");
+    vga_put_dec(st->spinups);
+    vga_puts(", motor-offs ");
+    vga_put_dec(st->motor_offs);
+    vga_puts(" (after ");
+    vga_put_dec(FDC_MOTOR_OFF_MS);
+    vga_puts("ms idle), retries ");
+    vga_put_dec(st->retries);
+    vga_puts(", resets ");
+    vga_put_dec(st->resets);
+    fdc_put_avg("\n     seeks ", st->seeks, st->seek_us, st->seek_max);
+    fdc_put_avg("; cylinder reads ", st->track_reads, st->read_us, st->read_max);
+
+    // Last seek and read time of every cylinder read so far
+    uint32_t shown = 0;
+    for (uint32_t c = 0; c < FDC_CYLINDERS; c++) {
+        struct fdc_cyl_stats* cs = &fdc.cyls[c];
+        if (!cs->reads) continue;
+        if (!shown) vga_puts("\n     cyl  seek/read us (last)");
+        vga_puts(shown++ % 4 ? "  " : "\n     ");
+        vga_put_dec_width(c, 2);
+        vga_puts(": ");
+        vga_put_dec_width(cs->seek_us, 6);
+        vga_putc('/');
+        vga_put_dec_width(cs->read_us, 6);
+    }
+}
+
+static void floppy_drop(void) {
+    for (uint32_t i = 0; i < FDC_TRACK_CACHE; i++) fdc_track_drop(&fdc.tracks[i]);
+}
+
+// ==================== BUFFER CACHE ====================
+// Block-sized (one page, BUF_SECTORS sectors) copies of device data,
+// hashed by (device, block). Replacement is ARC: T1 holds blocks seen
+// once, T2 blocks seen again, and the ghost lists B1/B2 remember the
+// keys (not the data) of blocks recently evicted from each. A hit on a
+// ghost shows which list was evicted too eagerly and moves the target
+// size of T1 (arc_p) towards it, so a long sequential scan only churns
+// T1 while the blocks that keep being reused survive in T2.
+// Buffers that are referenced, being read or dirty are never evicted.
+// Writes are write-back: bdirty() only marks the buffer, and the
+// flusher (WRITEBACK, below) writes it out once it has been dirty for
+// WB_EXPIRE_MS. bwrite() is there for data that must be on disk now.
+//
+// Reads that continue a device's last one are sequential: the first
+// starts a BUF_RA_MIN-block read-ahead, and each time the reader gets
+// within half a window of its end the next one is issued asynchronously
+// at double the size, up to BUF_RA_MAX. A random read resets it.
+#define BUF_SECTORS     (PAGE_SIZE / SECTOR_SIZE)
+#define BUF_VALID       0x01
+#define BUF_LOCKED      0x02            // Read in flight
+#define BUF_ERROR       0x04
+#define BUF_READAHEAD   0x08            // Prefetched, not yet used
+#define BUF_DIRTY       0x10
+#define BUF_WRITEBACK   0x20            // Write in flight (the flusher holds a reference)
+
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_NONE };
+
+struct buf {
+    struct block_device* dev;
+    uint32_t block;
+    volatile uint32_t flags;
+    uint32_t refs;
+    uint32_t list;                      // ARC_*
+    uint8_t* data;                      // Only while in T1/T2
+    uint32_t dirtied;                   // jiffies when BUF_DIRTY was set
+    struct buf* hash_next;
+    struct buf* prev;                   // Towards MRU
+    struct buf* next;                   // Towards LRU
+    struct block_request req;
+};
+
+struct buf_list {
+    struct buf* mru;
+    struct buf* lru;
+    uint32_t count;
+};
+
+struct buf_readahead {
+    struct block_device* dev;
+    uint32_t last;                      // Last block read
+    uint32_t next;                      // First block not yet prefetched
+    uint32_t window;
+};
+
+struct buf_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t ghost_hits;
+    uint32_t evictions;
+    uint32_t ra_issued;
+    uint32_t ra_hits;                   // Prefetched blocks that were then read
+    uint32_t ra_wasted;                 // Evicted before anyone read them
+};
+
+static struct buf* buf_heads;           // BUF_CACHE_BLOCKS * 2: resident + ghosts
+static struct buf* buf_free;
+static struct buf* buf_hash[1 << BUF_HASH_BITS];
+static struct buf_list arc[4];
+static uint32_t arc_p = 0;              // Target size of T1
+static uint32_t buf_pages = 0;          // Data pages allocated so far
+static uint32_t buf_ndirty = 0;
+static struct buf_readahead buf_ra[MAX_BLOCK_DEVS];
+static struct buf_stats buf_stats;
+static spinlock_t buf_lock;
+
+static uint32_t buf_hashfn(struct block_device* dev, uint32_t block) {
+    return (((uint32_t)dev >> 4) ^ block) * 2654435761u >> (32 - BUF_HASH_BITS);
+}
+
+// Caller holds buf_lock (as for everything below down to bread)
+static struct buf* buf_lookup(struct block_device* dev, uint32_t block) {
+    for (struct buf* b = buf_hash[buf_hashfn(dev, block)]; b; b = b->hash_next) {
+        if (b->dev == dev && b->block == block) return b;
+    }
+    return 0;
+}
+
+static void buf_hash_remove(struct buf* b) {
+    struct buf** pp = &buf_hash[buf_hashfn(b->dev, b->block)];
+    while (*pp != b) pp = &(*pp)->hash_next;
+    *pp = b->hash_next;
+}
+
+static void arc_remove(struct buf* b) {
+    struct buf_list* l = &arc[b->list];
+    if (b->prev) b->prev->next = b->next;
+    else l->mru = b->next;
+    if (b->next) b->next->prev = b->prev;
+    else l->lru = b->prev;
+    l->count--;
+    b->list = ARC_NONE;
+}
+
+static void arc_add(uint32_t list, struct buf* b) {
+    struct buf_list* l = &arc[list];
+    b->list = list;
+    b->prev = 0;
+    b->next = l->mru;
+    if (l->mru) l->mru->prev = b;
+    else l->lru = b;
+    l->mru = b;
+    l->count++;
+}
+
+static void arc_move(uint32_t list, struct buf* b) {
+    arc_remove(b);
+    arc_add(list, b);
+}
+
+// Forget a ghost (or unused head) entirely
+static void buf_release_head(struct buf* b) {
+    arc_remove(b);
+    buf_hash_remove(b);
+    b->hash_next = buf_free;
+    buf_free = b;
+}
+
+// Oldest buffer on a resident list that nothing is using
+static struct buf* arc_victim(uint32_t list) {
+    for (struct buf* b = arc[list].lru; b; b = b->prev) {
+        if (!b->refs && !(b->flags & (BUF_LOCKED | BUF_DIRTY))) return b;
+    }
+    return 0;
+}
+
+// Take the page of a resident buffer being evicted
+static uint8_t* arc_take_page(struct buf* b) {
+    uint8_t* page = b->data;
+    if (b->flags & BUF_READAHEAD) buf_stats.ra_wasted++;
+    buf_stats.evictions++;
+    b->data = 0;
+    b->flags = 0;
+    return page;
+}
+
+// Turn a resident buffer into a ghost on the matching B list
+static uint8_t* arc_evict(struct buf* b) {
+    uint32_t ghost = b->list == ARC_T1 ? ARC_B1 : ARC_B2;
+    uint8_t* page = arc_take_page(b);
+    arc_move(ghost, b);
+    return page;
+}
+
+// ARC's REPLACE: evict from T1 if it is over its target, else from T2
+static uint8_t* arc_replace(bool ghost_in_b2) {
+    bool from_t1 = arc[ARC_T1].count &&
+                   (arc[ARC_T1].count > arc_p || (ghost_in_b2 && arc[ARC_T1].count == arc_p));
+    struct buf* b = arc_victim(from_t1 ? ARC_T1 : ARC_T2);
+    if (!b) b = arc_victim(from_t1 ? ARC_T2 : ARC_T1);
+    return b ? arc_evict(b) : 0;
+}
+
+// A page for a block about to become resident: a fresh one while the
+// cache is growing, otherwise whatever REPLACE frees
+static uint8_t* arc_page(bool ghost_in_b2) {
+    if (arc[ARC_T1].count + arc[ARC_T2].count < BUF_CACHE_BLOCKS && buf_pages < BUF_CACHE_BLOCKS) {
+        uint8_t* page = (uint8_t*)pmm_alloc_page();
+        if (page) {
+            buf_pages++;
+            return page;
+        }
+    }
+    return arc_replace(ghost_in_b2);
+}
+
+// Make (dev, block) resident, following ARC for ghost hits and misses.
+// Returns it with BUF_LOCKED set if the caller has to read it, or 0
+// if every resident buffer is pinned.
+static struct buf* arc_insert(struct block_device* dev, uint32_t block, struct buf* ghost) {
+    uint32_t c = BUF_CACHE_BLOCKS;
+    uint8_t* page = 0;
+    struct buf* b = ghost;
+    if (ghost && ghost->list == ARC_B1) {
+        uint32_t delta = arc[ARC_B2].count > arc[ARC_B1].count ? arc[ARC_B2].count / arc[ARC_B1].count : 1;
+        arc_p = arc_p + delta < c ? arc_p + delta : c;
+        page = arc_page(false);
+    } else if (ghost) {
+        uint32_t delta = arc[ARC_B1].count > arc[ARC_B2].count ? arc[ARC_B1].count / arc[ARC_B2].count : 1;
+        arc_p = arc_p > delta ? arc_p - delta : 0;
+        page = arc_page(true);
+    } else {
+        if (!buf_free && arc[ARC_B2].count) buf_release_head(arc[ARC_B2].lru);
+        if (!buf_free && arc[ARC_B1].count) buf_release_head(arc[ARC_B1].lru);
+        if (!buf_free) return 0;
+        uint32_t l1 = arc[ARC_T1].count + arc[ARC_B1].count;
+        uint32_t total = l1 + arc[ARC_T2].count + arc[ARC_B2].count;
+        if (l1 >= c && arc[ARC_B1].count) {
+            buf_release_head(arc[ARC_B1].lru);
+        } else if (l1 >= c) {
+            // T1 alone fills the cache: its LRU goes without leaving a ghost
+            struct buf* victim = arc_victim(ARC_T1);
+            if (victim) {
+                page = arc_take_page(victim);
+                buf_release_head(victim);
+            }
+        } else if (total >= 2 * c && arc[ARC_B2].count) {
+            buf_release_head(arc[ARC_B2].lru);
+        }
+        if (!page) page = arc_page(false);
+    }
+    if (!page) return 0;
+
+    if (!b) {
+        b = buf_free;
+        buf_free = b->hash_next;
+        b->dev = dev;
+        b->block = block;
+        uint32_t h = buf_hashfn(dev, block);
+        b->hash_next = buf_hash[h];
+        buf_hash[h] = b;
+        b->list = ARC_NONE;
+        arc_add(ARC_T1, b);
+    } else {
+        arc_move(ARC_T2, b);
+    }
+    b->data = page;
+    b->flags = BUF_LOCKED;
+    b->refs = 0;
+    return b;
+}
+
+static void brelse(struct buf* b) {
+    uint32_t flags = spin_lock_irqsave(&buf_lock);
+    b->refs--;
+    spin_unlock_irqrestore(&buf_lock, flags);
+}
+
+// Write-through: the buffer's block goes to disk before this returns.
+// The caller holds a reference and has already changed b->data.
+static bool bwrite(struct buf* b) {
+    uint32_t sector = b->block * BUF_SECTORS;
+    uint32_t left = b->dev->sectors - sector;
+    return blk_write(b->dev, sector, left < BUF_SECTORS ? left : BUF_SECTORS, b->data);
+}
+
+// Write-back: the caller holds a reference and has changed b->data;
+// the flusher writes it later. Callers that may be producing a lot of
+// it call balance_dirty() once they hold no locks.
+static void bdirty(struct buf* b) {
+    uint32_t flags = spin_lock_irqsave(&buf_lock);
+    if (!(b->flags & BUF_DIRTY)) {
+        b->flags |= BUF_DIRTY;
+        b->dirtied = jiffies;
+        buf_ndirty++;
+    }
+    spin_unlock_irqrestore(&buf_lock, flags);
+}
+
+// Bring cached copies of sectors [sector, sector + count) of dev up to
+// date with data just written around the cache. A read of one of them
+// still in flight could land the old contents afterwards, so it is
+// waited for first.
+static void buf_update(struct block_device* dev, uint32_t sector, uint32_t count, const uint8_t* data) {
+    for (uint32_t s = sector; s < sector + count; ) {
+        uint32_t block = s / BUF_SECTORS;
+        uint32_t off = s % BUF_SECTORS;
+        uint32_t n = BUF_SECTORS - off < sector + count - s ? BUF_SECTORS - off : sector + count - s;
+        uint32_t flags = spin_lock_irqsave(&buf_lock);
+        struct buf* b = buf_lookup(dev, block);
+        if (b && (b->flags & BUF_LOCKED)) {
+            b->refs++;
+            spin_unlock_irqrestore(&buf_lock, flags);
+            wait_event(b->req.wait, !(b->flags & BUF_LOCKED));
+            brelse(b);
+            continue;
+        }
+        if (b && b->data && (b->flags & BUF_VALID)) {
+            memcpy(b->data + off * SECTOR_SIZE, data + (s - sector) * SECTOR_SIZE, n * SECTOR_SIZE);
+        }
+        spin_unlock_irqrestore(&buf_lock, flags);
+        s += n;
+    }
+}
+
+static void buf_end_io(struct block_request* req) {
+    struct buf* b = req->private;
+    b->flags = (b->flags & ~BUF_LOCKED) | (req->error ? BUF_ERROR : BUF_VALID);
+    wake_up_all(&req->wait);
+}
+
+static void buf_start_read(struct buf* b) {
+    struct block_request* req = &b->req;
+    uint32_t sector = b->block * BUF_SECTORS;
+    uint32_t left = b->dev->sectors - sector;
+    req->dev = b->dev;
+    req->sector = sector;
+    req->count = left < BUF_SECTORS ? left : BUF_SECTORS;
+    req->buffer = b->data;
+    req->segs = 0;
+    req->write = false;
+    req->end_io = buf_end_io;
+    req->private = b;
+    blk_submit(req);
+}
+
+// Prefetch without taking a reference; blocks already known (resident
+// or ghost) are left alone
+static void buf_readahead(struct block_device* dev, uint32_t block) {
+    uint32_t flags = spin_lock_irqsave(&buf_lock);
+    struct buf* b = buf_lookup(dev, block) ? 0 : arc_insert(dev, block, 0);
+    if (b) {
+        b->flags |= BUF_READAHEAD;
+        buf_stats.ra_issued++;
+    }
+    spin_unlock_irqrestore(&buf_lock, flags);
+    if (b) buf_start_read(b);
+}
+
+// Caller holds buf_lock. Blocks [*start, *end) to prefetch after this
+// read of block, empty if it isn't sequential.
+static void buf_ra_window(struct block_device* dev, uint32_t block, uint32_t* start, uint32_t* end) {
+    struct buf_readahead* ra = 0;
+    for (uint32_t i = 0; i < MAX_BLOCK_DEVS && !ra; i++) {
+        if (buf_ra[i].dev == dev || !buf_ra[i].dev) ra = &buf_ra[i];
+    }
+    *start = *end = 0;
+    if (!ra) return;
+    if (ra->dev != dev || block != ra->last + 1) {
+        ra->dev = dev;
+        ra->window = 0;
+        ra->next = block + 1;
+    } else if (!ra->window) {
+        ra->window = BUF_RA_MIN;
+    }
+    ra->last = block;
+    if (!ra->window || ra->next > block + 1 + ra->window / 2) return;
+
+    uint32_t blocks = (dev->sectors + BUF_SECTORS - 1) / BUF_SECTORS;
+    *start = ra->next > block + 1 ? ra->next : block + 1;
+    *end = block + 1 + ra->window < blocks ? block + 1 + ra->window : blocks;
+    ra->next = *end;
+    if (ra->window < BUF_RA_MAX) ra->window *= 2;
+}
+
+// The cached block, read in if needed and referenced until brelse().
+// 0 on I/O error, a block past the end, or a cache full of pinned buffers.
+static struct buf* bread(struct block_device* dev, uint32_t block) {
+    if (block >= (dev->sectors + BUF_SECTORS - 1) / BUF_SECTORS) return 0;
+    uint32_t ra_start, ra_end;
+    uint32_t flags = spin_lock_irqsave(&buf_lock);
+    struct buf* b = buf_lookup(dev, block);
+    bool read = false;
+    if (b && b->list <= ARC_T2) {
+        buf_stats.hits++;
+        if (b->flags & BUF_READAHEAD) {
+            // First real use of a prefetched block: still "seen once"
+            b->flags &= ~BUF_READAHEAD;
+            buf_stats.ra_hits++;
+            arc_move(ARC_T1, b);
+        } else {
+            arc_move(ARC_T2, b);
+        }
+        if (!(b->flags & (BUF_VALID | BUF_LOCKED))) {
+            b->flags = BUF_LOCKED;      // Failed before: try again
+            read = true;
+        }
+    } else {
+        buf_stats.misses++;
+        if (b) buf_stats.ghost_hits++;
+        b = arc_insert(dev, block, b);
+        read = b != 0;
+    }
+    if (b) b->refs++;
+    buf_ra_window(dev, block, &ra_start, &ra_end);
+    spin_unlock_irqrestore(&buf_lock, flags);
+
+    if (read) buf_start_read(b);
+    for (uint32_t i = ra_start; i < ra_end; i++) buf_readahead(dev, i);
+    if (!b) return 0;
+    wait_event(b->req.wait, !(b->flags & BUF_LOCKED));
+    if (!(b->flags & BUF_VALID)) {
+        brelse(b);
+        return 0;
+    }
+    return b;
+}
+
+// Evict every clean, unused buffer of dev (all devices if 0), leaving
+// no ghosts. Returns how many were dropped.
+static uint32_t buf_drop(struct block_device* dev) {
+    uint32_t dropped = 0;
+    uint32_t flags = spin_lock_irqsave(&buf_lock);
+    for (uint32_t list = ARC_T1; list <= ARC_B2; list++) {
+        struct buf* b = arc[list].lru;
+        while (b) {
+            struct buf* prev = b->prev;
+            if ((!dev || b->dev == dev) && !b->refs && !(b->flags & (BUF_LOCKED | BUF_DIRTY))) {
+                if (b->data) {
+                    pmm_free_page((uint32_t)b->data);
+                    buf_pages--;
+                    b->data = 0;
+                    dropped++;
+                }
+                b->flags = 0;
+                buf_release_head(b);
+            }
+            b = prev;
+        }
+    }
+    for (uint32_t i = 0; i < MAX_BLOCK_DEVS; i++) {
+        if (!dev || buf_ra[i].dev == dev) buf_ra[i].dev = 0;
+    }
+    spin_unlock_irqrestore(&buf_lock, flags);
+    return dropped;
+}
+
+static void buf_init(void) {
+    uint32_t frames[(BUF_CACHE_BLOCKS * 2 * sizeof(struct buf) + PAGE_SIZE - 1) / PAGE_SIZE];
+    uint32_t pages = sizeof(frames) / sizeof(frames[0]);
+    for (uint32_t i = 0; i < pages; i++) {
+        frames[i] = pmm_alloc_page();
+        if (!frames[i]) return;
+    }
+    buf_heads = vmap(frames, pages, PTE_PRESENT | PTE_WRITE);
+    if (!buf_heads) return;
+    for (uint32_t i = 0; i < BUF_CACHE_BLOCKS * 2; i++) {
+        buf_heads[i].list = ARC_NONE;
+        buf_heads[i].hash_next = buf_free;
+        buf_free = &buf_heads[i];
+    }
+}
+
+static void show_buffer_stats(void) {
+    struct buf_stats st = buf_stats;
+    uint32_t lookups = st.hits + st.misses;
+    vga_puts("\nBuffer cache: ");
+    vga_put_dec(buf_pages * (PAGE_SIZE / 1024));
+    vga_puts("KB of ");
+    vga_put_dec(BUF_CACHE_BLOCKS * (PAGE_SIZE / 1024));
+    vga_puts("KB, T1 ");
+    vga_put_dec(arc[ARC_T1].count);
+    vga_puts(" (target ");
+    vga_put_dec(arc_p);
+    vga_puts("), T2 ");
+    vga_put_dec(arc[ARC_T2].count);
+    vga_puts(", ghosts ");
+    vga_put_dec(arc[ARC_B1].count);
+    vga_puts("+");
+    vga_put_dec(arc[ARC_B2].count);
+    vga_puts("\n  ");
+    vga_put_dec(st.hits);
+    vga_puts(" hits, ");
+    vga_put_dec(st.misses);
+    vga_puts(" misses (");
+    vga_put_dec(lookups ? (uint32_t)div64_32((uint64_t)st.hits * 100, lookups) : 0);
+    vga_puts("% hit rate), ");
+    vga_put_dec(st.ghost_hits);
+    vga_puts(" ghost hits, ");
+    vga_put_dec(st.evictions);
+    vga_puts(" evictions");
+    vga_puts("\n  read-ahead: ");
+    vga_put_dec(st.ra_issued);
+    vga_puts(" blocks, ");
+    vga_put_dec(st.ra_hits);
+    vga_puts(" used, ");
+    vga_put_dec(st.ra_wasted);
+    vga_puts(" evicted unused");
+}
+
+// ==================== PAGE CACHE ====================
+// File data in memory, one copy of it: each file's frames are found by
+// page index through its own radix tree (their struct page says which
+// file and where), reads copy straight out of them and filemap_map()
+// maps the very same frames. A page missing from
+// a disk-backed file comes from its readpage; writes go into the page
+// and leave it dirty until writepage has put it on disk. Files with
+// dirty pages are queued on page_dirty_list, in the order they first
+// got one, for the flusher. Memory-only files (no ops) keep their pages
+// for good. Past PAGE_CACHE_PAGES, the
+// least recently used clean, unreferenced page of a disk-backed file is
+// given back before another is added.
+#define RADIX_BITS      6
+#define RADIX_SLOTS     (1 << RADIX_BITS)
+#define RADIX_MASK      (RADIX_SLOTS - 1)
+
+// Fixed-size objects carved out of whole pages, which are never given
+// back; freed objects are reused
+struct obj_cache {
+    uint32_t size;
+    void* free;
+    uint32_t pages;
+    uint32_t objects;
+};
+
+static void* obj_alloc(struct obj_cache* c) {
+    if (!c->free) {
+        uint8_t* page = (uint8_t*)pmm_alloc_page();
+        if (!page) return 0;
+        for (uint32_t off = 0; off + c->size <= PAGE_SIZE; off += c->size) {
+            *(void**)(page + off) = c->free;
+            c->free = page + off;
+        }
+        c->pages++;
+    }
+    void* p = c->free;
+    c->free = *(void**)p;
+    memset(p, 0, c->size);
+    c->objects++;
+    return p;
+}
+
+static void obj_free(struct obj_cache* c, void* p) {
+    *(void**)p = c->free;
+    c->free = p;
+    c->objects--;
+}
+
+struct radix_node {
+    void* slots[RADIX_SLOTS];
+};
+
+// Height 0 is empty; height h holds indices below 64^h
+struct radix_tree {
+    struct radix_node* root;
+    uint32_t height;
+};
+
+static bool radix_fits(const struct radix_tree* t, uint32_t index) {
+    return t->height && (t->height * RADIX_BITS >= 32 || !(index >> (t->height * RADIX_BITS)));
+}
+
+static void* radix_lookup(const struct radix_tree* t, uint32_t index) {
+    if (!radix_fits(t, index)) return 0;
+    struct radix_node* n = t->root;
+    for (uint32_t shift = (t->height - 1) * RADIX_BITS; n && shift; shift -= RADIX_BITS) {
+        n = n->slots[(index >> shift) & RADIX_MASK];
+    }
+    return n ? n->slots[index & RADIX_MASK] : 0;
+}
+
+// Nodes come from the caller's cache (and lock)
+static bool radix_insert(struct radix_tree* t, uint32_t index, void* item, struct obj_cache* nodes) {
+    // Grow at the top: the old root becomes slot 0 of a new one
+    while (!radix_fits(t, index)) {
+        struct radix_node* n = obj_alloc(nodes);
+        if (!n) return false;
+        n->slots[0] = t->root;
+        t->root = n;
+        t->height++;
+    }
+    struct radix_node* n = t->root;
+    for (uint32_t shift = (t->height - 1) * RADIX_BITS; shift; shift -= RADIX_BITS) {
+        void** slot = &n->slots[(index >> shift) & RADIX_MASK];
+        if (!*slot && !(*slot = obj_alloc(nodes))) return false;
+        n = *slot;
+    }
+    n->slots[index & RADIX_MASK] = item;
+    return true;
+}
+
+// Empty nodes stay until radix_destroy()
+static void radix_delete(struct radix_tree* t, uint32_t index) {
+    if (!radix_fits(t, index)) return;
+    struct radix_node* n = t->root;
+    for (uint32_t shift = (t->height - 1) * RADIX_BITS; n && shift; shift -= RADIX_BITS) {
+        n = n->slots[(index >> shift) & RADIX_MASK];
+    }
+    if (n) n->slots[index & RADIX_MASK] = 0;
+}
+
+// The first item at or after *index, which is moved to it; 0 if none.
+// Empty subtrees are skipped whole.
+static void* radix_next(const struct radix_tree* t, uint32_t* index) {
+    uint32_t i = *index;
+    while (radix_fits(t, i)) {
+        struct radix_node* n = t->root;
+        uint32_t shift = (t->height - 1) * RADIX_BITS;
+        while (shift && n->slots[(i >> shift) & RADIX_MASK]) {
+            n = n->slots[(i >> shift) & RADIX_MASK];
+            shift -= RADIX_BITS;
+        }
+        if (!shift && n->slots[i & RADIX_MASK]) {
+            *index = i;
+            return n->slots[i & RADIX_MASK];
+        }
+        uint32_t next = (i & ~((1u << shift) - 1)) + (1u << shift);
+        if (next <= i) break;
+        i = next;
+    }
+    return 0;
+}
+
+static void radix_free_node(struct radix_node* n, uint32_t height, struct obj_cache* nodes) {
+    for (uint32_t i = 0; height > 1 && i < RADIX_SLOTS; i++) {
+        if (n->slots[i]) radix_free_node(n->slots[i], height - 1, nodes);
+    }
+    obj_free(nodes, n);
+}
+
+// Give every node back; the items are the caller's
+static void radix_destroy(struct radix_tree* t, struct obj_cache* nodes) {
+    if (t->root) radix_free_node(t->root, t->height, nodes);
+    t->root = 0;
+    t->height = 0;
+}
+
+// Called without page_cache_lock, with the page locked (readpage) or
+// referenced (writepage), under whatever lock the filesystem needs
+// writeback is optional and called by the flusher with no locks held:
+// it writes back every dirty page of host's filesystem.
+struct address_space_ops {
+    bool (*readpage)(struct address_space* m, struct page* page);
+    bool (*writepage)(struct address_space* m, struct page* page);
+    bool (*writeback)(void* host);
+};
+
+struct address_space {
+    struct radix_tree pages;
+    uint32_t nrpages;
+    uint32_t ndirty;
+    const struct address_space_ops* ops;  // 0: memory only
+    void* host;                         // The filesystem's inode
+    uint32_t dirtied;                   // jiffies when ndirty left 0
+    struct address_space* dirty_next;   // On page_dirty_list
+};
+
+struct page_cache_stats {
+    uint32_t pages;                     // In every file
+    uint32_t dirty;
+    uint32_t hits;
+    uint32_t misses;                    // Read in through readpage
+    uint32_t evictions;
+    uint32_t writebacks;
+    uint32_t mapped;                    // Referenced by filemap_map()
+};
+
+static struct obj_cache page_cache_nodes = { sizeof(struct radix_node), 0, 0, 0 };
+static struct page* page_lru_mru;
+static struct page* page_lru_lru;
+static struct page_cache_stats page_cache_stats;
+static struct address_space* page_dirty_list;
+static struct wait_queue page_wait;     // PG_LOCKED cleared
+static spinlock_t page_cache_lock;
+
+// Caller holds page_cache_lock (down to page_cache_shrink)
+static void page_lru_remove(struct page* page) {
+    if (page->prev) page->prev->next = page->next;
+    else page_lru_mru = page->next;
+    if (page->next) page->next->prev = page->prev;
+    else page_lru_lru = page->prev;
+    page->prev = page->next = 0;
+}
+
+// A file's first dirty page queues it behind the others, its last
+// clean one takes it off; the list is short, so both walk it
+static void mapping_dirty_add(struct address_space* m) {
+    struct address_space** link = &page_dirty_list;
+    while (*link) link = &(*link)->dirty_next;
+    *link = m;
+    m->dirty_next = 0;
+    m->dirtied = jiffies;
+}
+
+static void mapping_dirty_del(struct address_space* m) {
+    for (struct address_space** link = &page_dirty_list; *link; link = &(*link)->dirty_next) {
+        if (*link == m) {
+            *link = m->dirty_next;
+            break;
+        }
+    }
+    m->dirty_next = 0;
+}
+
+static void page_lru_touch(struct page* page) {
+    if (!page->mapping || !page->mapping->ops) return;
+    if (page_lru_mru == page) return;
+    if (page->prev || page->next || page_lru_lru == page) page_lru_remove(page);
+    page->next = page_lru_mru;
+    if (page_lru_mru) page_lru_mru->prev = page;
+    page_lru_mru = page;
+    if (!page_lru_lru) page_lru_lru = page;
+}
+
+// Out of its file (and the LRU); freed now if nobody holds it
+static void page_detach(struct page* page) {
+    struct address_space* m = page->mapping;
+    if (m->ops) page_lru_remove(page);
+    radix_delete(&m->pages, page->index);
+    m->nrpages--;
+    if (page->flags & PG_DIRTY) {
+        if (!--m->ndirty) mapping_dirty_del(m);
+        page_cache_stats.dirty--;
+    }
+    page->mapping = 0;
+    page->flags &= ~PG_DIRTY;
+    page_cache_stats.pages--;
+    if (!page->refs) {
+        page->flags = 0;
+        pmm_free_page((uint32_t)page_address(page));
+    }
+}
+
+static uint32_t page_cache_shrink(uint32_t target) {
+    uint32_t freed = 0;
+    struct page* page = page_lru_lru;
+    while (page && freed < target) {
+        struct page* prev = page->prev;
+        if (!page->refs && !(page->flags & (PG_DIRTY | PG_LOCKED))) {
+            page_detach(page);
+            page_cache_stats.evictions++;
+            freed++;
+        }
+        page = prev;
+    }
+    return freed;
+}
+
+// Referenced; 0 if it isn't cached
+static struct page* find_get_page(struct address_space* m, uint32_t index) {
+    uint32_t flags = spin_lock_irqsave(&page_cache_lock);
+    struct page* page = radix_lookup(&m->pages, index);
+    if (page) {
+        page->refs++;
+        page_lru_touch(page);
+    }
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+    return page;
+}
+
+static void put_page(struct page* page) {
+    uint32_t flags = spin_lock_irqsave(&page_cache_lock);
+    if (!--page->refs && !page->mapping) {
+        page->flags = 0;
+        pmm_free_page((uint32_t)page_address(page));
+    }
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+}
+
+// Page index of m, referenced and up to date: read in if it has to be,
+// or just zeroed if the caller is about to overwrite all of it. 0 if
+// there is no memory or the read failed.
+static struct page* read_cache_page(struct address_space* m, uint32_t index, bool overwrite) {
+    uint32_t flags = spin_lock_irqsave(&page_cache_lock);
+    struct page* page = radix_lookup(&m->pages, index);
+    bool read = false;
+    if (page) {
+        page_cache_stats.hits++;
+        page->refs++;
+        page_lru_touch(page);
+        if (!(page->flags & (PG_UPTODATE | PG_LOCKED))) {
+            // Failed before: try again
+            if (overwrite) memset(page_address(page), 0, PAGE_SIZE);
+            page->flags = overwrite ? PG_UPTODATE : PG_LOCKED;
+            read = !overwrite;
+        }
+    } else {
+        if (m->ops && page_cache_stats.pages >= PAGE_CACHE_PAGES) page_cache_shrink(1);
+        uint32_t frame = pmm_alloc_page();
+        page = frame ? virt_to_page((void*)frame) : 0;
+        if (!page || !radix_insert(&m->pages, index, page, &page_cache_nodes)) {
+            if (frame) pmm_free_page(frame);
+            spin_unlock_irqrestore(&page_cache_lock, flags);
+            return 0;
+        }
+        page->mapping = m;
+        page->index = index;
+        page->refs = 1;
+        read = m->ops && !overwrite;
+        page->flags = read ? PG_LOCKED : PG_UPTODATE;
+        m->nrpages++;
+        page_cache_stats.pages++;
+        page_lru_touch(page);
+    }
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+
+    if (read) {
+        bool ok = m->ops->readpage(m, page);
+        flags = spin_lock_irqsave(&page_cache_lock);
+        page->flags = ok ? PG_UPTODATE : PG_ERROR;
+        page_cache_stats.misses++;
+        spin_unlock_irqrestore(&page_cache_lock, flags);
+        wake_up_all(&page_wait);
+    }
+    wait_event(page_wait, !(page->flags & PG_LOCKED));
+    if (!(page->flags & PG_UPTODATE)) {
+        put_page(page);
+        return 0;
+    }
+    return page;
+}
+
+// Memory-only files have nothing to write back
+static void set_page_dirty(struct page* page) {
+    uint32_t flags = spin_lock_irqsave(&page_cache_lock);
+    struct address_space* m = page->mapping;
+    if (m && m->ops && !(page->flags & PG_DIRTY)) {
+        page->flags |= PG_DIRTY;
+        if (!m->ndirty++) mapping_dirty_add(m);
+        page_cache_stats.dirty++;
+    }
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+}
+
+static void clear_page_dirty(struct page* page) {
+    uint32_t flags = spin_lock_irqsave(&page_cache_lock);
+    if (page->flags & PG_DIRTY) {
+        page->flags &= ~PG_DIRTY;
+        if (!--page->mapping->ndirty) mapping_dirty_del(page->mapping);
+        page_cache_stats.dirty--;
+    }
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+}
+
+// len bytes at off, which the caller has checked against the file size
+static int32_t filemap_read(struct address_space* m, uint32_t off, void* dst, uint32_t len) {
+    uint8_t* out = dst;
+    for (uint32_t left = len; left;) {
+        uint32_t in_page = off % PAGE_SIZE;
+        uint32_t n = PAGE_SIZE - in_page < left ? PAGE_SIZE - in_page : left;
+        struct page* page = m->ops ? read_cache_page(m, off / PAGE_SIZE, false) : find_get_page(m, off / PAGE_SIZE);
+        if (page) {
+            memcpy(out, page_address(page) + in_page, n);
+            put_page(page);
+        } else if (m->ops) {
+            return -EIO;
+        } else {
+            memset(out, 0, n);          // Never written
+        }
+        out += n;
+        off += n;
+        left -= n;
+    }
+    return len;
+}
+
+// Into the cache, leaving the pages dirty; the caller moves the size.
+// Returns the bytes written, short if memory or a read ran out.
+static uint32_t filemap_write(struct address_space* m, uint32_t off, const void* src, uint32_t len, uint32_t size) {
+    const uint8_t* in = src;
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t in_page = off % PAGE_SIZE;
+        uint32_t n = PAGE_SIZE - in_page < len - done ? PAGE_SIZE - in_page : len - done;
+        // Nothing to read if all of what is there now gets overwritten
+        bool overwrite = (!in_page && n == PAGE_SIZE) || (!in_page && off + n >= size);
+        struct page* page = read_cache_page(m, off / PAGE_SIZE, overwrite);
+        if (!page) break;
+        memcpy(page_address(page) + in_page, in + done, n);
+        set_page_dirty(page);
+        put_page(page);
+        done += n;
+        off += n;
+    }
+    return done;
+}
+
+// Every dirty page through writepage, in file order
+static bool filemap_writeback(struct address_space* m) {
+    bool ok = true;
+    uint32_t index = 0;
+    while (m->ndirty) {
+        uint32_t flags = spin_lock_irqsave(&page_cache_lock);
+        struct page* page;
+        while ((page = radix_next(&m->pages, &index)) && !(page->flags & PG_DIRTY)) index++;
+        if (page) page->refs++;
+        spin_unlock_irqrestore(&page_cache_lock, flags);
+        if (!page) break;
+        if (m->ops->writepage(m, page)) {
+            clear_page_dirty(page);
+            page_cache_stats.writebacks++;
+        } else {
+            ok = false;
+        }
+        put_page(page);
+        index++;
+    }
+    return ok;
+}
+
+// Drop pages from index on, dirty or not. Pages still referenced (a
+// mapping) leave the file and go when the last reference does.
+static void truncate_inode_pages(struct address_space* m, uint32_t from) {
+    uint32_t flags = spin_lock_irqsave(&page_cache_lock);
+    struct page* page;
+    while ((page = radix_next(&m->pages, &from))) {
+        if (page->flags & PG_LOCKED) {
+            page->refs++;
+            spin_unlock_irqrestore(&page_cache_lock, flags);
+            wait_event(page_wait, !(page->flags & PG_LOCKED));
+            put_page(page);
+            flags = spin_lock_irqsave(&page_cache_lock);
+            continue;
+        }
+        page_detach(page);
+        from++;
+    }
+    if (!m->nrpages) radix_destroy(&m->pages, &page_cache_nodes);
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+}
+
+// Map count pages of m from index first into the shared window: the
+// same frames reads copy from, referenced until filemap_unmap()
+static void* filemap_map(struct address_space* m, uint32_t first, uint32_t count) {
+    uint32_t frames[VMALLOC_MAX_PAGES];
+    if (!count || count > VMALLOC_MAX_PAGES) return 0;
+    for (uint32_t i = 0; i < count; i++) {
+        struct page* page = read_cache_page(m, first + i, false);
+        if (!page) {
+            while (i--) put_page(virt_to_page((void*)frames[i]));
+            return 0;
+        }
+        frames[i] = (uint32_t)page_address(page);
+    }
+    void* addr = vmap(frames, count, 0);
+    if (!addr) {
+        for (uint32_t i = 0; i < count; i++) put_page(virt_to_page((void*)frames[i]));
+        return 0;
+    }
+    __atomic_fetch_add(&page_cache_stats.mapped, count, __ATOMIC_RELAXED);
+    return addr;
+}
+
+// Pages written through the mapping (the CPU set their PTE's dirty
+// bit) are dirty in the cache too
+static void filemap_unmap(void* addr, uint32_t count) {
+    struct page* pages[VMALLOC_MAX_PAGES];
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t pte = *vmap_pte((uint32_t)addr + i * PAGE_SIZE);
+        pages[i] = virt_to_page((void*)(pte & ~0xFFF));
+        if (pte & PTE_DIRTY) set_page_dirty(pages[i]);
+    }
+    vunmap(addr, count);
+    for (uint32_t i = 0; i < count; i++) put_page(pages[i]);
+    __atomic_fetch_sub(&page_cache_stats.mapped, count, __ATOMIC_RELAXED);
+}
+
+static void show_page_cache(void) {
+    struct page_cache_stats* st = &page_cache_stats;
+    vga_puts("\nPage cache: ");
+    vga_put_dec(st->pages * (PAGE_SIZE / 1024));
+    vga_puts("KB cached, ");
+    vga_put_dec(st->dirty * (PAGE_SIZE / 1024));
+    vga_puts("KB dirty, ");
+    vga_put_dec(st->mapped);
+    vga_puts(" pages mapped");
+    vga_puts("\n  ");
+    vga_put_dec(st->hits);
+    vga_puts(" hits, ");
+    vga_put_dec(st->misses);
+    vga_puts(" read in, ");
+    vga_put_dec(st->writebacks);
+    vga_puts(" written back, ");
+    vga_put_dec(st->evictions);
+    vga_puts(" evicted; ");
+    vga_put_dec(page_cache_nodes.pages);
+    vga_puts(" pages of radix nodes");
+}
+
+// ==================== WRITEBACK ====================
+// The "flush" thread writes dirty buffers and file pages back. Every
+// WB_INTERVAL_MS it writes what has been dirty for WB_EXPIRE_MS; while
+// more than WB_BACKGROUND_PCT of both caches together is dirty it
+// writes everything, oldest file first, until it is under that again.
+// Buffers go out WB_BATCH at a time sorted by (device, block) and all
+// submitted before any is waited for, so the elevator merges
+// neighbours into long writes instead of seeking between them. File
+// pages go through their filesystem's writeback op, which knows how
+// to lay them out (the log-structured one appends them to its log).
+// Writers that take the dirty total past WB_DIRTY_PCT are held in
+// balance_dirty() until the flusher has caught up.
+#define WB_HOSTS 4                      // Filesystems written back per pass
+
+struct wb_stats {
+    uint32_t runs;                      // Passes that wrote something
+    uint32_t background;                // Passes started by the background limit
+    uint32_t batches;
+    uint32_t buffers;                   // Written back...
+    uint32_t pages;                     // ...and file pages
+    uint32_t errors;
+    uint64_t bytes;
+    uint64_t busy_us;                   // Spent in passes that wrote
+    uint32_t syncs;
+    uint32_t throttled;                 // Writers held by balance_dirty()
+    uint32_t throttle_ms;
+};
+
+static struct mutex wb_lock;            // One pass at a time
+static struct wb_stats wb_stats;
+static volatile bool wb_kick;           // Wake the flusher early
+
+// Dirty data in pages, buffers and file pages together
+static inline uint32_t wb_dirty(void) {
+    return buf_ndirty + page_cache_stats.dirty;
+}
+
+static inline uint32_t wb_limit(uint32_t pct) {
+    return (BUF_CACHE_BLOCKS + PAGE_CACHE_PAGES) * pct / 100;
+}
+
+// Dirtied at or before cutoff (jiffies)
+static inline bool wb_due(uint32_t dirtied, uint32_t cutoff) {
+    return (int32_t)(cutoff - dirtied) >= 0;
+}
+
+static void wb_end_io(struct block_request* req) {
+    struct buf* b = req->private;
+    uint32_t flags = spin_lock_irqsave(&buf_lock);
+    b->flags &= ~BUF_WRITEBACK;
+    spin_unlock_irqrestore(&buf_lock, flags);
+    wake_up_all(&req->wait);
+}
+
+// Up to WB_BATCH buffers dirtied by cutoff, sorted by (device, block),
+// each referenced and moved from BUF_DIRTY to BUF_WRITEBACK. Changing
+// one again while it is written just makes it dirty again.
+static uint32_t wb_collect(struct buf** batch, uint32_t cutoff) {
+    uint32_t n = 0;
+    uint32_t flags = spin_lock_irqsave(&buf_lock);
+    for (uint32_t list = ARC_T1; list <= ARC_T2 && buf_ndirty; list++) {
+        for (struct buf* b = arc[list].lru; b && n < WB_BATCH; b = b->prev) {
+            if ((b->flags & (BUF_DIRTY | BUF_WRITEBACK)) != BUF_DIRTY || !wb_due(b->dirtied, cutoff)) continue;
+            b->flags = (b->flags & ~BUF_DIRTY) | BUF_WRITEBACK;
+            b->refs++;
+            buf_ndirty--;
+            uint32_t i = n++;
+            for (; i && (batch[i - 1]->dev > b->dev ||
+                         (batch[i - 1]->dev == b->dev && batch[i - 1]->block > b->block)); i--) {
+                batch[i] = batch[i - 1];
+            }
+            batch[i] = b;
+        }
+    }
+    spin_unlock_irqrestore(&buf_lock, flags);
+    return n;
+}
+
+static void wb_write_batch(struct buf** batch, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        struct buf* b = batch[i];
+        struct block_request* req = &b->req;
+        uint32_t sector = b->block * BUF_SECTORS;
+        uint32_t left = b->dev->sectors - sector;
+        req->dev = b->dev;
+        req->sector = sector;
+        req->count = left < BUF_SECTORS ? left : BUF_SECTORS;
+        req->buffer = b->data;
+        req->segs = 0;
+        req->write = true;
+        req->end_io = wb_end_io;
+        req->private = b;
+        blk_submit(req);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        struct buf* b = batch[i];
+        wait_event(b->req.wait, !(b->flags & BUF_WRITEBACK));
+        if (b->req.error) {
+            wb_stats.errors++;
+        } else {
+            wb_stats.buffers++;
+            wb_stats.bytes += b->req.count * SECTOR_SIZE;
+        }
+        brelse(b);
+    }
+    wb_stats.batches++;
+}
+
+// The filesystems with a file dirtied by cutoff write back all of theirs
+static void wb_write_pages(uint32_t cutoff) {
+    bool (*writeback[WB_HOSTS])(void* host);
+    void* hosts[WB_HOSTS];
+    uint32_t n = 0;
+    uint32_t flags = spin_lock_irqsave(&page_cache_lock);
+    for (struct address_space* m = page_dirty_list; m && n < WB_HOSTS; m = m->dirty_next) {
+        if (!wb_due(m->dirtied, cutoff)) break;          // The rest are younger
+        if (!m->ops->writeback) continue;
+        uint32_t i = 0;
+        while (i < n && hosts[i] != m->host) i++;
+        if (i < n) continue;
+        writeback[n] = m->ops->writeback;
+        hosts[n++] = m->host;
+    }
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t before = page_cache_stats.writebacks;
+        if (!writeback[i](hosts[i])) wb_stats.errors++;
+        uint32_t pages = page_cache_stats.writebacks - before;
+        wb_stats.pages += pages;
+        wb_stats.bytes += pages * PAGE_SIZE;
+    }
+}
+
+// One pass: everything dirtied by cutoff, or with background set, until
+// the dirty total is under the background limit. False if a write failed.
+static bool wb_flush(uint32_t cutoff, bool background) {
+    struct buf* batch[WB_BATCH];
+    mutex_lock(&wb_lock);
+    uint32_t errors = wb_stats.errors;
+    uint64_t bytes = wb_stats.bytes;
+    uint64_t start = rdtsc();
+    wb_write_pages(cutoff);
+    while (!background || wb_dirty() > wb_limit(WB_BACKGROUND_PCT)) {
+        uint32_t n = wb_collect(batch, cutoff);
+        if (!n) break;
+        wb_write_batch(batch, n);
+    }
+    if (wb_stats.bytes != bytes) {
+        wb_stats.runs++;
+        wb_stats.busy_us += div64_32(rdtsc() - start, tsc_per_us);
+    }
+    bool ok = wb_stats.errors == errors;
+    mutex_unlock(&wb_lock);
+    return ok;
+}
+
+// Everything dirty now, on disk before this returns
+static bool wb_sync(void) {
+    wb_stats.syncs++;
+    return wb_flush(jiffies, false);
+}
+
+static void wb_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        uint32_t until = jiffies + WB_INTERVAL_MS * TIMER_HZ / 1000;
+        wait_event(sleep_wait, wb_kick || (int32_t)(jiffies - until) >= 0);
+        wb_kick = false;
+        bool background = wb_dirty() > wb_limit(WB_BACKGROUND_PCT);
+        if (background) wb_stats.background++;
+        wb_flush(background ? jiffies : jiffies - WB_EXPIRE_MS * TIMER_HZ / 1000, background);
+    }
+}
+
+// For writers, after dirtying data and holding no locks: past the
+// background limit the flusher is woken, past the dirty limit the
+// writer also sleeps until it is under it again (or WB_PAUSE_MAX_MS,
+// so a device that has stopped taking writes can't hang it).
+static void balance_dirty(void) {
+    if (wb_dirty() <= wb_limit(WB_BACKGROUND_PCT)) return;
+    wb_kick = true;
+    if (wb_dirty() <= wb_limit(WB_DIRTY_PCT)) return;
+    uint32_t start = jiffies;
+    for (uint32_t waited = 0; waited < WB_PAUSE_MAX_MS && wb_dirty() > wb_limit(WB_DIRTY_PCT); waited += WB_PAUSE_MS) {
+        wb_kick = true;
+        msleep(WB_PAUSE_MS);
+    }
+    __atomic_fetch_add(&wb_stats.throttled, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&wb_stats.throttle_ms, (jiffies - start) * 1000 / TIMER_HZ, __ATOMIC_RELAXED);
+}
+
+static void show_writeback(void) {
+    struct wb_stats st = wb_stats;
+    uint32_t busy_ms = (uint32_t)div64_32(st.busy_us, 1000);
+    vga_puts("\nDirty: ");
+    vga_put_dec(buf_ndirty * (PAGE_SIZE / 1024));
+    vga_puts("KB in buffers, ");
+    vga_put_dec(page_cache_stats.dirty * (PAGE_SIZE / 1024));
+    vga_puts("KB in files; flusher starts at ");
+    vga_put_dec(wb_limit(WB_BACKGROUND_PCT) * (PAGE_SIZE / 1024));
+    vga_puts("KB, writers wait at ");
+    vga_put_dec(wb_limit(WB_DIRTY_PCT) * (PAGE_SIZE / 1024));
+    vga_puts("KB");
+    vga_puts("\n  written back: ");
+    vga_put_dec((uint32_t)(st.bytes >> 10));
+    vga_puts("KB (");
+    vga_put_dec(st.buffers);
+    vga_puts(" buffers in ");
+    vga_put_dec(st.batches);
+    vga_puts(" batches, ");
+    vga_put_dec(st.pages);
+    vga_puts(" file pages) at ");
+    vga_put_dec(busy_ms ? (uint32_t)div64_32((st.bytes >> 10) * 1000, busy_ms) : 0);
+    vga_puts(" KB/s, ");
+    vga_put_dec(st.errors);
+    vga_puts(" errors");
+    vga_puts("\n  ");
+    vga_put_dec(st.runs);
+    vga_puts(" passes (");
+    vga_put_dec(st.background);
+    vga_puts(" over the background limit), ");
+    vga_put_dec(st.syncs);
+    vga_puts(" syncs; writers throttled ");
+    vga_put_dec(st.throttled);
+    vga_puts(" times for ");
+    vga_put_dec(st.throttle_ms);
+    vga_puts("ms");
+}
+
+// ==================== DENTRY CACHE ====================
+// Path lookups on the disk filesystems come here first. A dentry is
+// one name in one directory, hashed by (parent, name), and points at
+// the inode the name resolved to, or at nothing: a negative dentry
+// records that the name doesn't exist, so asking for it again (a
+// command searched for along the shell's path, say) is a hash probe
+// and not a directory read. Inodes are hashed by (super block, inode
+// number) and carry what their filesystem needs to find the file
+// without its path. Only a miss calls the filesystem's lookup op.
+//
+// Dentries reference their parent and inode. Unreferenced ones wait on
+// an LRU and are freed from its cold end past DCACHE_MAX; unreferenced
+// inodes likewise past ICACHE_MAX. Their obj_cache pages stay with the
+// cache for reuse, so the limits bound its memory rather than free any.
+// Filesystems call d_invalidate() when a name appears or goes away; a
+// lookup that raced with one isn't cached. tmpfs doesn't need any of
+// this: its tree is already hashed names in memory.
+#define DNAME_INLINE 40                 // Longer names get a DNAME_MAX buffer
+#define DNAME_MAX    255
+
+enum { INODE_FILE, INODE_DIR };
+
+struct super_block;
+
+struct inode {
+    struct super_block* sb;
+    uint32_t ino;
+    uint32_t type;                      // INODE_*
+    uint32_t data[2];                   // The filesystem's own
+    uint32_t refs;                      // Dentries and callers
+    struct inode* hash_next;
+    struct inode* prev;                 // LRU while unreferenced, towards MRU
+    struct inode* next;
+};
+
+struct dentry {
+    struct dentry* hash_next;
+    struct dentry* parent;              // Referenced; a root is its own
+    struct inode* inode;                // Referenced; 0 if the name doesn't exist
+    struct super_block* sb;
+    uint32_t hash;
+    uint32_t len;
+    uint32_t refs;                      // Callers and children
+    bool hashed;                        // Cleared when invalidated
+    struct dentry* prev;                // LRU while unreferenced, towards MRU
+    struct dentry* next;
+    char* name;                         // iname or a DNAME_MAX buffer, not terminated
+    char iname[DNAME_INLINE];
+};
+
+// lookup is called without locks for name[0..len) in directory dir. It
+// returns 0 with ino, type and data of out filled in, -ENOENT if there
+// is no such name (cached as a negative dentry) or another error (not
+// cached).
+struct super_operations {
+    int32_t (*lookup)(struct super_block* sb, struct inode* dir, const char* name, uint32_t len, struct inode* out);
+};
+
+struct super_block {
+    const char* name;
+    const struct super_operations* ops;
+    void* fs;                           // 0 until mounted
+    struct dentry* root;
+};
+
+struct dcache_stats {
+    uint32_t lookups;                   // Path components resolved
+    uint32_t hits;
+    uint32_t negative_hits;             // ...that said the name doesn't exist
+    uint32_t misses;                    // Went to the filesystem
+    uint32_t raced;                     // Looked up across an invalidation: not cached
+    uint32_t invalidations;
+    uint32_t dentries_shrunk;
+    uint32_t inodes_shrunk;
+};
+
+static struct obj_cache dentry_cache = { sizeof(struct dentry), 0, 0, 0 };
+static struct obj_cache dname_cache = { DNAME_MAX, 0, 0, 0 };
+static struct obj_cache inode_cache = { sizeof(struct inode), 0, 0, 0 };
+static struct dentry* dentry_hash[1 << DCACHE_HASH_BITS];
+static struct inode* inode_hash[1 << DCACHE_HASH_BITS];
+static struct dentry* dentry_lru_mru;
+static struct dentry* dentry_lru_lru;
+static struct inode* inode_lru_mru;
+static struct inode* inode_lru_lru;
+static uint32_t dentry_unused, inode_unused, dentry_negative;
+static uint32_t dcache_seq;             // Bumped by every invalidation
+static struct dcache_stats dcache_stats;
+static spinlock_t dcache_lock;
+
+static uint32_t d_hashfn(const struct dentry* parent, const char* name, uint32_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t)parent;
+    for (uint32_t i = 0; i < len; i++) h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+static struct dentry** d_bucket(uint32_t hash) {
+    return &dentry_hash[(hash * 0x9E3779B1u) >> (32 - DCACHE_HASH_BITS)];
+}
+
+static struct inode** i_bucket(const struct super_block* sb, uint32_t ino) {
+    return &inode_hash[(((uint32_t)sb >> 4) ^ ino) * 2654435761u >> (32 - DCACHE_HASH_BITS)];
+}
+
+// Caller holds dcache_lock (as for everything below down to dput)
+static void d_lru_add(struct dentry* d) {
+    d->prev = 0;
+    d->next = dentry_lru_mru;
+    if (dentry_lru_mru) dentry_lru_mru->prev = d;
+    else dentry_lru_lru = d;
+    dentry_lru_mru = d;
+    dentry_unused++;
+}
+
+static void d_lru_del(struct dentry* d) {
+    if (d->prev) d->prev->next = d->next;
+    else dentry_lru_mru = d->next;
+    if (d->next) d->next->prev = d->prev;
+    else dentry_lru_lru = d->prev;
+    d->prev = d->next = 0;
+    dentry_unused--;
+}
+
+static void i_lru_add(struct inode* inode) {
+    inode->prev = 0;
+    inode->next = inode_lru_mru;
+    if (inode_lru_mru) inode_lru_mru->prev = inode;
+    else inode_lru_lru = inode;
+    inode_lru_mru = inode;
+    inode_unused++;
+}
+
+static void i_lru_del(struct inode* inode) {
+    if (inode->prev) inode->prev->next = inode->next;
+    else inode_lru_mru = inode->next;
+    if (inode->next) inode->next->prev = inode->prev;
+    else inode_lru_lru = inode->prev;
+    inode->prev = inode->next = 0;
+    inode_unused--;
+}
+
+// Referenced; what the filesystem just said about it replaces what was cached
+static struct inode* iget_locked(struct super_block* sb, const struct inode* found) {
+    struct inode** bucket = i_bucket(sb, found->ino);
+    struct inode* inode = *bucket;
+    while (inode && (inode->sb != sb || inode->ino != found->ino)) inode = inode->hash_next;
+    if (!inode) {
+        if (!(inode = obj_alloc(&inode_cache))) return 0;
+        inode->sb = sb;
+        inode->ino = found->ino;
+        inode->hash_next = *bucket;
+        *bucket = inode;
+    } else if (!inode->refs) {
+        i_lru_del(inode);
+    }
+    inode->type = found->type;
+    inode->data[0] = found->data[0];
+    inode->data[1] = found->data[1];
+    inode->refs++;
+    return inode;
+}
+
+static void iput_locked(struct inode* inode) {
+    if (!--inode->refs) i_lru_add(inode);
+}
+
+static void i_free(struct inode* inode) {
+    struct inode** link = i_bucket(inode->sb, inode->ino);
+    while (*link != inode) link = &(*link)->hash_next;
+    *link = inode->hash_next;
+    i_lru_del(inode);
+    obj_free(&inode_cache, inode);
+}
+
+static void d_get_locked(struct dentry* d) {
+    if (!d->refs++ && d->hashed) d_lru_del(d);
+}
+
+static void d_unhash(struct dentry* d) {
+    struct dentry** link = d_bucket(d->hash);
+    while (*link != d) link = &(*link)->hash_next;
+    *link = d->hash_next;
+    d->hashed = false;
+}
+
+static void d_free(struct dentry* d);
+
+// Unhashed dentries go with their last reference, hashed ones wait on the LRU
+static void dput_locked(struct dentry* d) {
+    if (--d->refs) return;
+    if (d->hashed) d_lru_add(d);
+    else d_free(d);
+}
+
+// An unreferenced dentry, with its references on its inode and parent
+static void d_free(struct dentry* d) {
+    struct dentry* parent = d->parent;
+    if (d->hashed) {
+        d_unhash(d);
+        d_lru_del(d);
+    }
+    if (d->inode) iput_locked(d->inode);
+    else dentry_negative--;
+    if (d->name != d->iname) obj_free(&dname_cache, d->name);
+    obj_free(&dentry_cache, d);
+    if (parent != d) dput_locked(parent);
+}
+
+// Trim the LRUs to their limits, or empty them
+static void dcache_shrink(bool all) {
+    uint32_t max = all ? 0 : DCACHE_MAX;
+    while (dentry_unused > max && dentry_lru_lru) {
+        d_free(dentry_lru_lru);
+        dcache_stats.dentries_shrunk++;
+    }
+    max = all ? 0 : ICACHE_MAX;
+    while (inode_unused > max && inode_lru_lru) {
+        i_free(inode_lru_lru);
+        dcache_stats.inodes_shrunk++;
+    }
+}
+
+static struct dentry* __d_lookup(const struct dentry* parent, const char* name, uint32_t len, uint32_t hash) {
+    for (struct dentry* d = *d_bucket(hash); d; d = d->hash_next) {
+        if (d->hash == hash && d->parent == parent && d->len == len && !memcmp(d->name, name, len)) return d;
+    }
+    return 0;
+}
+
+static void dget(struct dentry* d) {
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    d_get_locked(d);
+    spin_unlock_irqrestore(&dcache_lock, flags);
+}
+
+static void dput(struct dentry* d) {
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    dput_locked(d);
+    dcache_shrink(false);
+    spin_unlock_irqrestore(&dcache_lock, flags);
+}
+
+// Cache what the filesystem said about name in parent (found: 0 if it
+// isn't there), unless an invalidation since seq may have made it stale.
+// Referenced; 0 if out of memory.
+static struct dentry* d_add(struct dentry* parent, const char* name, uint32_t len, uint32_t hash,
+                            const struct inode* found, uint32_t seq) {
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    struct dentry* d = __d_lookup(parent, name, len, hash);
+    if (d) {
+        // Someone else looked it up meanwhile
+        d_get_locked(d);
+        spin_unlock_irqrestore(&dcache_lock, flags);
+        return d;
+    }
+    d = obj_alloc(&dentry_cache);
+    char* name_buf = !d ? 0 : len > DNAME_INLINE ? obj_alloc(&dname_cache) : d->iname;
+    struct inode* inode = name_buf && found ? iget_locked(parent->sb, found) : 0;
+    if (d && (!name_buf || (found && !inode))) {
+        if (name_buf && name_buf != d->iname) obj_free(&dname_cache, name_buf);
+        obj_free(&dentry_cache, d);
+        d = 0;
+    }
+    if (d) {
+        d->name = name_buf;
+        memcpy(d->name, name, len);
+        d->len = len;
+        d->hash = hash;
+        d->sb = parent->sb;
+        d->inode = inode;
+        d->refs = 1;
+        d->parent = parent;
+        d_get_locked(parent);
+        if (!inode) dentry_negative++;
+        if (seq == dcache_seq) {
+            struct dentry** bucket = d_bucket(hash);
+            d->hash_next = *bucket;
+            *bucket = d;
+            d->hashed = true;
+        } else {
+            dcache_stats.raced++;
+        }
+        dcache_shrink(false);
+    }
+    spin_unlock_irqrestore(&dcache_lock, flags);
+    return d;
+}
+
+// name[0..len) in the directory parent, referenced; 0 with *err set if
+// it doesn't exist or can't be looked up
+static struct dentry* d_lookup(struct dentry* parent, const char* name, uint32_t len, int32_t* err) {
+    uint32_t hash = d_hashfn(parent, name, len);
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    dcache_stats.lookups++;
+    struct dentry* d = __d_lookup(parent, name, len, hash);
+    if (d) {
+        d_get_locked(d);
+        dcache_stats.hits++;
+        if (!d->inode) dcache_stats.negative_hits++;
+    } else {
+        dcache_stats.misses++;
+    }
+    uint32_t seq = dcache_seq;
+    spin_unlock_irqrestore(&dcache_lock, flags);
+
+    if (!d) {
+        struct inode found = {0};
+        *err = parent->sb->ops->lookup(parent->sb, parent->inode, name, len, &found);
+        if (*err && *err != -ENOENT) return 0;
+        if (!(d = d_add(parent, name, len, hash, *err ? 0 : &found, seq))) {
+            if (!*err) *err = -ENOMEM;
+            return 0;
+        }
+    }
+    if (!d->inode) {
+        dput(d);
+        *err = -ENOENT;
+        return 0;
+    }
+    return d;
+}
+
+// Mount fs on sb with the given root inode
+static bool d_alloc_root(struct super_block* sb, void* fs, const struct inode* root) {
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    struct dentry* d = obj_alloc(&dentry_cache);
+    struct inode* inode = d ? iget_locked(sb, root) : 0;
+    if (inode) {
+        d->parent = d;
+        d->sb = sb;
+        d->inode = inode;
+        d->refs = 1;                    // For good
+        d->name = d->iname;
+        d->name[0] = '/';
+        d->len = 1;
+        sb->root = d;
+        sb->fs = fs;
+    } else if (d) {
+        obj_free(&dentry_cache, d);
+    }
+    spin_unlock_irqrestore(&dcache_lock, flags);
+    return inode != 0;
+}
+
+// path from sb's root, referenced; 0 with *err set if it can't be resolved
+static struct dentry* path_lookup(struct super_block* sb, const char* path, int32_t* err) {
+    struct dentry* d = sb->root;
+    *err = -ENOENT;
+    if (!d) return 0;
+    dget(d);
+    while (*path) {
+        while (*path == '/') path++;
+        uint32_t len = 0;
+        while (path[len] && path[len] != '/') len++;
+        if (!len) break;
+        const char* name = path;
+        path += len;
+        if (len == 1 && name[0] == '.') continue;
+        struct dentry* next = 0;
+        if (len == 2 && name[0] == '.' && name[1] == '.') {
+            next = d->parent;
+            dget(next);
+        } else if (d->inode->type != INODE_DIR) {
+            *err = -ENOTDIR;
+        } else if (len > DNAME_MAX) {
+            *err = -ENAMETOOLONG;
+        } else {
+            next = d_lookup(d, name, len, err);
+        }
+        dput(d);
+        if (!(d = next)) return 0;
+    }
+    return d;
+}
+
+// A copy of the inode path resolves to (zeroed if none); 0 or a negative errno
+static int32_t path_inode(struct super_block* sb, const char* path, struct inode* out) {
+    int32_t err;
+    struct dentry* d = path_lookup(sb, path, &err);
+    if (!d) {
+        memset(out, 0, sizeof(*out));
+        return err;
+    }
+    *out = *d->inode;
+    dput(d);
+    return 0;
+}
+
+// A name under sb has appeared or gone away: drop what the cache has
+// for it, and for a file that existed every other name cached for it
+// (FAT's long and short names). Those are found through inode ino if
+// it is nonzero and cached, else through the path's own dentry. Only
+// what is cached is walked.
+static void d_invalidate(struct super_block* sb, const char* path, uint32_t ino) {
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    dcache_seq++;
+    struct dentry* d = sb->root;
+    while (d && *path) {
+        while (*path == '/') path++;
+        uint32_t len = 0;
+        while (path[len] && path[len] != '/') len++;
+        if (!len) break;
+        if (len == 2 && path[0] == '.' && path[1] == '.') d = d->parent;
+        else if (len != 1 || path[0] != '.') d = __d_lookup(d, path, len, d_hashfn(d, path, len));
+        path += len;
+    }
+    if (d && !d->hashed) d = 0;
+    struct inode* inode = 0;
+    if (ino) {
+        inode = *i_bucket(sb, ino);
+        while (inode && (inode->sb != sb || inode->ino != ino)) inode = inode->hash_next;
+    }
+    if (!inode && d) inode = d->inode;
+    for (uint32_t i = 0; (d || inode) && i < (1u << DCACHE_HASH_BITS); i++) {
+        for (struct dentry* a = dentry_hash[i], *next; a; a = next) {
+            next = a->hash_next;
+            if (a != d && (!inode || a->inode != inode)) continue;
+            dcache_stats.invalidations++;
+            if (a->refs) d_unhash(a);
+            else d_free(a);
+        }
+    }
+    spin_unlock_irqrestore(&dcache_lock, flags);
+}
+
+static void show_dcache(void) {
+    struct dcache_stats st = dcache_stats;
+    vga_puts("\nDentry cache: ");
+    vga_put_dec(dentry_cache.objects);
+    vga_puts(" names (");
+    vga_put_dec(dentry_negative);
+    vga_puts(" negative, ");
+    vga_put_dec(dentry_unused);
+    vga_puts(" unused), ");
+    vga_put_dec(inode_cache.objects);
+    vga_puts(" inodes (");
+    vga_put_dec(inode_unused);
+    vga_puts(" unused) in ");
+    vga_put_dec(dentry_cache.pages + dname_cache.pages + inode_cache.pages);
+    vga_puts(" pages");
+    vga_puts("\n  ");
+    vga_put_dec(st.lookups);
+    vga_puts(" lookups: ");
+    vga_put_dec(st.hits);
+    vga_puts(" hits (");
+    vga_put_dec(st.negative_hits);
+    vga_puts(" negative), ");
+    vga_put_dec(st.misses);
+    vga_puts(" went to the filesystem, ");
+    vga_put_dec(st.raced);
+    vga_puts(" raced");
+    vga_puts("\n  ");
+    vga_put_dec(st.invalidations);
+    vga_puts(" invalidated; shrunk ");
+    vga_put_dec(st.dentries_shrunk);
+    vga_puts(" names and ");
+    vga_put_dec(st.inodes_shrunk);
+    vga_puts(" inodes");
+}
+
+static void dcache_drop(void) {
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    dcache_shrink(true);
+    spin_unlock_irqrestore(&dcache_lock, flags);
+}
+
+// ==================== VFS ====================
+// One view of every filesystem. The mount table maps path prefixes to
+// filesystems; resolving a path makes it canonical (no ".", "..", or
+// repeated slashes), picks the longest mount prefix and hands the
+// filesystem the rest, always starting with '/'. The table is read
+// under a seqlock: a lookup copies the entry it wants and tries again
+// if a mount changed the table meanwhile, so resolving takes no lock.
+// Open files, with their offsets, live in one table; each thread's
+// descriptors point into it and are closed when it exits. Filesystems
+// whose data is in the page cache can map it for zero-copy reads; the
+// others are only ever copied into the caller's buffer.
+#define VFS_CREATE      0x01            // vfs_open(): make the file if it's missing...
+#define VFS_TRUNC       0x02            // ...empty it...
+#define VFS_APPEND      0x04            // ...write at its end
+#define VFS_END         0xFFFFFFFF      // write op offset: the end of the file
+
+struct vfs_stat {
+    uint32_t ino;
+    uint32_t type;                      // INODE_*
+    uint32_t size;
+};
+
+struct vfs_dirent {
+    char name[DNAME_MAX + 1];
+    uint32_t type;
+    uint32_t size;
+};
+
+struct file {
+    const struct fs_operations* ops;    // 0 = free slot
+    void* fs;
+    uint32_t flags;                     // VFS_*
+    uint32_t pos;                       // Offset, or where readdir is
+    struct vfs_stat st;                 // As of open, size kept up by writes
+    void* priv;                         // The filesystem's own
+};
+
+// Paths are within the filesystem. Ops it doesn't have are 0: without
+// write, mkdir and unlink it is read-only, without map its files are
+// only copied out. Returns are 0 (or a count) or a negative errno.
+struct fs_operations {
+    int32_t (*getattr)(void* fs, const char* path, struct vfs_stat* st);
+    int32_t (*open)(struct file* f, const char* path, uint32_t flags);   // Fills in st and priv
+    void (*release)(struct file* f);
+    int32_t (*read)(struct file* f, uint32_t off, void* buf, uint32_t len);
+    int32_t (*write)(struct file* f, uint32_t off, const void* buf, uint32_t len);
+    int32_t (*readdir)(struct file* f, struct vfs_dirent* d);           // 1, or 0 at the end
+    void* (*map)(struct file* f, uint32_t first, uint32_t count);        // filemap_map() of its pages
+    int32_t (*mkdir)(void* fs, const char* path);
+    int32_t (*unlink)(void* fs, const char* path);
+    void (*show)(const char* path);     // The shell's stat
+};
+
+struct vfsmount {
+    const char* path;                   // Canonical
+    uint32_t len;
+    const struct fs_operations* ops;
+    void* fs;
+};
+
+static struct vfsmount mounts[VFS_MAX_MOUNTS];
+static uint32_t nr_mounts;
+static uint32_t mount_seq;              // Odd while the table is changing
+static spinlock_t mount_lock;           // Between writers
+static struct file vfs_files[VFS_MAX_FILES];
+static spinlock_t vfs_files_lock;
+
+static uint32_t mount_read_begin(void) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&mount_seq, __ATOMIC_ACQUIRE)) & 1) cpu_relax();
+    return seq;
+}
+
+static bool mount_read_retry(uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&mount_seq, __ATOMIC_RELAXED) != seq;
+}
+
+static int32_t vfs_mount(const char* path, const struct fs_operations* ops, void* fs) {
+    int32_t err = 0;
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
+    for (uint32_t i = 0; i < nr_mounts && !err; i++) {
+        if (strcmp(mounts[i].path, path) == 0) err = -EBUSY;
+    }
+    if (!err && nr_mounts == VFS_MAX_MOUNTS) err = -ENOSPC;
+    if (!err) {
+        __atomic_store_n(&mount_seq, mount_seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        mounts[nr_mounts] = (struct vfsmount){ path, strlen(path), ops, fs };
+        nr_mounts++;
+        __atomic_store_n(&mount_seq, mount_seq + 1, __ATOMIC_RELEASE);
+    }
+    spin_unlock_irqrestore(&mount_lock, flags);
+    return err;
+}
+
+// path made absolute and canonical, into out (VFS_PATH_MAX bytes)
+static int32_t vfs_normalize(const char* path, char* out) {
+    uint32_t n = 0;
+    while (*path) {
+        while (*path == '/') path++;
+        uint32_t len = 0;
+        while (path[len] && path[len] != '/') len++;
+        if (!len) break;
+        if (len == 2 && path[0] == '.' && path[1] == '.') {
+            while (n && out[--n] != '/');
+        } else if (len != 1 || path[0] != '.') {
+            if (n + 1 + len >= VFS_PATH_MAX) return -ENAMETOOLONG;
+            out[n++] = '/';
+            memcpy(out + n, path, len);
+            n += len;
+        }
+        path += len;
+    }
+    if (!n) out[n++] = '/';
+    out[n] = '\0';
+    return 0;
+}
+
+// The mount path is on, copied into mnt, and the path within it (in
+// buf, VFS_PATH_MAX bytes); 0 with *err set if it can't be resolved
+static const char* vfs_resolve(const char* path, struct vfsmount* mnt, char* buf, int32_t* err) {
+    if ((*err = vfs_normalize(path, buf))) return 0;
+    bool found;
+    uint32_t seq;
+    do {
+        seq = mount_read_begin();
+        found = false;
+        for (uint32_t i = 0; i < nr_mounts; i++) {
+            const struct vfsmount* m = &mounts[i];
+            if (found && m->len <= mnt->len) continue;
+            if (m->len == 1 || (!memcmp(buf, m->path, m->len) && (!buf[m->len] || buf[m->len] == '/'))) {
+                *mnt = *m;
+                found = true;
+            }
+        }
+    } while (mount_read_retry(seq));
+    if (!found) {
+        *err = -ENOENT;
+        return 0;
+    }
+    const char* rest = mnt->len == 1 ? buf : buf + mnt->len;
+    return *rest ? rest : "/";
+}
+
+// The last components of the mounts directly under dir (canonical)
+static uint32_t vfs_submounts(const char* dir, const char** names, uint32_t max) {
+    uint32_t n, dir_len = strcmp(dir, "/") ? strlen(dir) : 0;
+    uint32_t seq;
+    do {
+        seq = mount_read_begin();
+        n = 0;
+        for (uint32_t i = 0; i < nr_mounts && n < max; i++) {
+            const char* p = mounts[i].path;
+            if (mounts[i].len <= dir_len + 1 || memcmp(p, dir, dir_len) || p[dir_len] != '/') continue;
+            p += dir_len + 1;
+            const char* slash = p;
+            while (*slash && *slash != '/') slash++;
+            if (!*slash) names[n++] = p;
+        }
+    } while (mount_read_retry(seq));
+    return n;
+}
+
+// ---- Files ----
+static struct file* vfs_file(int32_t fd) {
+    return fd >= 0 && fd < THREAD_MAX_FDS ? current_thread()->fds[fd] : 0;
+}
+
+static void vfs_put_file(struct file* f) {
+    uint32_t flags = spin_lock_irqsave(&vfs_files_lock);
+    f->ops = 0;
+    spin_unlock_irqrestore(&vfs_files_lock, flags);
+}
+
+// A descriptor for path, or a negative errno
+static int32_t vfs_open(const char* path, uint32_t flags) {
+    char buf[VFS_PATH_MAX];
+    struct vfsmount mnt;
+    int32_t err;
+    const char* rest = vfs_resolve(path, &mnt, buf, &err);
+    if (!rest) return err;
+    if ((flags & (VFS_CREATE | VFS_TRUNC | VFS_APPEND)) && !mnt.ops->write) return -EROFS;
+    struct thread* t = current_thread();
+    int32_t fd = 0;
+    while (fd < THREAD_MAX_FDS && t->fds[fd]) fd++;
+    if (fd == THREAD_MAX_FDS) return -EMFILE;
+
+    struct file* f = 0;
+    uint32_t irq = spin_lock_irqsave(&vfs_files_lock);
+    for (uint32_t i = 0; i < VFS_MAX_FILES && !f; i++) {
+        if (!vfs_files[i].ops) f = &vfs_files[i];
+    }
+    if (f) f->ops = mnt.ops;
+    spin_unlock_irqrestore(&vfs_files_lock, irq);
+    if (!f) return -ENFILE;
+    f->fs = mnt.fs;
+    f->flags = flags;
+    f->pos = 0;
+    f->priv = 0;
+    memset(&f->st, 0, sizeof(f->st));
+    if ((err = mnt.ops->open(f, rest, flags))) {
+        vfs_put_file(f);
+        return err;
+    }
+    t->fds[fd] = f;
+    return fd;
+}
+
+static int32_t vfs_close(int32_t fd) {
+    struct file* f = vfs_file(fd);
+    if (!f) return -EBADF;
+    current_thread()->fds[fd] = 0;
+    if (f->ops->release) f->ops->release(f);
+    vfs_put_file(f);
+    return 0;
+}
+
+// From thread_exit()
+static void vfs_exit_files(void) {
+    for (int32_t fd = 0; fd < THREAD_MAX_FDS; fd++) vfs_close(fd);
+}
+
+static int32_t vfs_pread(int32_t fd, void* buf, uint32_t len, uint32_t off) {
+    struct file* f = vfs_file(fd);
+    if (!f) return -EBADF;
+    if (f->st.type == INODE_DIR) return -EISDIR;
+    return f->ops->read(f, off, buf, len);
+}
+
+static int32_t vfs_read(int32_t fd, void* buf, uint32_t len) {
+    struct file* f = vfs_file(fd);
+    int32_t n = f ? vfs_pread(fd, buf, len, f->pos) : -EBADF;
+    if (n > 0) f->pos += n;
+    return n;
+}
+
+static int32_t vfs_write(int32_t fd, const void* buf, uint32_t len) {
+    struct file* f = vfs_file(fd);
+    if (!f) return -EBADF;
+    if (f->st.type == INODE_DIR) return -EISDIR;
+    if (!f->ops->write) return -EROFS;
+    bool append = f->flags & VFS_APPEND;
+    int32_t n = f->ops->write(f, append ? VFS_END : f->pos, buf, len);
+    if (n > 0) f->pos = append ? f->st.size : f->pos + n;
+    return n;
+}
+
+// Next entry of a directory: 1, or 0 at its end
+static int32_t vfs_readdir(int32_t fd, struct vfs_dirent* d) {
+    struct file* f = vfs_file(fd);
+    if (!f) return -EBADF;
+    if (f->st.type != INODE_DIR) return -ENOTDIR;
+    return f->ops->readdir(f, d);
+}
+
+static int32_t vfs_fstat(int32_t fd, struct vfs_stat* st) {
+    struct file* f = vfs_file(fd);
+    if (!f) return -EBADF;
+    *st = f->st;
+    return 0;
+}
+
+// Zero-copy: count pages of the file from index first, mapped straight
+// from the page cache until vfs_unmap(); 0 if the filesystem can't, and
+// then vfs_pread() it is
+static void* vfs_map(int32_t fd, uint32_t first, uint32_t count) {
+    struct file* f = vfs_file(fd);
+    return f && f->st.type != INODE_DIR && f->ops->map ? f->ops->map(f, first, count) : 0;
+}
+
+static void vfs_unmap(void* addr, uint32_t count) {
+    filemap_unmap(addr, count);
+}
+
+// ---- Paths ----
+static int32_t vfs_stat(const char* path, struct vfs_stat* st) {
+    char buf[VFS_PATH_MAX];
+    struct vfsmount mnt;
+    int32_t err;
+    const char* rest = vfs_resolve(path, &mnt, buf, &err);
+    return rest ? mnt.ops->getattr(mnt.fs, rest, st) : err;
+}
+
+static int32_t vfs_mkdir(const char* path) {
+    char buf[VFS_PATH_MAX];
+    struct vfsmount mnt;
+    int32_t err;
+    const char* rest = vfs_resolve(path, &mnt, buf, &err);
+    if (!rest) return err;
+    return mnt.ops->mkdir ? mnt.ops->mkdir(mnt.fs, rest) : -EROFS;
+}
+
+static int32_t vfs_unlink(const char* path) {
+    char buf[VFS_PATH_MAX];
+    struct vfsmount mnt;
+    int32_t err;
+    const char* rest = vfs_resolve(path, &mnt, buf, &err);
+    if (!rest) return err;
+    if (!strcmp(rest, "/")) return -EBUSY;      // A mount point
+    return mnt.ops->unlink ? mnt.ops->unlink(mnt.fs, rest) : -EROFS;
+}
+
+// ---- Shell view ----
+static void vfs_put_error(int32_t err) {
+    vga_puts("\n");
+    vga_puts(strerror(err));
+}
+
+static void vfs_ls(const char* path) {
+    char canon[VFS_PATH_MAX];
+    struct vfs_stat st = {0};
+    int32_t err = vfs_normalize(path, canon);
+    int32_t fd = err ? err : vfs_open(canon, 0);
+    if (fd < 0) {
+        vfs_put_error(fd);
+        return;
+    }
+    vfs_fstat(fd, &st);
+    if (st.type != INODE_DIR) {
+        const char* name = canon;
+        for (const char* p = canon; *p; p++) {
+            if (*p == '/') name = p + 1;
+        }
+        vga_puts("\n");
+        vga_put_dec_width(st.size, 10);
+        vga_puts("  ");
+        vga_puts(name);
+        vfs_close(fd);
+        return;
+    }
+    struct vfs_dirent* d = (struct vfs_dirent*)pmm_alloc_page();
+    while (d && (err = vfs_readdir(fd, d)) > 0) {
+        vga_puts("\n");
+        if (d->type == INODE_DIR) vga_puts("         -");
+        else vga_put_dec_width(d->size, 10);
+        vga_puts("  ");
+        vga_puts(d->name);
+        if (d->type == INODE_DIR) vga_putc('/');
+    }
+    if (!d || err < 0) vfs_put_error(d ? err : -ENOMEM);
+    if (d) pmm_free_page((uint32_t)d);
+    vfs_close(fd);
+
+    // Mount points look like directories of the filesystem they're on
+    const char* names[VFS_MAX_MOUNTS];
+    uint32_t n = vfs_submounts(canon, names, VFS_MAX_MOUNTS);
+    for (uint32_t i = 0; i < n; i++) {
+        vga_puts("\n         -  ");
+        vga_puts(names[i]);
+        vga_putc('/');
+    }
+}
+
+// Mapped a window at a time where the filesystem can, so the text is
+// printed straight from the page cache; copied a page at a time if not
+static void vfs_cat(const char* path) {
+    struct vfs_stat st = {0};
+    int32_t fd = vfs_open(path, 0);
+    if (fd >= 0) {
+        vfs_fstat(fd, &st);
+        if (st.type == INODE_DIR) {
+            vfs_close(fd);
+            fd = -EISDIR;
+        }
+    }
+    if (fd < 0) {
+        vfs_put_error(fd);
+        return;
+    }
+    uint8_t* buf = 0;
+    vga_puts("\n");
+    for (uint32_t off = 0; off < st.size;) {
+        uint32_t n = st.size - off < VMALLOC_MAX_PAGES * PAGE_SIZE ? st.size - off : VMALLOC_MAX_PAGES * PAGE_SIZE;
+        uint32_t pages = (n + PAGE_SIZE - 1) / PAGE_SIZE;
+        const uint8_t* data = vfs_map(fd, off / PAGE_SIZE, pages);
+        if (data) {
+            vga_put_text(data, n);
+            vfs_unmap((void*)data, pages);
+            off += n;
+            continue;
+        }
+        if (!buf && !(buf = (uint8_t*)pmm_alloc_page())) {
+            vfs_put_error(-ENOMEM);
+            break;
+        }
+        int32_t got = vfs_pread(fd, buf, n < PAGE_SIZE ? n : PAGE_SIZE, off);
+        if (got <= 0) {
+            if (got < 0) vfs_put_error(got);
+            break;
+        }
+        vga_put_text(buf, got);
+        off += got;
+    }
+    if (buf) pmm_free_page((uint32_t)buf);
+    vfs_close(fd);
+}
+
+static void vfs_show(const char* path) {
+    char buf[VFS_PATH_MAX];
+    struct vfsmount mnt;
+    int32_t err;
+    const char* rest = vfs_resolve(path, &mnt, buf, &err);
+    if (rest) mnt.ops->show(rest);
+    else vfs_put_error(err);
+}
+
+// Whole file (up to max bytes); -1 if it isn't a file
+static int32_t shell_read_file(const char* path, void* buf, uint32_t max) {
+    int32_t fd = vfs_open(path, 0);
+    if (fd < 0) return -1;
+    uint32_t total = 0;
+    int32_t n = 0;
+    while (total < max && (n = vfs_read(fd, (uint8_t*)buf + total, max - total)) > 0) total += n;
+    vfs_close(fd);
+    return n < 0 ? -1 : (int32_t)total;
+}
+
+// Searched in order for a command the shell doesn't know, which is then
+// run as a script
+static const char* const shell_search_path[] = { "/bin", "/lfs/bin", "/ext2/bin", "/disk/bin" };
+
+// First file called name along the search path, into path. On the disks
+// each try is a dentry cache lookup, so searching for the same command
+// again reads no directory, whether or not it was found.
+static bool shell_find_command(const char* name, char* path, uint32_t size) {
+    for (uint32_t i = 0; i < sizeof(shell_search_path) / sizeof(shell_search_path[0]); i++) {
+        uint32_t dir = strlen(shell_search_path[i]);
+        struct vfs_stat st;
+        if (dir + 1 + strlen(name) >= size) continue;
+        strcpy(path, shell_search_path[i]);
+        path[dir] = '/';
+        strcpy(path + dir + 1, name);
+        if (!vfs_stat(path, &st) && st.type == INODE_FILE) return true;
+    }
+    return false;
+}
+
+// ==================== FAT FILESYSTEM ====================
+// Read-only FAT16/FAT32, found through the MBR partition table (or a
+// BPB in sector 0) of the first block device that has one. All reads,
+// FAT sectors included, go through the buffer cache. Opening a file
+// walks its cluster chain once into a sorted extent map (runs of
+// consecutive clusters), so reading at any offset is a binary search
+// over the extents rather than a walk down the chain.
+#define FAT_ATTR_READONLY   0x01
+#define FAT_ATTR_HIDDEN     0x02
+#define FAT_ATTR_SYSTEM     0x04
+#define FAT_ATTR_VOLUME     0x08
+#define FAT_ATTR_DIR        0x10
+#define FAT_ATTR_LFN        0x0F
+#define FAT_NAME_MAX        255
+#define FAT_INLINE_EXTENTS  4
+
+struct fat_fs {
+    struct block_device* dev;
+    uint32_t start;                     // First sector of the volume on dev
+    uint32_t type;                      // 16 or 32
+    uint32_t sectors_per_cluster;
+    uint32_t cluster_bytes;
+    uint32_t fat_start;                 // Volume-relative sectors
+    uint32_t fat_size;                  // Sectors per FAT copy
+    uint32_t nfats;
+    uint32_t root_start;                // FAT16 fixed root directory
+    uint32_t root_sectors;
+    uint32_t data_start;
+    uint32_t clusters;                  // Data clusters, numbered from 2
+    uint32_t root_cluster;              // FAT32
+    uint32_t fsinfo;                    // FAT32 FSInfo sector, 0 if none
+    char label[12];
+};
+
+struct fat_extent {
+    uint32_t file_cluster;              // Index of the first cluster in the file
+    uint32_t cluster;                   // Where it is on disk
+    uint32_t count;
+};
+
+struct fat_file {
+    struct fat_fs* fs;
+    uint32_t cluster;                   // First cluster, 0 for the FAT16 root
+    uint32_t size;
+    uint8_t attr;
+    struct fat_extent* extents;
+    uint32_t nr_extents;
+    uint32_t extent_pages;              // Backing extents when not inline
+    struct fat_extent inline_extents[FAT_INLINE_EXTENTS];
+};
+
+struct fat_dirent {
+    char name[FAT_NAME_MAX + 1];
+    char short_name[13];
+    uint32_t pos;                       // Directory offset of its first (LFN) entry
+    uint32_t entry;                     // ...and of the short entry
+    uint8_t attr;
+    uint32_t cluster;
+    uint32_t size;
+    uint16_t date, time;
+};
+
+struct fat_dir_iter {
+    struct fat_file dir;
+    uint32_t pos;                       // Byte offset of the next entry
+    uint32_t sector_pos;                // Offset of what sector[] holds
+    uint8_t sector[SECTOR_SIZE];
+    char lfn[FAT_NAME_MAX + 1];
+    uint32_t lfn_pos;                   // Where the current LFN run started
+    uint8_t lfn_sum;
+    bool lfn_valid;
+};
+
+static struct fat_fs fat_volume;
+static struct fat_fs* fat_root = 0;
+
+static uint32_t get_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Copy len bytes at byte off from volume sector on, through the cache
+static bool fat_read_sectors(struct fat_fs* fs, uint32_t sector, uint32_t off, void* dst, uint32_t len) {
+    uint8_t* out = dst;
+    sector += off / SECTOR_SIZE;
+    off %= SECTOR_SIZE;
+    while (len) {
+        uint32_t abs = fs->start + sector;
+        struct buf* b = bread(fs->dev, abs / BUF_SECTORS);
+        if (!b) return false;
+        uint32_t boff = (abs % BUF_SECTORS) * SECTOR_SIZE + off;
+        uint32_t n = PAGE_SIZE - boff < len ? PAGE_SIZE - boff : len;
+        memcpy(out, b->data + boff, n);
+        brelse(b);
+        out += n;
+        len -= n;
+        sector += (off + n) / SECTOR_SIZE;
+        off = (off + n) % SECTOR_SIZE;
+    }
+    return true;
+}
+
+static uint32_t fat_cluster_sector(struct fat_fs* fs, uint32_t cluster) {
+    return fs->data_start + (cluster - 2) * fs->sectors_per_cluster;
+}
+
+// Next cluster in the chain, or 0 at the end (or on a bad/corrupt entry)
+static uint32_t fat_next(struct fat_fs* fs, uint32_t cluster) {
+    uint32_t next = 0;
+    uint32_t size = fs->type == 32 ? 4 : 2;
+    if (!fat_read_sectors(fs, fs->fat_start, cluster * size, &next, size)) return 0;
+    if (fs->type == 32) next &= 0x0FFFFFFF;
+    if (next < 2 || next >= fs->clusters + 2) return 0;
+    return next;
+}
+
+static void fat_close(struct fat_file* f) {
+    if (f->extent_pages) vfree(f->extents, f->extent_pages);
+    f->extents = 0;
+    f->extent_pages = 0;
+}
+
+// Walk the chain from f->cluster, filling at most max extents if
+// extents isn't 0. Returns the number of extents; *clusters gets the
+// chain length.
+static uint32_t fat_walk_chain(struct fat_file* f, struct fat_extent* extents, uint32_t max, uint32_t* clusters) {
+    uint32_t n = 0, index = 0, prev = 0;
+    for (uint32_t c = f->cluster; c && index < f->fs->clusters; prev = c, c = fat_next(f->fs, c), index++) {
+        if (n && c == prev + 1) {
+            if (extents) extents[n - 1].count++;
+            continue;
+        }
+        if (extents && n == max) break;
+        if (extents) extents[n] = (struct fat_extent){ index, c, 1 };
+        n++;
+    }
+    *clusters = index;
+    return n;
+}
+
+// Build the extent map. Directories get their size from the chain.
+static bool fat_open_cluster(struct fat_fs* fs, uint32_t cluster, uint32_t size, uint8_t attr, struct fat_file* f) {
+    memset(f, 0, sizeof(*f));
+    f->fs = fs;
+    f->cluster = cluster;
+    f->size = size;
+    f->attr = attr;
+    if (!cluster) {
+        if (fs->type == 16) f->size = fs->root_sectors * SECTOR_SIZE;
+        return fs->type == 16 || !(attr & FAT_ATTR_DIR);
+    }
+
+    uint32_t chain;
+    uint32_t n = fat_walk_chain(f, 0, 0, &chain);
+    if (n <= FAT_INLINE_EXTENTS) {
+        f->extents = f->inline_extents;
+    } else {
+        uint32_t pages = (n * sizeof(struct fat_extent) + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (pages > FAT_EXTENT_PAGES || !(f->extents = vmalloc(pages))) return false;
+        f->extent_pages = pages;
+    }
+    f->nr_extents = fat_walk_chain(f, f->extents, n, &chain);
+    if (attr & FAT_ATTR_DIR) f->size = chain * fs->cluster_bytes;
+    return true;
+}
+
+// Extent holding the file's index'th cluster: binary search
+static const struct fat_extent* fat_find_extent(const struct fat_file* f, uint32_t index) {
+    uint32_t lo = 0, hi = f->nr_extents;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        const struct fat_extent* e = &f->extents[mid];
+        if (index < e->file_cluster) hi = mid;
+        else if (index >= e->file_cluster + e->count) lo = mid + 1;
+        else return e;
+    }
+    return 0;
+}
+
+// Read up to len bytes at off; returns the number read (short at EOF),
+// or -1 on an I/O error or a chain shorter than the file
+static int32_t fat_read(struct fat_file* f, uint32_t off, void* dst, uint32_t len) {
+    struct fat_fs* fs = f->fs;
+    uint8_t* out = dst;
+    if (off >= f->size) return 0;
+    if (len > f->size - off) len = f->size - off;
+    if (!f->cluster) {
+        return fat_read_sectors(fs, fs->root_start, off, out, len) ? (int32_t)len : -1;
+    }
+    uint32_t left = len;
+    while (left) {
+        const struct fat_extent* e = fat_find_extent(f, off / fs->cluster_bytes);
+        if (!e) return -1;
+        // Everything to the end of this extent is contiguous on disk
+        uint32_t rel = off - e->file_cluster * fs->cluster_bytes;
+        uint32_t run = e->count * fs->cluster_bytes - rel;
+        uint32_t n = run < left ? run : left;
+        if (!fat_read_sectors(fs, fat_cluster_sector(fs, e->cluster), rel, out, n)) return -1;
+        out += n;
+        off += n;
+        left -= n;
+    }
+    return len;
+}
+
+// Iterators live in a page of their own; they are too big for a
+// thread stack
+static struct fat_dir_iter* fat_opendir(struct fat_fs* fs, uint32_t cluster) {
+    struct fat_dir_iter* it = (struct fat_dir_iter*)pmm_alloc_page();
+    if (!it) return 0;
+    if (!cluster && fs->type == 32) cluster = fs->root_cluster;
+    if (!fat_open_cluster(fs, cluster, 0, FAT_ATTR_DIR, &it->dir)) {
+        pmm_free_page((uint32_t)it);
+        return 0;
+    }
+    it->sector_pos = 0xFFFFFFFF;
+    return it;
+}
+
+static void fat_closedir(struct fat_dir_iter* it) {
+    fat_close(&it->dir);
+    pmm_free_page((uint32_t)it);
+}
+
+static uint8_t fat_short_sum(const uint8_t* name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    return sum;
+}
+
+// "NAME    EXT" -> "name.ext", honouring the NT lowercase flags
+static void fat_short_name(const uint8_t* e, char* out) {
+    uint32_t n = 0;
+    for (int i = 0; i < 8 && e[i] != ' '; i++) {
+        char c = (i == 0 && e[0] == 0x05) ? (char)0xE5 : e[i];
+        out[n++] = (e[12] & 0x08) ? tolower(c) : c;
+    }
+    if (e[8] != ' ') {
+        out[n++] = '.';
+        for (int i = 8; i < 11 && e[i] != ' '; i++) out[n++] = (e[12] & 0x10) ? tolower(e[i]) : e[i];
+    }
+    out[n] = '\0';
+}
+
+// Next entry, skipping deleted ones, volume labels, "." and "..".
+// Long names are used when their checksum matches the short entry.
+static bool fat_readdir(struct fat_dir_iter* it, struct fat_dirent* d) {
+    for (; it->pos < it->dir.size; it->pos += 32) {
+        uint32_t in_sector = it->pos % SECTOR_SIZE;
+        if (it->pos - in_sector != it->sector_pos) {
+            if (fat_read(&it->dir, it->pos - in_sector, it->sector, SECTOR_SIZE) != SECTOR_SIZE) return false;
+            it->sector_pos = it->pos - in_sector;
+        }
+        const uint8_t* e = &it->sector[in_sector];
+        if (e[0] == 0) return false;
+        if (e[0] == 0xE5) {
+            it->lfn_valid = false;
+            continue;
+        }
+        if (e[11] == FAT_ATTR_LFN) {
+            uint32_t order = e[0] & 0x1F;
+            if (e[0] & 0x40) {
+                memset(it->lfn, 0, sizeof(it->lfn));
+                it->lfn_pos = it->pos;
+                it->lfn_sum = e[13];
+                it->lfn_valid = true;
+            }
+            if (!order || order > 20 || e[13] != it->lfn_sum) {
+                it->lfn_valid = false;
+                continue;
+            }
+            static const uint8_t offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+            for (uint32_t i = 0; i < 13; i++) {
+                uint16_t ch = e[offsets[i]] | (e[offsets[i] + 1] << 8);
+                uint32_t at = (order - 1) * 13 + i;
+                if (ch == 0 || ch == 0xFFFF || at >= FAT_NAME_MAX) continue;
+                it->lfn[at] = ch < 0x80 ? (char)ch : '?';
+            }
+            continue;
+        }
+        bool lfn = it->lfn_valid && it->lfn_sum == fat_short_sum(e);
+        it->lfn_valid = false;
+        if (e[11] & FAT_ATTR_VOLUME) continue;
+        if (e[0] == '.' && (e[1] == ' ' || (e[1] == '.' && e[2] == ' '))) continue;
+
+        fat_short_name(e, d->short_name);
+        strcpy(d->name, lfn ? it->lfn : d->short_name);
+        d->pos = lfn ? it->lfn_pos : it->pos;
+        d->entry = it->pos;
+        d->attr = e[11];
+        d->cluster = (e[26] | (e[27] << 8)) | ((uint32_t)(e[20] | (e[21] << 8)) << 16);
+        d->size = get_le32(&e[28]);
+        d->time = e[22] | (e[23] << 8);
+        d->date = e[24] | (e[25] << 8);
+        it->pos += 32;
+        return true;
+    }
+    return false;
+}
+
+// ---- Directory index ----
+// A FAT directory is an unsorted array of entries, so a lookup reads
+// all of it. The first lookup in a directory hashes every long and
+// short name, case-folded, into an open-addressed table of entry
+// offsets; later lookups probe it and read back only the candidates.
+// Anything that modifies a directory drops its index.
+struct fat_index_slot {
+    uint32_t hash;
+    uint32_t pos;                       // Entry offset + 1, 0 when empty
+};
+
+struct fat_index {
+    struct fat_fs* fs;
+    uint32_t cluster;
+    struct fat_dir_iter* it;            // 0 when unused; holds the extent map
+    struct fat_index_slot* slots;       // 0 if the directory is too big: scan
+    uint32_t mask;
+    uint32_t pages;
+    uint32_t names;
+    uint32_t last_used;
+};
+
+static struct fat_index fat_indexes[FAT_DIR_INDEXES];
+static struct mutex fat_index_lock;
+static uint32_t fat_index_clock;
+static struct { uint32_t builds, lookups, probes, scans, invalidations; } fat_index_stats;
+
+// FNV-1a over the lowercased name
+static uint32_t fat_name_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    while (*name) h = (h ^ (uint8_t)tolower(*name++)) * 16777619u;
+    return h;
+}
+
+static uint32_t fat_dir_key(struct fat_fs* fs, uint32_t cluster) {
+    return !cluster && fs->type == 32 ? fs->root_cluster : cluster;
+}
+
+static void fat_index_drop(struct fat_index* x) {
+    if (x->slots) vfree(x->slots, x->pages);
+    if (x->it) fat_closedir(x->it);
+    memset(x, 0, sizeof(*x));
+}
+
+static void fat_index_insert(struct fat_index* x, const char* name, uint32_t pos) {
+    uint32_t h = fat_name_hash(name);
+    uint32_t i = h & x->mask;
+    while (x->slots[i].pos) i = (i + 1) & x->mask;
+    x->slots[i] = (struct fat_index_slot){ h, pos + 1 };
+    x->names++;
+}
+
+// Two passes: count the names, then fill a table at most half full.
+// d is scratch.
+static void fat_index_build(struct fat_index* x, struct fat_dirent* d) {
+    struct fat_dir_iter* it = x->it;
+    uint32_t names = 0;
+    for (it->pos = 0, it->lfn_valid = false; fat_readdir(it, d);) names += strcmp(d->name, d->short_name) ? 2 : 1;
+
+    uint32_t size = 16;
+    while (size < names * 2) size *= 2;
+    x->pages = (size * sizeof(struct fat_index_slot) + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (x->pages > FAT_INDEX_PAGES || !(x->slots = vmalloc(x->pages))) {
+        x->slots = 0;
+        return;
+    }
+    x->mask = size - 1;
+    for (it->pos = 0, it->lfn_valid = false; fat_readdir(it, d) && x->names < names;) {
+        fat_index_insert(x, d->name, d->pos);
+        if (strcmp(d->name, d->short_name)) fat_index_insert(x, d->short_name, d->pos);
+    }
+    fat_index_stats.builds++;
+}
+
+// Caller holds fat_index_lock
+static struct fat_index* fat_index_get(struct fat_fs* fs, uint32_t cluster, struct fat_dirent* d) {
+    struct fat_index* victim = &fat_indexes[0];
+    cluster = fat_dir_key(fs, cluster);
+    for (uint32_t i = 0; i < FAT_DIR_INDEXES; i++) {
+        struct fat_index* x = &fat_indexes[i];
+        if (x->it && x->fs == fs && x->cluster == cluster) {
+            x->last_used = ++fat_index_clock;
+            return x;
+        }
+        if (!x->it || (victim->it && x->last_used < victim->last_used)) victim = x;
+    }
+    fat_index_drop(victim);
+    if (!(victim->it = fat_opendir(fs, cluster))) return 0;
+    victim->fs = fs;
+    victim->cluster = cluster;
+    victim->last_used = ++fat_index_clock;
+    fat_index_build(victim, d);
+    return victim;
+}
+
+static bool fat_name_matches(const struct fat_dirent* d, const char* name) {
+    return strcasecmp(d->name, name) == 0 || strcasecmp(d->short_name, name) == 0;
+}
+
+// Find name (long or short, any case) in a directory
+static bool fat_dir_find(struct fat_fs* fs, uint32_t cluster, const char* name, struct fat_dirent* d) {
+    bool found = false;
+    mutex_lock(&fat_index_lock);
+    struct fat_index* x = fat_index_get(fs, cluster, d);
+    fat_index_stats.lookups++;
+    if (x && x->slots) {
+        uint32_t h = fat_name_hash(name);
+        for (uint32_t i = h & x->mask; !found && x->slots[i].pos; i = (i + 1) & x->mask) {
+            if (x->slots[i].hash != h) continue;
+            fat_index_stats.probes++;
+            x->it->pos = x->slots[i].pos - 1;
+            x->it->lfn_valid = false;
+            found = fat_readdir(x->it, d) && fat_name_matches(d, name);
+        }
+    } else if (x) {
+        fat_index_stats.scans++;
+        x->it->pos = 0;
+        x->it->lfn_valid = false;
+        while (!found && fat_readdir(x->it, d)) found = fat_name_matches(d, name);
+    }
+    mutex_unlock(&fat_index_lock);
+    return found;
+}
+
+static void fat_index_invalidate(struct fat_fs* fs, uint32_t cluster) {
+    mutex_lock(&fat_index_lock);
+    cluster = fat_dir_key(fs, cluster);
+    for (uint32_t i = 0; i < FAT_DIR_INDEXES; i++) {
+        struct fat_index* x = &fat_indexes[i];
+        if (x->it && x->fs == fs && x->cluster == cluster) {
+            fat_index_drop(x);
+            fat_index_stats.invalidations++;
+        }
+    }
+    mutex_unlock(&fat_index_lock);
+}
+
+// Resolve an absolute or root-relative path, case-insensitively.
+// *parent (if not 0) gets the cluster of the directory holding it.
+static bool fat_lookup(struct fat_fs* fs, const char* path, struct fat_dirent* d, uint32_t* parent) {
+    memset(d, 0, sizeof(*d));
+    d->attr = FAT_ATTR_DIR;
+    d->cluster = fs->type == 32 ? fs->root_cluster : 0;
+    strcpy(d->name, "/");
+    char component[FAT_NAME_MAX + 1];
+    while (*path) {
+        while (*path == '/') path++;
+        uint32_t n = 0;
+        while (*path && *path != '/') {
+            if (n < FAT_NAME_MAX) component[n++] = *path;
+            path++;
+        }
+        component[n] = '\0';
+        if (!n) break;
+        if (!(d->attr & FAT_ATTR_DIR)) return false;
+        if (parent) *parent = d->cluster;
+        if (!fat_dir_find(fs, d->cluster, component, d)) return false;
+    }
+    return true;
+}
+
+// Write len bytes at byte off of volume sector on into the cache,
+// which writes the block back later. Doesn't cross a block. The caller
+// calls balance_dirty() once it is done.
+static bool fat_write_sectors(struct fat_fs* fs, uint32_t sector, uint32_t off, const void* src, uint32_t len) {
+    uint32_t abs = fs->start + sector + off / SECTOR_SIZE;
+    struct buf* b = bread(fs->dev, abs / BUF_SECTORS);
+    if (!b) return false;
+    memcpy(b->data + (abs % BUF_SECTORS) * SECTOR_SIZE + off % SECTOR_SIZE, src, len);
+    bdirty(b);
+    brelse(b);
+    return true;
+}
+
+// Volume sector holding byte pos of a directory
+static uint32_t fat_dir_sector(struct fat_file* dir, uint32_t pos) {
+    struct fat_fs* fs = dir->fs;
+    if (!dir->cluster) return fs->root_start + pos / SECTOR_SIZE;
+    const struct fat_extent* e = fat_find_extent(dir, pos / fs->cluster_bytes);
+    if (!e) return 0;
+    uint32_t cluster = e->cluster + pos / fs->cluster_bytes - e->file_cluster;
+    return fat_cluster_sector(fs, cluster) + (pos % fs->cluster_bytes) / SECTOR_SIZE;
+}
+
+// Mark a cluster free in every copy of the FAT
+static bool fat_free_cluster(struct fat_fs* fs, uint32_t cluster) {
+    uint32_t entry = 0, size = fs->type == 32 ? 4 : 2;
+    // FAT32 keeps the top four bits of an entry
+    if (fs->type == 32 && !fat_read_sectors(fs, fs->fat_start, cluster * 4, &entry, 4)) return false;
+    entry &= 0xF0000000;
+    for (uint32_t i = 0; i < fs->nfats; i++) {
+        if (!fat_write_sectors(fs, fs->fat_start + i * fs->fat_size, cluster * size, &entry, size)) return false;
+    }
+    return true;
+}
+
+// FAT32 keeps a free cluster count and a hint where to look for one in
+// FSInfo, which other systems trust: add freed clusters from first on.
+// An unknown count (0xFFFFFFFF) stays unknown.
+static bool fat_fsinfo_freed(struct fat_fs* fs, uint32_t freed, uint32_t first) {
+    uint8_t sig[4];
+    uint32_t info[2];                   // Free count, next free
+    if (!fs->fsinfo || !freed) return true;
+    if (!fat_read_sectors(fs, fs->fsinfo, 484, sig, 4) || !fat_read_sectors(fs, fs->fsinfo, 488, info, 8)) return false;
+    if (get_le32(sig) != 0x61417272) return true;
+    if (info[0] != 0xFFFFFFFF) info[0] = info[0] + freed <= fs->clusters ? info[0] + freed : 0xFFFFFFFF;
+    if (info[1] == 0xFFFFFFFF || first < info[1]) info[1] = first;
+    return fat_write_sectors(fs, fs->fsinfo, 488, info, 8);
+}
+
+// Delete a file: its entries (long name and short) become 0xE5, then
+// its chain is freed and FSInfo told. The parent's index, and the
+// directory sector its iterator holds, are dropped once the entries
+// are gone.
+static bool fat_remove(struct fat_fs* fs, uint32_t parent, const struct fat_dirent* d) {
+    struct fat_file dir;
+    if (!fat_open_cluster(fs, fat_dir_key(fs, parent), 0, FAT_ATTR_DIR, &dir)) return false;
+    bool ok = true;
+    static const uint8_t deleted = 0xE5;
+    for (uint32_t pos = d->pos; ok && pos <= d->entry; pos += 32) {
+        uint32_t sector = fat_dir_sector(&dir, pos);
+        ok = sector && fat_write_sectors(fs, sector, pos % SECTOR_SIZE, &deleted, 1);
+    }
+    fat_close(&dir);
+    fat_index_invalidate(fs, parent);
+    uint32_t freed = 0, first = ~0u;
+    for (uint32_t c = d->cluster; ok && c && freed < fs->clusters; ) {
+        uint32_t next = fat_next(fs, c);
+        ok = fat_free_cluster(fs, c);
+        if (ok && c < first) first = c;
+        if (ok) freed++;
+        c = next;
+    }
+    return fat_fsinfo_freed(fs, freed, first) && ok;
+}
+
+// ---- Dentry cache ----
+// A file's inode number is where its short entry is on the volume, so
+// its long and short names, in any case, are one inode; data[] is its
+// first cluster and size.
+#define FAT_ROOT_INO 1                  // Sector 0 is the boot sector: no entry there
+
+// d's inode number, d being in directory parent; 0 on error
+static uint32_t fat_ino(struct fat_fs* fs, uint32_t parent, const struct fat_dirent* d) {
+    struct fat_file dir;
+    if (!fat_open_cluster(fs, fat_dir_key(fs, parent), 0, FAT_ATTR_DIR, &dir)) return 0;
+    uint32_t sector = fat_dir_sector(&dir, d->entry);
+    fat_close(&dir);
+    return sector ? sector * (SECTOR_SIZE / 32) + d->entry % SECTOR_SIZE / 32 : 0;
+}
+
+static int32_t fat_d_lookup(struct super_block* sb, struct inode* dir, const char* name, uint32_t len,
+                            struct inode* out) {
+    struct fat_fs* fs = sb->fs;
+    char cname[FAT_NAME_MAX + 1];
+    struct fat_dirent d;
+    if (len > FAT_NAME_MAX) return -ENOENT;
+    memcpy(cname, name, len);
+    cname[len] = '\0';
+    if (!fat_dir_find(fs, dir->data[0], cname, &d)) return -ENOENT;
+    if (!(out->ino = fat_ino(fs, dir->data[0], &d))) return -EIO;
+    out->type = (d.attr & FAT_ATTR_DIR) ? INODE_DIR : INODE_FILE;
+    out->data[0] = d.cluster;
+    out->data[1] = d.size;
+    return 0;
+}
+
+static const struct super_operations fat_sops = { fat_d_lookup };
+static const struct fs_operations fat_fops;
+static struct super_block fat_sb = { "disk", &fat_sops, 0, 0 };
+
+static bool fat_open_inode(struct fat_fs* fs, const struct inode* inode, struct fat_file* f) {
+    if (inode->type == INODE_DIR) return fat_open_cluster(fs, fat_dir_key(fs, inode->data[0]), 0, FAT_ATTR_DIR, f);
+    return fat_open_cluster(fs, inode->data[0], inode->data[1], 0, f);
+}
+
+static bool fat_parse_bpb(const uint8_t* bpb, struct fat_fs* fs) {
+    memset(fs, 0, sizeof(*fs));
+    if (bpb[510] != 0x55 || bpb[511] != 0xAA) return false;
+    uint32_t bytes_per_sector = bpb[11] | (bpb[12] << 8);
+    uint32_t spc = bpb[13];
+    uint32_t reserved = bpb[14] | (bpb[15] << 8);
+    uint32_t nfats = bpb[16];
+    uint32_t root_entries = bpb[17] | (bpb[18] << 8);
+    uint32_t total = bpb[19] | (bpb[20] << 8);
+    uint32_t fat_size = bpb[22] | (bpb[23] << 8);
+    if (!total) total = get_le32(&bpb[32]);
+    if (!fat_size) fat_size = get_le32(&bpb[36]);
+    if (bytes_per_sector != SECTOR_SIZE || !spc || (spc & (spc - 1)) || !nfats || !fat_size) return false;
+
+    fs->sectors_per_cluster = spc;
+    fs->cluster_bytes = spc * SECTOR_SIZE;
+    fs->fat_start = reserved;
+    fs->fat_size = fat_size;
+    fs->nfats = nfats;
+    fs->root_start = reserved + nfats * fat_size;
+    fs->root_sectors = (root_entries * 32 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    fs->data_start = fs->root_start + fs->root_sectors;
+    if (total <= fs->data_start) return false;
+    fs->clusters = (total - fs->data_start) / spc;
+    // The cluster count alone decides the FAT width
+    if (fs->clusters < 4085) return false;              // FAT12
+    fs->type = fs->clusters < 65525 ? 16 : 32;
+    const uint8_t* label = &bpb[43];
+    if (fs->type == 32) {
+        fs->root_cluster = get_le32(&bpb[44]);
+        fs->fsinfo = bpb[48] | (bpb[49] << 8);
+        if (fs->fsinfo >= reserved || fs->fsinfo == 0xFFFF) fs->fsinfo = 0;
+        label = &bpb[71];
+    }
+    memcpy(fs->label, label, 11);
+    for (int i = 10; i >= 0 && fs->label[i] == ' '; i--) fs->label[i] = '\0';
+    return true;
+}
+
+// Sector sector of dev, pinned in the buffer cache until brelse(*b)
+static const uint8_t* fat_bread_sector(struct block_device* dev, uint32_t sector, struct buf** b) {
+    *b = bread(dev, sector / BUF_SECTORS);
+    return *b ? (*b)->data + (sector % BUF_SECTORS) * SECTOR_SIZE : 0;
+}
+
+// Parse the BPB of a volume starting at sector start of dev
+static bool fat_mount(struct block_device* dev, uint32_t start, struct fat_fs* fs) {
+    struct buf* b;
+    const uint8_t* bpb = fat_bread_sector(dev, start, &b);
+    if (!bpb) return false;
+    bool ok = fat_parse_bpb(bpb, fs);
+    brelse(b);
+    fs->dev = dev;
+    fs->start = start;
+    return ok;
+}
+
+// First FAT volume on any disk: MBR partitions, then a bare BPB
+static void fat_init(void) {
+    static const uint8_t fat_types[] = { 0x04, 0x06, 0x0B, 0x0C, 0x0E };
+    for (uint32_t i = 0; i < block_device_count && !fat_root; i++) {
+        struct block_device* dev = block_devices[i];
+        struct buf* b;
+        const uint8_t* mbr = fat_bread_sector(dev, 0, &b);
+        if (!mbr) continue;
+        uint32_t starts[4] = {0};
+        for (uint32_t p = 0; p < 4 && mbr[510] == 0x55 && mbr[511] == 0xAA; p++) {
+            const uint8_t* e = &mbr[446 + p * 16];
+            for (uint32_t t = 0; t < sizeof(fat_types); t++) {
+                if (e[4] == fat_types[t]) starts[p] = get_le32(&e[8]);
+            }
+        }
+        brelse(b);
+        for (uint32_t p = 0; p < 4 && !fat_root; p++) {
+            if (starts[p] && starts[p] < dev->sectors && fat_mount(dev, starts[p], &fat_volume)) fat_root = &fat_volume;
+        }
+        if (!fat_root && fat_mount(dev, 0, &fat_volume)) fat_root = &fat_volume;
+    }
+    if (fat_root) {
+        struct inode root = { .ino = FAT_ROOT_INO, .type = INODE_DIR, .data = { fat_dir_key(fat_root, 0), 0 } };
+        if (d_alloc_root(&fat_sb, fat_root, &root)) vfs_mount("/disk", &fat_fops, fat_root);
+        else fat_root = 0;
+    }
+}
+
+static void fat_put_date(uint16_t date, uint16_t time) {
+    uint32_t fields[5] = { (date >> 5) & 0xF, date & 0x1F, time >> 11, (time >> 5) & 0x3F, (time & 0x1F) * 2 };
+    vga_put_dec(1980 + (date >> 9));
+    for (uint32_t i = 0; i < 5; i++) {
+        vga_putc(i < 2 ? '-' : i == 2 ? ' ' : ':');
+        if (fields[i] < 10) vga_putc('0');
+        vga_put_dec(fields[i]);
+    }
+}
+
+// Deleting is all the writing there is. Every other spelling of the
+// name is dropped from the dentry cache by inode number.
+static int32_t fat_unlink(void* fs, const char* path) {
+    struct fat_dirent d;
+    uint32_t parent = 0;
+    if (!fat_lookup(fs, path, &d, &parent)) return -ENOENT;
+    if (d.attr & FAT_ATTR_DIR) return -EISDIR;
+    if (d.attr & FAT_ATTR_READONLY) return -EACCES;
+    uint32_t ino = fat_ino(fs, parent, &d);
+    bool ok = fat_remove(fs, parent, &d);
+    d_invalidate(&fat_sb, path, ino);
+    balance_dirty();
+    return ok ? 0 : -EIO;
+}
+
+static void fat_stat(const char* path) {
+    struct fat_fs* fs = fat_root;
+    struct fat_dirent d;
+    struct fat_file f;
+    if (!fat_lookup(fs, path, &d, 0) || !fat_open_cluster(fs, d.cluster ? d.cluster : (fs->type == 32 ? fs->root_cluster : 0),
+                                                       d.size, d.attr, &f)) {
+        vga_puts("\nNo such file or directory");
+        return;
+    }
+    vga_puts("\n  File: ");
+    vga_puts(d.name);
+    vga_puts((d.attr & FAT_ATTR_DIR) ? "  (directory)" : "  (file)");
+    vga_puts("\n  Size: ");
+    vga_put_dec(f.size);
+    vga_puts("  Clusters: ");
+    uint32_t clusters = 0;
+    for (uint32_t i = 0; i < f.nr_extents; i++) clusters += f.extents[i].count;
+    vga_put_dec(clusters);
+    vga_puts(" in ");
+    vga_put_dec(f.nr_extents);
+    vga_puts(" extents, first ");
+    vga_put_dec(f.cluster);
+    if (d.date) {
+        vga_puts("\n  Modified: ");
+        fat_put_date(d.date, d.time);
+    }
+    if (d.attr & (FAT_ATTR_READONLY | FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM)) {
+        vga_puts("\n  Attributes:");
+        if (d.attr & FAT_ATTR_READONLY) vga_puts(" read-only");
+        if (d.attr & FAT_ATTR_HIDDEN) vga_puts(" hidden");
+        if (d.attr & FAT_ATTR_SYSTEM) vga_puts(" system");
+    }
+    if (strcmp(d.name, "/") == 0) {
+        vga_puts("\n  Volume: ");
+        vga_puts(fs->label[0] ? fs->label : "(no label)");
+        vga_puts(" on ");
+        vga_puts(fs->dev->name);
+        vga_puts(" at sector ");
+        vga_put_dec(fs->start);
+        vga_puts(", FAT");
+        vga_put_dec(fs->type);
+        vga_puts(", ");
+        vga_put_dec(fs->clusters);
+        vga_puts(" x ");
+        vga_put_dec(fs->cluster_bytes);
+        vga_puts(" byte clusters");
+        vga_puts("\n  Dir index: ");
+        vga_put_dec(fat_index_stats.builds);
+        vga_puts(" built, ");
+        vga_put_dec(fat_index_stats.lookups);
+        vga_puts(" lookups, ");
+        vga_put_dec(fat_index_stats.probes);
+        vga_puts(" entries read, ");
+        vga_put_dec(fat_index_stats.scans);
+        vga_puts(" scans, ");
+        vga_put_dec(fat_index_stats.invalidations);
+        vga_puts(" dropped");
+    }
+    fat_close(&f);
+}
+
+// ---- VFS ----
+static int32_t fat_getattr(void* fs, const char* path, struct vfs_stat* st) {
+    (void)fs;
+    struct inode inode;
+    int32_t err = path_inode(&fat_sb, path, &inode);
+    *st = (struct vfs_stat){ inode.ino, inode.type, inode.data[1] };
+    return err;
+}
+
+// Directories get an iterator, files an open fat_file; a page each
+static int32_t fat_vfs_open(struct file* f, const char* path, uint32_t flags) {
+    (void)flags;
+    struct inode inode;
+    int32_t err = path_inode(&fat_sb, path, &inode);
+    if (err) return err;
+    f->st = (struct vfs_stat){ inode.ino, inode.type, inode.data[1] };
+    if (inode.type == INODE_DIR) {
+        f->priv = fat_opendir(f->fs, inode.data[0]);
+    } else if ((f->priv = (void*)pmm_alloc_page()) && !fat_open_inode(f->fs, &inode, f->priv)) {
+        pmm_free_page((uint32_t)f->priv);
+        f->priv = 0;
+    }
+    return f->priv ? 0 : -EIO;
+}
+
+static void fat_vfs_release(struct file* f) {
+    if (f->st.type == INODE_DIR) {
+        fat_closedir(f->priv);
+    } else {
+        fat_close(f->priv);
+        pmm_free_page((uint32_t)f->priv);
+    }
+}
+
+static int32_t fat_vfs_read(struct file* f, uint32_t off, void* buf, uint32_t len) {
+    int32_t n = fat_read(f->priv, off, buf, len);
+    return n < 0 ? -EIO : n;
+}
+
+// Hidden entries aren't listed
+static int32_t fat_vfs_readdir(struct file* f, struct vfs_dirent* out) {
+    struct fat_dir_iter* it = f->priv;
+    struct fat_dirent d;
+    if (it->pos != f->pos) {
+        it->pos = f->pos;
+        it->lfn_valid = false;
+    }
+    bool found;
+    while ((found = fat_readdir(it, &d)) && (d.attr & FAT_ATTR_HIDDEN));
+    f->pos = it->pos;
+    if (!found) return 0;
+    strcpy(out->name, d.name);
+    out->type = (d.attr & FAT_ATTR_DIR) ? INODE_DIR : INODE_FILE;
+    out->size = d.size;
+    return 1;
+}
+
+static const struct fs_operations fat_fops = {
+    fat_getattr, fat_vfs_open, fat_vfs_release, fat_vfs_read, 0, fat_vfs_readdir, 0, 0, fat_unlink, fat_stat
+};
+
+// ==================== LOG-STRUCTURED FILESYSTEM ====================
+// BloodOS's own writable filesystem, in an MBR partition of type 0x7F
+// made by mkfs.lfs. Nothing is updated in place. Writes leave file data
+// dirty in the page cache; about a segment's worth at a time, on sync,
+// it is appended to the head of the log in memory with the indirect
+// blocks and inodes that now point at it, and reaches the disk as one
+// sequential write (a partial segment: a summary block saying what
+// each block is, then the blocks). The inode map says where each inode currently is;
+// it and the segment usage table are written only at checkpoints,
+// every LFS_CHECKPOINT_MS, alternating between two regions so a torn
+// write leaves the other one. After a crash the volume is as it was at
+// the last checkpoint.
+//
+// Every block pointer carries the CRC32C of the block it names (the
+// inode map that of each inode, summaries and checkpoints their own),
+// so a corrupted block is reported instead of returned. A segment that
+// empties becomes reusable at the next checkpoint, once nothing on disk
+// refers to it. The cleaner thread keeps LFS_CLEAN_HIGH segments free,
+// copying what is still live out of the segments with the best
+// (1 - u) * age / (1 + u), u being the fraction still in use.
+//
+// Addresses count 4KB blocks from the start of the partition: the
+// superblock, two checkpoint regions (header, inode map, usage table),
+// then the segments.
+#define LFS_MAGIC           0x53464C42  // "BLFS"
+#define LFS_CP_MAGIC        0x50434C42  // "BLCP"
+#define LFS_SUM_MAGIC       0x4D534C42  // "BLSM"
+#define LFS_VERSION         1
+#define LFS_PART_TYPE       0x7F
+#define LFS_BLOCK           PAGE_SIZE
+#define LFS_NDIRECT         10
+#define LFS_ROOT_INO        1
+#define LFS_NAME_MAX        27
+#define LFS_MODE_FILE       1
+#define LFS_MODE_DIR        2
+#define LFS_INDEX_INDIRECT  0xFFFFFFFF  // Summary index of an indirect block...
+#define LFS_INDEX_INODES    0xFFFFFFFE  // ...and of a block of inodes
+#define LFS_LOC_NEW         0xFFFFFFFF  // Inode map: allocated, not yet in the log
+#define LFS_SEG_PENDING     0x01        // Emptied since the last checkpoint
+#define LFS_SEG_SKIP        0x02        // The cleaner couldn't empty it this run
+#define LFS_END             0xFFFFFFFF  // lfs_write_file() offset: append
+
+struct lfs_ptr {
+    uint32_t addr;                      // 0: a hole
+    uint32_t crc;
+};
+
+struct lfs_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blocks;
+    uint32_t seg_blocks;
+    uint32_t nsegs;
+    uint32_t seg_start;
+    uint32_t cp_start[2];
+    uint32_t cp_blocks;                 // Header, inode map, usage table
+    uint32_t max_inodes;
+    uint32_t crc;                       // Of this struct, this field 0
+};
+
+struct lfs_checkpoint {
+    uint32_t magic;
+    uint32_t seq;                       // The newer valid region wins
+    uint32_t log_seq;                   // Next partial segment's number
+    uint32_t head_seg;
+    uint32_t head_off;                  // Where the next partial segment goes
+    uint32_t crc;                       // Of the whole region, this field 0
+};
+
+struct lfs_imap_entry {
+    uint32_t loc;                       // block * LFS_INODES_PER_BLOCK + slot; 0: free
+    uint32_t crc;                       // Of the inode
+};
+
+struct lfs_seg_usage {
+    uint32_t live;                      // Bytes still referenced
+    uint32_t age;                       // log_seq when last written
+};
+
+struct lfs_inode {
+    uint32_t ino;
+    uint16_t mode;
+    uint16_t links;
+    uint32_t size;
+    uint32_t blocks;                    // Data blocks allocated
+    struct lfs_ptr direct[LFS_NDIRECT];
+    struct lfs_ptr indirect;
+    uint8_t reserved[24];
+};
+
+struct lfs_sum_entry {
+    uint32_t ino;
+    uint32_t index;                     // File block, or LFS_INDEX_*
+    uint32_t crc;
+};
+
+struct lfs_summary {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t nblocks;
+    uint32_t crc;                       // Of the block, this field 0
+    struct lfs_sum_entry entries[];
+};
+
+struct lfs_dirent {
+    uint32_t ino;                       // 0: free slot
+    char name[LFS_NAME_MAX + 1];
+};
+
+#define LFS_INODES_PER_BLOCK (LFS_BLOCK / sizeof(struct lfs_inode))
+#define LFS_NINDIRECT        (LFS_BLOCK / sizeof(struct lfs_ptr))
+
+struct lfs_icache {
+    struct lfs_inode di;                // di.ino 0: slot unused
+    uint32_t refs;
+    bool dirty;                         // Newer than the log
+    bool indirect_dirty;
+    uint32_t logged_size;               // di.size as of the last data write-back
+    struct lfs_ptr* indirect;           // Loaded indirect block, or 0
+    uint32_t last_used;
+    struct address_space mapping;       // File data in the page cache
+};
+
+struct lfs_stats {
+    uint32_t partials;                  // Partial segments written
+    uint32_t data_blocks;               // Blocks appended: file data...
+    uint32_t meta_blocks;               // ...indirect blocks and inodes
+    uint32_t device_writes;
+    uint64_t user_bytes;                // Passed to lfs_write()
+    uint32_t checkpoints;
+    uint32_t cleaner_runs;
+    uint32_t segs_cleaned;
+    uint32_t blocks_copied;             // Live blocks the cleaner moved
+    uint32_t crc_errors;
+};
+
+struct lfs_fs {
+    struct block_device* dev;
+    uint32_t start;                     // First sector on dev
+    struct lfs_super sb;
+    uint32_t imap_blocks;
+    uint32_t sut_blocks;
+    struct lfs_imap_entry* imap;
+    struct lfs_seg_usage* sut;
+    uint8_t seg_flags[LFS_MAX_SEGS];
+    uint32_t cp_seq;
+    uint32_t cp_next;                   // Region the next checkpoint goes to
+    uint32_t log_seq;
+    uint32_t head_seg;
+    uint32_t head_off;                  // Where the buffered partial segment goes
+    uint8_t* seg;                       // Its summary, then nblocks blocks
+    uint32_t nblocks;
+    uint8_t* scratch;                   // A block for read-modify-write and packing inodes
+    uint8_t* dir_page;                  // A block of directory entries
+    bool dirty;                         // Changed since the last checkpoint
+    uint32_t last_checkpoint;           // jiffies
+    uint32_t ino_hint;
+    uint32_t tick;
+    bool cleaning;                      // Syncs inside the cleaner leave file data be
+    struct mutex lock;                  // Everything here, for every operation
+    struct lfs_icache icache[LFS_ICACHE];
+    struct lfs_stats stats;
+};
+
+static struct lfs_fs lfs_volume;
+static struct lfs_fs* lfs_root = 0;
+
+static inline uint32_t lfs_seg_base(struct lfs_fs* fs, uint32_t seg) {
+    return fs->sb.seg_start + seg * fs->sb.seg_blocks;
+}
+
+static inline uint32_t lfs_seg_of(struct lfs_fs* fs, uint32_t addr) {
+    return (addr - fs->sb.seg_start) / fs->sb.seg_blocks;
+}
+
+// The next append has to move to another segment
+static inline bool lfs_seg_full(struct lfs_fs* fs) {
+    return fs->head_off + 1 + fs->nblocks >= fs->sb.seg_blocks;
+}
+
+static uint32_t lfs_free_segments(struct lfs_fs* fs) {
+    uint32_t n = 0;
+    for (uint32_t s = 0; s < fs->sb.nsegs; s++) {
+        if (s != fs->head_seg && !fs->sut[s].live && !(fs->seg_flags[s] & LFS_SEG_PENDING)) n++;
+    }
+    return n;
+}
+
+static uint32_t lfs_pending_segments(struct lfs_fs* fs) {
+    uint32_t n = 0;
+    for (uint32_t s = 0; s < fs->sb.nsegs; s++) n += fs->seg_flags[s] & LFS_SEG_PENDING;
+    return n;
+}
+
+// Blocks [addr, addr + count) from the disk, through the buffer cache
+static bool lfs_read_disk(struct lfs_fs* fs, uint32_t addr, uint32_t count, void* dst) {
+    uint32_t sector = fs->start + addr * BUF_SECTORS;
+    uint32_t len = count * LFS_BLOCK;
+    if (sector + count * BUF_SECTORS > fs->dev->sectors) return false;
+    uint8_t* out = dst;
+    while (len) {
+        struct buf* b = bread(fs->dev, sector / BUF_SECTORS);
+        if (!b) return false;
+        uint32_t off = (sector % BUF_SECTORS) * SECTOR_SIZE;
+        uint32_t n = PAGE_SIZE - off < len ? PAGE_SIZE - off : len;
+        memcpy(out, b->data + off, n);
+        brelse(b);
+        out += n;
+        len -= n;
+        sector += n / SECTOR_SIZE;
+    }
+    return true;
+}
+
+static bool lfs_write_disk(struct lfs_fs* fs, uint32_t addr, uint32_t count, const void* src) {
+    uint32_t sector = fs->start + addr * BUF_SECTORS;
+    fs->stats.device_writes++;
+    if (!blk_write(fs->dev, sector, count * BUF_SECTORS, src)) return false;
+    buf_update(fs->dev, sector, count * BUF_SECTORS, src);
+    return true;
+}
+
+// Block addr in the partial segment still in memory, or 0
+static const uint8_t* lfs_buffered(struct lfs_fs* fs, uint32_t addr) {
+    uint32_t first = lfs_seg_base(fs, fs->head_seg) + fs->head_off + 1;
+    return addr >= first && addr < first + fs->nblocks ? fs->seg + (addr - first + 1) * LFS_BLOCK : 0;
+}
+
+// Block addr, from the partial segment still in memory if it is there
+static bool lfs_read_raw(struct lfs_fs* fs, uint32_t addr, void* dst) {
+    const uint8_t* buffered = lfs_buffered(fs, addr);
+    if (!buffered) return lfs_read_disk(fs, addr, 1, dst);
+    memcpy(dst, buffered, LFS_BLOCK);
+    return true;
+}
+
+// The block p names, checked against p's CRC
+static bool lfs_read_block(struct lfs_fs* fs, struct lfs_ptr p, void* dst) {
+    if (!lfs_read_raw(fs, p.addr, dst)) return false;
+    if (crc32c(dst, LFS_BLOCK) == p.crc) return true;
+    fs->stats.crc_errors++;
+    return false;
+}
+
+// bytes at addr are no longer referenced
+static void lfs_kill(struct lfs_fs* fs, uint32_t addr, uint32_t bytes) {
+    if (!addr) return;
+    uint32_t s = lfs_seg_of(fs, addr);
+    fs->sut[s].live = fs->sut[s].live > bytes ? fs->sut[s].live - bytes : 0;
+    if (!fs->sut[s].live && s != fs->head_seg) fs->seg_flags[s] |= LFS_SEG_PENDING;
+    fs->dirty = true;
+}
+
+// Move the head of the log to the next reusable segment
+static bool lfs_next_segment(struct lfs_fs* fs) {
+    uint32_t old = fs->head_seg;
+    for (uint32_t i = 1; i < fs->sb.nsegs; i++) {
+        uint32_t s = (old + i) % fs->sb.nsegs;
+        if (fs->sut[s].live || (fs->seg_flags[s] & LFS_SEG_PENDING)) continue;
+        fs->head_seg = s;
+        fs->head_off = 0;
+        if (!fs->sut[old].live) fs->seg_flags[old] |= LFS_SEG_PENDING;
+        return true;
+    }
+    return false;
+}
+
+// Write the buffered partial segment out in one request. The next one
+// starts after it, or in another segment if this one has no room left.
+static bool lfs_write_partial(struct lfs_fs* fs) {
+    bool ok = true;
+    if (fs->nblocks) {
+        struct lfs_summary* sum = (struct lfs_summary*)fs->seg;
+        sum->magic = LFS_SUM_MAGIC;
+        sum->seq = fs->log_seq++;
+        sum->nblocks = fs->nblocks;
+        sum->crc = 0;
+        sum->crc = crc32c(sum, LFS_BLOCK);
+        ok = lfs_write_disk(fs, lfs_seg_base(fs, fs->head_seg) + fs->head_off, fs->nblocks + 1, fs->seg);
+        fs->stats.partials++;
+        fs->sut[fs->head_seg].age = sum->seq;
+        fs->head_off += fs->nblocks + 1;
+        fs->nblocks = 0;
+        memset(fs->seg, 0, LFS_BLOCK);
+    }
+    if (fs->head_off + 2 > fs->sb.seg_blocks && !lfs_next_segment(fs)) ok = false;
+    return ok;
+}
+
+// Buffer a block for the log, of which live bytes are in use; *p says
+// where it will be
+static bool lfs_append(struct lfs_fs* fs, uint32_t ino, uint32_t index, const void* data,
+                       uint32_t live, struct lfs_ptr* p) {
+    if (lfs_seg_full(fs) && (!lfs_write_partial(fs) || lfs_seg_full(fs))) return false;
+    uint32_t i = fs->nblocks++;
+    uint8_t* dst = fs->seg + (i + 1) * LFS_BLOCK;
+    struct lfs_sum_entry* e = &((struct lfs_summary*)fs->seg)->entries[i];
+    memcpy(dst, data, LFS_BLOCK);
+    p->addr = lfs_seg_base(fs, fs->head_seg) + fs->head_off + 1 + i;
+    p->crc = crc32c(dst, LFS_BLOCK);
+    e->ino = ino;
+    e->index = index;
+    e->crc = p->crc;
+    fs->sut[fs->head_seg].live += live;
+    fs->dirty = true;
+    if (index >= LFS_INDEX_INODES) fs->stats.meta_blocks++;
+    else fs->stats.data_blocks++;
+    return true;
+}
+
+// ---- Inodes ----
+// A small cache of inodes in memory, referenced while in use. Changes
+// stay here (dirty) until lfs_sync() appends them to the log.
+static void lfs_iput(struct lfs_icache* ic) {
+    ic->refs--;
+}
+
+static bool lfs_sync(struct lfs_fs* fs);
+
+static void lfs_icache_drop(struct lfs_icache* ic) {
+    truncate_inode_pages(&ic->mapping, 0);
+    if (ic->indirect) pmm_free_page((uint32_t)ic->indirect);
+    memset(ic, 0, sizeof(*ic));
+}
+
+static const struct address_space_ops lfs_aops;
+
+// A slot for another inode: unused, or the least recently used clean
+// one (its cached pages go with it). If every slot is dirty the
+// metadata is synced first.
+static struct lfs_icache* lfs_icache_slot(struct lfs_fs* fs) {
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        struct lfs_icache* victim = 0;
+        for (uint32_t i = 0; i < LFS_ICACHE; i++) {
+            struct lfs_icache* ic = &fs->icache[i];
+            if (!ic->di.ino) {
+                victim = ic;
+                break;
+            }
+            if (ic->refs || ic->dirty || ic->mapping.ndirty) continue;
+            if (!victim || ic->last_used < victim->last_used) victim = ic;
+        }
+        if (victim) {
+            lfs_icache_drop(victim);
+            victim->mapping.ops = &lfs_aops;
+            victim->mapping.host = fs;
+            return victim;
+        }
+        if (!pass) lfs_sync(fs);
+    }
+    return 0;
+}
+
+static struct lfs_icache* lfs_iget(struct lfs_fs* fs, uint32_t ino) {
+    if (!ino || ino >= fs->sb.max_inodes || !fs->imap[ino].loc) return 0;
+    for (uint32_t i = 0; i < LFS_ICACHE; i++) {
+        struct lfs_icache* ic = &fs->icache[i];
+        if (ic->di.ino == ino) {
+            ic->refs++;
+            ic->last_used = ++fs->tick;
+            return ic;
+        }
+    }
+    struct lfs_imap_entry e = fs->imap[ino];
+    struct lfs_icache* ic = e.loc != LFS_LOC_NEW ? lfs_icache_slot(fs) : 0;
+    if (!ic || !lfs_read_raw(fs, e.loc / LFS_INODES_PER_BLOCK, fs->scratch)) return 0;
+    struct lfs_inode* di = &((struct lfs_inode*)fs->scratch)[e.loc % LFS_INODES_PER_BLOCK];
+    if (di->ino != ino || crc32c(di, sizeof(*di)) != e.crc) {
+        fs->stats.crc_errors++;
+        return 0;
+    }
+    ic->di = *di;
+    ic->logged_size = di->size;
+    ic->refs = 1;
+    ic->last_used = ++fs->tick;
+    return ic;
+}
+
+static struct lfs_icache* lfs_ialloc(struct lfs_fs* fs, uint16_t mode) {
+    uint32_t count = fs->sb.max_inodes - LFS_ROOT_INO - 1;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t ino = LFS_ROOT_INO + 1 + (fs->ino_hint + i) % count;
+        if (fs->imap[ino].loc) continue;
+        struct lfs_icache* ic = lfs_icache_slot(fs);
+        if (!ic) return 0;
+        fs->ino_hint = ino;
+        fs->imap[ino].loc = LFS_LOC_NEW;
+        ic->di.ino = ino;
+        ic->di.mode = mode;
+        ic->di.links = 1;
+        ic->refs = 1;
+        ic->dirty = true;
+        ic->last_used = ++fs->tick;
+        return ic;
+    }
+    return 0;
+}
+
+// The pointer to file block index, loading the indirect block when it
+// is needed; 0 past the largest file or if that fails
+static struct lfs_ptr* lfs_bmap(struct lfs_fs* fs, struct lfs_icache* ic, uint32_t index) {
+    if (index < LFS_NDIRECT) return &ic->di.direct[index];
+    index -= LFS_NDIRECT;
+    if (index >= LFS_NINDIRECT) return 0;
+    if (!ic->indirect) {
+        struct lfs_ptr* page = (struct lfs_ptr*)pmm_alloc_page();
+        if (!page) return 0;
+        if (ic->di.indirect.addr && !lfs_read_block(fs, ic->di.indirect, page)) {
+            pmm_free_page((uint32_t)page);
+            return 0;
+        }
+        ic->indirect = page;
+    }
+    return &ic->indirect[index];
+}
+
+static inline void lfs_dirty_ptr(struct lfs_icache* ic, uint32_t index) {
+    ic->dirty = true;
+    if (index >= LFS_NDIRECT) ic->indirect_dirty = true;
+}
+
+static void lfs_truncate(struct lfs_fs* fs, struct lfs_icache* ic) {
+    uint32_t blocks = (ic->di.size + LFS_BLOCK - 1) / LFS_BLOCK;
+    truncate_inode_pages(&ic->mapping, 0);
+    for (uint32_t i = 0; i < blocks; i++) {
+        struct lfs_ptr* p = lfs_bmap(fs, ic, i);
+        if (!p) break;
+        lfs_kill(fs, p->addr, LFS_BLOCK);
+        p->addr = 0;
+    }
+    lfs_kill(fs, ic->di.indirect.addr, LFS_BLOCK);
+    if (ic->indirect) pmm_free_page((uint32_t)ic->indirect);
+    ic->indirect = 0;
+    ic->indirect_dirty = false;
+    memset(&ic->di.indirect, 0, sizeof(ic->di.indirect));
+    ic->di.size = 0;
+    ic->di.blocks = 0;
+    ic->logged_size = 0;
+    ic->dirty = true;
+}
+
+// Truncate ic, give its inode number back and forget it
+static void lfs_ifree(struct lfs_fs* fs, struct lfs_icache* ic) {
+    struct lfs_imap_entry* e = &fs->imap[ic->di.ino];
+    lfs_truncate(fs, ic);
+    if (e->loc != LFS_LOC_NEW) lfs_kill(fs, e->loc / LFS_INODES_PER_BLOCK, sizeof(struct lfs_inode));
+    e->loc = 0;
+    e->crc = 0;
+    lfs_icache_drop(ic);
+}
+
+// One block of packed inodes into the log; the inode map follows them.
+// Inside the cleaner, whose syncs leave file data be, an inode goes in
+// with no more size than its data in the log has, and stays dirty.
+static bool lfs_put_inodes(struct lfs_fs* fs, struct lfs_icache** members, uint32_t n) {
+    struct lfs_inode* blk = (struct lfs_inode*)fs->scratch;
+    struct lfs_ptr p;
+    for (uint32_t i = 0; i < n && fs->cleaning; i++) {
+        if (blk[i].size > members[i]->logged_size) blk[i].size = members[i]->logged_size;
+    }
+    bool ok = lfs_append(fs, 0, LFS_INDEX_INODES, blk, n * sizeof(struct lfs_inode), &p);
+    for (uint32_t i = 0; ok && i < n; i++) {
+        struct lfs_imap_entry* e = &fs->imap[blk[i].ino];
+        if (e->loc != LFS_LOC_NEW) lfs_kill(fs, e->loc / LFS_INODES_PER_BLOCK, sizeof(struct lfs_inode));
+        e->loc = p.addr * LFS_INODES_PER_BLOCK + i;
+        e->crc = crc32c(&blk[i], sizeof(struct lfs_inode));
+        members[i]->dirty = blk[i].size != members[i]->di.size;
+    }
+    memset(blk, 0, LFS_BLOCK);
+    return ok;
+}
+
+// Append every dirty page, indirect block and inode, then write the
+// partial segment out: after this the log has everything but the inode
+// map and usage table, which wait for the checkpoint
+static bool lfs_sync(struct lfs_fs* fs) {
+    struct lfs_icache* members[LFS_INODES_PER_BLOCK];
+    uint32_t n = 0;
+    bool ok = true;
+    for (uint32_t i = 0; i < LFS_ICACHE && !fs->cleaning; i++) {
+        struct lfs_icache* ic = &fs->icache[i];
+        if (ic->mapping.ndirty && !filemap_writeback(&ic->mapping)) return false;
+        ic->logged_size = ic->di.size;
+    }
+    for (uint32_t i = 0; i < LFS_ICACHE; i++) {
+        struct lfs_icache* ic = &fs->icache[i];
+        if (!ic->indirect_dirty) continue;
+        struct lfs_ptr p;
+        if (!lfs_append(fs, ic->di.ino, LFS_INDEX_INDIRECT, ic->indirect, LFS_BLOCK, &p)) return false;
+        lfs_kill(fs, ic->di.indirect.addr, LFS_BLOCK);
+        ic->di.indirect = p;
+        ic->indirect_dirty = false;
+    }
+    memset(fs->scratch, 0, LFS_BLOCK);
+    for (uint32_t i = 0; i < LFS_ICACHE && ok; i++) {
+        struct lfs_icache* ic = &fs->icache[i];
+        if (!ic->dirty) continue;
+        ((struct lfs_inode*)fs->scratch)[n] = ic->di;
+        members[n++] = ic;
+        if (n == LFS_INODES_PER_BLOCK) {
+            ok = lfs_put_inodes(fs, members, n);
+            n = 0;
+        }
+    }
+    if (n && ok) ok = lfs_put_inodes(fs, members, n);
+    return lfs_write_partial(fs) && ok;
+}
+
+// Sync, then write the inode map and usage table to the older
+// checkpoint region, header last. Segments emptied since the previous
+// checkpoint become reusable.
+static bool lfs_checkpoint(struct lfs_fs* fs) {
+    if (!lfs_sync(fs)) return false;
+    uint32_t region = fs->sb.cp_start[fs->cp_next];
+    struct lfs_checkpoint* cp = (struct lfs_checkpoint*)fs->scratch;
+    memset(cp, 0, LFS_BLOCK);
+    cp->magic = LFS_CP_MAGIC;
+    cp->seq = fs->cp_seq + 1;
+    cp->log_seq = fs->log_seq;
+    cp->head_seg = fs->head_seg;
+    cp->head_off = fs->head_off;
+    uint32_t crc = crc32c_update(~0u, cp, LFS_BLOCK);
+    crc = crc32c_update(crc, fs->imap, fs->imap_blocks * LFS_BLOCK);
+    cp->crc = ~crc32c_update(crc, fs->sut, fs->sut_blocks * LFS_BLOCK);
+    if (!lfs_write_disk(fs, region + 1, fs->imap_blocks, fs->imap) ||
+        !lfs_write_disk(fs, region + 1 + fs->imap_blocks, fs->sut_blocks, fs->sut) ||
+        !lfs_write_disk(fs, region, 1, cp)) {
+        return false;
+    }
+    fs->cp_seq++;
+    fs->cp_next ^= 1;
+    for (uint32_t s = 0; s < fs->sb.nsegs; s++) fs->seg_flags[s] &= ~LFS_SEG_PENDING;
+    fs->dirty = false;
+    fs->last_checkpoint = jiffies;
+    fs->stats.checkpoints++;
+    return true;
+}
+
+// ---- Cleaner ----
+// Copy a block the summary entry e describes if it is still live: its
+// owner's pointer (or the inode map) still names addr. Inodes and
+// indirect blocks just get marked dirty; the sync at the end of the
+// segment moves them.
+static void lfs_clean_block(struct lfs_fs* fs, const struct lfs_sum_entry* e, uint32_t addr, uint8_t* blk) {
+    if (e->index == LFS_INDEX_INODES) {
+        if (!lfs_read_disk(fs, addr, 1, blk)) return;
+        const struct lfs_inode* inodes = (const struct lfs_inode*)blk;
+        for (uint32_t i = 0; i < LFS_INODES_PER_BLOCK; i++) {
+            uint32_t ino = inodes[i].ino;
+            if (!ino || ino >= fs->sb.max_inodes || fs->imap[ino].loc != addr * LFS_INODES_PER_BLOCK + i) continue;
+            struct lfs_icache* ic = lfs_iget(fs, ino);
+            if (!ic) continue;
+            ic->dirty = true;
+            lfs_iput(ic);
+        }
+        fs->stats.blocks_copied++;
+        return;
+    }
+
+    struct lfs_icache* ic = lfs_iget(fs, e->ino);
+    if (!ic) return;
+    if (e->index == LFS_INDEX_INDIRECT) {
+        if (ic->di.indirect.addr == addr && lfs_bmap(fs, ic, LFS_NDIRECT)) {
+            lfs_dirty_ptr(ic, LFS_NDIRECT);
+            fs->stats.blocks_copied++;
+        }
+    } else {
+        struct lfs_ptr* p = lfs_bmap(fs, ic, e->index);
+        struct lfs_ptr moved;
+        if (p && p->addr == addr && lfs_read_block(fs, *p, blk) &&
+            lfs_append(fs, e->ino, e->index, blk, LFS_BLOCK, &moved)) {
+            lfs_kill(fs, addr, LFS_BLOCK);
+            *p = moved;
+            lfs_dirty_ptr(ic, e->index);
+            fs->stats.blocks_copied++;
+        }
+    }
+    lfs_iput(ic);
+}
+
+// Walk seg's partial segments and move everything live out of it
+static bool lfs_clean_segment(struct lfs_fs* fs, uint32_t seg) {
+    uint8_t* sum_page = (uint8_t*)pmm_alloc_page();
+    uint8_t* blk = (uint8_t*)pmm_alloc_page();
+    uint32_t base = lfs_seg_base(fs, seg);
+    for (uint32_t off = 0; sum_page && blk && off + 1 < fs->sb.seg_blocks; ) {
+        struct lfs_summary* sum = (struct lfs_summary*)sum_page;
+        if (!lfs_read_disk(fs, base + off, 1, sum)) break;
+        uint32_t crc = sum->crc;
+        sum->crc = 0;
+        // Past the last partial segment written since the segment was reused
+        if (sum->magic != LFS_SUM_MAGIC || !sum->nblocks || sum->nblocks >= fs->sb.seg_blocks - off ||
+            crc32c(sum, LFS_BLOCK) != crc) {
+            break;
+        }
+        for (uint32_t i = 0; i < sum->nblocks; i++) lfs_clean_block(fs, &sum->entries[i], base + off + 1 + i, blk);
+        off += sum->nblocks + 1;
+    }
+    if (sum_page) pmm_free_page((uint32_t)sum_page);
+    if (blk) pmm_free_page((uint32_t)blk);
+    bool ok = lfs_sync(fs) && !fs->sut[seg].live;
+    if (ok) fs->stats.segs_cleaned++;
+    return ok;
+}
+
+// Cost-benefit: a segment is worth cleaning in proportion to the space
+// it gives back and how long its data has stayed put, against the cost
+// of reading it and writing its live part again. -1 if none qualifies.
+static int32_t lfs_pick_victim(struct lfs_fs* fs) {
+    uint32_t cap = fs->sb.seg_blocks * LFS_BLOCK;
+    uint64_t best = 0;
+    int32_t victim = -1;
+    for (uint32_t s = 0; s < fs->sb.nsegs; s++) {
+        uint32_t live = fs->sut[s].live;
+        if (s == fs->head_seg || !live || live >= cap || (fs->seg_flags[s] & LFS_SEG_SKIP)) continue;
+        uint32_t age = fs->log_seq - fs->sut[s].age;
+        uint64_t score = div64_32((uint64_t)(cap - live) * (age + 1), cap + live);
+        if (score > best) {
+            best = score;
+            victim = s;
+        }
+    }
+    return victim;
+}
+
+// Clean until target segments are free or reusable at the checkpoint
+// that follows. A segment that doesn't come out empty (an owner's inode
+// couldn't be loaded, say with every icache slot holding dirty pages)
+// is passed over for the next best. Returns how many were cleaned.
+static uint32_t lfs_clean(struct lfs_fs* fs, uint32_t target) {
+    uint32_t cleaned = 0;
+    if (fs->cleaning) return 0;
+    fs->cleaning = true;
+    fs->stats.cleaner_runs++;
+    while (lfs_free_segments(fs) + lfs_pending_segments(fs) < target) {
+        int32_t victim = lfs_pick_victim(fs);
+        if (victim < 0) break;
+        if (lfs_clean_segment(fs, victim)) cleaned++;
+        else fs->seg_flags[victim] |= LFS_SEG_SKIP;
+    }
+    for (uint32_t s = 0; s < fs->sb.nsegs; s++) fs->seg_flags[s] &= ~LFS_SEG_SKIP;
+    if (lfs_pending_segments(fs)) lfs_checkpoint(fs);
+    fs->cleaning = false;
+    return cleaned;
+}
+
+// Writers leave LFS_RESERVE_SEGS free for metadata and the cleaner
+static bool lfs_make_room(struct lfs_fs* fs) {
+    if (lfs_free_segments(fs) > LFS_RESERVE_SEGS) return true;
+    lfs_clean(fs, LFS_RESERVE_SEGS + 1);
+    return lfs_free_segments(fs) > LFS_RESERVE_SEGS;
+}
+
+static void lfs_cleaner_thread(void* arg) {
+    struct lfs_fs* fs = arg;
+    while (1) {
+        msleep(LFS_CLEANER_MS);
+        mutex_lock(&fs->lock);
+        if (lfs_free_segments(fs) < LFS_CLEAN_LOW) lfs_clean(fs, LFS_CLEAN_HIGH);
+        if (fs->dirty && jiffies - fs->last_checkpoint >= LFS_CHECKPOINT_MS * TIMER_HZ / 1000) lfs_checkpoint(fs);
+        mutex_unlock(&fs->lock);
+    }
+}
+
+// ---- Files and directories ----
+// File data lives in the page cache. Pages come straight from the disk
+// (or the partial segment still in memory), not through the buffer
+// cache; writing one back moves its block to the head of the log.
+// Both run under fs->lock, like everything that reaches them.
+static inline struct lfs_icache* lfs_mapping_inode(struct address_space* m) {
+    return (struct lfs_icache*)((uint8_t*)m - offsetof(struct lfs_icache, mapping));
+}
+
+static bool lfs_readpage(struct address_space* m, struct page* page) {
+    struct lfs_fs* fs = m->host;
+    struct lfs_ptr* p = lfs_bmap(fs, lfs_mapping_inode(m), page->index);
+    uint8_t* data = page_address(page);
+    if (!p) return false;
+    if (!p->addr) {
+        memset(data, 0, LFS_BLOCK);     // A hole
+        return true;
+    }
+    const uint8_t* buffered = lfs_buffered(fs, p->addr);
+    if (buffered) memcpy(data, buffered, LFS_BLOCK);
+    else if (!blk_read(fs->dev, fs->start + p->addr * BUF_SECTORS, BUF_SECTORS, data)) return false;
+    if (crc32c(data, LFS_BLOCK) == p->crc) return true;
+    fs->stats.crc_errors++;
+    return false;
+}
+
+static bool lfs_writepage(struct address_space* m, struct page* page) {
+    struct lfs_fs* fs = m->host;
+    struct lfs_icache* ic = lfs_mapping_inode(m);
+    if (page->index >= (ic->di.size + LFS_BLOCK - 1) / LFS_BLOCK) return true;     // Past the end
+    if (lfs_seg_full(fs) && !lfs_make_room(fs)) return false;
+    struct lfs_ptr* p = lfs_bmap(fs, ic, page->index);
+    struct lfs_ptr np;
+    if (!p || !lfs_append(fs, ic->di.ino, page->index, page_address(page), LFS_BLOCK, &np)) return false;
+    if (p->addr) lfs_kill(fs, p->addr, LFS_BLOCK);
+    else ic->di.blocks++;
+    *p = np;
+    lfs_dirty_ptr(ic, page->index);
+    return true;
+}
+
+// For the flusher: all dirty file data to the log
+static bool lfs_writeback(void* host) {
+    struct lfs_fs* fs = host;
+    mutex_lock(&fs->lock);
+    bool ok = lfs_sync(fs);
+    mutex_unlock(&fs->lock);
+    return ok;
+}
+
+static const struct address_space_ops lfs_aops = { lfs_readpage, lfs_writepage, lfs_writeback };
+
+static uint32_t lfs_dirty_pages(struct lfs_fs* fs) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < LFS_ICACHE; i++) n += fs->icache[i].mapping.ndirty;
+    return n;
+}
+
+// Callers hold fs->lock
+static int32_t lfs_read(struct lfs_icache* ic, uint32_t off, void* buf, uint32_t len) {
+    if (off >= ic->di.size) return 0;
+    if (len > ic->di.size - off) len = ic->di.size - off;
+    return filemap_read(&ic->mapping, off, buf, len);
+}
+
+// Into the page cache. Once a segment's worth of file data is dirty it
+// goes to the log, so that it does in long sequential writes. Returns
+// the bytes written, short on error.
+static int32_t lfs_write(struct lfs_fs* fs, struct lfs_icache* ic, uint32_t off, const void* buf, uint32_t len) {
+    const uint8_t* in = buf;
+    uint32_t max = (LFS_NDIRECT + LFS_NINDIRECT) * LFS_BLOCK;
+    uint32_t done = 0;
+    int32_t err = 0;
+    if (off > max) return -EFBIG;
+    if (len > max - off) {
+        len = max - off;
+        err = -EFBIG;
+    }
+    while (done < len) {
+        if (lfs_dirty_pages(fs) >= fs->sb.seg_blocks - 1 && !lfs_sync(fs)) {
+            err = lfs_free_segments(fs) > LFS_RESERVE_SEGS ? -EIO : -ENOSPC;
+            break;
+        }
+        uint32_t n = LFS_BLOCK - (off + done) % LFS_BLOCK;
+        if (n > len - done) n = len - done;
+        uint32_t written = filemap_write(&ic->mapping, off + done, in + done, n, ic->di.size);
+        done += written;
+        if (off + done > ic->di.size) {
+            ic->di.size = off + done;
+            ic->dirty = true;
+        }
+        if (written < n) {
+            err = -EIO;
+            break;
+        }
+    }
+    if (done) fs->dirty = true;
+    fs->stats.user_bytes += done;
+    return done || !err ? (int32_t)done : err;
+}
+
+// Entry name[0..len) of dir: its inode number, and its slot if asked; 0 if none
+static uint32_t lfs_dir_find(struct lfs_fs* fs, struct lfs_icache* dir, const char* name, uint32_t len,
+                             uint32_t* slot) {
+    for (uint32_t off = 0; off < dir->di.size; off += LFS_BLOCK) {
+        int32_t n = lfs_read(dir, off, fs->dir_page, LFS_BLOCK);
+        if (n <= 0) return 0;
+        const struct lfs_dirent* d = (const struct lfs_dirent*)fs->dir_page;
+        for (uint32_t i = 0; i < (uint32_t)n / sizeof(*d); i++) {
+            if (d[i].ino && strlen(d[i].name) == len && !memcmp(d[i].name, name, len)) {
+                if (slot) *slot = off / sizeof(*d) + i;
+                return d[i].ino;
+            }
+        }
+    }
+    return 0;
+}
+
+// Into the first free slot, or at the end
+static int32_t lfs_dir_add(struct lfs_fs* fs, struct lfs_icache* dir, const char* name, uint32_t len, uint32_t ino) {
+    uint32_t slot = dir->di.size / sizeof(struct lfs_dirent);
+    for (uint32_t off = 0; off < dir->di.size && slot == dir->di.size / sizeof(struct lfs_dirent); off += LFS_BLOCK) {
+        int32_t n = lfs_read(dir, off, fs->dir_page, LFS_BLOCK);
+        if (n <= 0) return -EIO;
+        const struct lfs_dirent* d = (const struct lfs_dirent*)fs->dir_page;
+        for (uint32_t i = 0; i < (uint32_t)n / sizeof(*d); i++) {
+            if (!d[i].ino) {
+                slot = off / sizeof(*d) + i;
+                break;
+            }
+        }
+    }
+    struct lfs_dirent d = {0};
+    d.ino = ino;
+    memcpy(d.name, name, len);
+    int32_t n = lfs_write(fs, dir, slot * sizeof(d), &d, sizeof(d));
+    return n == sizeof(d) ? 0 : n < 0 ? n : -ENOSPC;
+}
+
+// path[0..len) from the root, referenced
+static struct lfs_icache* lfs_namei(struct lfs_fs* fs, const char* path, uint32_t len, int32_t* err) {
+    const char* end = path + len;
+    struct lfs_icache* ic = lfs_iget(fs, LFS_ROOT_INO);
+    *err = -EIO;
+    while (ic) {
+        while (path < end && *path == '/') path++;
+        if (path == end) return ic;
+        const char* name = path;
+        while (path < end && *path != '/') path++;
+        uint32_t ino = ic->di.mode == LFS_MODE_DIR ? lfs_dir_find(fs, ic, name, path - name, 0) : 0;
+        *err = ic->di.mode == LFS_MODE_DIR ? -ENOENT : -ENOTDIR;
+        lfs_iput(ic);
+        if (!ino) return 0;
+        ic = lfs_iget(fs, ino);
+        *err = -EIO;
+    }
+    return 0;
+}
+
+// The directory path's last component is in, referenced, and that
+// component
+static struct lfs_icache* lfs_parent(struct lfs_fs* fs, const char* path, const char** name, uint32_t* len,
+                                     int32_t* err) {
+    const char* end = path + strlen(path);
+    while (end > path && end[-1] == '/') end--;
+    const char* last = end;
+    while (last > path && last[-1] != '/') last--;
+    *name = last;
+    *len = end - last;
+    *err = -EINVAL;
+    if (!*len) return 0;                // The root
+    *err = -ENAMETOOLONG;
+    if (*len > LFS_NAME_MAX) return 0;
+    struct lfs_icache* dir = lfs_namei(fs, path, last - path, err);
+    if (dir && dir->di.mode != LFS_MODE_DIR) {
+        lfs_iput(dir);
+        *err = -ENOTDIR;
+        return 0;
+    }
+    return dir;
+}
+
+// ---- Dentry cache ----
+// Names are looked up here on a miss, under fs->lock like everything
+// else; lfs_create() and lfs_remove() invalidate what they change.
+static int32_t lfs_d_lookup(struct super_block* sb, struct inode* dir, const char* name, uint32_t len,
+                            struct inode* out) {
+    struct lfs_fs* fs = sb->fs;
+    if (len > LFS_NAME_MAX) return -ENOENT;
+    mutex_lock(&fs->lock);
+    struct lfs_icache* ic = lfs_iget(fs, dir->ino);
+    uint32_t ino = ic ? lfs_dir_find(fs, ic, name, len, 0) : 0;
+    int32_t err = !ic ? -EIO : !ino ? -ENOENT : 0;
+    if (ic) lfs_iput(ic);
+    if (ino && (ic = lfs_iget(fs, ino))) {
+        out->ino = ino;
+        out->type = ic->di.mode == LFS_MODE_DIR ? INODE_DIR : INODE_FILE;
+        lfs_iput(ic);
+    } else if (ino) {
+        err = -EIO;
+    }
+    mutex_unlock(&fs->lock);
+    return err;
+}
+
+static const struct super_operations lfs_sops = { lfs_d_lookup };
+static struct super_block lfs_sb = { "lfs", &lfs_sops, 0, 0 };
+static const struct fs_operations lfs_fops;
+
+static int32_t lfs_create(struct lfs_fs* fs, const char* path, uint16_t mode, struct lfs_icache** out) {
+    const char* name;
+    uint32_t len;
+    int32_t err;
+    struct lfs_icache* dir = lfs_parent(fs, path, &name, &len, &err);
+    if (!dir) return err;
+    uint32_t ino = lfs_dir_find(fs, dir, name, len, 0);
+    struct lfs_icache* ic = 0;
+    if (ino && (!out || mode != LFS_MODE_FILE)) {
+        err = -EEXIST;
+    } else if (ino) {
+        ic = lfs_iget(fs, ino);
+        err = !ic ? -EIO : ic->di.mode == LFS_MODE_DIR ? -EISDIR : 0;
+    } else if (!(ic = lfs_ialloc(fs, mode))) {
+        err = -ENOSPC;
+    } else if ((err = lfs_dir_add(fs, dir, name, len, ic->di.ino))) {
+        lfs_ifree(fs, ic);
+        ic = 0;
+    } else {
+        d_invalidate(&lfs_sb, path, 0);
+    }
+    lfs_iput(dir);
+    if (err && ic) lfs_iput(ic);
+    else if (out) *out = ic;
+    else if (ic) lfs_iput(ic);
+    return err;
+}
+
+// ---- Operations for the shell ----
+static int32_t lfs_mkdir(struct lfs_fs* fs, const char* path) {
+    mutex_lock(&fs->lock);
+    int32_t err = lfs_create(fs, path, LFS_MODE_DIR, 0);
+    mutex_unlock(&fs->lock);
+    return err;
+}
+
+// Write len bytes at off (LFS_END: at the end) into path, created if
+// needed and emptied first if truncate
+static int32_t lfs_write_file(struct lfs_fs* fs, const char* path, uint32_t off, const void* data, uint32_t len,
+                              bool truncate) {
+    struct lfs_icache* ic;
+    mutex_lock(&fs->lock);
+    int32_t err = lfs_create(fs, path, LFS_MODE_FILE, &ic);
+    if (!err) {
+        if (truncate) lfs_truncate(fs, ic);
+        int32_t n = lfs_write(fs, ic, off == LFS_END ? ic->di.size : off, data, len);
+        err = n < 0 ? n : (uint32_t)n < len ? -ENOSPC : 0;
+        lfs_iput(ic);
+    }
+    mutex_unlock(&fs->lock);
+    balance_dirty();
+    return err;
+}
+
+static int32_t lfs_remove(struct lfs_fs* fs, const char* path) {
+    const char* name;
+    uint32_t len, slot;
+    int32_t err;
+    mutex_lock(&fs->lock);
+    struct lfs_icache* dir = lfs_parent(fs, path, &name, &len, &err);
+    uint32_t ino = dir ? lfs_dir_find(fs, dir, name, len, &slot) : 0;
+    struct lfs_icache* ic = ino ? lfs_iget(fs, ino) : 0;
+    if (dir) err = !ino ? -ENOENT : !ic ? -EIO : 0;
+    if (ic && ic->di.mode == LFS_MODE_DIR) {
+        // Empty means no entry in use
+        for (uint32_t off = 0; !err && off < ic->di.size; off += sizeof(struct lfs_dirent)) {
+            struct lfs_dirent d;
+            if (lfs_read(ic, off, &d, sizeof(d)) != sizeof(d)) err = -EIO;
+            else if (d.ino) err = -ENOTEMPTY;
+        }
+    }
+    if (!err && ic->refs > 1) err = -EBUSY;      // Open
+    if (!err) {
+        struct lfs_dirent d = {0};
+        if (lfs_write(fs, dir, slot * sizeof(d), &d, sizeof(d)) != sizeof(d)) err = -EIO;
+    }
+    if (!err) {
+        lfs_ifree(fs, ic);
+        d_invalidate(&lfs_sb, path, 0);
+    } else if (ic) {
+        lfs_iput(ic);
+    }
+    if (dir) lfs_iput(dir);
+    mutex_unlock(&fs->lock);
+    return err;
+}
+
+// path resolved through the dentry cache, then fs locked and its inode
+// referenced; fs->lock is held on return either way
+static struct lfs_icache* lfs_lookup(struct lfs_fs* fs, const char* path, int32_t* err) {
+    struct inode inode;
+    *err = path_inode(&lfs_sb, path, &inode);
+    mutex_lock(&fs->lock);
+    if (*err) return 0;
+    struct lfs_icache* ic = lfs_iget(fs, inode.ino);
+    if (!ic) *err = fs->imap[inode.ino].loc ? -EIO : -ENOENT;
+    return ic;
+}
+
+static bool lfs_sync_volume(struct lfs_fs* fs) {
+    mutex_lock(&fs->lock);
+    bool ok = lfs_checkpoint(fs);
+    mutex_unlock(&fs->lock);
+    return ok;
+}
+
+// ---- Mount ----
+// Load checkpoint region r into the inode map and usage table; its
+// sequence number, or 0 if it isn't valid
+static uint32_t lfs_load_checkpoint(struct lfs_fs* fs, uint32_t r, struct lfs_checkpoint* cp) {
+    uint32_t region = fs->sb.cp_start[r];
+    if (!lfs_read_disk(fs, region, 1, fs->scratch) ||
+        !lfs_read_disk(fs, region + 1, fs->imap_blocks, fs->imap) ||
+        !lfs_read_disk(fs, region + 1 + fs->imap_blocks, fs->sut_blocks, fs->sut)) {
+        return 0;
+    }
+    *cp = *(struct lfs_checkpoint*)fs->scratch;
+    ((struct lfs_checkpoint*)fs->scratch)->crc = 0;
+    uint32_t crc = crc32c_update(~0u, fs->scratch, LFS_BLOCK);
+    crc = crc32c_update(crc, fs->imap, fs->imap_blocks * LFS_BLOCK);
+    crc = ~crc32c_update(crc, fs->sut, fs->sut_blocks * LFS_BLOCK);
+    if (cp->magic != LFS_CP_MAGIC || crc != cp->crc || cp->head_seg >= fs->sb.nsegs ||
+        cp->head_off + 2 > fs->sb.seg_blocks) {
+        return 0;
+    }
+    return cp->seq;
+}
+
+static void lfs_release(struct lfs_fs* fs) {
+    if (fs->scratch) pmm_free_page((uint32_t)fs->scratch);
+    if (fs->dir_page) pmm_free_page((uint32_t)fs->dir_page);
+    if (fs->imap) vfree(fs->imap, fs->imap_blocks);
+    if (fs->sut) vfree(fs->sut, fs->sut_blocks);
+    if (fs->seg) vfree(fs->seg, fs->sb.seg_blocks);
+    for (uint32_t i = 0; i < LFS_ICACHE; i++) lfs_icache_drop(&fs->icache[i]);
+    memset(fs, 0, sizeof(*fs));
+}
+
+static bool lfs_mount_volume(struct block_device* dev, uint32_t start, struct lfs_fs* fs) {
+    struct lfs_super* sb = &fs->sb;
+    fs->dev = dev;
+    fs->start = start;
+    fs->scratch = (uint8_t*)pmm_alloc_page();
+    if (!fs->scratch || !lfs_read_disk(fs, 0, 1, fs->scratch)) return false;
+    *sb = *(struct lfs_super*)fs->scratch;
+    struct lfs_super check = *sb;
+    check.crc = 0;
+    fs->imap_blocks = (sb->max_inodes * sizeof(struct lfs_imap_entry) + LFS_BLOCK - 1) / LFS_BLOCK;
+    fs->sut_blocks = sb->cp_blocks - 1 - fs->imap_blocks;
+    if (sb->magic != LFS_MAGIC || sb->version != LFS_VERSION || crc32c(&check, sizeof(check)) != sb->crc ||
+        sb->seg_blocks < 2 || sb->seg_blocks > VMALLOC_MAX_PAGES || !sb->nsegs || sb->nsegs > LFS_MAX_SEGS ||
+        sb->max_inodes <= LFS_ROOT_INO + 1 || sb->max_inodes > LFS_MAX_INODES || sb->cp_blocks <= 1 + fs->imap_blocks ||
+        fs->sut_blocks * LFS_BLOCK < sb->nsegs * sizeof(struct lfs_seg_usage) ||
+        sb->seg_start + sb->nsegs * sb->seg_blocks > sb->blocks ||
+        sb->blocks > (dev->sectors - start) / BUF_SECTORS) {
+        return false;
+    }
+
+    fs->imap = vmalloc(fs->imap_blocks);
+    fs->sut = vmalloc(fs->sut_blocks);
+    fs->seg = vmalloc(sb->seg_blocks);
+    fs->dir_page = (uint8_t*)pmm_alloc_page();
+    if (!fs->imap || !fs->sut || !fs->seg || !fs->dir_page) return false;
+
+    struct lfs_checkpoint cp[2];
+    uint32_t seq[2] = { lfs_load_checkpoint(fs, 0, &cp[0]), lfs_load_checkpoint(fs, 1, &cp[1]) };
+    uint32_t r = seq[1] > seq[0];
+    if (!seq[r] || (r == 0 && !lfs_load_checkpoint(fs, 0, &cp[0]))) return false;
+    fs->cp_seq = cp[r].seq;
+    fs->cp_next = r ^ 1;
+    fs->log_seq = cp[r].log_seq;
+    fs->head_seg = cp[r].head_seg;
+    fs->head_off = cp[r].head_off;
+    fs->last_checkpoint = jiffies;
+    struct lfs_icache* root = lfs_iget(fs, LFS_ROOT_INO);
+    if (!root || root->di.mode != LFS_MODE_DIR) return false;
+    lfs_iput(root);
+    return true;
+}
+
+static bool lfs_mount(struct block_device* dev, uint32_t start, struct lfs_fs* fs) {
+    if (lfs_mount_volume(dev, start, fs)) return true;
+    lfs_release(fs);
+    return false;
+}
+
+// First partition of type LFS_PART_TYPE on any disk. Cleaning and
+// periodic checkpoints run in their own thread.
+static void lfs_init(void) {
+    for (uint32_t i = 0; i < block_device_count && !lfs_root; i++) {
+        struct block_device* dev = block_devices[i];
+        struct buf* b = bread(dev, 0);
+        if (!b) continue;
+        uint32_t starts[4] = {0};
+        for (uint32_t p = 0; p < 4 && b->data[510] == 0x55 && b->data[511] == 0xAA; p++) {
+            const uint8_t* e = &b->data[446 + p * 16];
+            if (e[4] == LFS_PART_TYPE) starts[p] = get_le32(&e[8]);
+        }
+        brelse(b);
+        for (uint32_t p = 0; p < 4 && !lfs_root; p++) {
+            if (starts[p] && starts[p] < dev->sectors && lfs_mount(dev, starts[p], &lfs_volume)) lfs_root = &lfs_volume;
+        }
+    }
+    if (!lfs_root) return;
+    struct inode root = { .ino = LFS_ROOT_INO, .type = INODE_DIR };
+    if (!d_alloc_root(&lfs_sb, lfs_root, &root)) {
+        lfs_release(lfs_root);
+        lfs_root = 0;
+        return;
+    }
+    vfs_mount("/lfs", &lfs_fops, lfs_root);
+    thread_create("lfs_cleaner", lfs_cleaner_thread, lfs_root);
+}
+
+// ---- Shell view ----
+static void lfs_put_error(int32_t err) {
+    vga_puts("\n");
+    vga_puts(strerror(err));
+}
+
+static void show_lfs(struct lfs_fs* fs) {
+    struct lfs_stats* st = &fs->stats;
+    uint32_t live = 0;
+    for (uint32_t s = 0; s < fs->sb.nsegs; s++) live += fs->sut[s].live;
+    vga_puts("\n  Volume: ");
+    vga_puts(fs->dev->name);
+    vga_puts(" at sector ");
+    vga_put_dec(fs->start);
+    vga_puts(", ");
+    vga_put_dec(fs->sb.nsegs);
+    vga_puts(" x ");
+    vga_put_dec(fs->sb.seg_blocks * LFS_BLOCK / 1024);
+    vga_puts("KB segments, CRC32C in ");
+    vga_puts(cpu_has_sse42 ? "SSE4.2" : "software");
+    vga_puts("\n  Segments: ");
+    vga_put_dec(lfs_free_segments(fs));
+    vga_puts(" free, ");
+    vga_put_dec(lfs_pending_segments(fs));
+    vga_puts(" freed at next checkpoint; ");
+    vga_put_dec(live / 1024);
+    vga_puts("KB live; head ");
+    vga_put_dec(fs->head_seg);
+    vga_putc('+');
+    vga_put_dec(fs->head_off + fs->nblocks);
+    vga_puts("\n  Log: ");
+    vga_put_dec(st->partials);
+    vga_puts(" partial segments in ");
+    vga_put_dec(st->device_writes);
+    vga_puts(" writes; ");
+    vga_put_dec(st->data_blocks);
+    vga_puts(" data, ");
+    vga_put_dec(st->meta_blocks);
+    vga_puts(" metadata blocks for ");
+    vga_put_dec((uint32_t)(st->user_bytes >> 10));
+    vga_puts("KB written");
+    vga_puts("\n  Checkpoints: ");
+    vga_put_dec(st->checkpoints);
+    vga_puts(" (#");
+    vga_put_dec(fs->cp_seq);
+    vga_puts(fs->dirty ? ", dirty)" : ", clean)");
+    vga_puts("; cleaner: ");
+    vga_put_dec(st->cleaner_runs);
+    vga_puts(" runs, ");
+    vga_put_dec(st->segs_cleaned);
+    vga_puts(" segments, ");
+    vga_put_dec(st->blocks_copied);
+    vga_puts(" blocks copied; ");
+    vga_put_dec(st->crc_errors);
+    vga_puts(" CRC errors");
+}
+
+static void lfs_stat(const char* path) {
+    struct lfs_fs* fs = lfs_root;
+    int32_t err;
+    struct lfs_icache* ic = lfs_lookup(fs, path, &err);
+    if (!ic) {
+        lfs_put_error(err);
+    } else {
+        uint32_t loc = fs->imap[ic->di.ino].loc;
+        vga_puts("\n  File: ");
+        vga_puts(path);
+        vga_puts(ic->di.mode == LFS_MODE_DIR ? "  (directory)" : "  (file)");
+        vga_puts("\n  Size: ");
+        vga_put_dec(ic->di.size);
+        vga_puts("  Blocks: ");
+        vga_put_dec(ic->di.blocks);
+        vga_puts(ic->di.indirect.addr || ic->indirect ? " (indirect)" : "");
+        vga_puts("  Inode: ");
+        vga_put_dec(ic->di.ino);
+        if (loc == LFS_LOC_NEW) {
+            vga_puts(", not yet in the log");
+        } else {
+            vga_puts(" in segment ");
+            vga_put_dec(lfs_seg_of(fs, loc / LFS_INODES_PER_BLOCK));
+        }
+        if (ic->dirty) vga_puts(", dirty");
+        vga_puts("\n  Cached: ");
+        vga_put_dec(ic->mapping.nrpages);
+        vga_puts(" pages, ");
+        vga_put_dec(ic->mapping.ndirty);
+        vga_puts(" dirty");
+        if (ic->di.ino == LFS_ROOT_INO) show_lfs(fs);
+        lfs_iput(ic);
+    }
+    mutex_unlock(&fs->lock);
+}
+
+// ---- VFS ----
+// An open file keeps its inode referenced, and so in memory with its
+// pages; it can't be removed until it is closed.
+static int32_t lfs_getattr(void* fs, const char* path, struct vfs_stat* st) {
+    int32_t err;
+    struct lfs_icache* ic = lfs_lookup(fs, path, &err);
+    if (ic) {
+        *st = (struct vfs_stat){ ic->di.ino, ic->di.mode == LFS_MODE_DIR ? INODE_DIR : INODE_FILE, ic->di.size };
+        lfs_iput(ic);
+    }
+    mutex_unlock(&((struct lfs_fs*)fs)->lock);
+    return err;
+}
+
+static int32_t lfs_vfs_open(struct file* f, const char* path, uint32_t flags) {
+    struct lfs_fs* fs = f->fs;
+    struct lfs_icache* ic;
+    int32_t err;
+    if (flags & VFS_CREATE) {
+        mutex_lock(&fs->lock);
+        err = lfs_create(fs, path, LFS_MODE_FILE, &ic);
+    } else {
+        ic = lfs_lookup(fs, path, &err);
+    }
+    if (!err && ic->di.mode == LFS_MODE_DIR && (flags & (VFS_TRUNC | VFS_APPEND))) {
+        lfs_iput(ic);
+        err = -EISDIR;
+    }
+    if (!err) {
+        if (flags & VFS_TRUNC) lfs_truncate(fs, ic);
+        f->priv = ic;
+        f->st = (struct vfs_stat){ ic->di.ino, ic->di.mode == LFS_MODE_DIR ? INODE_DIR : INODE_FILE, ic->di.size };
+    }
+    mutex_unlock(&fs->lock);
+    return err;
+}
+
+static void lfs_vfs_release(struct file* f) {
+    struct lfs_fs* fs = f->fs;
+    mutex_lock(&fs->lock);
+    lfs_iput(f->priv);
+    mutex_unlock(&fs->lock);
+}
+
+static int32_t lfs_vfs_read(struct file* f, uint32_t off, void* buf, uint32_t len) {
+    struct lfs_fs* fs = f->fs;
+    mutex_lock(&fs->lock);
+    int32_t n = lfs_read(f->priv, off, buf, len);
+    mutex_unlock(&fs->lock);
+    return n;
+}
+
+static int32_t lfs_vfs_write(struct file* f, uint32_t off, const void* buf, uint32_t len) {
+    struct lfs_fs* fs = f->fs;
+    struct lfs_icache* ic = f->priv;
+    mutex_lock(&fs->lock);
+    int32_t n = lfs_write(fs, ic, off == VFS_END ? ic->di.size : off, buf, len);
+    f->st.size = ic->di.size;
+    mutex_unlock(&fs->lock);
+    balance_dirty();
+    return n;
+}
+
+static int32_t lfs_vfs_readdir(struct file* f, struct vfs_dirent* out) {
+    struct lfs_fs* fs = f->fs;
+    struct lfs_icache* dir = f->priv;
+    int32_t ret = 0;
+    mutex_lock(&fs->lock);
+    while (!ret && f->pos < dir->di.size) {
+        struct lfs_dirent d;
+        if (lfs_read(dir, f->pos, &d, sizeof(d)) != sizeof(d)) {
+            ret = -EIO;
+            break;
+        }
+        f->pos += sizeof(d);
+        if (!d.ino) continue;
+        struct lfs_icache* child = lfs_iget(fs, d.ino);
+        strcpy(out->name, d.name);
+        out->type = child && child->di.mode == LFS_MODE_DIR ? INODE_DIR : INODE_FILE;
+        out->size = child ? child->di.size : 0;
+        if (child) lfs_iput(child);
+        ret = 1;
+    }
+    mutex_unlock(&fs->lock);
+    return ret;
+}
+
+static void* lfs_vfs_map(struct file* f, uint32_t first, uint32_t count) {
+    struct lfs_fs* fs = f->fs;
+    struct lfs_icache* ic = f->priv;
+    mutex_lock(&fs->lock);
+    void* addr = filemap_map(&ic->mapping, first, count);
+    mutex_unlock(&fs->lock);
+    return addr;
+}
+
+static int32_t lfs_vfs_mkdir(void* fs, const char* path) {
+    return lfs_mkdir(fs, path);
+}
+
+static int32_t lfs_unlink(void* fs, const char* path) {
+    return lfs_remove(fs, path);
+}
+
+static const struct fs_operations lfs_fops = {
+    lfs_getattr, lfs_vfs_open, lfs_vfs_release, lfs_vfs_read, lfs_vfs_write, lfs_vfs_readdir, lfs_vfs_map,
+    lfs_vfs_mkdir, lfs_unlink, lfs_stat
+};
+
+// ==================== EXT2 FILESYSTEM ====================
+// Read-only ext2 (revisions 0 and 1, 1-4KB blocks) as made by mke2fs on
+// the host, found through a partition of type 0x83 or a superblock at
+// byte 1024 of a whole disk. Mounting reads the superblock and every
+// group descriptor into memory. Everything else goes through the
+// buffer cache, with three small caches on top:
+//  - the inode-table blocks holding recently used inodes stay pinned
+//    (EXT2_ITABLE_CACHE), so a stat or a path walk costs no hash lookup
+//  - EXT2_ICACHE decoded inodes, each with a mapping cache of the last
+//    EXT2_MAP_CACHE pointer blocks it used. A pointer block covers a
+//    window of block-size/4 file blocks, so a sequential read descends
+//    the indirect tree once per window, not once per block
+//  - file reads are split into runs of blocks that are contiguous on
+//    disk and copied a cache block at a time, which the buffer cache
+//    sees as a sequential stream and reads ahead of
+// One mutex per volume covers all of it.
+#define EXT2_SUPER_MAGIC    0xEF53
+#define EXT2_PART_TYPE      0x83        // "Linux"
+#define EXT2_ROOT_INO       2
+#define EXT2_NDIR_BLOCKS    12
+#define EXT2_IND_BLOCK      12
+#define EXT2_DIND_BLOCK     13
+#define EXT2_TIND_BLOCK     14
+#define EXT2_NAME_LEN       255
+#define EXT2_S_IFMT         0xF000
+#define EXT2_S_IFLNK        0xA000
+#define EXT2_S_IFREG        0x8000
+#define EXT2_S_IFDIR        0x4000
+#define EXT2_FT_DIR         2
+#define EXT2_FT_SYMLINK     7
+#define EXT2_INCOMPAT_FILETYPE 0x0002   // The only incompatible feature we read
+
+struct ext2_super {
+    uint32_t inodes_count;
+    uint32_t blocks_count;
+    uint32_t r_blocks_count;
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t first_data_block;
+    uint32_t log_block_size;            // Block size is 1024 << this
+    uint32_t log_frag_size;
+    uint32_t blocks_per_group;
+    uint32_t frags_per_group;
+    uint32_t inodes_per_group;
+    uint32_t mtime;
+    uint32_t wtime;
+    uint16_t mnt_count;
+    uint16_t max_mnt_count;
+    uint16_t magic;
+    uint16_t state;
+    uint16_t errors;
+    uint16_t minor_rev_level;
+    uint32_t lastcheck;
+    uint32_t checkinterval;
+    uint32_t creator_os;
+    uint32_t rev_level;
+    uint16_t def_resuid;
+    uint16_t def_resgid;
+    uint32_t first_ino;                 // Revision 1 on
+    uint16_t inode_size;
+    uint16_t block_group_nr;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+    uint8_t uuid[16];
+    char volume_name[16];
+};
+
+struct ext2_group_desc {
+    uint32_t block_bitmap;
+    uint32_t inode_bitmap;
+    uint32_t inode_table;
+    uint16_t free_blocks_count;
+    uint16_t free_inodes_count;
+    uint16_t used_dirs_count;
+    uint16_t pad;
+    uint32_t reserved[3];
+};
+
+struct ext2_inode {
+    uint16_t mode;
+    uint16_t uid;
+    uint32_t size;
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+    uint32_t dtime;
+    uint16_t gid;
+    uint16_t links_count;
+    uint32_t blocks;                    // 512-byte units
+    uint32_t flags;
+    uint32_t osd1;
+    uint32_t block[15];
+    uint32_t generation;
+    uint32_t file_acl;
+    uint32_t size_high;                 // Regular files: bits 32-63 of the size
+    uint32_t faddr;
+    uint8_t osd2[12];
+};
+
+struct ext2_dirent {
+    uint32_t ino;
+    uint8_t type;                       // EXT2_FT_*, 0 without the filetype feature
+    char name[EXT2_NAME_LEN + 1];
+};
+
+struct ext2_map {
+    uint32_t window;                    // File blocks NDIR + window * ptrs onwards
+    struct buf* b;                      // Pinned; 0 = slot empty or a hole
+    const uint32_t* ptrs;
+    uint32_t last_used;
+};
+
+struct ext2_icache {
+    uint32_t ino;                       // 0 = free
+    uint32_t size;
+    uint32_t last_used;
+    struct ext2_inode di;
+    struct ext2_map map[EXT2_MAP_CACHE];
+};
+
+struct ext2_itable {
+    uint32_t block;                     // Buffer cache block
+    struct buf* b;                      // Pinned, 0 = free
+    uint32_t last_used;
+};
+
+struct ext2_stats {
+    uint32_t itable_hits;
+    uint32_t itable_misses;
+    uint32_t icache_hits;
+    uint32_t icache_misses;
+    uint32_t map_hits;                  // Pointer-block lookups the mapping cache answered
+    uint32_t map_misses;                // ...and walks down the indirect tree
+    uint32_t runs;                      // Contiguous runs read...
+    uint32_t run_blocks;                // ...and the blocks in them
+    uint64_t bytes;
+};
+
+struct ext2_fs {
+    struct block_device* dev;
+    uint32_t start;                     // First sector of the volume on dev
+    struct ext2_super sb;
+    uint32_t block_size;
+    uint32_t sectors_per_block;
+    uint32_t ptrs;                      // Block numbers per pointer block
+    uint32_t inode_size;
+    uint32_t groups;
+    char label[17];
+    struct ext2_group_desc* gd;
+    uint32_t gd_pages;
+    struct mutex lock;
+    uint32_t clock;                     // LRU of the three caches
+    struct ext2_itable itable[EXT2_ITABLE_CACHE];
+    struct ext2_icache icache[EXT2_ICACHE];
+    struct ext2_stats stats;
+};
+
+static struct ext2_fs ext2_volume;
+static struct ext2_fs* ext2_root = 0;
+
+// Copy len bytes at byte off from volume sector on, through the cache
+static bool ext2_read_sectors(struct ext2_fs* fs, uint32_t sector, uint32_t off, void* dst, uint32_t len) {
+    uint8_t* out = dst;
+    sector += off / SECTOR_SIZE;
+    off %= SECTOR_SIZE;
+    while (len) {
+        uint32_t abs = fs->start + sector;
+        struct buf* b = bread(fs->dev, abs / BUF_SECTORS);
+        if (!b) return false;
+        uint32_t boff = (abs % BUF_SECTORS) * SECTOR_SIZE + off;
+        uint32_t n = PAGE_SIZE - boff < len ? PAGE_SIZE - boff : len;
+        memcpy(out, b->data + boff, n);
+        brelse(b);
+        out += n;
+        len -= n;
+        sector += (off + n) / SECTOR_SIZE;
+        off = (off + n) % SECTOR_SIZE;
+    }
+    return true;
+}
+
+// Block blk in its buffer cache block, which holds the whole of it: the
+// volume starts on a block boundary
+static const uint8_t* ext2_bread(struct ext2_fs* fs, uint32_t blk, struct buf** b) {
+    uint32_t abs = fs->start + blk * fs->sectors_per_block;
+    *b = bread(fs->dev, abs / BUF_SECTORS);
+    return *b ? (*b)->data + (abs % BUF_SECTORS) * SECTOR_SIZE : 0;
+}
+
+// ---- Inodes ----
+// Caller holds fs->lock (as for everything down to the shell view)
+static const uint8_t* ext2_itable_get(struct ext2_fs* fs, uint32_t block) {
+    struct ext2_itable* victim = &fs->itable[0];
+    for (uint32_t i = 0; i < EXT2_ITABLE_CACHE; i++) {
+        struct ext2_itable* t = &fs->itable[i];
+        if (t->b && t->block == block) {
+            fs->stats.itable_hits++;
+            t->last_used = ++fs->clock;
+            return t->b->data;
+        }
+        if (!t->b || (victim->b && t->last_used < victim->last_used)) victim = t;
+    }
+    fs->stats.itable_misses++;
+    if (victim->b) brelse(victim->b);
+    victim->b = bread(fs->dev, block);
+    victim->block = block;
+    victim->last_used = ++fs->clock;
+    return victim->b ? victim->b->data : 0;
+}
+
+static bool ext2_read_inode(struct ext2_fs* fs, uint32_t ino, struct ext2_inode* di) {
+    if (!ino || ino > fs->sb.inodes_count) return false;
+    uint32_t group = (ino - 1) / fs->sb.inodes_per_group;
+    if (group >= fs->groups) return false;
+    uint32_t byte = (ino - 1) % fs->sb.inodes_per_group * fs->inode_size;
+    uint32_t abs = fs->start + fs->gd[group].inode_table * fs->sectors_per_block + byte / SECTOR_SIZE;
+    const uint8_t* data = ext2_itable_get(fs, abs / BUF_SECTORS);
+    if (!data) return false;
+    // Inodes are a power of two of at least 128 bytes: never split by a sector
+    memcpy(di, data + (abs % BUF_SECTORS) * SECTOR_SIZE + byte % SECTOR_SIZE, sizeof(*di));
+    return true;
+}
+
+static void ext2_map_drop(struct ext2_icache* ic) {
+    for (uint32_t i = 0; i < EXT2_MAP_CACHE; i++) {
+        if (ic->map[i].b) brelse(ic->map[i].b);
+    }
+    memset(ic->map, 0, sizeof(ic->map));
+}
+
+static struct ext2_icache* ext2_iget(struct ext2_fs* fs, uint32_t ino) {
+    struct ext2_icache* victim = &fs->icache[0];
+    for (uint32_t i = 0; i < EXT2_ICACHE; i++) {
+        struct ext2_icache* ic = &fs->icache[i];
+        if (ic->ino == ino) {
+            fs->stats.icache_hits++;
+            ic->last_used = ++fs->clock;
+            return ic;
+        }
+        if (!ic->ino || (victim->ino && ic->last_used < victim->last_used)) victim = ic;
+    }
+    fs->stats.icache_misses++;
+    ext2_map_drop(victim);
+    victim->ino = 0;
+    if (!ext2_read_inode(fs, ino, &victim->di)) return 0;
+    victim->ino = ino;
+    victim->last_used = ++fs->clock;
+    // Nothing past 4GB is reachable through a 32-bit offset anyway
+    victim->size = (victim->di.mode & EXT2_S_IFMT) == EXT2_S_IFREG && victim->di.size_high ? 0xFFFFFFFF : victim->di.size;
+    return victim;
+}
+
+static bool ext2_is_dir(const struct ext2_icache* ic) {
+    return (ic->di.mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+}
+
+// ---- Block mapping ----
+// Entry index of pointer block blk, 0 if blk is a hole
+static bool ext2_ptr(struct ext2_fs* fs, uint32_t blk, uint32_t index, uint32_t* out) {
+    *out = 0;
+    if (!blk) return true;
+    if (blk >= fs->sb.blocks_count) return false;
+    return ext2_read_sectors(fs, blk * fs->sectors_per_block, index * 4, out, 4);
+}
+
+// The pointer block for a window of the file, through the inode's
+// mapping cache. *ptrs is 0 when the whole window is a hole.
+static bool ext2_map_window(struct ext2_fs* fs, struct ext2_icache* ic, uint32_t window, const uint32_t** ptrs) {
+    struct ext2_map* victim = &ic->map[0];
+    for (uint32_t i = 0; i < EXT2_MAP_CACHE; i++) {
+        struct ext2_map* m = &ic->map[i];
+        if (m->last_used && m->window == window) {
+            fs->stats.map_hits++;
+            m->last_used = ++fs->clock;
+            *ptrs = m->ptrs;
+            return true;
+        }
+        if (m->last_used < victim->last_used) victim = m;
+    }
+    fs->stats.map_misses++;
+
+    // Window 0 is the indirect block, the next ptrs come from the double
+    // indirect one, the ptrs * ptrs after that from the triple
+    uint32_t blk, w = window;
+    if (w == 0) {
+        blk = ic->di.block[EXT2_IND_BLOCK];
+    } else if (--w < fs->ptrs) {
+        if (!ext2_ptr(fs, ic->di.block[EXT2_DIND_BLOCK], w, &blk)) return false;
+    } else {
+        uint32_t mid;
+        w -= fs->ptrs;
+        if (w / fs->ptrs >= fs->ptrs) return false;
+        if (!ext2_ptr(fs, ic->di.block[EXT2_TIND_BLOCK], w / fs->ptrs, &mid) ||
+            !ext2_ptr(fs, mid, w % fs->ptrs, &blk)) return false;
+    }
+    if (blk >= fs->sb.blocks_count) return false;
+
+    if (victim->b) brelse(victim->b);
+    memset(victim, 0, sizeof(*victim));
+    if (blk && !(victim->ptrs = (const uint32_t*)ext2_bread(fs, blk, &victim->b))) return false;
+    victim->window = window;
+    victim->last_used = ++fs->clock;
+    *ptrs = victim->ptrs;
+    return true;
+}
+
+// Disk block of file block lblk (0 = hole). *run gets how many blocks
+// from there on are consecutive on disk, as far as one pointer block goes.
+static bool ext2_bmap(struct ext2_fs* fs, struct ext2_icache* ic, uint32_t lblk, uint32_t* phys, uint32_t* run) {
+    const uint32_t* ptrs = ic->di.block;
+    uint32_t i = lblk, n = EXT2_NDIR_BLOCKS;
+    if (lblk >= EXT2_NDIR_BLOCKS) {
+        if (!ext2_map_window(fs, ic, (lblk - EXT2_NDIR_BLOCKS) / fs->ptrs, &ptrs)) return false;
+        i = (lblk - EXT2_NDIR_BLOCKS) % fs->ptrs;
+        n = fs->ptrs;
+    }
+    *phys = ptrs ? ptrs[i] : 0;
+    *run = 1;
+    if (*phys >= fs->sb.blocks_count) return false;
+    while (*phys && i + *run < n && ptrs[i + *run] == *phys + *run) (*run)++;
+    return true;
+}
+
+// Read up to len bytes at off; returns the number read (short at EOF),
+// or -EIO
+static int32_t ext2_read(struct ext2_fs* fs, struct ext2_icache* ic, uint32_t off, void* dst, uint32_t len) {
+    uint8_t* out = dst;
+    if (off >= ic->size) return 0;
+    if (len > ic->size - off) len = ic->size - off;
+    uint32_t left = len;
+    while (left) {
+        uint32_t phys, run;
+        uint32_t in = off % fs->block_size;
+        if (!ext2_bmap(fs, ic, off / fs->block_size, &phys, &run)) return -EIO;
+        uint32_t n = run * fs->block_size - in;
+        if (n > left) n = left;
+        if (!phys) {
+            memset(out, 0, n);
+        } else {
+            if (!ext2_read_sectors(fs, phys * fs->sectors_per_block, in, out, n)) return -EIO;
+            fs->stats.runs++;
+            fs->stats.run_blocks += (in + n + fs->block_size - 1) / fs->block_size;
+        }
+        out += n;
+        off += n;
+        left -= n;
+    }
+    fs->stats.bytes += len;
+    return len;
+}
+
+// ---- Directories ----
+// Entry at *pos of a directory, skipping unused ones; *pos moves past it
+static bool ext2_readdir(struct ext2_fs* fs, struct ext2_icache* dir, uint32_t* pos, struct ext2_dirent* d) {
+    while (*pos < dir->size) {
+        uint8_t head[8];
+        if (ext2_read(fs, dir, *pos, head, sizeof(head)) != sizeof(head)) return false;
+        uint32_t rec_len = head[4] | (head[5] << 8);
+        uint32_t name_len = head[6];
+        if (!(fs->sb.feature_incompat & EXT2_INCOMPAT_FILETYPE)) name_len |= head[7] << 8;
+        if (rec_len < 8 || rec_len % 4 || *pos % fs->block_size + rec_len > fs->block_size ||
+            name_len > rec_len - 8 || name_len > EXT2_NAME_LEN) return false;
+        uint32_t at = *pos;
+        *pos += rec_len;
+        d->ino = get_le32(head);
+        if (!d->ino || !name_len) continue;
+        if (ext2_read(fs, dir, at + 8, d->name, name_len) != (int32_t)name_len) return false;
+        d->name[name_len] = '\0';
+        d->type = (fs->sb.feature_incompat & EXT2_INCOMPAT_FILETYPE) ? head[7] : 0;
+        return true;
+    }
+    return false;
+}
+
+// ---- Dentry cache ----
+// Names are looked up here on a miss. The volume is read-only, so
+// nothing cached ever has to be invalidated.
+static int32_t ext2_d_lookup(struct super_block* sb, struct inode* dir, const char* name, uint32_t len,
+                             struct inode* out) {
+    struct ext2_fs* fs = sb->fs;
+    struct ext2_dirent d;
+    if (len > EXT2_NAME_LEN) return -ENOENT;
+    mutex_lock(&fs->lock);
+    struct ext2_icache* ic = ext2_iget(fs, dir->ino);
+    int32_t err = ic ? -ENOENT : -EIO;
+    for (uint32_t pos = 0; err == -ENOENT && ext2_readdir(fs, ic, &pos, &d);) {
+        if (strlen(d.name) == len && memcmp(d.name, name, len) == 0) err = 0;
+    }
+    if (!err && (ic = ext2_iget(fs, d.ino))) {
+        out->ino = d.ino;
+        out->type = ext2_is_dir(ic) ? INODE_DIR : INODE_FILE;
+    } else if (!err) {
+        err = -EIO;
+    }
+    mutex_unlock(&fs->lock);
+    return err;
+}
+
+static const struct super_operations ext2_sops = { ext2_d_lookup };
+static struct super_block ext2_sb = { "ext2", &ext2_sops, 0, 0 };
+static const struct fs_operations ext2_fops;
+
+// path resolved through the dentry cache, then fs locked and its inode
+// read; fs->lock is held on return either way
+static struct ext2_icache* ext2_lookup(struct ext2_fs* fs, const char* path, int32_t* err) {
+    struct inode inode;
+    *err = path_inode(&ext2_sb, path, &inode);
+    mutex_lock(&fs->lock);
+    if (*err) return 0;
+    struct ext2_icache* ic = ext2_iget(fs, inode.ino);
+    if (!ic) *err = -EIO;
+    return ic;
+}
+
+// ---- Mount ----
+static bool ext2_mount(struct block_device* dev, uint32_t start, struct ext2_fs* fs) {
+    memset(fs, 0, sizeof(*fs));
+    fs->dev = dev;
+    fs->start = start;
+    struct ext2_super* sb = &fs->sb;
+    if (start + 4 > dev->sectors || !ext2_read_sectors(fs, 2, 0, sb, sizeof(*sb))) return false;
+    if (sb->magic != EXT2_SUPER_MAGIC || sb->log_block_size > 2 || !sb->blocks_per_group ||
+        !sb->inodes_per_group || sb->blocks_count <= sb->first_data_block) return false;
+    if (sb->feature_incompat & ~EXT2_INCOMPAT_FILETYPE) return false;   // ext3 journal recovery, ext4 extents...
+
+    memcpy(fs->label, sb->volume_name, sizeof(sb->volume_name));
+    fs->block_size = 1024 << sb->log_block_size;
+    fs->sectors_per_block = fs->block_size / SECTOR_SIZE;
+    fs->ptrs = fs->block_size / 4;
+    fs->inode_size = sb->rev_level ? sb->inode_size : 128;
+    if (fs->inode_size < 128 || (fs->inode_size & (fs->inode_size - 1)) || fs->inode_size > fs->block_size) return false;
+    if (start % fs->sectors_per_block ||
+        (uint64_t)sb->blocks_count * fs->sectors_per_block > dev->sectors - start) return false;
+
+    fs->groups = (sb->blocks_count - sb->first_data_block + sb->blocks_per_group - 1) / sb->blocks_per_group;
+    fs->gd_pages = (fs->groups * sizeof(struct ext2_group_desc) + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (fs->gd_pages > VMALLOC_MAX_PAGES || !(fs->gd = vmalloc(fs->gd_pages))) return false;
+    if (!ext2_read_sectors(fs, (sb->first_data_block + 1) * fs->sectors_per_block, 0, fs->gd,
+                           fs->groups * sizeof(struct ext2_group_desc))) {
+        vfree(fs->gd, fs->gd_pages);
+        return false;
+    }
+    return true;
+}
+
+// First ext2 volume: a Linux partition on any disk, else a whole disk
+static void ext2_init(void) {
+    for (uint32_t i = 0; i < block_device_count && !ext2_root; i++) {
+        struct block_device* dev = block_devices[i];
+        struct buf* b = bread(dev, 0);
+        if (!b) continue;
+        uint32_t starts[4] = {0};
+        for (uint32_t p = 0; p < 4 && b->data[510] == 0x55 && b->data[511] == 0xAA; p++) {
+            const uint8_t* e = &b->data[446 + p * 16];
+            if (e[4] == EXT2_PART_TYPE) starts[p] = get_le32(&e[8]);
+        }
+        brelse(b);
+        for (uint32_t p = 0; p < 4 && !ext2_root; p++) {
+            if (starts[p] && starts[p] < dev->sectors && ext2_mount(dev, starts[p], &ext2_volume)) ext2_root = &ext2_volume;
+        }
+        if (!ext2_root && ext2_mount(dev, 0, &ext2_volume)) ext2_root = &ext2_volume;
+    }
+    if (ext2_root) {
+        struct inode root = { .ino = EXT2_ROOT_INO, .type = INODE_DIR };
+        if (d_alloc_root(&ext2_sb, ext2_root, &root)) {
+            vfs_mount("/ext2", &ext2_fops, ext2_root);
+        } else {
+            vfree(ext2_root->gd, ext2_root->gd_pages);
+            ext2_root = 0;
+        }
+    }
+}
+
+// ---- Shell view ----
+static void ext2_put_error(int32_t err) {
+    vga_puts("\n");
+    vga_puts(strerror(err));
+}
+
+static void show_ext2(struct ext2_fs* fs) {
+    struct ext2_stats* st = &fs->stats;
+    vga_puts("\n  Volume: ");
+    vga_puts(fs->label[0] ? fs->label : "(no label)");
+    vga_puts(" on ");
+    vga_puts(fs->dev->name);
+    vga_puts(" at sector ");
+    vga_put_dec(fs->start);
+    vga_puts(", ext2 rev ");
+    vga_put_dec(fs->sb.rev_level);
+    vga_puts(", ");
+    vga_put_dec(fs->sb.blocks_count);
+    vga_puts(" x ");
+    vga_put_dec(fs->block_size);
+    vga_puts(" byte blocks (");
+    vga_put_dec(fs->sb.free_blocks_count);
+    vga_puts(" free), ");
+    vga_put_dec(fs->groups);
+    vga_puts(" groups, ");
+    vga_put_dec(fs->sb.inodes_count);
+    vga_puts(" inodes of ");
+    vga_put_dec(fs->inode_size);
+    vga_puts(" bytes");
+    vga_puts("\n  Inode tables: ");
+    vga_put_dec(st->itable_hits);
+    vga_puts(" hits, ");
+    vga_put_dec(st->itable_misses);
+    vga_puts(" misses; inodes: ");
+    vga_put_dec(st->icache_hits);
+    vga_puts(" hits, ");
+    vga_put_dec(st->icache_misses);
+    vga_puts(" misses");
+    vga_puts("\n  Block map: ");
+    vga_put_dec(st->map_hits);
+    vga_puts(" cached, ");
+    vga_put_dec(st->map_misses);
+    vga_puts(" indirect walks; ");
+    vga_put_dec((uint32_t)(st->bytes >> 10));
+    vga_puts("KB read in ");
+    vga_put_dec(st->runs);
+    vga_puts(" runs of ");
+    vga_put_dec(st->runs ? st->run_blocks / st->runs : 0);
+    vga_puts(" blocks");
+}
+
+static void ext2_stat(const char* path) {
+    struct ext2_fs* fs = ext2_root;
+    int32_t err;
+    struct ext2_icache* ic = ext2_lookup(fs, path, &err);
+    if (!ic) {
+        ext2_put_error(err);
+    } else {
+        uint32_t type = ic->di.mode & EXT2_S_IFMT;
+        vga_puts("\n  File: ");
+        vga_puts(path);
+        vga_puts(type == EXT2_S_IFDIR ? "  (directory)" : type == EXT2_S_IFLNK ? "  (symlink)" : "  (file)");
+        vga_puts("\n  Size: ");
+        vga_put_dec(ic->size);
+        vga_puts("  Blocks: ");
+        vga_put_dec(ic->di.blocks / fs->sectors_per_block);
+        vga_puts(ic->di.block[EXT2_TIND_BLOCK] ? " (triple indirect)" : ic->di.block[EXT2_DIND_BLOCK] ? " (double indirect)" :
+                 ic->di.block[EXT2_IND_BLOCK] ? " (indirect)" : "");
+        vga_puts("  Inode: ");
+        vga_put_dec(ic->ino);
+        vga_puts(" in group ");
+        vga_put_dec((ic->ino - 1) / fs->sb.inodes_per_group);
+        vga_puts("\n  Mode: ");
+        vga_put_hex(ic->di.mode);
+        vga_puts("  Links: ");
+        vga_put_dec(ic->di.links_count);
+        vga_puts("  Uid: ");
+        vga_put_dec(ic->di.uid);
+        if (ic->ino == EXT2_ROOT_INO) show_ext2(fs);
+    }
+    mutex_unlock(&fs->lock);
+}
+
+// ---- VFS ----
+// Read-only. Open files only remember their inode number: the inode
+// cache finds it again on every read.
+static int32_t ext2_getattr(void* fs, const char* path, struct vfs_stat* st) {
+    int32_t err;
+    struct ext2_icache* ic = ext2_lookup(fs, path, &err);
+    if (ic) *st = (struct vfs_stat){ ic->ino, ext2_is_dir(ic) ? INODE_DIR : INODE_FILE, ic->size };
+    mutex_unlock(&((struct ext2_fs*)fs)->lock);
+    return err;
+}
+
+static int32_t ext2_vfs_open(struct file* f, const char* path, uint32_t flags) {
+    (void)flags;
+    return ext2_getattr(f->fs, path, &f->st);
+}
+
+// A fast symlink reads as its target, which is in the block pointers
+static int32_t ext2_vfs_read(struct file* f, uint32_t off, void* buf, uint32_t len) {
+    struct ext2_fs* fs = f->fs;
+    mutex_lock(&fs->lock);
+    struct ext2_icache* ic = ext2_iget(fs, f->st.ino);
+    int32_t n = -EIO;
+    if (ic && (ic->di.mode & EXT2_S_IFMT) == EXT2_S_IFLNK && !ic->di.blocks) {
+        uint32_t size = ic->size < sizeof(ic->di.block) ? ic->size : sizeof(ic->di.block);
+        n = off < size ? (len < size - off ? len : size - off) : 0;
+        memcpy(buf, (const uint8_t*)ic->di.block + off, n);
+    } else if (ic) {
+        n = ext2_read(fs, ic, off, buf, len);
+    }
+    mutex_unlock(&fs->lock);
+    return n;
+}
+
+// Sizes come from the inodes: each one read is an inode-table hit for
+// its neighbours
+static int32_t ext2_vfs_readdir(struct file* f, struct vfs_dirent* out) {
+    struct ext2_fs* fs = f->fs;
+    struct ext2_dirent d;
+    int32_t ret = 0;
+    mutex_lock(&fs->lock);
+    while (!ret) {
+        struct ext2_icache* dir = ext2_iget(fs, f->st.ino);
+        if (!dir) {
+            ret = -EIO;
+            break;
+        }
+        if (!ext2_readdir(fs, dir, &f->pos, &d)) break;
+        if (strcmp(d.name, ".") == 0 || strcmp(d.name, "..") == 0) continue;
+        struct ext2_icache* ic = ext2_iget(fs, d.ino);
+        bool is_dir = ic ? ext2_is_dir(ic) : d.type == EXT2_FT_DIR;
+        strcpy(out->name, d.name);
+        out->type = is_dir ? INODE_DIR : INODE_FILE;
+        out->size = ic && !is_dir ? ic->size : 0;
+        ret = 1;
+    }
+    mutex_unlock(&fs->lock);
+    return ret;
+}
+
+static const struct fs_operations ext2_fops = {
+    ext2_getattr, ext2_vfs_open, 0, ext2_vfs_read, 0, ext2_vfs_readdir, 0, 0, 0, ext2_stat
+};
+
+// ==================== TMPFS ====================
+// Files that only live in memory, filled at boot from the initrd: a cpio
+// archive (newc format) the bootloader loads at INITRD_ADDR. File data
+// is memory-only pages in the page cache; names go through one hash
+// table keyed by (parent, name). Nothing is ever removed, so lookups
+// take no lock; creating and writing take tmpfs_lock.
+#define TMPFS_NAME_MAX  59
+#define TMPFS_DIR       0x01
+
+struct tmpfs_inode {
+    uint32_t ino;
+    uint32_t flags;                     // TMPFS_DIR
+    uint32_t size;
+    uint32_t mtime;                     // Unix time, from the archive
+    struct address_space data;          // Files
+    struct tmpfs_dentry* children;      // Directories, sorted by name
+};
+
+struct tmpfs_dentry {
+    struct tmpfs_dentry* hash_next;
+    struct tmpfs_dentry* sibling;
+    struct tmpfs_dentry* parent;
+    struct tmpfs_inode* inode;
+    uint32_t hash;
+    char name[TMPFS_NAME_MAX + 1];
+};
+
+static struct obj_cache tmpfs_inodes = { sizeof(struct tmpfs_inode), 0, 0, 0 };
+static struct obj_cache tmpfs_dentries = { sizeof(struct tmpfs_dentry), 0, 0, 0 };
+static struct tmpfs_dentry* tmpfs_hash[1 << TMPFS_HASH_BITS];
+static struct tmpfs_inode tmpfs_root_inode = { 1, TMPFS_DIR, 0, 0, { { 0, 0 }, 0, 0, 0, 0, 0, 0 }, 0 };
+static struct tmpfs_dentry tmpfs_root = { 0, 0, &tmpfs_root, &tmpfs_root_inode, 0, "/" };
+static struct mutex tmpfs_lock;
+static uint32_t tmpfs_next_ino = 2;
+static const struct fs_operations tmpfs_fops;
+static struct { uint32_t files, dirs, skipped, archive_bytes; bool loaded; } initrd_stats;
+
+static uint32_t tmpfs_name_hash(const struct tmpfs_dentry* parent, const char* name, uint32_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t)parent;
+    for (uint32_t i = 0; i < len; i++) h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+static struct tmpfs_dentry** tmpfs_bucket(uint32_t hash) {
+    return &tmpfs_hash[(hash * 0x9E3779B1u) >> (32 - TMPFS_HASH_BITS)];
+}
+
+// The first len bytes of name, in parent
+static struct tmpfs_dentry* tmpfs_lookup_child(struct tmpfs_dentry* parent, const char* name, uint32_t len) {
+    if (len == 1 && name[0] == '.') return parent;
+    if (len == 2 && name[0] == '.' && name[1] == '.') return parent->parent;
+    uint32_t hash = tmpfs_name_hash(parent, name, len);
+    struct tmpfs_dentry* d = __atomic_load_n(tmpfs_bucket(hash), __ATOMIC_ACQUIRE);
+    for (; d; d = d->hash_next) {
+        if (d->hash == hash && d->parent == parent && !memcmp(d->name, name, len) && !d->name[len]) return d;
+    }
+    return 0;
+}
+
+static struct tmpfs_dentry* tmpfs_lookup(const char* path) {
+    struct tmpfs_dentry* d = &tmpfs_root;
+    while (d && *path) {
+        while (*path == '/') path++;
+        uint32_t len = 0;
+        while (path[len] && path[len] != '/') len++;
+        if (!len) break;
+        if (!(d->inode->flags & TMPFS_DIR)) return 0;
+        d = tmpfs_lookup_child(d, path, len);
+        path += len;
+    }
+    return d;
+}
+
+// Existing entries are returned as they are. Everything is filled in
+// before it's published, for the lock-free readers.
+static struct tmpfs_dentry* tmpfs_create(struct tmpfs_dentry* parent, const char* name, uint32_t len, uint32_t flags) {
+    if (!len || len > TMPFS_NAME_MAX || !(parent->inode->flags & TMPFS_DIR)) return 0;
+    mutex_lock(&tmpfs_lock);
+    struct tmpfs_dentry* d = tmpfs_lookup_child(parent, name, len);
+    if (d) {
+        mutex_unlock(&tmpfs_lock);
+        return d;
+    }
+    struct tmpfs_inode* inode = obj_alloc(&tmpfs_inodes);
+    d = inode ? obj_alloc(&tmpfs_dentries) : 0;
+    if (d) {
+        inode->ino = tmpfs_next_ino++;
+        inode->flags = flags;
+        inode->data.host = inode;
+        memcpy(d->name, name, len);
+        d->parent = parent;
+        d->inode = inode;
+        d->hash = tmpfs_name_hash(parent, name, len);
+
+        struct tmpfs_dentry** link = &parent->inode->children;
+        while (*link && strcmp((*link)->name, d->name) < 0) link = &(*link)->sibling;
+        d->sibling = *link;
+        __atomic_store_n(link, d, __ATOMIC_RELEASE);
+        struct tmpfs_dentry** bucket = tmpfs_bucket(d->hash);
+        d->hash_next = *bucket;
+        __atomic_store_n(bucket, d, __ATOMIC_RELEASE);
+    } else if (inode) {
+        obj_free(&tmpfs_inodes, inode);
+    }
+    mutex_unlock(&tmpfs_lock);
+    return d;
+}
+
+// Create path and any missing directories above it
+static struct tmpfs_dentry* tmpfs_create_path(const char* path, uint32_t flags) {
+    struct tmpfs_dentry* d = &tmpfs_root;
+    while (d && *path) {
+        while (*path == '/') path++;
+        uint32_t len = 0;
+        while (path[len] && path[len] != '/') len++;
+        if (!len) break;
+        bool last = !path[len] || !path[len + 1];
+        struct tmpfs_dentry* child = tmpfs_lookup_child(d, path, len);
+        d = child ? child : tmpfs_create(d, path, len, last ? flags : TMPFS_DIR);
+        path += len;
+    }
+    return d;
+}
+
+static bool tmpfs_write(struct tmpfs_inode* inode, uint32_t off, const void* src, uint32_t len) {
+    mutex_lock(&tmpfs_lock);
+    uint32_t n = filemap_write(&inode->data, off, src, len, inode->size);
+    if (n && off + n > inode->size) inode->size = off + n;
+    mutex_unlock(&tmpfs_lock);
+    return n == len;
+}
+
+// Pages that were never written read as zeroes
+static uint32_t tmpfs_read(struct tmpfs_inode* inode, uint32_t off, void* dst, uint32_t len) {
+    if (off >= inode->size) return 0;
+    if (len > inode->size - off) len = inode->size - off;
+    return filemap_read(&inode->data, off, dst, len);
+}
+
+// ---- Initrd ----
+static uint32_t cpio_field(const char* p) {
+    uint32_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        char c = tolower(p[i]);
+        value = value * 16 + (c >= 'a' ? c - 'a' + 10 : c - '0');
+    }
+    return value;
+}
+
+// newc: a 110-byte ASCII header, the name, the data, each 4-byte
+// aligned, up to "TRAILER!!!". Directories and regular files only.
+// The tmpfs is mounted on "/" whether there is an archive or not.
+static void initrd_init(void) {
+    vfs_mount("/", &tmpfs_fops, 0);
+    const char* base = (const char*)INITRD_ADDR;
+    uint32_t off = 0;
+    while (off + 110 <= INITRD_MAX && !memcmp(base + off, "070701", 6)) {
+        const char* h = base + off;
+        uint32_t mode = cpio_field(h + 14), mtime = cpio_field(h + 46);
+        uint32_t size = cpio_field(h + 54), namesize = cpio_field(h + 94);
+        uint32_t data = (off + 110 + namesize + 3) & ~3u;
+        const char* name = h + 110;
+        if (!namesize || data + size > INITRD_MAX || name[namesize - 1]) break;
+        if (!strcmp(name, "TRAILER!!!")) {
+            initrd_stats.loaded = true;
+            initrd_stats.archive_bytes = data;
+            break;
+        }
+        if (name[0] == '.' && name[1] == '/') name += 2;
+
+        uint32_t type = mode & 0170000;
+        struct tmpfs_dentry* d = 0;
+        if ((type == 0040000 || type == 0100000) && name[0] && strcmp(name, ".")) {
+            d = tmpfs_create_path(name, type == 0040000 ? TMPFS_DIR : 0);
+        }
+        if (d && type == 0100000 && tmpfs_write(d->inode, 0, base + data, size)) initrd_stats.files++;
+        else if (d && type == 0040000) initrd_stats.dirs++;
+        else if (strcmp(name, ".")) initrd_stats.skipped++;
+        if (d) d->inode->mtime = mtime;
+        off = (data + size + 3) & ~3u;
+    }
+}
+
+// ---- Shell view ----
+static void tmpfs_stat(const char* path) {
+    struct tmpfs_dentry* d = tmpfs_lookup(path);
+    if (!d) {
+        vga_puts("\nNo such file or directory");
+        return;
+    }
+    struct tmpfs_inode* inode = d->inode;
+    vga_puts("\n  File: ");
+    vga_puts(d->name);
+    vga_puts((inode->flags & TMPFS_DIR) ? "  (directory)" : "  (file)");
+    vga_puts("\n  Inode: ");
+    vga_put_dec(inode->ino);
+    if (!(inode->flags & TMPFS_DIR)) {
+        vga_puts("  Size: ");
+        vga_put_dec(inode->size);
+        vga_puts("  Pages: ");
+        vga_put_dec(inode->data.nrpages);
+        vga_puts("  Radix height: ");
+        vga_put_dec(inode->data.pages.height);
+    }
+    if (d != &tmpfs_root) return;
+    vga_puts("\n  tmpfs from initrd at ");
+    vga_put_hex(INITRD_ADDR);
+    if (!initrd_stats.loaded) {
+        vga_puts(": no archive");
+        return;
+    }
+    vga_puts(", ");
+    vga_put_dec(initrd_stats.archive_bytes);
+    vga_puts(" bytes: ");
+    vga_put_dec(initrd_stats.files);
+    vga_puts(" files, ");
+    vga_put_dec(initrd_stats.dirs);
+    vga_puts(" dirs");
+    if (initrd_stats.skipped) {
+        vga_puts(", ");
+        vga_put_dec(initrd_stats.skipped);
+        vga_puts(" skipped");
+    }
+    vga_puts("\n  Pages: ");
+    vga_put_dec(tmpfs_inodes.pages + tmpfs_dentries.pages);
+    vga_puts(" inode/dentry (");
+    vga_put_dec(tmpfs_dentries.objects);
+    vga_puts(" names in ");
+    vga_put_dec(1 << TMPFS_HASH_BITS);
+    vga_puts(" hash buckets)");
+}
+
+// ---- VFS ----
+// Mounted on "/", read-only from there: the initrd is all it holds
+static int32_t tmpfs_getattr(void* fs, const char* path, struct vfs_stat* st) {
+    (void)fs;
+    struct tmpfs_dentry* d = tmpfs_lookup(path);
+    if (!d) return -ENOENT;
+    *st = (struct vfs_stat){ d->inode->ino, (d->inode->flags & TMPFS_DIR) ? INODE_DIR : INODE_FILE, d->inode->size };
+    return 0;
+}
+
+static int32_t tmpfs_vfs_open(struct file* f, const char* path, uint32_t flags) {
+    (void)flags;
+    f->priv = tmpfs_lookup(path);
+    return tmpfs_getattr(f->fs, path, &f->st);
+}
+
+static int32_t tmpfs_vfs_read(struct file* f, uint32_t off, void* buf, uint32_t len) {
+    return tmpfs_read(((struct tmpfs_dentry*)f->priv)->inode, off, buf, len);
+}
+
+// pos counts entries along the sorted list of children
+static int32_t tmpfs_vfs_readdir(struct file* f, struct vfs_dirent* out) {
+    struct tmpfs_dentry* c = __atomic_load_n(&((struct tmpfs_dentry*)f->priv)->inode->children, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; c && i < f->pos; i++) c = c->sibling;
+    if (!c) return 0;
+    f->pos++;
+    strcpy(out->name, c->name);
+    out->type = (c->inode->flags & TMPFS_DIR) ? INODE_DIR : INODE_FILE;
+    out->size = c->inode->size;
+    return 1;
+}
+
+static void* tmpfs_vfs_map(struct file* f, uint32_t first, uint32_t count) {
+    return filemap_map(&((struct tmpfs_dentry*)f->priv)->inode->data, first, count);
+}
+
+static const struct fs_operations tmpfs_fops = {
+    tmpfs_getattr, tmpfs_vfs_open, 0, tmpfs_vfs_read, 0, tmpfs_vfs_readdir, tmpfs_vfs_map, 0, 0, tmpfs_stat
+};
+
+// ==================== DEVFS ====================
+// Every block device as a file under /dev, read through the buffer
+// cache. A device is as long as its whole cache blocks, up to 4GB.
+static struct block_device* devfs_find(const char* path) {
+    while (*path == '/') path++;
+    return *path ? blk_find(path) : 0;
+}
+
+static uint32_t devfs_size(const struct block_device* dev) {
+    uint32_t blocks = dev->sectors / BUF_SECTORS;
+    return blocks >= 0x100000 ? 0xFFFFF000 : blocks * PAGE_SIZE;
+}
+
+static int32_t devfs_getattr(void* fs, const char* path, struct vfs_stat* st) {
+    (void)fs;
+    struct block_device* dev = devfs_find(path);
+    if (!dev && strcmp(path, "/") != 0) return -ENOENT;
+    *st = (struct vfs_stat){ 1, INODE_DIR, 0 };
+    for (uint32_t i = 0; dev && i < block_device_count; i++)
+        if (block_devices[i] == dev) *st = (struct vfs_stat){ 2 + i, INODE_FILE, devfs_size(dev) };
+    return 0;
+}
+
+static int32_t devfs_open(struct file* f, const char* path, uint32_t flags) {
+    (void)flags;
+    f->priv = devfs_find(path);
+    return devfs_getattr(f->fs, path, &f->st);
+}
+
+static int32_t devfs_read(struct file* f, uint32_t off, void* dst, uint32_t len) {
+    struct block_device* dev = f->priv;
+    uint8_t* out = dst;
+    if (off >= f->st.size) return 0;
+    if (len > f->st.size - off) len = f->st.size - off;
+    for (uint32_t left = len; left;) {
+        uint32_t in_block = off % PAGE_SIZE;
+        uint32_t n = PAGE_SIZE - in_block < left ? PAGE_SIZE - in_block : left;
+        struct buf* b = bread(dev, off / PAGE_SIZE);
+        if (!b) return -EIO;
+        memcpy(out, b->data + in_block, n);
+        brelse(b);
+        out += n;
+        off += n;
+        left -= n;
+    }
+    return len;
+}
+
+// pos is the index in block_devices
+static int32_t devfs_readdir(struct file* f, struct vfs_dirent* out) {
+    if (f->pos >= block_device_count) return 0;
+    struct block_device* dev = block_devices[f->pos++];
+    strcpy(out->name, dev->name);
+    out->type = INODE_FILE;
+    out->size = devfs_size(dev);
+    return 1;
+}
+
+static void devfs_show(const char* path) {
+    struct block_device* dev = devfs_find(path);
+    if (!dev && strcmp(path, "/") != 0) {
+        vga_puts("\nNo such file or directory");
+        return;
+    }
+    vga_puts("\n  File: ");
+    vga_puts(dev ? dev->name : "/");
+    vga_puts(dev ? "  (block device)" : "  (directory)");
+    if (!dev) {
+        vga_puts("\n  devfs: ");
+        vga_put_dec(block_device_count);
+        vga_puts(" block devices");
+        return;
+    }
+    vga_puts("\n  Size: ");
+    vga_put_dec(dev->sectors);
+    vga_puts(" sectors");
+    if (dev->model[0]) {
+        vga_puts("  Model: ");
+        vga_puts(dev->model);
+    }
+}
+
+static const struct fs_operations devfs_fops = {
+    devfs_getattr, devfs_open, 0, devfs_read, 0, devfs_readdir, 0, 0, 0, devfs_show
+};
+
+static void devfs_init(void) {
+    vfs_mount("/dev", &devfs_fops, 0);
+}
+
+// ==================== WAKEUP BENCHMARK ====================
+static volatile uint32_t wake_bench_ack;
+
+static void wake_bench_pong(void* arg) {
+    (void)arg;
+    wake_bench_ack = 1;
+}
+
+// Round trip: BSP stores the wakeup, the target leaves idle and acks
+static void wake_bench_run(struct cpu* target, uint32_t method, const char* name) {
+    uint32_t saved = target->idle_method;
+    uint32_t min = 0xFFFFFFFF, max = 0;
+    uint64_t total = 0;
+
+    target->idle_method = method;
+    wake_bench_ack = 0;
+    cpu_call(target, wake_bench_pong, 0);
+    while (!wake_bench_ack) cpu_relax();
+
+    for (uint32_t i = 0; i < WAKE_BENCH_ROUNDS; i++) {
+        while (target->idle_state != method) cpu_relax();
+        wake_bench_ack = 0;
+
+        uint64_t start = rdtsc();
+        cpu_call(target, wake_bench_pong, 0);
+        while (!wake_bench_ack) cpu_relax();
+        uint32_t cycles = (uint32_t)(rdtsc() - start);
+
+        total += cycles;
+        if (cycles < min) min = cycles;
+        if (cycles > max) max = cycles;
+    }
+    target->idle_method = saved;
+    cpu_wake(target);
+
+    vga_puts("\n  ");
+    vga_puts(name);
+    vga_puts(": min ");
+    vga_put_dec(cycles_to_ns(min));
+    vga_puts("ns  avg ");
+    vga_put_dec(cycles_to_ns(div64_32(total, WAKE_BENCH_ROUNDS)));
+    vga_puts("ns  max ");
+    vga_put_dec(cycles_to_ns(max));
+    vga_puts("ns");
+}
+
+static void wake_bench(void) {
+    if (cpu_count < 2 || !cpus[1].online) {
+        vga_puts("\nwakebench: needs a second CPU (try 'make run-smp')");
+        return;
+    }
+    vga_puts("\nCross-CPU wakeup, CPU0 -> CPU1, ");
+    vga_put_dec(WAKE_BENCH_ROUNDS);
+    vga_puts(" rounds:");
+    if (cpu_has_mwait) {
+        wake_bench_run(&cpus[1], IDLE_MWAIT, "mwait");
+    } else {
+        vga_puts("\n  mwait: not supported by this CPU");
+    }
+    wake_bench_run(&cpus[1], IDLE_HLT, "hlt+IPI");
+}
+
+// ==================== TLB BENCHMARK ====================
+static void tlb_bench_switch(void* arg) {
+    switch_mm(arg);
+    wake_bench_ack = 1;
+}
+
+static void tlb_bench_remote(struct cpu* c, struct mm* mm) {
+    wake_bench_ack = 0;
+    cpu_call(c, tlb_bench_switch, mm);
+    while (!wake_bench_ack) cpu_relax();
+}
+
+static bool tlb_bench_map(struct mm* mm, const uint32_t* frames) {
+    for (uint32_t i = 0; i < TLB_BENCH_PAGES; i++) {
+        uint32_t va = MM_PRIVATE_BASE + i * PAGE_SIZE;
+        if (!mm_map(mm, va, frames[i])) return false;
+        *(volatile uint32_t*)va = i;    // Pull the translation into the TLB
+    }
+    return true;
+}
+
+static void tlb_bench_report(const char* name, uint64_t cycles, uint32_t ipis) {
+    vga_puts("\n  ");
+    vga_puts(name);
+    vga_puts(": ");
+    vga_put_dec(cycles_to_ns(div64_32(cycles, TLB_BENCH_PAGES)));
+    vga_puts("ns/page, ");
+    vga_put_dec(ipis);
+    vga_puts(" IPIs");
+}
+
+// Unmap TLB_BENCH_PAGES pages from an mm shared with one other CPU,
+// flushing after every page and then as one batch
+static void tlb_bench(void) {
+    static uint32_t frames[TLB_BENCH_PAGES];
+    struct cpu* self = this_cpu();
+    struct cpu* remote = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (cpus[i].online && &cpus[i] != self) {
+            remote = &cpus[i];
+            break;
+        }
+    }
+
+    struct mm* mm = mm_create();
+    if (!mm) {
+        vga_puts("\ntlbbench: out of memory");
+        return;
+    }
+    bool ok = true;
+    for (uint32_t i = 0; i < TLB_BENCH_PAGES; i++) {
+        frames[i] = pmm_alloc_page();
+        if (!frames[i]) ok = false;
+    }
+
+    struct mm* saved = self->active_mm;
+    switch_mm(mm);
+    if (remote) tlb_bench_remote(remote, mm);
+
+    vga_puts("\nUnmapping ");
+    vga_put_dec(TLB_BENCH_PAGES);
+    vga_puts(" pages, mm shared with ");
+    vga_put_dec(remote ? 1 : 0);
+    vga_puts(" other CPU(s):");
+
+    if (ok && tlb_bench_map(mm, frames)) {
+        uint32_t ipis = tlb_ipis;
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < TLB_BENCH_PAGES; i++) {
+            mm_unmap(mm, MM_PRIVATE_BASE + i * PAGE_SIZE);
+            tlb_flush_mm(mm);
+        }
+        tlb_bench_report("per-page", rdtsc() - start, tlb_ipis - ipis);
+    }
+    if (ok && tlb_bench_map(mm, frames)) {
+        uint32_t ipis = tlb_ipis;
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < TLB_BENCH_PAGES; i++) {
+            mm_unmap(mm, MM_PRIVATE_BASE + i * PAGE_SIZE);
+        }
+        tlb_flush_mm(mm);
+        tlb_bench_report("batched ", rdtsc() - start, tlb_ipis - ipis);
+    }
+
+    if (remote) tlb_bench_remote(remote, &kernel_mm);
+    switch_mm(saved);
+    mm_destroy(mm);
+    for (uint32_t i = 0; i < TLB_BENCH_PAGES; i++) {
+        if (frames[i]) pmm_free_page(frames[i]);
+    }
+}
+
+// ==================== BLOCK BENCHMARK ====================
+// Sequential or random reads/writes of one request size. Writes put back
+// what an untimed read just fetched, so the disk contents survive.
+static uint32_t dd_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// 0 if a page or the mapping can't be had; dd_buffer_free() either way
+static uint8_t* dd_buffer_alloc(uint32_t* frames, uint32_t pages) {
+    bool ok = true;
+    for (uint32_t i = 0; i < pages; i++) {
+        frames[i] = pmm_alloc_page();
+        if (!frames[i]) ok = false;
+    }
+    return ok ? vmap(frames, pages, PTE_PRESENT | PTE_WRITE) : 0;
+}
+
+static void dd_buffer_free(uint8_t* buf, uint32_t* frames, uint32_t pages) {
+    if (buf) vunmap(buf, pages);
+    for (uint32_t i = 0; i < pages; i++) {
+        if (frames[i]) pmm_free_page(frames[i]);
+    }
+}
+
+static void dd_bench(struct block_device* dev, bool write, bool random, uint32_t kb) {
+    uint32_t per = kb * 1024 / SECTOR_SIZE;
+    uint32_t slots = dev->sectors / per;
+    uint32_t total = DD_TOTAL_KB / kb;
+    if (!random && total > slots) total = slots;
+    if (!slots || !total) {
+        vga_puts("\nDevice too small");
+        return;
+    }
+
+    uint32_t frames[DD_MAX_KB / 4] = {0};
+    uint32_t pages = (kb + 3) / 4;
+    uint8_t* buf = dd_buffer_alloc(frames, pages);
+    if (!buf) {
+        dd_buffer_free(buf, frames, pages);
+        vga_puts("\nOut of memory");
+        return;
+    }
+
+    uint32_t seed = (uint32_t)rdtsc() | 1;
+    uint64_t cycles = 0, worst = 0;
+    uint32_t done = 0;
+    for (; done < total; done++) {
+        uint32_t sector = (random ? dd_random(&seed) % slots : done) * per;
+        if (write && !blk_read(dev, sector, per, buf)) break;
+        uint64_t start = rdtsc();
+        if (!blk_rw(dev, sector, per, buf, write)) break;
+        uint64_t took = rdtsc() - start;
+        cycles += took;
+        if (took > worst) worst = took;
+    }
+
+    dd_buffer_free(buf, frames, pages);
+
+    uint32_t us = (uint32_t)div64_32(cycles, tsc_per_us);
+    vga_puts("\n");
+    vga_puts(random ? "Random " : "Sequential ");
+    vga_puts(write ? "write: " : "read: ");
+    vga_put_dec(done);
+    vga_puts(" x ");
+    vga_put_dec(kb);
+    vga_puts("KB in ");
+    vga_put_dec(us / 1000);
+    vga_puts("ms");
+    if (done < total) vga_puts(" (I/O error)");
+    if (!us) return;
+    vga_puts("\n  ");
+    vga_put_dec((uint32_t)div64_32((uint64_t)done * kb * 1000000, us));
+    vga_puts(" KB/s, ");
+    vga_put_dec((uint32_t)div64_32((uint64_t)done * 1000000, us));
+    vga_puts(" IOPS, avg ");
+    vga_put_dec(us / done);
+    vga_puts("us, max ");
+    vga_put_dec((uint32_t)div64_32(worst, tsc_per_us));
+    vga_puts("us");
+}
+
+// Same sequential read with PIO and with bus-master DMA, comparing the
+// CPU time the driver spends (submit + interrupt) per MB moved
+static void ata_dma_bench(struct block_device* dev) {
+    struct ata_drive* d = ata_drive_of(dev);
+    if (!d) {
+        vga_puts("\nNot an ATA disk");
+        return;
+    }
+    uint32_t per = DD_MAX_KB * 1024 / SECTOR_SIZE;
+    uint32_t total = DD_TOTAL_KB / DD_MAX_KB;
+    if (total > dev->sectors / per) total = dev->sectors / per;
+    uint32_t frames[DD_MAX_KB / 4] = {0};
+    uint8_t* buf = dd_buffer_alloc(frames, DD_MAX_KB / 4);
+    if (!buf || !total) {
+        dd_buffer_free(buf, frames, DD_MAX_KB / 4);
+        vga_puts("\nNo buffer or device too small");
+        return;
+    }
+
+    for (uint32_t mode = 0; mode < 2; mode++) {
+        if (mode && !d->dma_capable) {
+            vga_puts("\nDMA: not available (no bus-master IDE or drive lacks DMA)");
+            break;
+        }
+        d->dma = mode;
+        uint64_t cpu = d->ch->cpu_cycles;
+        uint64_t start = rdtsc();
+        uint32_t done = 0;
+        while (done < total && blk_read(dev, done * per, per, buf)) done++;
+        uint64_t wall = rdtsc() - start;
+        cpu = d->ch->cpu_cycles - cpu;
+
+        uint32_t kb = done * DD_MAX_KB;
+        uint32_t us = (uint32_t)div64_32(wall, tsc_per_us);
+        vga_puts(mode ? "\nDMA: " : "\nPIO: ");
+        vga_put_dec(kb);
+        vga_puts("KB, ");
+        vga_put_dec(us ? (uint32_t)div64_32((uint64_t)kb * 1000000, us) : 0);
+        vga_puts(" KB/s, ");
+        vga_put_dec(kb ? (uint32_t)div64_32(cpu * 1024, kb) : 0);
+        vga_puts(" driver cycles/MB");
+        if (done < total) vga_puts(" (I/O error)");
+    }
+    d->dma = d->dma_capable;
+    dd_buffer_free(buf, frames, DD_MAX_KB / 4);
+}
+
+// 4KB random reads with 1..32 requests in flight, to show how IOPS and
+// latency scale with queue depth, how many completions each interrupt
+// retires and how many doorbell writes the driver needed. A request is
+// reusable once end_io has cleared its busy bit.
+static struct block_request qd_requests[QD_BENCH_MAX_DEPTH];
+static uint32_t qd_frames[QD_BENCH_MAX_DEPTH];
+static uint64_t qd_start[QD_BENCH_MAX_DEPTH];
+static struct wait_queue qd_wait;
+static volatile uint32_t qd_busy;
+static volatile uint32_t qd_inflight;
+static volatile uint32_t qd_errors;
+static volatile uint32_t qd_latency_sum;    // us
+static volatile uint32_t qd_latency_max;
+
+static void qd_bench_end_io(struct block_request* req) {
+    uint32_t i = req - qd_requests;
+    uint32_t us = (uint32_t)div64_32(rdtsc() - qd_start[i], tsc_per_us);
+    uint32_t max = qd_latency_max;
+    while (us > max && !__atomic_compare_exchange_n(&qd_latency_max, &max, us, false,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&qd_latency_sum, us, __ATOMIC_RELAXED);
+    if (req->error) __atomic_add_fetch(&qd_errors, 1, __ATOMIC_RELAXED);
+    __atomic_and_fetch(&qd_busy, ~(1u << i), __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&qd_inflight, 1, __ATOMIC_RELEASE);
+    wake_up(&qd_wait);
+}
+
+static void qd_bench(struct block_device* dev) {
+    uint32_t blocks = dev->sectors / 8;
+    for (uint32_t i = 0; i < QD_BENCH_MAX_DEPTH; i++) {
+        if (!qd_frames[i]) qd_frames[i] = pmm_alloc_page();
+        if (!qd_frames[i] || !blocks) {
+            vga_puts("\nOut of memory or device too small");
+            return;
+        }
+    }
+
+    qd_errors = 0;
+    uint32_t seed = (uint32_t)rdtsc() | 1;
+    vga_puts("\n  depth    IOPS  avg us  max us  per irq  kicks/100");
+    for (uint32_t depth = 1; depth <= QD_BENCH_MAX_DEPTH; depth *= 2) {
+        uint32_t irqs = dev->stats.interrupts;
+        uint32_t kicks = dev->stats.kicks;
+        qd_latency_sum = 0;
+        qd_latency_max = 0;
+        uint64_t start = rdtsc();
+        for (uint32_t issued = 0; issued < QD_BENCH_OPS; issued++) {
+            wait_event(qd_wait, qd_inflight < depth);
+            uint32_t i = __builtin_ctz(~qd_busy);
+            struct block_request* req = &qd_requests[i];
+            memset(req, 0, sizeof(*req));
+            req->dev = dev;
+            req->sector = dd_random(&seed) % blocks * 8;
+            req->count = 8;
+            req->buffer = (uint8_t*)qd_frames[i];
+            req->end_io = qd_bench_end_io;
+            __atomic_or_fetch(&qd_busy, 1u << i, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&qd_inflight, 1, __ATOMIC_RELAXED);
+            qd_start[i] = rdtsc();
+            blk_submit(req);
+        }
+        wait_event(qd_wait, qd_inflight == 0);
+        uint32_t us = (uint32_t)div64_32(rdtsc() - start, tsc_per_us);
+        irqs = dev->stats.interrupts - irqs;
+        kicks = dev->stats.kicks - kicks;
+        uint32_t per_irq = irqs ? QD_BENCH_OPS * 10 / irqs : 0;
+
+        vga_puts("\n  ");
+        vga_put_dec_width(depth, 5);
+        vga_put_dec_width(us ? (uint32_t)div64_32((uint64_t)QD_BENCH_OPS * 1000000, us) : 0, 8);
+        vga_put_dec_width(qd_latency_sum / QD_BENCH_OPS, 8);
+        vga_put_dec_width(qd_latency_max, 8);
+        vga_put_dec_width(per_irq / 10, 7);
+        vga_putc('.');
+        vga_put_dec(per_irq % 10);
+        vga_put_dec_width(kicks * 100 / QD_BENCH_OPS, 11);
+    }
+    if (qd_errors) {
+        vga_puts("\n  ");
+        vga_put_dec(qd_errors);
+        vga_puts(" I/O errors");
+    }
+}
+
+// The same kind of batch under both schedulers, all submitted at once:
+// ELV_BENCH_OPS 4KB reads, half of them one sequential run and half
+// random, shuffled. Each pass uses fresh positions so neither gets the
+// other's disk cache.
+static struct block_request elv_bench_requests[ELV_BENCH_OPS];
+static uint32_t elv_bench_frames[ELV_BENCH_OPS];
+static struct wait_queue elv_bench_wait;
+static volatile uint32_t elv_bench_left;
+static volatile uint32_t elv_bench_errors;
+
+static void elv_bench_end_io(struct block_request* req) {
+    if (req->error) __atomic_add_fetch(&elv_bench_errors, 1, __ATOMIC_RELAXED);
+    if (!__atomic_sub_fetch(&elv_bench_left, 1, __ATOMIC_RELEASE)) wake_up(&elv_bench_wait);
+}
+
+static void elv_bench(struct block_device* dev) {
+    uint32_t blocks = dev->sectors / 8;
+    for (uint32_t i = 0; i < ELV_BENCH_OPS; i++) {
+        if (!elv_bench_frames[i]) elv_bench_frames[i] = pmm_alloc_page();
+        if (!elv_bench_frames[i] || blocks < ELV_BENCH_OPS * 2) {
+            vga_puts("\nOut of memory or device too small");
+            return;
         }
-    } else if (c == '\b') {
-        if (cursor_x > 0) {
-            cursor_x--;
-        } else if (cursor_y > 0) {
-            cursor_y--;
-            cursor_x = VGA_WIDTH - 1;
+    }
+
+    uint32_t saved = dev->elv.mode;
+    uint32_t seed = (uint32_t)rdtsc() | 1;
+    elv_bench_errors = 0;
+    vga_puts("\n  sched         us  commands  merges  seek/cmd  avg queued  avg total");
+    for (uint32_t mode = ELV_NOOP; mode <= ELV_DEADLINE; mode++) {
+        uint32_t sectors[ELV_BENCH_OPS];
+        uint32_t run = dd_random(&seed) % (blocks - ELV_BENCH_OPS);
+        for (uint32_t i = 0; i < ELV_BENCH_OPS; i++) {
+            sectors[i] = (i & 1 ? run + i / 2 : dd_random(&seed) % blocks) * 8;
         }
-        VGA_MEMORY[cursor_y * VGA_WIDTH + cursor_x] = vga_color << 8 | ' ';
-    } else if (c == '\r') {
-        cursor_x = 0;
-    } else if (c == '\t') {
-        cursor_x = (cursor_x + 4) & ~3;
-    } else {
-        VGA_MEMORY[cursor_y * VGA_WIDTH + cursor_x] = vga_color << 8 | c;
-        cursor_x++;
+        for (uint32_t i = ELV_BENCH_OPS - 1; i > 0; i--) {
+            uint32_t j = dd_random(&seed) % (i + 1);
+            uint32_t t = sectors[i];
+            sectors[i] = sectors[j];
+            sectors[j] = t;
+        }
+
+        elv_set_mode(dev, mode);
+        struct elv_stats before = dev->elv.stats;
+        elv_bench_left = ELV_BENCH_OPS;
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < ELV_BENCH_OPS; i++) {
+            struct block_request* req = &elv_bench_requests[i];
+            memset(req, 0, sizeof(*req));
+            req->dev = dev;
+            req->sector = sectors[i];
+            req->count = 8;
+            req->buffer = (uint8_t*)elv_bench_frames[i];
+            req->end_io = elv_bench_end_io;
+            blk_submit(req);
+        }
+        wait_event(elv_bench_wait, elv_bench_left == 0);
+        uint32_t us = (uint32_t)div64_32(rdtsc() - start, tsc_per_us);
+
+        struct elv_stats* st = &dev->elv.stats;
+        uint32_t commands = st->dispatched - before.dispatched;
+        vga_puts(mode == ELV_NOOP ? "\n  noop    " : "\n  deadline");
+        vga_put_dec_width(us, 9);
+        vga_put_dec_width(commands, 10);
+        vga_put_dec_width(st->back_merges + st->front_merges - before.back_merges - before.front_merges, 8);
+        vga_put_dec_width(commands ? (uint32_t)div64_32(st->seek - before.seek, commands) : 0, 10);
+        vga_put_dec_width((uint32_t)div64_32(st->wait_us[0] - before.wait_us[0], ELV_BENCH_OPS), 12);
+        vga_put_dec_width((uint32_t)div64_32(st->total_us[0] - before.total_us[0], ELV_BENCH_OPS), 11);
     }
-    
-    if (cursor_x >= VGA_WIDTH) {
-        cursor_x = 0;
-        cursor_y++;
+    elv_set_mode(dev, saved);
+    if (elv_bench_errors) {
+        vga_puts("\n  ");
+        vga_put_dec(elv_bench_errors);
+        vga_puts(" I/O errors");
     }
 }
 
-static void vga_puts(const char* str) {
-    while (*str) vga_putc(*str++);
-}
+// IORING_BENCH_OPS random 4KB reads three ways: one blocking blk_read()
+// at a time, then through a ring kept IORING_BENCH_DEPTH deep, first
+// sleeping for completions and then polling for them. The ring passes
+// refill every free SQE and reap every ready CQE per io_ring_enter().
+// Each ring then times a lone 2ms timeout: the sleeping one sees the
+// tick's granularity, the polled one the TSC. Last, the polled ring
+// reads a batch from the gap between the MBR and the first partition
+// and times writing it back unchanged, then an fsync. No filesystem or
+// buffer cache writes there, so the raw writes can't undo theirs.
+static uint32_t ioring_frames[IORING_BENCH_DEPTH];
 
-static void vga_clear(void) {
-    for (uint32_t i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
-        VGA_MEMORY[i] = vga_color << 8 | ' ';
+// Blocks before the first partition, MBR block included; 0 if the disk
+// has no partition table
+static uint32_t ioring_gap_blocks(struct block_device* dev, uint8_t* mbr) {
+    if (!blk_read(dev, 0, 1, mbr) || mbr[510] != 0x55 || mbr[511] != 0xAA) return 0;
+    uint32_t first = dev->sectors;
+    for (uint32_t p = 0; p < 4; p++) {
+        const uint8_t* e = &mbr[446 + p * 16];
+        if (e[4] && get_le32(&e[8]) < first) first = get_le32(&e[8]);
     }
-    cursor_x = 0;
-    cursor_y = 0;
+    return first / 8;
 }
 
-static void vga_set_cursor(void) {
-    uint16_t pos = cursor_y * VGA_WIDTH + cursor_x;
-    outb(0x3D4, 0x0F);
-    outb(0x3D5, (uint8_t)(pos & 0xFF));
-    outb(0x3D4, 0x0E);
-    outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
+static uint32_t ioring_bench_pass(struct io_ring* r, uint32_t index, uint32_t blocks,
+                                  uint32_t* seed, uint32_t* errors) {
+    uint32_t issued = 0, reaped = 0, enters = 0;
+    uint32_t idle = ~0u >> (32 - IORING_BENCH_DEPTH);    // Free frames
+    while (reaped < IORING_BENCH_OPS) {
+        uint32_t queued = 0;
+        while (idle && issued < IORING_BENCH_OPS) {
+            struct io_uring_sqe* sqe = io_ring_get_sqe(r);
+            if (!sqe) break;
+            uint32_t slot = __builtin_ctz(idle);
+            idle &= idle - 1;
+            io_ring_prep(sqe, IORING_OP_READ, index, (uint64_t)(dd_random(seed) % blocks) * PAGE_SIZE,
+                         PAGE_SIZE, (void*)ioring_frames[slot], slot);
+            io_ring_queue(r);
+            queued++;
+            issued++;
+        }
+        io_ring_enter(r, queued, 1);
+        enters++;
+        for (struct io_uring_cqe* cqe; (cqe = io_ring_peek_cqe(r)); io_ring_cqe_seen(r)) {
+            if (cqe->res != PAGE_SIZE) (*errors)++;
+            idle |= 1u << (uint32_t)cqe->user_data;
+            reaped++;
+        }
+    }
+    return enters;
 }
 
-// ==================== STRING FUNCTIONS ====================
-static size_t strlen(const char* str) {
-    size_t len = 0;
-    while (str[len]) len++;
-    return len;
+// Read blocks 1..IORING_BENCH_DEPTH (block 0 is the MBR), then time
+// writing them back unchanged through the ring, followed by an fsync
+static void ioring_bench_writeback(struct io_ring* r, struct block_device* dev, uint32_t index,
+                                   uint32_t* errors) {
+    if (ioring_gap_blocks(dev, (uint8_t*)ioring_frames[0]) <= IORING_BENCH_DEPTH) {
+        vga_puts("\n  No room before the first partition to write");
+        return;
+    }
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        uint8_t opcode = pass ? IORING_OP_WRITE : IORING_OP_READ;
+        for (uint32_t i = 0; i < IORING_BENCH_DEPTH; i++) {
+            io_ring_prep(io_ring_get_sqe(r), opcode, index, (uint64_t)(i + 1) * PAGE_SIZE,
+                         PAGE_SIZE, (void*)ioring_frames[i], i);
+            io_ring_queue(r);
+        }
+        if (pass) break;
+        io_ring_enter(r, IORING_BENCH_DEPTH, IORING_BENCH_DEPTH);
+        for (struct io_uring_cqe* cqe; (cqe = io_ring_peek_cqe(r)); io_ring_cqe_seen(r)) {
+            if (cqe->res != PAGE_SIZE) (*errors)++;
+        }
+        if (*errors) return;
+    }
+
+    uint64_t start = rdtsc();
+    io_ring_enter(r, IORING_BENCH_DEPTH, 0);
+    io_ring_prep(io_ring_get_sqe(r), IORING_OP_FSYNC, index, 0, 0, 0, ~0ull);
+    io_ring_queue(r);
+    int32_t res = 0;
+    for (uint32_t seen = 0, sent = 0; seen <= IORING_BENCH_DEPTH; ) {
+        sent += io_ring_enter(r, 1 - sent, 1);
+        for (struct io_uring_cqe* cqe; (cqe = io_ring_peek_cqe(r)); io_ring_cqe_seen(r)) {
+            if (cqe->user_data == ~0ull) res = cqe->res;
+            else if (cqe->res < 0) (*errors)++;
+            seen++;
+        }
+    }
+    vga_puts("\n  ");
+    vga_put_dec(IORING_BENCH_DEPTH);
+    vga_puts(" writes + fsync: ");
+    vga_put_dec((uint32_t)div64_32(rdtsc() - start, tsc_per_us));
+    vga_puts("us, fsync ");
+    vga_puts(res ? "failed" : "ok");
 }
 
-static int strcmp(const char* s1, const char* s2) {
-    while (*s1 && (*s1 == *s2)) {
-        s1++;
-        s2++;
+static void ioring_bench(struct block_device* dev) {
+    uint32_t index = 0;
+    while (block_devices[index] != dev) index++;
+    uint32_t blocks = dev->sectors / 8;
+    for (uint32_t i = 0; i < IORING_BENCH_DEPTH; i++) {
+        if (!ioring_frames[i]) ioring_frames[i] = pmm_alloc_page();
+        if (!ioring_frames[i] || blocks < IORING_BENCH_DEPTH) {
+            vga_puts("\nOut of memory or device too small");
+            return;
+        }
+    }
+
+    uint32_t seed = (uint32_t)rdtsc() | 1;
+    uint32_t errors = 0;
+    vga_puts("\n  mode        us    IOPS  calls  irqs  polls");
+    for (uint32_t mode = 0; mode < 3; mode++) {
+        struct io_ring* r = 0;
+        if (mode && !(r = io_ring_setup(IORING_BENCH_DEPTH, mode == 2 ? IORING_SETUP_IOPOLL : 0))) {
+            vga_puts("\n  No ring");
+            return;
+        }
+        uint32_t irqs = dev->stats.interrupts;
+        uint32_t polls = dev->stats.polls;
+        uint32_t calls = IORING_BENCH_OPS;
+        uint64_t start = rdtsc();
+        if (!mode) {
+            for (uint32_t i = 0; i < IORING_BENCH_OPS; i++) {
+                if (!blk_read(dev, dd_random(&seed) % blocks * 8, 8, (void*)ioring_frames[0])) errors++;
+            }
+        } else {
+            calls = ioring_bench_pass(r, index, blocks, &seed, &errors);
+        }
+        uint32_t us = (uint32_t)div64_32(rdtsc() - start, tsc_per_us);
+
+        static const char* const names[3] = { "\n  sync   ", "\n  ring   ", "\n  iopoll " };
+        vga_puts(names[mode]);
+        vga_put_dec_width(us, 8);
+        vga_put_dec_width(us ? (uint32_t)div64_32((uint64_t)IORING_BENCH_OPS * 1000000, us) : 0, 8);
+        vga_put_dec_width(calls, 7);
+        vga_put_dec_width(dev->stats.interrupts - irqs, 6);
+        vga_put_dec_width(dev->stats.polls - polls, 7);
+        if (r) io_ring_exit(r);
+    }
+    for (uint32_t mode = 1; mode < 3; mode++) {
+        struct io_ring* r = io_ring_setup(IORING_BENCH_DEPTH, mode == 2 ? IORING_SETUP_IOPOLL : 0);
+        if (!r) break;
+        io_ring_prep(io_ring_get_sqe(r), IORING_OP_TIMEOUT, 0, 2000, 0, 0, 0);
+        io_ring_queue(r);
+        uint64_t start = rdtsc();
+        io_ring_enter(r, 1, 1);
+        struct io_uring_cqe* cqe = io_ring_peek_cqe(r);
+        vga_puts(mode == 1 ? "\n  2000us timeout: ring " : ", iopoll ");
+        vga_put_dec((uint32_t)div64_32(rdtsc() - start, tsc_per_us));
+        vga_puts("us");
+        if (!cqe || cqe->res != -ETIME) vga_puts(" (wrong result)");
+        if (cqe) io_ring_cqe_seen(r);
+
+        if (mode == 2 && !errors) ioring_bench_writeback(r, dev, index, &errors);
+        io_ring_exit(r);
+    }
+    if (errors) {
+        vga_puts("\n  ");
+        vga_put_dec(errors);
+        vga_puts(" I/O errors");
     }
-    return *(unsigned char*)s1 - *(unsigned char*)s2;
 }
 
-static void strcpy(char* dest, const char* src) {
-    while ((*dest++ = *src++));
+// Read the first kb of dev through the buffer cache twice: the first
+// pass comes from the disk (with read-ahead), the second from memory
+static void bcache_bench(struct block_device* dev, uint32_t kb) {
+    uint32_t blocks = kb / (PAGE_SIZE / 1024);
+    uint32_t dev_blocks = dev->sectors / BUF_SECTORS;
+    if (blocks > dev_blocks) blocks = dev_blocks;
+    if (!blocks) {
+        vga_puts("\nDevice too small");
+        return;
+    }
+    buf_drop(dev);
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        uint32_t ra_hits = buf_stats.ra_hits;
+        uint32_t misses = buf_stats.misses;
+        uint64_t start = rdtsc();
+        uint32_t done = 0;
+        for (; done < blocks; done++) {
+            struct buf* b = bread(dev, done);
+            if (!b) break;
+            brelse(b);
+        }
+        uint32_t us = (uint32_t)div64_32(rdtsc() - start, tsc_per_us);
+        vga_puts(pass ? "\n  warm: " : "\n  cold: ");
+        vga_put_dec(done * (PAGE_SIZE / 1024));
+        vga_puts("KB in ");
+        vga_put_dec(us);
+        vga_puts("us, ");
+        vga_put_dec(us ? (uint32_t)div64_32((uint64_t)done * (PAGE_SIZE / 1024) * 1000000, us) : 0);
+        vga_puts(" KB/s, ");
+        vga_put_dec(buf_stats.misses - misses);
+        vga_puts(" misses, ");
+        vga_put_dec(buf_stats.ra_hits - ra_hits);
+        vga_puts(" read-ahead hits");
+        if (done < blocks) vga_puts(" (I/O error)");
+    }
+}
+// Rewrite the first kb of dev with what is already there, a block at
+// a time through the buffer cache: write-through, each bwrite() waiting
+// for the device, then write-back, bdirty() and one sync at the end.
+// The blocks are read in first so that both passes time only writes.
+static void wb_bench(struct block_device* dev, uint32_t kb) {
+    uint32_t blocks = kb / (PAGE_SIZE / 1024);
+    uint32_t dev_blocks = dev->sectors / BUF_SECTORS;
+    if (blocks > dev_blocks) blocks = dev_blocks;
+    if (blocks > BUF_CACHE_BLOCKS / 2) blocks = BUF_CACHE_BLOCKS / 2;
+    if (!blocks) {
+        vga_puts("\nDevice too small");
+        return;
+    }
+    for (uint32_t i = 0; i < blocks; i++) {
+        struct buf* b = bread(dev, i);
+        if (!b) {
+            vga_puts("\nRead error");
+            return;
+        }
+        brelse(b);
+    }
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        uint32_t throttled = wb_stats.throttled;
+        uint32_t batches = wb_stats.batches;
+        bool ok = true;
+        uint64_t start = rdtsc();
+        uint32_t done = 0;
+        for (; done < blocks && ok; done++) {
+            struct buf* b = bread(dev, done);
+            if (!b) break;
+            if (pass) bdirty(b);
+            else ok = bwrite(b);
+            brelse(b);
+            if (pass) balance_dirty();
+        }
+        uint32_t writer_us = (uint32_t)div64_32(rdtsc() - start, tsc_per_us);
+        if (pass && !wb_sync()) ok = false;
+        uint32_t us = (uint32_t)div64_32(rdtsc() - start, tsc_per_us);
+        vga_puts(pass ? "\n  write-back:    " : "\n  write-through: ");
+        vga_put_dec(done * (PAGE_SIZE / 1024));
+        vga_puts("KB in ");
+        vga_put_dec(us / 1000);
+        vga_puts("ms, ");
+        vga_put_dec(us ? (uint32_t)div64_32((uint64_t)done * (PAGE_SIZE / 1024) * 1000000, us) : 0);
+        vga_puts(" KB/s");
+        if (pass) {
+            vga_puts("; writer done after ");
+            vga_put_dec(writer_us / 1000);
+            vga_puts("ms, ");
+            vga_put_dec(wb_stats.batches - batches);
+            vga_puts(" batches, ");
+            vga_put_dec(wb_stats.throttled - throttled);
+            vga_puts(" throttled");
+        }
+        if (!ok || done < blocks) vga_puts(" (I/O error)");
+    }
 }
 
-static void memset(void* dest, int value, size_t n) {
-    unsigned char* d = dest;
-    while (n--) *d++ = (unsigned char)value;
+// Write-heavy load on the log-structured volume: LFS_BENCH_FILES small
+// files, an LFS_BENCH_KB file written sequentially and then rewritten
+// 4KB at a time at random, and a checkpoint. Per phase, how many device
+// writes carried it and how many blocks reached the log (summaries,
+// inodes and indirect blocks included) per 4KB the caller wrote.
+static void lfs_bench(struct lfs_fs* fs) {
+    uint8_t* buf = (uint8_t*)pmm_alloc_page();
+    if (!buf) {
+        vga_puts("\nOut of memory");
+        return;
+    }
+    int32_t err = lfs_mkdir(fs, "/bench");
+    if (err && err != -EEXIST) {
+        lfs_put_error(err);
+        pmm_free_page((uint32_t)buf);
+        return;
+    }
+
+    uint32_t seed = (uint32_t)rdtsc() | 1;
+    uint32_t chunks = LFS_BENCH_KB / 4;
+    uint32_t cleaned = fs->stats.segs_cleaned;
+    uint32_t copied = fs->stats.blocks_copied;
+    char name[16] = "/bench/f";
+    vga_puts("\n  phase         us   ops/s  writes  log blocks  per 4KB");
+    for (uint32_t phase = 0; phase < 4 && !err; phase++) {
+        static const uint32_t ops[4] = { LFS_BENCH_FILES, LFS_BENCH_KB / 4, LFS_BENCH_KB / 4, 1 };
+        struct lfs_stats before = fs->stats;
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < ops[phase] && !err; i++) {
+            for (uint32_t j = 0; j < PAGE_SIZE; j += 4) *(uint32_t*)(buf + j) = dd_random(&seed);
+            if (phase == 0) {
+                uint32_t n = 8;
+                if (i >= 10) name[n++] = '0' + i / 10;
+                name[n++] = '0' + i % 10;
+                name[n] = 0;
+                err = lfs_write_file(fs, name, 0, buf, PAGE_SIZE, true);
+            } else if (phase == 1) {
+                err = lfs_write_file(fs, "/bench/big", i ? LFS_END : 0, buf, PAGE_SIZE, !i);
+            } else if (phase == 2) {
+                err = lfs_write_file(fs, "/bench/big", dd_random(&seed) % chunks * PAGE_SIZE, buf, PAGE_SIZE, false);
+            } else if (!lfs_sync_volume(fs)) {
+                err = -EIO;
+            }
+        }
+        uint32_t us = (uint32_t)div64_32(rdtsc() - start, tsc_per_us);
+        uint32_t logged = fs->stats.partials - before.partials + fs->stats.data_blocks - before.data_blocks +
+                          fs->stats.meta_blocks - before.meta_blocks;
+        uint32_t user = (uint32_t)((fs->stats.user_bytes - before.user_bytes) / PAGE_SIZE);
+
+        static const char* const names[4] = { "\n  create  ", "\n  fill    ", "\n  rewrite ", "\n  sync    " };
+        vga_puts(names[phase]);
+        vga_put_dec_width(us, 8);
+        vga_put_dec_width(us ? (uint32_t)div64_32((uint64_t)ops[phase] * 1000000, us) : 0, 8);
+        vga_put_dec_width(fs->stats.device_writes - before.device_writes, 8);
+        vga_put_dec_width(logged, 12);
+        if (user) {
+            uint32_t amp = logged * 100 / user;
+            vga_put_dec_width(amp / 100, 7);
+            vga_putc('.');
+            vga_put_dec(amp % 100 / 10);
+            vga_put_dec(amp % 10);
+        }
+    }
+    if (err) lfs_put_error(err);
+    vga_puts("\n  Cleaner: ");
+    vga_put_dec(fs->stats.segs_cleaned - cleaned);
+    vga_puts(" segments, ");
+    vga_put_dec(fs->stats.blocks_copied - copied);
+    vga_puts(" blocks copied");
+
+    for (uint32_t i = 0; i < LFS_BENCH_FILES; i++) {
+        uint32_t n = 8;
+        if (i >= 10) name[n++] = '0' + i / 10;
+        name[n++] = '0' + i % 10;
+        name[n] = 0;
+        lfs_remove(fs, name);
+    }
+    lfs_remove(fs, "/bench/big");
+    lfs_remove(fs, "/bench");
+    lfs_sync_volume(fs);
+    pmm_free_page((uint32_t)buf);
 }
 
 // ==================== TERMINAL FUNCTIONS ====================
@@ -122,7 +11502,6 @@ static void show_prompt(void) {
     vga_set_color(2, 0);  // Green
     vga_puts("root~bloodos:~ ");
     vga_set_color(7, 0);  // White
-    cmd_pos = 0;
 }
 
 static void add_to_history(const char* cmd) {
@@ -140,8 +11519,24 @@ static void add_to_history(const char* cmd) {
 }
 
 // ==================== COMMAND EXECUTION ====================
+static void show_initcalls(void);
+static void run_script(const char* path);
+
+// Running scripts, innermost last. Only the outermost run_script()
+// loops; a nested one just pushes its file, so the shell's stack is
+// the same however deep scripts call each other.
+struct script_frame {
+    char* text;                         // The file, a page, lines cut in place
+    int32_t len;
+    int32_t pos;
+    char path[VFS_PATH_MAX];            // Canonical
+};
+
+static struct script_frame script_stack[SCRIPT_MAX_DEPTH];
+static uint32_t script_depth = 0;       // Script lines skip history and the prompt
+
 static void execute_command(const char* cmd) {
-    add_to_history(cmd);
+    if (!script_depth) add_to_history(cmd);
     
     // Extract command and arguments
     char command[32];
@@ -174,11 +11569,39 @@ static void execute_command(const char* cmd) {
         vga_puts("  shutdown  - Power off\n");
         vga_puts("  ver       - Show version\n");
         vga_puts("  color     - Change color\n");
-        vga_puts("  ls        - List files\n");
+        vga_puts("  ls        - List a directory\n");
+        vga_puts("  cat       - Print a file\n");
+        vga_puts("  stat      - File or volume details\n");
+        vga_puts("  rm        - Delete a file\n");
+        vga_puts("  mkdir     - Make a directory\n");
+        vga_puts("  write     - Replace a file with text; append adds it\n");
+        vga_puts("  sh        - Run the commands in a file (or name one in a bin/)\n");
         vga_puts("  time      - Show time\n");
         vga_puts("  date      - Show date\n");
         vga_puts("  calc      - Calculator\n");
         vga_puts("  mem       - Memory info\n");
+        vga_puts("  wakebench - Cross-CPU wakeup latency\n");
+        vga_puts("  cpus      - Per-CPU statistics\n");
+        vga_puts("  tlb       - TLB shootdown statistics\n");
+        vga_puts("  tlbbench  - Per-page vs batched shootdowns\n");
+        vga_puts("  schedlat  - Scheduling latency per class\n");
+        vga_puts("  hog       - Load every CPU for a few seconds\n");
+        vga_puts("  initcalls - Boot initcall timings\n");
+        vga_puts("  irqaffinity - IRQ routing; <irq> <mask> sets\n");
+        vga_puts("  irqbalance  - IRQ balancer [on|off]\n");
+        vga_puts("  lsblk     - Block devices and I/O counts\n");
+        vga_puts("  dd        - Disk throughput benchmark\n");
+        vga_puts("  dmabench  - Disk CPU cost, PIO vs DMA\n");
+        vga_puts("  bcache    - Buffer cache stats; drop | <dev> [KB]\n");
+        vga_puts("  writeback - Dirty data and flusher stats; bench <dev> [KB]\n");
+        vga_puts("  sync      - Write all dirty data to disk\n");
+        vga_puts("  dcache    - Dentry and inode cache stats; drop\n");
+        vga_puts("  lspci     - PCI devices\n");
+        vga_puts("  qdbench   - IOPS and latency at queue depths 1-32\n");
+        vga_puts("  iosched   - I/O scheduler stats; <dev> noop|deadline|bench\n");
+        vga_puts("  ringbench - Sync reads vs. batched I/O rings, with and without polling\n");
+        vga_puts("  lfs       - Log-structured volume stats; sync | clean | bench\n");
+        vga_puts("  floppy    - Floppy track cache, seek and read times; drop\n");
         vga_puts("  cls       - Clear screen\n");
         vga_puts("  exit      - Exit shell\n");
     }
@@ -211,10 +11634,62 @@ static void execute_command(const char* cmd) {
             vga_puts("\nColor changed");
         }
     }
-    else if (strcmp(command, "ls") == 0) {
-        vga_puts("\nbin/    dev/    etc/    home/");
-        vga_puts("\nlib/    proc/   root/   tmp/");
-        vga_puts("\nusr/    var/    boot/   sys/");
+    else if (strcmp(command, "ls") == 0 || strcmp(command, "cat") == 0 || strcmp(command, "stat") == 0 ||
+             strcmp(command, "rm") == 0) {
+        int32_t err = 0;
+        if (command[0] != 'l' && !args[0]) vga_puts(command[0] == 'c' ? "\nUsage: cat <file>" : command[0] == 'r' ? "\nUsage: rm <file>" : "\nUsage: stat <path>");
+        else if (command[0] == 'l') vfs_ls(args[0] ? args : "/");
+        else if (command[0] == 'c') vfs_cat(args);
+        else if (command[0] == 'r') err = vfs_unlink(args);
+        else vfs_show(args);
+        if (err) vfs_put_error(err);
+    }
+    else if (strcmp(command, "mkdir") == 0 || strcmp(command, "write") == 0 || strcmp(command, "append") == 0) {
+        // mkdir <path> | write <path> <text> | append <path> <text>
+        char path[64] = {0};
+        const char* p = args;
+        for (uint32_t n = 0; *p && *p != ' '; p++) {
+            if (n < sizeof(path) - 1) path[n++] = *p;
+        }
+        while (*p == ' ') p++;
+        int32_t err = 0;
+        if (!path[0] || (command[0] != 'm' && !*p)) {
+            vga_puts(command[0] == 'm' ? "\nUsage: mkdir <path>" : "\nUsage: write|append <path> <text>");
+        } else if (command[0] == 'm') {
+            err = vfs_mkdir(path);
+        } else if ((err = vfs_open(path, VFS_CREATE | (command[0] == 'w' ? VFS_TRUNC : VFS_APPEND))) >= 0) {
+            int32_t fd = err;
+            uint32_t len = strlen(p);
+            err = vfs_write(fd, p, len);
+            if (err >= 0) err = (uint32_t)err < len ? -ENOSPC : 0;
+            vfs_close(fd);
+        }
+        if (err) vfs_put_error(err);
+    }
+    else if (strcmp(command, "lfs") == 0) {
+        // lfs | lfs sync | lfs clean (to LFS_CLEAN_HIGH free) | lfs bench
+        if (!lfs_root) {
+            vga_puts("\nNo filesystem mounted");
+        } else if (!args[0]) {
+            show_lfs(lfs_root);
+        } else if (strcmp(args, "sync") == 0) {
+            vga_puts(lfs_sync_volume(lfs_root) ? "\nCheckpoint written" : "\nCheckpoint failed");
+        } else if (strcmp(args, "clean") == 0) {
+            mutex_lock(&lfs_root->lock);
+            uint32_t cleaned = lfs_clean(lfs_root, LFS_CLEAN_HIGH);
+            mutex_unlock(&lfs_root->lock);
+            vga_puts("\nCleaned ");
+            vga_put_dec(cleaned);
+            vga_puts(" segments");
+        } else if (strcmp(args, "bench") == 0) {
+            lfs_bench(lfs_root);
+        } else {
+            vga_puts("\nUsage: lfs [sync|clean|bench]");
+        }
+    }
+    else if (strcmp(command, "sh") == 0) {
+        if (!args[0]) vga_puts("\nUsage: sh <file>");
+        else run_script(args);
     }
     else if (strcmp(command, "time") == 0) {
         vga_puts("\n00:00:00 UTC");
@@ -226,7 +11701,188 @@ static void execute_command(const char* cmd) {
         vga_puts("\nCalculator: Enter expression");
     }
     else if (strcmp(command, "mem") == 0) {
-        vga_puts("\nMemory: 64MB total, 32MB free");
+        vga_puts("\nMemory: ");
+        vga_put_dec(mem_total_kb / 1024);
+        vga_puts("MB total, ");
+        vga_put_dec(pmm_free * 4 / 1024);
+        vga_puts("MB free");
+        show_pmm_init();
+        show_page_cache();
+    }
+    else if (strcmp(command, "wakebench") == 0) {
+        wake_bench();
+    }
+    else if (strcmp(command, "cpus") == 0) {
+        show_cpus();
+    }
+    else if (strcmp(command, "tlb") == 0) {
+        show_tlb_stats();
+    }
+    else if (strcmp(command, "tlbbench") == 0) {
+        tlb_bench();
+    }
+    else if (strcmp(command, "schedlat") == 0) {
+        if (strcmp(args, "reset") == 0) {
+            reset_sched_latency();
+            vga_puts("\nLatency counters cleared");
+        } else {
+            show_sched_latency();
+        }
+    }
+    else if (strcmp(command, "hog") == 0) {
+        start_hogs(HOG_SECONDS);
+        vga_puts("\nStarted ");
+        vga_put_dec(cpu_count);
+        vga_puts(" CPU hogs for ");
+        vga_put_dec(HOG_SECONDS);
+        vga_puts("s");
+    }
+    else if (strcmp(command, "initcalls") == 0) {
+        show_initcalls();
+    }
+    else if (strcmp(command, "irqaffinity") == 0) {
+        const char* p = args;
+        uint32_t irq, mask;
+        if (!args[0]) {
+            show_irqs();
+        } else if (!parse_uint(&p, &irq) || !parse_uint(&p, &mask)) {
+            vga_puts("\nUsage: irqaffinity [<irq> <cpu mask>]");
+        } else if (!irq_set_affinity(irq, mask)) {
+            vga_puts("\nCan't route that IRQ to those CPUs");
+        } else {
+            vga_puts("\nIRQ ");
+            vga_put_dec(irq);
+            vga_puts(" now on cpu");
+            vga_put_dec(irqs[irq].target);
+        }
+    }
+    else if (strcmp(command, "lsblk") == 0) {
+        show_block_devices();
+    }
+    else if (strcmp(command, "dd") == 0) {
+        // dd <dev> <read|write> <seq|rand> [KB per request]
+        char dev_name[8] = {0}, op[8] = {0}, pattern[8] = {0};
+        char* fields[3] = { dev_name, op, pattern };
+        const char* p = args;
+        for (uint32_t f = 0; f < 3; f++) {
+            for (uint32_t n = 0; *p && *p != ' '; p++) {
+                if (n < 7) fields[f][n++] = *p;
+            }
+            while (*p == ' ') p++;
+        }
+        uint32_t kb = 4;
+        if (*p) parse_uint(&p, &kb);
+        struct block_device* dev = blk_find(dev_name);
+        bool write = strcmp(op, "write") == 0;
+        bool random = strcmp(pattern, "rand") == 0;
+        if (!dev || (!write && strcmp(op, "read") != 0) || (!random && strcmp(pattern, "seq") != 0) ||
+            kb == 0 || kb > DD_MAX_KB) {
+            vga_puts("\nUsage: dd <dev> <read|write> <seq|rand> [KB, 1-64]");
+        } else {
+            dd_bench(dev, write, random, kb);
+        }
+    }
+    else if (strcmp(command, "bcache") == 0) {
+        // bcache | bcache drop | bcache <dev> [KB]
+        if (!args[0]) {
+            show_buffer_stats();
+        } else if (strcmp(args, "drop") == 0) {
+            vga_puts("\nDropped ");
+            vga_put_dec(buf_drop(0));
+            vga_puts(" buffers");
+        } else {
+            char dev_name[8] = {0};
+            const char* p = args;
+            for (uint32_t n = 0; *p && *p != ' '; p++) {
+                if (n < 7) dev_name[n++] = *p;
+            }
+            while (*p == ' ') p++;
+            uint32_t kb = BCACHE_BENCH_KB;
+            if (*p) parse_uint(&p, &kb);
+            struct block_device* dev = blk_find(dev_name);
+            if (dev) bcache_bench(dev, kb);
+            else vga_puts("\nUsage: bcache [drop | <dev> [KB]]");
+        }
+    }
+    else if (strcmp(command, "writeback") == 0) {
+        // writeback | writeback bench <dev> [KB]
+        if (!args[0]) {
+            show_writeback();
+        } else if (memcmp(args, "bench ", 6) == 0) {
+            char dev_name[8] = {0};
+            const char* p = args + 6;
+            for (uint32_t n = 0; *p && *p != ' '; p++) {
+                if (n < 7) dev_name[n++] = *p;
+            }
+            while (*p == ' ') p++;
+            uint32_t kb = WB_BENCH_KB;
+            if (*p) parse_uint(&p, &kb);
+            struct block_device* dev = blk_find(dev_name);
+            if (dev) wb_bench(dev, kb);
+            else vga_puts("\nNo such device");
+        } else {
+            vga_puts("\nUsage: writeback [bench <dev> [KB]]");
+        }
+    }
+    else if (strcmp(command, "sync") == 0) {
+        uint64_t start = rdtsc();
+        bool ok = wb_sync();
+        if (lfs_root && !lfs_sync_volume(lfs_root)) ok = false;
+        vga_puts(ok ? "\nSynced in " : "\nSync failed after ");
+        vga_put_dec((uint32_t)div64_32(rdtsc() - start, tsc_per_us) / 1000);
+        vga_puts("ms");
+    }
+    else if (strcmp(command, "dcache") == 0) {
+        if (strcmp(args, "drop") == 0) dcache_drop();
+        show_dcache();
+    }
+    else if (strcmp(command, "dmabench") == 0) {
+        struct block_device* dev = blk_find(args[0] ? args : "hda");
+        if (dev) ata_dma_bench(dev);
+        else vga_puts("\nNo such device");
+    }
+    else if (strcmp(command, "qdbench") == 0) {
+        struct block_device* dev = blk_find(args[0] ? args : "sda");
+        if (dev) qd_bench(dev);
+        else vga_puts("\nNo such device");
+    }
+    else if (strcmp(command, "iosched") == 0) {
+        // iosched | iosched <dev> noop|deadline|bench
+        char dev_name[8] = {0};
+        const char* p = args;
+        for (uint32_t n = 0; *p && *p != ' '; p++) {
+            if (n < 7) dev_name[n++] = *p;
+        }
+        while (*p == ' ') p++;
+        struct block_device* dev = blk_find(dev_name);
+        if (!args[0]) show_iosched();
+        else if (dev && strcmp(p, "noop") == 0) elv_set_mode(dev, ELV_NOOP);
+        else if (dev && strcmp(p, "deadline") == 0) elv_set_mode(dev, ELV_DEADLINE);
+        else if (dev && strcmp(p, "bench") == 0) elv_bench(dev);
+        else vga_puts("\nUsage: iosched [<dev> noop|deadline|bench]");
+    }
+    else if (strcmp(command, "ringbench") == 0) {
+        struct block_device* dev = blk_find(args[0] ? args : "sda");
+        if (dev) ioring_bench(dev);
+        else vga_puts("\nNo such device");
+    }
+    else if (strcmp(command, "floppy") == 0) {
+        if (strcmp(args, "drop") == 0) {
+            floppy_drop();
+            vga_puts("\nTrack cache emptied");
+        }
+        else show_floppy();
+    }
+    else if (strcmp(command, "lspci") == 0) {
+        show_pci();
+    }
+    else if (strcmp(command, "irqbalance") == 0) {
+        if (strcmp(args, "on") == 0 || strcmp(args, "off") == 0) {
+            irq_balance_enable(args[1] == 'n');
+        }
+        vga_puts("\nIRQ balancer ");
+        vga_puts(irq_balance_on ? "on" : "off");
+        if (!ioapic) vga_puts(" (needs an IOAPIC)");
     }
     else if (strcmp(command, "exit") == 0) {
         vga_puts("\nLogging out...");
@@ -235,12 +11891,75 @@ static void execute_command(const char* cmd) {
         return;
     }
     else if (command[0] != '\0') {
-        vga_puts("\nCommand not found: ");
-        vga_puts(command);
-        vga_puts("\nType 'help' for available commands");
+        char path[64];
+        if (shell_find_command(command, path, sizeof(path))) {
+            // Found by name, a script could otherwise call itself by
+            // just naming itself; that only ends at SCRIPT_MAX_DEPTH
+            bool running = false;
+            for (uint32_t k = 0; k < script_depth; k++) {
+                if (strcmp(script_stack[k].path, path) == 0) running = true;
+            }
+            if (running) {
+                vga_puts("\nScript calls itself: ");
+                vga_puts(command);
+            } else {
+                run_script(path);
+            }
+        } else {
+            vga_puts("\nCommand not found: ");
+            vga_puts(command);
+            vga_puts("\nType 'help' for available commands");
+        }
     }
     
-    show_prompt();
+    if (!script_depth) show_prompt();
+}
+
+// One command per line; blank lines and '#' comments are skipped
+static void run_script(const char* path) {
+    if (script_depth == SCRIPT_MAX_DEPTH) {
+        vga_puts("\nScripts nested too deeply");
+        return;
+    }
+    struct script_frame* f = &script_stack[script_depth];
+    if (vfs_normalize(path, f->path)) {
+        vga_puts("\nNo such file");
+        return;
+    }
+    char* text = (char*)pmm_alloc_page();
+    if (!text) {
+        vga_puts("\nOut of memory");
+        return;
+    }
+    int32_t len = shell_read_file(f->path, text, PAGE_SIZE - 1);
+    if (len < 0) {
+        vga_puts("\nNo such file");
+        pmm_free_page((uint32_t)text);
+        return;
+    }
+    text[len] = '\0';
+    f->text = text;
+    f->len = len;
+    f->pos = 0;
+    script_depth++;
+    if (script_depth > 1) return;       // The outermost loop below runs it
+
+    while (script_depth) {
+        f = &script_stack[script_depth - 1];
+        if (f->pos >= f->len) {
+            pmm_free_page((uint32_t)f->text);
+            script_depth--;
+            continue;
+        }
+        char* line = f->text + f->pos;
+        int32_t n = 0;
+        while (f->pos + n < f->len && line[n] != '\n') n++;
+        f->pos += n + 1;
+        line[n] = '\0';
+        if (n && line[n - 1] == '\r') line[n - 1] = '\0';
+        while (*line == ' ') line++;
+        if (*line && *line != '#') execute_command(line);
+    }
 }
 
 // ==================== KEYBOARD HANDLER ====================
@@ -252,19 +11971,44 @@ static char get_ascii(uint8_t scancode) {
     return (c != '?') ? c : 0;
 }
 
+static volatile uint8_t kbd_buffer[KBD_BUFFER_SIZE];
+static volatile uint32_t kbd_head = 0;
+static volatile uint32_t kbd_tail = 0;
+static struct wait_queue kbd_wait;
+
+// Complete lines handed from the keyboard thread to the shell thread
+static char shell_lines[SHELL_LINES][CMD_BUFFER_SIZE];
+static volatile uint32_t shell_head = 0;
+static volatile uint32_t shell_tail = 0;
+static struct wait_queue shell_wait;
+
+// IRQ1: queue the scancode and let the keyboard thread do the work
 static void handle_keyboard(void) {
     uint8_t scancode = inb(0x60);
-    
+    uint32_t next = (kbd_head + 1) % KBD_BUFFER_SIZE;
+    if (next != kbd_tail) {
+        kbd_buffer[kbd_head] = scancode;
+        kbd_head = next;
+    }
+    wake_up(&kbd_wait);
+}
+
+// Line editing and echo; runs in the RT class so typing stays responsive
+// while the shell executes something heavy
+static void kbd_handle_scancode(uint8_t scancode) {
     // Key press (bit 7 clear)
     if (!(scancode & 0x80)) {
         if (scancode == 0x1C) { // Enter
             cmd_buffer[cmd_pos] = '\0';
             vga_putc('\n');
-            if (cmd_pos > 0) {
-                execute_command(cmd_buffer);
+            uint32_t next = (shell_head + 1) % SHELL_LINES;
+            if (cmd_pos > 0 && next != shell_tail) {
+                strcpy(shell_lines[shell_head], cmd_buffer);
+                shell_head = next;
+                wake_up(&shell_wait);
                 memset(cmd_buffer, 0, CMD_BUFFER_SIZE);
                 cmd_pos = 0;
-            } else {
+            } else if (cmd_pos == 0) {
                 show_prompt();
             }
         }
@@ -282,9 +12026,29 @@ static void handle_keyboard(void) {
             }
         }
     }
-    
-    // Acknowledge interrupt
-    outb(0x20, 0x20);
+}
+
+static void kbd_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        wait_event(kbd_wait, kbd_head != kbd_tail);
+        while (kbd_tail != kbd_head) {
+            uint8_t scancode = kbd_buffer[kbd_tail];
+            kbd_tail = (kbd_tail + 1) % KBD_BUFFER_SIZE;
+            kbd_handle_scancode(scancode);
+        }
+        vga_set_cursor();
+    }
+}
+
+static void shell_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        wait_event(shell_wait, shell_head != shell_tail);
+        execute_command(shell_lines[shell_tail]);
+        shell_tail = (shell_tail + 1) % SHELL_LINES;
+        vga_set_cursor();
+    }
 }
 
 // ==================== SYSTEM INITIALIZATION ====================
@@ -299,15 +12063,44 @@ static void init_pic(void) {
     outb(0x21, 0x01);  // ICW4
     outb(0xA1, 0x01);
     
-    // Enable keyboard interrupt only
-    outb(0x21, 0xFD);  // Enable IRQ1 (keyboard)
-    outb(0xA1, 0xFF);  // Disable all slave IRQs
+    // Everything masked; request_irq() unmasks lines as drivers claim
+    // them (or the IOAPIC takes over and the PIC stays masked)
+    outb(0x21, 0xFB);  // Cascade (IRQ2) only
+    outb(0xA1, 0xFF);
+}
+
+void interrupt_dispatch(struct interrupt_frame* frame) {
+    void (*handler)(void) = interrupt_handlers[frame->vector];
+    uint32_t irq = frame->vector - IRQ_BASE;
+    percpu_inc(interrupts);
+    percpu_write(vector, frame->vector);
+    if (irq < NR_IRQS && irqs[irq].nr_handlers) {
+        irq_handle(irq);
+    } else if (handler) {
+        handler();
+    } else {
+        if (frame->vector < 32) {
+            vga_set_color(4, 0);
+            vga_puts("\nCPU exception ");
+            vga_put_dec(frame->vector);
+            vga_puts(" at ");
+            vga_put_hex(frame->eip);
+            asm volatile ("cli");
+            while (1) asm volatile ("hlt");
+        }
+        return;
+    }
+    // Preempt on the way out if a wakeup or the tick asked for it
+    if (percpu_read(need_resched) && !percpu_read(preempt_count)) preempt_schedule();
 }
 
 static void init_idt(void) {
-    // Minimal IDT setup
-    // In a real OS, this would set up interrupt gates
-    // For now, we just enable interrupts
+    for (int i = 0; i < 256; i++) {
+        idt_set_gate(i, isr_stub_table[i]);
+    }
+    idtr.limit = sizeof(idt) - 1;
+    idtr.base = (uint32_t)&idt;
+    idt_load();
 }
 
 // ==================== BLOODOS ASCII ART ====================
@@ -338,25 +12131,219 @@ static void show_banner(void) {
     vga_puts("            Type 'help' for available commands\n\n");
 }
 
+// ==================== INITCALLS ====================
+// Boot work as a dependency graph. INITCALL_EARLY entries run in table
+// order on the BSP before interrupts are enabled; everything else gets
+// its own thread once all of its deps are done, so independent probes
+// overlap (across CPUs once smp is up) and the shell starts as soon as
+// the console is ready rather than after the slowest device.
+#define INITCALL_PENDING 0
+#define INITCALL_RUNNING 1
+#define INITCALL_DONE    2
+
+#define INITCALL_EARLY   0x01
+
+enum {
+    INIT_CONSOLE, INIT_IDT, INIT_PIC, INIT_CPU, INIT_PMM, INIT_PAGING,
+    INIT_LAPIC, INIT_IOAPIC, INIT_IDLE, INIT_TLB, INIT_SCHED,
+    INIT_TIMER, INIT_SMP, INIT_MEMORY, INIT_IRQBALANCE, INIT_PCI, INIT_ATA, INIT_AHCI, INIT_VIRTIO, INIT_BCACHE, INIT_WRITEBACK, INIT_FAT, INIT_LFS, INIT_EXT2, INIT_FLOPPY, INIT_INITRD, INIT_DEVFS, INIT_KBD, INIT_BANNER, INIT_SHELL,
+    INITCALL_COUNT
+};
+
+#define DEP(id) (1u << (id))
+
+struct initcall {
+    const char* name;
+    void (*fn)(void);
+    uint32_t deps;              // DEP() mask that must be done first
+    uint32_t flags;
+    volatile uint32_t state;
+    uint32_t cpu;
+    uint64_t start;             // TSC
+    uint64_t end;
+};
+
+static void init_sched(void) {
+    cpus[0].apic_id = lapic_id();
+    cpus[0].online = true;
+    sched_init_cpu(&cpus[0]);
+}
+
+static void init_kbd(void) {
+    thread_create_class("kbd", kbd_thread, 0, SCHED_RT, RT_PRIO_INPUT);
+    request_irq(isa_irq(1), "kbd", handle_keyboard);
+}
+
+static void init_irqbalance(void) {
+    thread_create("irqbalance", irq_balance_thread, 0);
+}
+
+static void init_writeback(void) {
+    thread_create("flush", wb_thread, 0);
+}
+
+static void init_shell(void) {
+    show_prompt();
+    thread_create("shell", shell_thread, 0);
+}
+
+static struct initcall initcalls[] = {
+    [INIT_CONSOLE] = { "console", vga_clear,     0, INITCALL_EARLY },
+    [INIT_IDT]     = { "idt",     init_idt,      0, INITCALL_EARLY },
+    [INIT_PIC]     = { "pic",     init_pic,      0, INITCALL_EARLY },
+    [INIT_CPU]     = { "cpu",     cpu_init,      0, INITCALL_EARLY },
+    [INIT_PMM]     = { "pmm",     pmm_init,      0, INITCALL_EARLY },
+    [INIT_PAGING]  = { "paging",  paging_init,   DEP(INIT_PMM), INITCALL_EARLY },
+    [INIT_LAPIC]   = { "lapic",   lapic_init,    DEP(INIT_PAGING), INITCALL_EARLY },
+    [INIT_IOAPIC]  = { "ioapic",  ioapic_init,   DEP(INIT_LAPIC) | DEP(INIT_PIC), INITCALL_EARLY },
+    [INIT_IDLE]    = { "idle",    idle_init,     DEP(INIT_IDT) | DEP(INIT_CPU), INITCALL_EARLY },
+    [INIT_TLB]     = { "tlb",     tlb_init,      DEP(INIT_IDT), INITCALL_EARLY },
+    [INIT_SCHED]   = { "sched",   init_sched,    DEP(INIT_LAPIC) | DEP(INIT_PMM), INITCALL_EARLY },
+    [INIT_TIMER]   = { "timer",   timer_init,    DEP(INIT_SCHED) | DEP(INIT_IOAPIC), 0 },
+    [INIT_SMP]     = { "smp",     smp_init,      DEP(INIT_TIMER), 0 },
+    [INIT_MEMORY]  = { "memory",  pmm_init_late, DEP(INIT_SCHED), 0 },
+    [INIT_IRQBALANCE] = { "irqbal", init_irqbalance, DEP(INIT_SMP), 0 },
+    [INIT_PCI]     = { "pci",     pci_init,      DEP(INIT_SCHED), 0 },
+    [INIT_ATA]     = { "ata",     ata_init,      DEP(INIT_PCI) | DEP(INIT_IOAPIC), 0 },
+    [INIT_AHCI]    = { "ahci",    ahci_init,     DEP(INIT_PCI) | DEP(INIT_IOAPIC), 0 },
+    [INIT_VIRTIO]  = { "virtio",  virtio_blk_init, DEP(INIT_PCI) | DEP(INIT_SMP), 0 },
+    [INIT_BCACHE]  = { "bcache",  buf_init,      DEP(INIT_SCHED), 0 },
+    [INIT_WRITEBACK] = { "flush", init_writeback, DEP(INIT_BCACHE), 0 },
+    [INIT_FAT]     = { "fat",     fat_init,      DEP(INIT_BCACHE) | DEP(INIT_ATA) | DEP(INIT_AHCI) |
+                                                 DEP(INIT_VIRTIO), 0 },
+    [INIT_LFS]     = { "lfs",     lfs_init,      DEP(INIT_BCACHE) | DEP(INIT_ATA) | DEP(INIT_AHCI) |
+                                                 DEP(INIT_VIRTIO), 0 },
+    [INIT_EXT2]    = { "ext2",    ext2_init,     DEP(INIT_BCACHE) | DEP(INIT_ATA) | DEP(INIT_AHCI) |
+                                                 DEP(INIT_VIRTIO), 0 },
+    [INIT_FLOPPY]  = { "floppy",  floppy_init,   DEP(INIT_TIMER) | DEP(INIT_IOAPIC) | DEP(INIT_FAT) |
+                                                 DEP(INIT_LFS) | DEP(INIT_EXT2), 0 },
+    [INIT_INITRD]  = { "initrd",  initrd_init,   DEP(INIT_SCHED), 0 },
+    [INIT_DEVFS]   = { "devfs",   devfs_init,    DEP(INIT_SCHED), 0 },
+    [INIT_KBD]     = { "kbd",     init_kbd,      DEP(INIT_SCHED) | DEP(INIT_IOAPIC), 0 },
+    [INIT_BANNER]  = { "banner",  show_banner,   DEP(INIT_CONSOLE), 0 },
+    [INIT_SHELL]   = { "shell",   init_shell,    DEP(INIT_KBD) | DEP(INIT_BANNER), 0 },
+};
+
+_Static_assert(INITCALL_COUNT <= MAX_INITCALLS, "initcall deps are a 32-bit mask");
+
+static spinlock_t initcall_lock;
+static volatile uint32_t initcall_done = 0;
+static uint64_t boot_tsc;
+static bool initcall_quiet = false;     // Set once the prompt is up
+
+static uint32_t initcall_us(uint64_t from, uint64_t to) {
+    return (uint32_t)div64_32(to - from, tsc_per_us);
+}
+
+static void initcall_put_name(const char* name) {
+    vga_puts(name);
+    for (size_t n = strlen(name); n < 9; n++) vga_putc(' ');
+}
+
+static void initcall_report(const struct initcall* ic) {
+    vga_set_color(8, 0);  // Grey
+    vga_puts("[init] ");
+    initcall_put_name(ic->name);
+    vga_put_dec(initcall_us(ic->start, ic->end));
+    vga_puts("us on cpu");
+    vga_put_dec(ic->cpu);
+    vga_puts("\n");
+    vga_set_color(7, 0);
+}
+
+static void initcall_run(struct initcall* ic) {
+    ic->cpu = percpu_read(index);
+    ic->start = rdtsc();
+    ic->fn();
+    ic->end = rdtsc();
+    if (ic == &initcalls[INIT_SHELL]) initcall_quiet = true;
+    else if (!initcall_quiet && !(ic->flags & INITCALL_EARLY)) initcall_report(ic);
+}
+
+static void initcall_complete(struct initcall* ic) {
+    uint32_t flags = spin_lock_irqsave(&initcall_lock);
+    ic->state = INITCALL_DONE;
+    initcall_done |= DEP(ic - initcalls);
+    spin_unlock_irqrestore(&initcall_lock, flags);
+}
+
+static void initcalls_run_early(void) {
+    boot_tsc = rdtsc();
+    for (uint32_t i = 0; i < INITCALL_COUNT; i++) {
+        struct initcall* ic = &initcalls[i];
+        if (!(ic->flags & INITCALL_EARLY)) continue;
+        initcall_run(ic);
+        initcall_complete(ic);
+    }
+    // Reported afterwards: the TSC isn't calibrated until "cpu" has run
+    for (uint32_t i = 0; i < INITCALL_COUNT; i++) {
+        if (initcalls[i].flags & INITCALL_EARLY) initcall_report(&initcalls[i]);
+    }
+}
+
+static void initcall_dispatch(void);
+
+static void initcall_thread(void* arg) {
+    struct initcall* ic = arg;
+    initcall_run(ic);
+    initcall_complete(ic);
+    initcall_dispatch();
+}
+
+// Start every pending initcall whose dependencies are now all done
+static void initcall_dispatch(void) {
+    struct initcall* ready[INITCALL_COUNT];
+    uint32_t count = 0;
+
+    uint32_t flags = spin_lock_irqsave(&initcall_lock);
+    for (uint32_t i = 0; i < INITCALL_COUNT; i++) {
+        struct initcall* ic = &initcalls[i];
+        if (ic->state != INITCALL_PENDING || (initcall_done & ic->deps) != ic->deps) continue;
+        ic->state = INITCALL_RUNNING;
+        ready[count++] = ic;
+    }
+    spin_unlock_irqrestore(&initcall_lock, flags);
+
+    for (uint32_t i = 0; i < count; i++) {
+        // Out of thread slots: run it here instead
+        if (!thread_create(ready[i]->name, initcall_thread, ready[i])) initcall_thread(ready[i]);
+    }
+}
+
+static void show_initcalls(void) {
+    static const char* const state_names[] = { "waiting", "running", "done" };
+    vga_puts("\nInitcalls (start and duration in us since boot):");
+    for (uint32_t i = 0; i < INITCALL_COUNT; i++) {
+        const struct initcall* ic = &initcalls[i];
+        vga_puts("\n  ");
+        initcall_put_name(ic->name);
+        vga_puts(state_names[ic->state]);
+        if (ic->state == INITCALL_PENDING) continue;
+        vga_puts(" cpu");
+        vga_put_dec(ic->cpu);
+        vga_puts(" +");
+        vga_put_dec(initcall_us(boot_tsc, ic->start));
+        if (ic->state == INITCALL_DONE) {
+            vga_puts(" took ");
+            vga_put_dec(initcall_us(ic->start, ic->end));
+        }
+    }
+}
+
 // ==================== MAIN KERNEL ====================
 void kernel_main(void) {
-    // Initialize
-    vga_clear();
-    show_banner();
+    // Per-CPU segment first: locking, and so console output, uses it
+    gdt_init();
+    percpu_init(&cpus[0]);
     
-    // Initialize system
-    init_idt();
-    init_pic();
+    // Core setup runs in order on this CPU; the rest is started as
+    // threads as soon as what it depends on has finished
+    initcalls_run_early();
     
     // Enable interrupts
     asm volatile("sti");
+    initcall_dispatch();
     
-    // Show prompt
-    show_prompt();
-    
-    // Main loop
-    while (1) {
-        // Handle keyboard in interrupt
-        asm volatile("hlt");
-    }
+    // Main loop: this context becomes CPU 0's idle thread
+    idle_loop(&cpus[0]);
 }
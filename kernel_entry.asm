@@ -1,6 +1,14 @@
 [BITS 32]
 [GLOBAL _start]
+[GLOBAL isr_stub_table]
+[GLOBAL ap_trampoline]
+[GLOBAL ap_trampoline_end]
+[GLOBAL context_switch]
 [EXTERN kernel_main]
+[EXTERN interrupt_dispatch]
+[EXTERN ap_main]
+
+AP_TRAMPOLINE equ 0x8000   ; Must match AP_TRAMPOLINE in kernel.c
 
 section .text
 _start:
@@ -16,6 +24,106 @@ _start:
     hlt
     jmp .hang
 
+; === INTERRUPT STUBS ===
+; Every vector pushes a dummy error code (unless the CPU already did)
+; and its vector number, so interrupt_dispatch sees one frame layout.
+%assign i 0
+%rep 256
+isr_stub_%+i:
+%if i != 8 && (i < 10 || i > 14) && i != 17 && i != 21
+    push dword 0
+%endif
+    push dword i
+    jmp isr_common
+%assign i i+1
+%endrep
+
+isr_common:
+    pusha
+    cld
+    push esp                ; struct interrupt_frame*
+    call interrupt_dispatch
+    add esp, 4
+    popa
+    add esp, 8              ; Drop vector and error code
+    iret
+
+; === CONTEXT SWITCH ===
+; void context_switch(uint32_t* save_esp, uint32_t new_esp)
+; Saves the callee-saved registers on the old stack, stores its ESP and
+; resumes whatever the new stack was suspended in (or thread_start).
+context_switch:
+    mov eax, [esp + 4]
+    mov edx, [esp + 8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; === AP TRAMPOLINE ===
+; Copied to AP_TRAMPOLINE by smp_init(). APs start here in real mode
+; (CS = AP_TRAMPOLINE >> 4, IP = 0), switch to protected mode with their
+; own copy of the flat GDT and call ap_main on the stack the BSP left
+; in ap_stack_top.
+bits 16
+ap_trampoline:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    lgdt [ap_gdt_descriptor - ap_trampoline]
+
+    mov eax, cr0
+    or eax, 0x1
+    mov cr0, eax
+
+    jmp dword 0x08:(AP_TRAMPOLINE + ap_pm - ap_trampoline)
+
+bits 32
+ap_pm:
+    mov ax, 0x10
+    mov ds, ax
+    mov ss, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov esp, [AP_TRAMPOLINE + ap_stack_top - ap_trampoline]
+    mov eax, ap_main
+    call eax
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+align 8
+ap_gdt:
+    dq 0x0
+    dq 0x00CF9A000000FFFF   ; Code: base 0, limit 4GB, ring 0
+    dq 0x00CF92000000FFFF   ; Data: base 0, limit 4GB, ring 0
+ap_gdt_descriptor:
+    dw ap_gdt_descriptor - ap_gdt - 1
+    dd AP_TRAMPOLINE + ap_gdt - ap_trampoline
+ap_stack_top:
+    dd 0                    ; Written by the BSP before each SIPI
+ap_trampoline_end:
+
+section .data
+align 4
+isr_stub_table:
+%assign i 0
+%rep 256
+    dd isr_stub_%+i
+%assign i i+1
+%endrep
+
 section .bss
 align 16
 kernel_stack:
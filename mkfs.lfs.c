@@ -0,0 +1,205 @@
+// mkfs.lfs - make an empty BloodOS log-structured filesystem
+//
+//   mkfs.lfs <image> <first sector> <sectors>
+//
+// Built for the host by the Makefile. The layout has to match the
+// LOG-STRUCTURED FILESYSTEM section of kernel.c: the superblock, two
+// checkpoint regions, then the segments. Segment 0 gets a partial
+// segment with the root directory's inode and region 0 the first
+// checkpoint; region 1 stays zero, so it never looks valid.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LFS_MAGIC           0x53464C42  // "BLFS"
+#define LFS_CP_MAGIC        0x50434C42  // "BLCP"
+#define LFS_SUM_MAGIC       0x4D534C42  // "BLSM"
+#define LFS_VERSION         1
+#define LFS_BLOCK           4096
+#define LFS_NDIRECT         10
+#define LFS_ROOT_INO        1
+#define LFS_MODE_DIR        2
+#define LFS_INDEX_INODES    0xFFFFFFFE
+#define LFS_SEG_BLOCKS      32          // 128KB segments
+#define LFS_MAX_SEGS        1024        // As in kernel.c
+#define LFS_MAX_INODES      1024        // As in kernel.c
+#define SECTOR_SIZE         512
+
+struct lfs_ptr {
+    uint32_t addr;
+    uint32_t crc;
+};
+
+struct lfs_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blocks;
+    uint32_t seg_blocks;
+    uint32_t nsegs;
+    uint32_t seg_start;
+    uint32_t cp_start[2];
+    uint32_t cp_blocks;
+    uint32_t max_inodes;
+    uint32_t crc;
+};
+
+struct lfs_checkpoint {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t log_seq;
+    uint32_t head_seg;
+    uint32_t head_off;
+    uint32_t crc;
+};
+
+struct lfs_imap_entry {
+    uint32_t loc;
+    uint32_t crc;
+};
+
+struct lfs_seg_usage {
+    uint32_t live;
+    uint32_t age;
+};
+
+struct lfs_inode {
+    uint32_t ino;
+    uint16_t mode;
+    uint16_t links;
+    uint32_t size;
+    uint32_t blocks;
+    struct lfs_ptr direct[LFS_NDIRECT];
+    struct lfs_ptr indirect;
+    uint8_t reserved[24];
+};
+
+struct lfs_sum_entry {
+    uint32_t ino;
+    uint32_t index;
+    uint32_t crc;
+};
+
+struct lfs_summary {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t nblocks;
+    uint32_t crc;
+    struct lfs_sum_entry entries[];
+};
+
+#define IMAP_BLOCKS ((LFS_MAX_INODES * sizeof(struct lfs_imap_entry) + LFS_BLOCK - 1) / LFS_BLOCK)
+#define SUT_BLOCKS  ((LFS_MAX_SEGS * sizeof(struct lfs_seg_usage) + LFS_BLOCK - 1) / LFS_BLOCK)
+#define CP_BLOCKS   (1 + IMAP_BLOCKS + SUT_BLOCKS)
+
+_Static_assert(sizeof(struct lfs_super) == 44, "superblock layout");
+_Static_assert(sizeof(struct lfs_inode) == 128, "inode layout");
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_update(uint32_t crc, const void* data, size_t len) {
+    const uint8_t* p = data;
+    while (len--) crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static uint32_t crc32c(const void* data, size_t len) {
+    return ~crc32c_update(~0u, data, len);
+}
+
+static void put_blocks(FILE* f, uint32_t start, uint32_t addr, const void* data, uint32_t count) {
+    if (fseek(f, (long)start * SECTOR_SIZE + (long)addr * LFS_BLOCK, SEEK_SET) ||
+        fwrite(data, LFS_BLOCK, count, f) != count) {
+        perror("mkfs.lfs");
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: mkfs.lfs <image> <first sector> <sectors>\n");
+        return 1;
+    }
+    uint32_t start = strtoul(argv[2], 0, 0);
+    uint32_t blocks = strtoul(argv[3], 0, 0) / (LFS_BLOCK / SECTOR_SIZE);
+    uint32_t seg_start = 1 + 2 * CP_BLOCKS;
+    if (blocks < seg_start + 4 * LFS_SEG_BLOCKS) {
+        fprintf(stderr, "mkfs.lfs: %s sectors is too small\n", argv[3]);
+        return 1;
+    }
+    uint32_t nsegs = (blocks - seg_start) / LFS_SEG_BLOCKS;
+    if (nsegs > LFS_MAX_SEGS) nsegs = LFS_MAX_SEGS;
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+        crc32c_table[i] = c;
+    }
+
+    FILE* f = fopen(argv[1], "r+b");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    // Zero the metadata so that checkpoint region 1 is invalid
+    static uint8_t zero[CP_BLOCKS][LFS_BLOCK];
+    put_blocks(f, start, 1, zero, CP_BLOCKS);
+    put_blocks(f, start, 1 + CP_BLOCKS, zero, CP_BLOCKS);
+
+    // Segment 0: a summary, then one block of inodes with the root in it
+    static uint8_t seg[2][LFS_BLOCK];
+    struct lfs_inode* root = (struct lfs_inode*)seg[1];
+    root->ino = LFS_ROOT_INO;
+    root->mode = LFS_MODE_DIR;
+    root->links = 2;
+    struct lfs_summary* sum = (struct lfs_summary*)seg[0];
+    sum->magic = LFS_SUM_MAGIC;
+    sum->seq = 1;
+    sum->nblocks = 1;
+    sum->entries[0].ino = 0;
+    sum->entries[0].index = LFS_INDEX_INODES;
+    sum->entries[0].crc = crc32c(seg[1], LFS_BLOCK);
+    sum->crc = crc32c(sum, LFS_BLOCK);
+    put_blocks(f, start, seg_start, seg, 2);
+
+    // Checkpoint region 0: header, inode map, segment usage table
+    static uint8_t cp_region[CP_BLOCKS][LFS_BLOCK];
+    struct lfs_checkpoint* cp = (struct lfs_checkpoint*)cp_region[0];
+    struct lfs_imap_entry* imap = (struct lfs_imap_entry*)cp_region[1];
+    struct lfs_seg_usage* sut = (struct lfs_seg_usage*)cp_region[1 + IMAP_BLOCKS];
+    imap[LFS_ROOT_INO].loc = (seg_start + 1) * (LFS_BLOCK / sizeof(struct lfs_inode));
+    imap[LFS_ROOT_INO].crc = crc32c(root, sizeof(*root));
+    sut[0].live = sizeof(*root);
+    sut[0].age = 1;
+    cp->magic = LFS_CP_MAGIC;
+    cp->seq = 1;
+    cp->log_seq = 2;
+    cp->head_seg = 0;
+    cp->head_off = 2;
+    cp->crc = crc32c(cp_region, sizeof(cp_region));
+    put_blocks(f, start, 1, cp_region, CP_BLOCKS);
+
+    // The superblock last: until it is there the volume doesn't mount
+    static uint8_t super[LFS_BLOCK];
+    struct lfs_super* sb = (struct lfs_super*)super;
+    sb->magic = LFS_MAGIC;
+    sb->version = LFS_VERSION;
+    sb->blocks = blocks;
+    sb->seg_blocks = LFS_SEG_BLOCKS;
+    sb->nsegs = nsegs;
+    sb->seg_start = seg_start;
+    sb->cp_start[0] = 1;
+    sb->cp_start[1] = 1 + CP_BLOCKS;
+    sb->cp_blocks = CP_BLOCKS;
+    sb->max_inodes = LFS_MAX_INODES;
+    sb->crc = crc32c(sb, sizeof(*sb));
+    put_blocks(f, start, 0, super, 1);
+
+    if (fclose(f)) {
+        perror(argv[1]);
+        return 1;
+    }
+    printf("mkfs.lfs: %u segments of %uKB, %u inodes\n", nsegs, LFS_SEG_BLOCKS * LFS_BLOCK / 1024, LFS_MAX_INODES);
+    return 0;
+}